@@ -24,6 +24,7 @@
 
 #include "config.h"
 #include <va/va_backend.h>
+#include <va/va_drmcommon.h>
 
 #include "dummy_drv_video.h"
 
@@ -32,20 +33,37 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 
 #define ASSERT	assert
 
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC		0x0001U
+#endif
+
+#ifndef VA_FOURCC_I420
+#define VA_FOURCC_I420		VA_FOURCC('I','4','2','0')
+#endif
+
+#define ALIGN(i, n)		(((i) + (n) - 1) & ~((n) - 1))
+
 #define INIT_DRIVER_DATA	struct dummy_driver_data * const driver_data = (struct dummy_driver_data *) ctx->pDriverData;
 
 #define CONFIG(id)  ((object_config_p) object_heap_lookup( &driver_data->config_heap, id ))
 #define CONTEXT(id) ((object_context_p) object_heap_lookup( &driver_data->context_heap, id ))
 #define SURFACE(id)	((object_surface_p) object_heap_lookup( &driver_data->surface_heap, id ))
 #define BUFFER(id)  ((object_buffer_p) object_heap_lookup( &driver_data->buffer_heap, id ))
+#define IMAGE(id)   ((object_image_p) object_heap_lookup( &driver_data->image_heap, id ))
 
 #define CONFIG_ID_OFFSET		0x01000000
 #define CONTEXT_ID_OFFSET		0x02000000
 #define SURFACE_ID_OFFSET		0x04000000
 #define BUFFER_ID_OFFSET		0x08000000
+#define IMAGE_ID_OFFSET			0x10000000
 
 static void dummy__error_message(const char *msg, ...)
 {
@@ -67,6 +85,36 @@ static void dummy__information_message(const char *msg, ...)
     va_end(args);
 }
 
+/*
+ * Allocates shareable memory. The dummy driver has no DRM device, so a
+ * memfd stands in for a GEM object and its fd for the DRM PRIME fd.
+ */
+static int dummy__memfd_create(const char *name, unsigned int size)
+{
+    int fd = -1;
+
+#ifdef __NR_memfd_create
+    fd = syscall(__NR_memfd_create, name, MFD_CLOEXEC);
+#endif
+    if (fd < 0)
+    {
+        char template[] = "/tmp/dummy_drv_video-XXXXXX";
+
+        fd = mkstemp(template);
+        if (fd < 0)
+            return -1;
+        unlink(template);
+    }
+
+    if (ftruncate(fd, size) < 0)
+    {
+        dummy__error_message("failed to allocate %u bytes: %s\n", size, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
 VAStatus dummy_QueryConfigProfiles(
 		VADriverContextP ctx,
 		VAProfile *profile_list,	/* out */
@@ -119,8 +167,9 @@ VAStatus dummy_QueryConfigEntrypoints(
         case VAProfileH264Baseline:
         case VAProfileH264Main:
         case VAProfileH264High:
-                *num_entrypoints = 1;
+                *num_entrypoints = 2;
                 entrypoint_list[0] = VAEntrypointVLD;
+                entrypoint_list[1] = VAEntrypointEncSlice;
                 break;
 
         case VAProfileVC1Simple:
@@ -160,6 +209,13 @@ VAStatus dummy_GetConfigAttributes(
               attrib_list[i].value = VA_RT_FORMAT_YUV420;
               break;
 
+          case VAConfigAttribRateControl:
+              if (VAEntrypointEncSlice == entrypoint)
+                  attrib_list[i].value = VA_RC_CQP | VA_RC_CBR | VA_RC_VBR;
+              else
+                  attrib_list[i].value = VA_ATTRIB_NOT_SUPPORTED;
+              break;
+
           default:
               /* Do nothing */
               attrib_list[i].value = VA_ATTRIB_NOT_SUPPORTED;
@@ -240,7 +296,8 @@ VAStatus dummy_CreateConfig(
         case VAProfileH264Baseline:
         case VAProfileH264Main:
         case VAProfileH264High:
-                if (VAEntrypointVLD == entrypoint)
+                if ((VAEntrypointVLD == entrypoint) ||
+                    (VAEntrypointEncSlice == entrypoint))
                 {
                     vaStatus = VA_STATUS_SUCCESS;
                 }
@@ -357,17 +414,284 @@ VAStatus dummy_QueryConfigAttributes(
     return vaStatus;
 }
 
-VAStatus dummy_CreateSurfaces(
+static void dummy__init_surface_layout(object_surface_p obj_surface, unsigned int width, unsigned int height)
+{
+    unsigned int pitch = ALIGN(width, 16);
+    unsigned int height_aligned = ALIGN(height, 16);
+
+    obj_surface->width = width;
+    obj_surface->height = height;
+    obj_surface->fourcc = VA_FOURCC_NV12;
+    obj_surface->num_planes = 2;
+    obj_surface->pitches[0] = pitch;
+    obj_surface->pitches[1] = pitch;
+    obj_surface->pitches[2] = 0;
+    obj_surface->offsets[0] = 0;
+    obj_surface->offsets[1] = pitch * height_aligned;
+    obj_surface->offsets[2] = 0;
+    obj_surface->data_size = pitch * height_aligned * 3 / 2;
+}
+
+static void dummy__copy_surface_layout(object_surface_p obj_surface, VASurfaceAttribExternalBuffers *ext_buffers)
+{
+    int i;
+
+    obj_surface->fourcc = ext_buffers->pixel_format;
+    obj_surface->num_planes = ext_buffers->num_planes;
+    for (i = 0; i < 3; i++)
+    {
+        obj_surface->pitches[i] = i < ext_buffers->num_planes ? ext_buffers->pitches[i] : 0;
+        obj_surface->offsets[i] = i < ext_buffers->num_planes ? ext_buffers->offsets[i] : 0;
+    }
+    obj_surface->data_size = ext_buffers->data_size;
+}
+
+/* Checks that the external buffer layout fits a NV12, I420 or YV12 surface */
+static VAStatus dummy__check_external_buffers(
+		VASurfaceAttribExternalBuffers *ext_buffers,
+		unsigned int width,
+		unsigned int height,
+		unsigned int num_surfaces
+	)
+{
+    uint64_t plane_start[3], plane_end[3];
+    unsigned int plane_width[3], plane_height[3];
+    unsigned int num_planes;
+    int i, j;
+
+    if (NULL == ext_buffers || NULL == ext_buffers->buffers ||
+        ext_buffers->num_buffers < num_surfaces)
+    {
+        return VA_STATUS_ERROR_INVALID_PARAMETER;
+    }
+    switch (ext_buffers->pixel_format)
+    {
+        case VA_FOURCC_NV12:
+            num_planes = 2;
+            plane_width[1] = width;     /* interleaved UV */
+            break;
+        case VA_FOURCC_I420:
+        case VA_FOURCC_YV12:
+            num_planes = 3;
+            plane_width[1] = plane_width[2] = (width + 1) / 2;
+            break;
+        default:
+            return VA_STATUS_ERROR_INVALID_IMAGE_FORMAT;
+    }
+    if (ext_buffers->num_planes != num_planes)
+    {
+        return VA_STATUS_ERROR_INVALID_IMAGE_FORMAT;
+    }
+    if (ext_buffers->width != width || ext_buffers->height != height)
+    {
+        return VA_STATUS_ERROR_INVALID_PARAMETER;
+    }
+    plane_width[0] = width;
+    plane_height[0] = height;
+    plane_height[1] = plane_height[2] = (height + 1) / 2;
+
+    /* Each plane must hold a full row per line, stay within the
+       buffer and not overlap any other plane */
+    for (i = 0; i < num_planes; i++)
+    {
+        if (ext_buffers->pitches[i] < plane_width[i])
+        {
+            return VA_STATUS_ERROR_INVALID_PARAMETER;
+        }
+        plane_start[i] = ext_buffers->offsets[i];
+        plane_end[i] = plane_start[i] +
+            (uint64_t)ext_buffers->pitches[i] * (plane_height[i] - 1) + plane_width[i];
+        if (plane_end[i] > ext_buffers->data_size)
+        {
+            return VA_STATUS_ERROR_INVALID_PARAMETER;
+        }
+        for (j = 0; j < i; j++)
+        {
+            if (plane_start[i] < plane_end[j] && plane_start[j] < plane_end[i])
+            {
+                return VA_STATUS_ERROR_INVALID_PARAMETER;
+            }
+        }
+    }
+    return VA_STATUS_SUCCESS;
+}
+
+static VAStatus dummy__allocate_surface(object_surface_p obj_surface)
+{
+    obj_surface->mem_fd = dummy__memfd_create("dummy_drv_video surface", obj_surface->data_size);
+    if (obj_surface->mem_fd < 0)
+    {
+        return VA_STATUS_ERROR_ALLOCATION_FAILED;
+    }
+
+    obj_surface->mem = mmap(NULL, obj_surface->data_size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED, obj_surface->mem_fd, 0);
+    if (MAP_FAILED == obj_surface->mem)
+    {
+        obj_surface->mem = NULL;
+        close(obj_surface->mem_fd);
+        obj_surface->mem_fd = -1;
+        return VA_STATUS_ERROR_ALLOCATION_FAILED;
+    }
+    obj_surface->mem_type = VA_SURFACE_ATTRIB_MEM_TYPE_VA;
+    return VA_STATUS_SUCCESS;
+}
+
+/* Wraps a DRM PRIME fd, i.e. a memfd exported by another VA display */
+static VAStatus dummy__import_surface_prime(
+		object_surface_p obj_surface,
+		VASurfaceAttribExternalBuffers *ext_buffers,
+		int prime_fd
+	)
+{
+    struct stat st;
+
+    if (fstat(prime_fd, &st) < 0 || st.st_size < ext_buffers->data_size)
+    {
+        return VA_STATUS_ERROR_INVALID_PARAMETER;
+    }
+
+    obj_surface->mem_fd = dup(prime_fd);
+    if (obj_surface->mem_fd < 0)
+    {
+        return VA_STATUS_ERROR_ALLOCATION_FAILED;
+    }
+
+    dummy__copy_surface_layout(obj_surface, ext_buffers);
+
+    obj_surface->mem = mmap(NULL, obj_surface->data_size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED, obj_surface->mem_fd, 0);
+    if (MAP_FAILED == obj_surface->mem)
+    {
+        obj_surface->mem = NULL;
+        close(obj_surface->mem_fd);
+        obj_surface->mem_fd = -1;
+        return VA_STATUS_ERROR_ALLOCATION_FAILED;
+    }
+    obj_surface->mem_type = VA_SURFACE_ATTRIB_MEM_TYPE_DRM_PRIME;
+    return VA_STATUS_SUCCESS;
+}
+
+/* Wraps caller memory, which must stay valid until the surface is destroyed */
+static VAStatus dummy__import_surface_user_ptr(
+		object_surface_p obj_surface,
+		VASurfaceAttribExternalBuffers *ext_buffers,
+		unsigned long user_ptr
+	)
+{
+    if (0 == user_ptr)
+    {
+        return VA_STATUS_ERROR_INVALID_PARAMETER;
+    }
+
+    dummy__copy_surface_layout(obj_surface, ext_buffers);
+    obj_surface->mem = (unsigned char *)user_ptr;
+    obj_surface->mem_fd = -1;
+    obj_surface->mem_type = VA_SURFACE_ATTRIB_MEM_TYPE_USER_PTR;
+    return VA_STATUS_SUCCESS;
+}
+
+static void dummy__destroy_surface(struct dummy_driver_data *driver_data, object_surface_p obj_surface)
+{
+    if (NULL != obj_surface->mem &&
+        VA_SURFACE_ATTRIB_MEM_TYPE_USER_PTR != obj_surface->mem_type)
+    {
+        munmap(obj_surface->mem, obj_surface->data_size);
+        obj_surface->mem = NULL;
+    }
+    if (obj_surface->mem_fd >= 0)
+    {
+        close(obj_surface->mem_fd);
+        obj_surface->mem_fd = -1;
+    }
+    object_heap_free( &driver_data->surface_heap, (object_base_p) obj_surface);
+}
+
+VAStatus dummy_QuerySurfaceAttributes(
 		VADriverContextP ctx,
-		int width,
-		int height,
-		int format,
-		int num_surfaces,
-		VASurfaceID *surfaces		/* out */
+		VAConfigID config,
+		VASurfaceAttrib *attrib_list,	/* out */
+		unsigned int *num_attribs	/* in/out */
+	)
+{
+    INIT_DRIVER_DATA
+    VASurfaceAttrib attribs[DUMMY_MAX_SURFACE_ATTRIBUTES];
+    int i = 0;
+
+    if (NULL == CONFIG(config))
+    {
+        return VA_STATUS_ERROR_INVALID_CONFIG;
+    }
+
+    memset(attribs, 0, sizeof(attribs));
+
+    attribs[i].type = VASurfaceAttribPixelFormat;
+    attribs[i].flags = VA_SURFACE_ATTRIB_GETTABLE | VA_SURFACE_ATTRIB_SETTABLE;
+    attribs[i].value.type = VAGenericValueTypeInteger;
+    attribs[i].value.value.i = VA_FOURCC_NV12;
+    i++;
+
+    attribs[i].type = VASurfaceAttribPixelFormat;
+    attribs[i].flags = VA_SURFACE_ATTRIB_GETTABLE | VA_SURFACE_ATTRIB_SETTABLE;
+    attribs[i].value.type = VAGenericValueTypeInteger;
+    attribs[i].value.value.i = VA_FOURCC_I420;
+    i++;
+
+    attribs[i].type = VASurfaceAttribPixelFormat;
+    attribs[i].flags = VA_SURFACE_ATTRIB_GETTABLE | VA_SURFACE_ATTRIB_SETTABLE;
+    attribs[i].value.type = VAGenericValueTypeInteger;
+    attribs[i].value.value.i = VA_FOURCC_YV12;
+    i++;
+
+    attribs[i].type = VASurfaceAttribMemoryType;
+    attribs[i].flags = VA_SURFACE_ATTRIB_GETTABLE | VA_SURFACE_ATTRIB_SETTABLE;
+    attribs[i].value.type = VAGenericValueTypeInteger;
+    attribs[i].value.value.i = VA_SURFACE_ATTRIB_MEM_TYPE_VA |
+        VA_SURFACE_ATTRIB_MEM_TYPE_DRM_PRIME |
+        VA_SURFACE_ATTRIB_MEM_TYPE_USER_PTR;
+    i++;
+
+    attribs[i].type = VASurfaceAttribExternalBufferDescriptor;
+    attribs[i].flags = VA_SURFACE_ATTRIB_SETTABLE;
+    attribs[i].value.type = VAGenericValueTypePointer;
+    attribs[i].value.value.p = NULL;
+    i++;
+
+    /* If the assert fails then DUMMY_MAX_SURFACE_ATTRIBUTES needs to be bigger */
+    ASSERT(i <= DUMMY_MAX_SURFACE_ATTRIBUTES);
+
+    if (NULL == attrib_list)
+    {
+        *num_attribs = i;
+        return VA_STATUS_SUCCESS;
+    }
+    if (*num_attribs < i)
+    {
+        *num_attribs = i;
+        return VA_STATUS_ERROR_MAX_NUM_EXCEEDED;
+    }
+
+    memcpy(attrib_list, attribs, i * sizeof(*attribs));
+    *num_attribs = i;
+    return VA_STATUS_SUCCESS;
+}
+
+VAStatus dummy_CreateSurfaces2(
+		VADriverContextP ctx,
+		unsigned int format,
+		unsigned int width,
+		unsigned int height,
+		VASurfaceID *surfaces,		/* out */
+		unsigned int num_surfaces,
+		VASurfaceAttrib *attrib_list,
+		unsigned int num_attribs
 	)
 {
     INIT_DRIVER_DATA
     VAStatus vaStatus = VA_STATUS_SUCCESS;
+    VASurfaceAttribExternalBuffers *ext_buffers = NULL;
+    unsigned int mem_type = VA_SURFACE_ATTRIB_MEM_TYPE_VA;
+    unsigned int fourcc = VA_FOURCC_NV12;
     int i;
 
     /* We only support one format */
@@ -376,6 +700,49 @@ VAStatus dummy_CreateSurfaces(
         return VA_STATUS_ERROR_UNSUPPORTED_RT_FORMAT;
     }
 
+    for (i = 0; i < num_attribs && attrib_list; i++)
+    {
+        if (!(attrib_list[i].flags & VA_SURFACE_ATTRIB_SETTABLE))
+        {
+            continue;
+        }
+        switch (attrib_list[i].type)
+        {
+            case VASurfaceAttribPixelFormat:
+                fourcc = attrib_list[i].value.value.i;
+                break;
+            case VASurfaceAttribMemoryType:
+                mem_type = attrib_list[i].value.value.i;
+                break;
+            case VASurfaceAttribExternalBufferDescriptor:
+                ext_buffers = attrib_list[i].value.value.p;
+                break;
+            default:
+                break;
+        }
+    }
+
+    switch (mem_type)
+    {
+        case VA_SURFACE_ATTRIB_MEM_TYPE_VA:
+            /* Driver allocated surfaces are always NV12 */
+            if (VA_FOURCC_NV12 != fourcc)
+            {
+                return VA_STATUS_ERROR_INVALID_IMAGE_FORMAT;
+            }
+            break;
+        case VA_SURFACE_ATTRIB_MEM_TYPE_DRM_PRIME:
+        case VA_SURFACE_ATTRIB_MEM_TYPE_USER_PTR:
+            vaStatus = dummy__check_external_buffers(ext_buffers, width, height, num_surfaces);
+            if (VA_STATUS_SUCCESS != vaStatus)
+            {
+                return vaStatus;
+            }
+            break;
+        default:
+            return VA_STATUS_ERROR_UNSUPPORTED_MEMORY_TYPE;
+    }
+
     for (i = 0; i < num_surfaces; i++)
     {
         int surfaceID = object_heap_allocate( &driver_data->surface_heap );
@@ -386,6 +753,29 @@ VAStatus dummy_CreateSurfaces(
             break;
         }
         obj_surface->surface_id = surfaceID;
+        obj_surface->mem_fd = -1;
+        obj_surface->mem = NULL;
+        dummy__init_surface_layout(obj_surface, width, height);
+
+        if (VA_SURFACE_ATTRIB_MEM_TYPE_DRM_PRIME == mem_type)
+        {
+            vaStatus = dummy__import_surface_prime(obj_surface, ext_buffers,
+                                                   (int)ext_buffers->buffers[i]);
+        }
+        else if (VA_SURFACE_ATTRIB_MEM_TYPE_USER_PTR == mem_type)
+        {
+            vaStatus = dummy__import_surface_user_ptr(obj_surface, ext_buffers,
+                                                      ext_buffers->buffers[i]);
+        }
+        else
+        {
+            vaStatus = dummy__allocate_surface(obj_surface);
+        }
+        if (VA_STATUS_SUCCESS != vaStatus)
+        {
+            object_heap_free( &driver_data->surface_heap, (object_base_p) obj_surface);
+            break;
+        }
         surfaces[i] = surfaceID;
     }
 
@@ -398,13 +788,26 @@ VAStatus dummy_CreateSurfaces(
             object_surface_p obj_surface = SURFACE(surfaces[i]);
             surfaces[i] = VA_INVALID_SURFACE;
             ASSERT(obj_surface);
-            object_heap_free( &driver_data->surface_heap, (object_base_p) obj_surface);
+            dummy__destroy_surface(driver_data, obj_surface);
         }
     }
 
     return vaStatus;
 }
 
+VAStatus dummy_CreateSurfaces(
+		VADriverContextP ctx,
+		int width,
+		int height,
+		int format,
+		int num_surfaces,
+		VASurfaceID *surfaces		/* out */
+	)
+{
+    return dummy_CreateSurfaces2(ctx, format, width, height,
+                                 surfaces, num_surfaces, NULL, 0);
+}
+
 VAStatus dummy_DestroySurfaces(
 		VADriverContextP ctx,
 		VASurfaceID *surface_list,
@@ -417,7 +820,7 @@ VAStatus dummy_DestroySurfaces(
     {
         object_surface_p obj_surface = SURFACE(surface_list[i]);
         ASSERT(obj_surface);
-        object_heap_free( &driver_data->surface_heap, (object_base_p) obj_surface);
+        dummy__destroy_surface(driver_data, obj_surface);
     }
     return VA_STATUS_SUCCESS;
 }
@@ -450,16 +853,84 @@ VAStatus dummy_DeriveImage(
 	VAImage *image     /* out */
 )
 {
-    /* TODO */
+    INIT_DRIVER_DATA
+    object_surface_p obj_surface = SURFACE(surface);
+    object_image_p obj_image;
+    object_buffer_p obj_buffer;
+    int imageID, bufferID;
+    int i;
+
+    if (NULL == obj_surface)
+    {
+        return VA_STATUS_ERROR_INVALID_SURFACE;
+    }
+
+    imageID = object_heap_allocate( &driver_data->image_heap );
+    obj_image = IMAGE(imageID);
+    if (NULL == obj_image)
+    {
+        return VA_STATUS_ERROR_ALLOCATION_FAILED;
+    }
+
+    /* The image buffer is the surface storage itself, there is no copy */
+    bufferID = object_heap_allocate( &driver_data->buffer_heap );
+    obj_buffer = BUFFER(bufferID);
+    if (NULL == obj_buffer)
+    {
+        object_heap_free( &driver_data->image_heap, (object_base_p) obj_image);
+        return VA_STATUS_ERROR_ALLOCATION_FAILED;
+    }
+    obj_buffer->buffer_data = obj_surface->mem;
+    obj_buffer->max_num_elements = 1;
+    obj_buffer->num_elements = 1;
+    obj_buffer->type = VAImageBufferType;
+    obj_buffer->buffer_size = obj_surface->data_size;
+    obj_buffer->mem_fd = obj_surface->mem_fd;
+    obj_buffer->is_surface_store = 1;
+    obj_buffer->export_refcount = 0;
+
+    memset(&obj_image->image, 0, sizeof(obj_image->image));
+    obj_image->image.image_id = imageID;
+    obj_image->image.format.fourcc = obj_surface->fourcc;
+    obj_image->image.format.byte_order = VA_LSB_FIRST;
+    obj_image->image.format.bits_per_pixel = 12;
+    obj_image->image.buf = bufferID;
+    obj_image->image.width = obj_surface->width;
+    obj_image->image.height = obj_surface->height;
+    obj_image->image.data_size = obj_surface->data_size;
+    obj_image->image.num_planes = obj_surface->num_planes;
+    for (i = 0; i < obj_surface->num_planes; i++)
+    {
+        obj_image->image.pitches[i] = obj_surface->pitches[i];
+        obj_image->image.offsets[i] = obj_surface->offsets[i];
+    }
+
+    *image = obj_image->image;
     return VA_STATUS_SUCCESS;
 }
 
+static void dummy__destroy_buffer(struct dummy_driver_data *driver_data, object_buffer_p obj_buffer);
+
 VAStatus dummy_DestroyImage(
 	VADriverContextP ctx,
 	VAImageID image
 )
 {
-    /* TODO */
+    INIT_DRIVER_DATA
+    object_image_p obj_image = IMAGE(image);
+    object_buffer_p obj_buffer;
+
+    if (NULL == obj_image)
+    {
+        return VA_STATUS_ERROR_INVALID_IMAGE;
+    }
+
+    obj_buffer = BUFFER(obj_image->image.buf);
+    if (NULL != obj_buffer)
+    {
+        dummy__destroy_buffer(driver_data, obj_buffer);
+    }
+    object_heap_free( &driver_data->image_heap, (object_base_p) obj_image);
     return VA_STATUS_SUCCESS;
 }
 
@@ -657,6 +1128,8 @@ VAStatus dummy_CreateContext(
     *context = contextID;
     obj_context->current_render_target = -1;
     obj_context->config_id = config_id;
+    obj_context->is_encode = (VAEntrypointEncSlice == obj_config->entrypoint);
+    obj_context->coded_buf = VA_INVALID_ID;
     obj_context->picture_width = picture_width;
     obj_context->picture_height = picture_height;
     obj_context->num_render_targets = num_render_targets;
@@ -764,6 +1237,13 @@ VAStatus dummy_CreateBuffer(
         case VAResidualDataBufferType:
         case VADeblockingParameterBufferType:
         case VAImageBufferType:
+        case VAEncCodedBufferType:
+        case VAEncSequenceParameterBufferType:
+        case VAEncPictureParameterBufferType:
+        case VAEncSliceParameterBufferType:
+        case VAEncPackedHeaderParameterBufferType:
+        case VAEncPackedHeaderDataBufferType:
+        case VAEncMiscParameterBufferType:
             /* Ok */
             break;
         default:
@@ -780,6 +1260,11 @@ VAStatus dummy_CreateBuffer(
     }
 
     obj_buffer->buffer_data = NULL;
+    obj_buffer->type = type;
+    obj_buffer->buffer_size = size * num_elements;
+    obj_buffer->mem_fd = -1;
+    obj_buffer->is_surface_store = 0;
+    obj_buffer->export_refcount = 0;
 
     vaStatus = dummy__allocate_buffer(obj_buffer, size * num_elements);
     if (VA_STATUS_SUCCESS == vaStatus)
@@ -859,6 +1344,26 @@ VAStatus dummy_UnmapBuffer(
 
 static void dummy__destroy_buffer(struct dummy_driver_data *driver_data, object_buffer_p obj_buffer)
 {
+    if (obj_buffer->export_refcount > 0)
+    {
+        close((int)obj_buffer->export_info.handle);
+        obj_buffer->export_refcount = 0;
+    }
+
+    if (obj_buffer->is_surface_store)
+    {
+        /* Owned by the parent surface */
+        obj_buffer->buffer_data = NULL;
+        obj_buffer->mem_fd = -1;
+    }
+    else if (obj_buffer->mem_fd >= 0)
+    {
+        munmap(obj_buffer->buffer_data, obj_buffer->buffer_size);
+        obj_buffer->buffer_data = NULL;
+        close(obj_buffer->mem_fd);
+        obj_buffer->mem_fd = -1;
+    }
+
     if (NULL != obj_buffer->buffer_data)
     {
         free(obj_buffer->buffer_data);
@@ -934,6 +1439,30 @@ VAStatus dummy_RenderPicture(
         }
     }
     
+    if (obj_context->is_encode)
+    {
+        /* Encode buffers stay owned by the application */
+        for(i = 0; (VA_STATUS_SUCCESS == vaStatus) && (i < num_buffers); i++)
+        {
+            object_buffer_p obj_buffer = BUFFER(buffers[i]);
+
+            if (obj_buffer->type == VAEncPictureParameterBufferType &&
+                obj_buffer->buffer_size >= sizeof(VAEncPictureParameterBufferH264))
+            {
+                VAEncPictureParameterBufferH264 *pic_param = obj_buffer->buffer_data;
+                object_buffer_p obj_coded = BUFFER(pic_param->coded_buf);
+
+                if (NULL == obj_coded || obj_coded->type != VAEncCodedBufferType)
+                {
+                    vaStatus = VA_STATUS_ERROR_INVALID_BUFFER;
+                    break;
+                }
+                obj_context->coded_buf = pic_param->coded_buf;
+            }
+        }
+        return vaStatus;
+    }
+
     /* Release buffers */
     for(i = 0; i < num_buffers; i++)
     {
@@ -945,6 +1474,44 @@ VAStatus dummy_RenderPicture(
     return vaStatus;
 }
 
+/*
+ * Stands in for the encoder output: an access unit delimiter followed by a
+ * filler NAL unit of one byte per macroblock, so that consumers of the coded
+ * buffer see a plausible, size-dependent H.264 byte stream.
+ */
+static VAStatus dummy__fill_coded_buffer(object_context_p obj_context, object_buffer_p obj_buffer)
+{
+    static const unsigned char aud[] = { 0x00, 0x00, 0x00, 0x01, 0x09, 0xf0 };
+    static const unsigned char filler[] = { 0x00, 0x00, 0x00, 0x01, 0x0c };
+    VACodedBufferSegment *segment = obj_buffer->buffer_data;
+    unsigned char *data = (unsigned char *)(segment + 1);
+    unsigned int capacity, size;
+
+    if (obj_buffer->buffer_size < sizeof(*segment) + sizeof(aud) + sizeof(filler) + 1)
+    {
+        return VA_STATUS_ERROR_INVALID_BUFFER;
+    }
+    capacity = obj_buffer->buffer_size - sizeof(*segment);
+
+    size = ((obj_context->picture_width + 15) / 16) * ((obj_context->picture_height + 15) / 16);
+    if (size > capacity - sizeof(aud) - sizeof(filler) - 1)
+    {
+        size = capacity - sizeof(aud) - sizeof(filler) - 1;
+    }
+
+    memcpy(data, aud, sizeof(aud));
+    memcpy(data + sizeof(aud), filler, sizeof(filler));
+    memset(data + sizeof(aud) + sizeof(filler), 0xff, size);
+    data[sizeof(aud) + sizeof(filler) + size] = 0x80;  /* rbsp_trailing_bits */
+
+    memset(segment, 0, sizeof(*segment));
+    segment->size = sizeof(aud) + sizeof(filler) + size + 1;
+    segment->buf = data;
+    segment->next = NULL;
+
+    return VA_STATUS_SUCCESS;
+}
+
 VAStatus dummy_EndPicture(
 		VADriverContextP ctx,
 		VAContextID context
@@ -961,6 +1528,21 @@ VAStatus dummy_EndPicture(
     obj_surface = SURFACE(obj_context->current_render_target);
     ASSERT(obj_surface);
 
+    if (obj_context->is_encode)
+    {
+        object_buffer_p obj_coded = BUFFER(obj_context->coded_buf);
+
+        if (NULL == obj_coded)
+        {
+            vaStatus = VA_STATUS_ERROR_INVALID_BUFFER;
+        }
+        else
+        {
+            vaStatus = dummy__fill_coded_buffer(obj_context, obj_coded);
+        }
+        obj_context->coded_buf = VA_INVALID_ID;
+    }
+
     // For now, assume that we are done with rendering right away
     obj_context->current_render_target = -1;
 
@@ -1071,6 +1653,123 @@ VAStatus dummy_SetDisplayAttributes (
 }
 
 
+/* Moves the buffer contents to a memfd, so that it can be shared */
+static VAStatus dummy__export_buffer(object_buffer_p obj_buffer)
+{
+    void *mem;
+    int fd;
+
+    if (obj_buffer->mem_fd >= 0)
+    {
+        return VA_STATUS_SUCCESS;
+    }
+
+    fd = dummy__memfd_create("dummy_drv_video buffer", obj_buffer->buffer_size);
+    if (fd < 0)
+    {
+        return VA_STATUS_ERROR_ALLOCATION_FAILED;
+    }
+
+    mem = mmap(NULL, obj_buffer->buffer_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (MAP_FAILED == mem)
+    {
+        close(fd);
+        return VA_STATUS_ERROR_ALLOCATION_FAILED;
+    }
+
+    if (NULL != obj_buffer->buffer_data)
+    {
+        memcpy(mem, obj_buffer->buffer_data, obj_buffer->buffer_size);
+        free(obj_buffer->buffer_data);
+    }
+    obj_buffer->buffer_data = mem;
+    obj_buffer->mem_fd = fd;
+    return VA_STATUS_SUCCESS;
+}
+
+VAStatus dummy_AcquireBufferHandle(
+		VADriverContextP ctx,
+		VABufferID buf_id,		/* in */
+		VABufferInfo *buf_info		/* in/out */
+	)
+{
+    INIT_DRIVER_DATA
+    VAStatus vaStatus;
+    object_buffer_p obj_buffer = BUFFER(buf_id);
+    unsigned int mem_type;
+    int fd;
+
+    if (NULL == obj_buffer)
+    {
+        return VA_STATUS_ERROR_INVALID_BUFFER;
+    }
+
+    /* DRM PRIME is the only memory type that can be exported */
+    mem_type = buf_info->mem_type;
+    if (0 == mem_type)
+    {
+        mem_type = VA_SURFACE_ATTRIB_MEM_TYPE_DRM_PRIME;
+    }
+    if (!(mem_type & VA_SURFACE_ATTRIB_MEM_TYPE_DRM_PRIME))
+    {
+        return VA_STATUS_ERROR_UNSUPPORTED_MEMORY_TYPE;
+    }
+
+    /* Caller memory wrapped in a surface has no fd to hand out */
+    if (obj_buffer->is_surface_store && obj_buffer->mem_fd < 0)
+    {
+        return VA_STATUS_ERROR_UNSUPPORTED_MEMORY_TYPE;
+    }
+
+    if (0 == obj_buffer->export_refcount)
+    {
+        vaStatus = dummy__export_buffer(obj_buffer);
+        if (VA_STATUS_SUCCESS != vaStatus)
+        {
+            return vaStatus;
+        }
+
+        fd = dup(obj_buffer->mem_fd);
+        if (fd < 0)
+        {
+            return VA_STATUS_ERROR_OPERATION_FAILED;
+        }
+        obj_buffer->export_info.handle = (uintptr_t)fd;
+        obj_buffer->export_info.type = obj_buffer->type;
+        obj_buffer->export_info.mem_type = VA_SURFACE_ATTRIB_MEM_TYPE_DRM_PRIME;
+        obj_buffer->export_info.mem_size = obj_buffer->buffer_size;
+    }
+    obj_buffer->export_refcount++;
+
+    *buf_info = obj_buffer->export_info;
+    return VA_STATUS_SUCCESS;
+}
+
+VAStatus dummy_ReleaseBufferHandle(
+		VADriverContextP ctx,
+		VABufferID buf_id		/* in */
+	)
+{
+    INIT_DRIVER_DATA
+    object_buffer_p obj_buffer = BUFFER(buf_id);
+
+    if (NULL == obj_buffer)
+    {
+        return VA_STATUS_ERROR_INVALID_BUFFER;
+    }
+    if (0 == obj_buffer->export_refcount)
+    {
+        return VA_STATUS_ERROR_INVALID_BUFFER;
+    }
+
+    if (0 == --obj_buffer->export_refcount)
+    {
+        close((int)obj_buffer->export_info.handle);
+        memset(&obj_buffer->export_info, 0, sizeof(obj_buffer->export_info));
+    }
+    return VA_STATUS_SUCCESS;
+}
+
 VAStatus dummy_BufferInfo(
         VADriverContextP ctx,
         VABufferID buf_id,	/* in */
@@ -1116,6 +1815,8 @@ VAStatus dummy_Terminate( VADriverContextP ctx )
 {
     INIT_DRIVER_DATA
     object_buffer_p obj_buffer;
+    object_surface_p obj_surface;
+    object_image_p obj_image;
     object_config_p obj_config;
     object_heap_iterator iter;
 
@@ -1129,7 +1830,22 @@ VAStatus dummy_Terminate( VADriverContextP ctx )
     }
     object_heap_destroy( &driver_data->buffer_heap );
 
-    /* TODO cleanup */
+    /* Clean up left over images, their buffers are gone already */
+    obj_image = (object_image_p) object_heap_first( &driver_data->image_heap, &iter);
+    while (obj_image)
+    {
+        object_heap_free( &driver_data->image_heap, (object_base_p) obj_image);
+        obj_image = (object_image_p) object_heap_next( &driver_data->image_heap, &iter);
+    }
+    object_heap_destroy( &driver_data->image_heap );
+
+    /* Clean up left over surfaces */
+    obj_surface = (object_surface_p) object_heap_first( &driver_data->surface_heap, &iter);
+    while (obj_surface)
+    {
+        dummy__destroy_surface(driver_data, obj_surface);
+        obj_surface = (object_surface_p) object_heap_next( &driver_data->surface_heap, &iter);
+    }
     object_heap_destroy( &driver_data->surface_heap );
 
     /* TODO cleanup */
@@ -1210,6 +1926,10 @@ VAStatus VA_DRIVER_INIT_FUNC(  VADriverContextP ctx )
     vtable->vaLockSurface = dummy_LockSurface;
     vtable->vaUnlockSurface = dummy_UnlockSurface;
     vtable->vaBufferInfo = dummy_BufferInfo;
+    vtable->vaCreateSurfaces2 = dummy_CreateSurfaces2;
+    vtable->vaQuerySurfaceAttributes = dummy_QuerySurfaceAttributes;
+    vtable->vaAcquireBufferHandle = dummy_AcquireBufferHandle;
+    vtable->vaReleaseBufferHandle = dummy_ReleaseBufferHandle;
 
     driver_data = (struct dummy_driver_data *) malloc( sizeof(*driver_data) );
     ctx->pDriverData = (void *) driver_data;
@@ -1226,6 +1946,9 @@ VAStatus VA_DRIVER_INIT_FUNC(  VADriverContextP ctx )
     result = object_heap_init( &driver_data->buffer_heap, sizeof(struct object_buffer), BUFFER_ID_OFFSET );
     ASSERT( result == 0 );
 
+    result = object_heap_init( &driver_data->image_heap, sizeof(struct object_image), IMAGE_ID_OFFSET );
+    ASSERT( result == 0 );
+
 
     return VA_STATUS_SUCCESS;
 }
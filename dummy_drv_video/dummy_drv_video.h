@@ -34,6 +34,7 @@
 #define DUMMY_MAX_IMAGE_FORMATS			10
 #define DUMMY_MAX_SUBPIC_FORMATS		4
 #define DUMMY_MAX_DISPLAY_ATTRIBUTES		4
+#define DUMMY_MAX_SURFACE_ATTRIBUTES		6
 #define DUMMY_STR_VENDOR			"Dummy Driver 1.0"
 
 struct dummy_driver_data {
@@ -41,6 +42,7 @@ struct dummy_driver_data {
     struct object_heap	context_heap;
     struct object_heap	surface_heap;
     struct object_heap	buffer_heap;
+    struct object_heap	image_heap;
 };
 
 struct object_config {
@@ -61,11 +63,24 @@ struct object_context {
     int num_render_targets;
     int flags;
     VASurfaceID *render_targets;
+    int is_encode;              /* VAEntrypointEncSlice config */
+    VABufferID coded_buf;       /* from the current picture parameters */
 };
 
 struct object_surface {
     struct object_base base;
     VASurfaceID surface_id;
+    unsigned int width;
+    unsigned int height;
+    /* NV12, I420 or YV12 storage */
+    unsigned int fourcc;
+    unsigned int num_planes;
+    unsigned int pitches[3];
+    unsigned int offsets[3];
+    unsigned int data_size;
+    unsigned int mem_type;      /* VA_SURFACE_ATTRIB_MEM_TYPE_* */
+    int mem_fd;                 /* memfd, exported as DRM PRIME fd, or -1 */
+    unsigned char *mem;         /* owned by the caller for USER_PTR */
 };
 
 struct object_buffer {
@@ -73,11 +88,23 @@ struct object_buffer {
     void *buffer_data;
     int max_num_elements;
     int num_elements;
+    VABufferType type;
+    unsigned int buffer_size;
+    int mem_fd;                 /* memfd, once exported, or -1 */
+    int is_surface_store;       /* buffer_data belongs to a surface */
+    unsigned int export_refcount;
+    VABufferInfo export_info;
+};
+
+struct object_image {
+    struct object_base base;
+    VAImage image;
 };
 
 typedef struct object_config *object_config_p;
 typedef struct object_context *object_context_p;
 typedef struct object_surface *object_surface_p;
 typedef struct object_buffer *object_buffer_p;
+typedef struct object_image *object_image_p;
 
 #endif /* _DUMMY_DRV_VIDEO_H_ */
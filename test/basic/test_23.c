@@ -0,0 +1,187 @@
+/*
+ * Copyright (c) 2007 Intel Corporation. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ * 
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+ * IN NO EVENT SHALL PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR
+ * ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#define TEST_DESCRIPTION	"Share surfaces between displays through DRM PRIME"
+#define TEST_DRM
+
+#include "test_common.c"
+#include <va/va_drmcommon.h>
+#include <unistd.h>
+
+int drm_fd2;
+VADisplay va_dpy2;
+
+void pre()
+{
+    int major, minor;
+
+    test_init();
+
+    /* A display of its own, as another process would have */
+    drm_fd2 = test_open_drm_device();
+    ASSERT( drm_fd2 >= 0 );
+    status("open DRM device: drm_fd2 = %d\n", drm_fd2);
+
+    va_dpy2 = vaGetDisplayDRM(drm_fd2);
+    ASSERT( va_dpy2 );
+    status("vaGetDisplayDRM: va_dpy2 = %08x\n", va_dpy2);
+
+    va_status = vaInitialize(va_dpy2, &major, &minor);
+    ASSERT( VA_STATUS_SUCCESS == va_status );
+}
+
+/* Maps the storage of a surface through a derived image */
+void *map_surface(VADisplay display, VASurfaceID surface, VAImage *image)
+{
+    void *data = NULL;
+
+    va_status = vaDeriveImage(display, surface, image);
+    ASSERT( VA_STATUS_SUCCESS == va_status );
+
+    va_status = vaMapBuffer(display, image->buf, &data);
+    ASSERT( VA_STATUS_SUCCESS == va_status );
+    ASSERT( data );
+    return data;
+}
+
+void unmap_surface(VADisplay display, VAImage *image)
+{
+    va_status = vaUnmapBuffer(display, image->buf);
+    ASSERT( VA_STATUS_SUCCESS == va_status );
+
+    va_status = vaDestroyImage(display, image->image_id);
+    ASSERT( VA_STATUS_SUCCESS == va_status );
+}
+
+void test()
+{
+    int width = 352;
+    int height = 288;
+    VASurfaceID surface, imported_surface;
+    VAImage image, imported_image;
+    VABufferInfo buf_info;
+    VASurfaceAttribExternalBuffers ext_buffers;
+    VASurfaceAttrib attribs[2];
+    unsigned long prime_fd;
+    unsigned char *data, *imported_data;
+    unsigned int i;
+
+    va_status = vaCreateSurfaces(va_dpy, VA_RT_FORMAT_YUV420, width, height, &surface, 1, NULL, 0);
+    ASSERT( VA_STATUS_SUCCESS == va_status );
+
+    /* Export the surface storage from the first display */
+    va_status = vaDeriveImage(va_dpy, surface, &image);
+    ASSERT( VA_STATUS_SUCCESS == va_status );
+    status("vaDeriveImage: image %08x, buffer %08x, %d bytes\n",
+           image.image_id, image.buf, image.data_size);
+
+    memset(&buf_info, 0, sizeof(buf_info));
+    buf_info.mem_type = VA_SURFACE_ATTRIB_MEM_TYPE_DRM_PRIME;
+    va_status = vaAcquireBufferHandle(va_dpy, image.buf, &buf_info);
+    if (VA_STATUS_ERROR_UNIMPLEMENTED == va_status)
+    {
+        status("vaAcquireBufferHandle is not implemented, skipping\n");
+        va_status = vaDestroyImage(va_dpy, image.image_id);
+        ASSERT( VA_STATUS_SUCCESS == va_status );
+        va_status = vaDestroySurfaces(va_dpy, &surface, 1);
+        ASSERT( VA_STATUS_SUCCESS == va_status );
+        return;
+    }
+    ASSERT( VA_STATUS_SUCCESS == va_status );
+    ASSERT( VA_SURFACE_ATTRIB_MEM_TYPE_DRM_PRIME == buf_info.mem_type );
+    ASSERT( buf_info.mem_size >= image.data_size );
+    status("vaAcquireBufferHandle: fd %d\n", (int)buf_info.handle);
+
+    /* Import it into the second display */
+    prime_fd = buf_info.handle;
+    memset(&ext_buffers, 0, sizeof(ext_buffers));
+    ext_buffers.pixel_format = image.format.fourcc;
+    ext_buffers.width = image.width;
+    ext_buffers.height = image.height;
+    ext_buffers.data_size = image.data_size;
+    ext_buffers.num_planes = image.num_planes;
+    for (i = 0; i < image.num_planes; i++)
+    {
+        ext_buffers.pitches[i] = image.pitches[i];
+        ext_buffers.offsets[i] = image.offsets[i];
+    }
+    ext_buffers.buffers = &prime_fd;
+    ext_buffers.num_buffers = 1;
+
+    attribs[0].type = VASurfaceAttribMemoryType;
+    attribs[0].flags = VA_SURFACE_ATTRIB_SETTABLE;
+    attribs[0].value.type = VAGenericValueTypeInteger;
+    attribs[0].value.value.i = VA_SURFACE_ATTRIB_MEM_TYPE_DRM_PRIME;
+    attribs[1].type = VASurfaceAttribExternalBufferDescriptor;
+    attribs[1].flags = VA_SURFACE_ATTRIB_SETTABLE;
+    attribs[1].value.type = VAGenericValueTypePointer;
+    attribs[1].value.value.p = &ext_buffers;
+
+    va_status = vaCreateSurfaces(va_dpy2, VA_RT_FORMAT_YUV420, width, height,
+                                 &imported_surface, 1, attribs, 2);
+    ASSERT( VA_STATUS_SUCCESS == va_status );
+    status("vaCreateSurfaces: imported surface %08x\n", imported_surface);
+
+    /* The imported surface holds its own reference to the memory */
+    va_status = vaReleaseBufferHandle(va_dpy, image.buf);
+    ASSERT( VA_STATUS_SUCCESS == va_status );
+    va_status = vaDestroyImage(va_dpy, image.image_id);
+    ASSERT( VA_STATUS_SUCCESS == va_status );
+
+    /* Writes through either display must be seen by the other one */
+    data = map_surface(va_dpy, surface, &image);
+    imported_data = map_surface(va_dpy2, imported_surface, &imported_image);
+    ASSERT( image.data_size == imported_image.data_size );
+
+    for (i = 0; i < image.data_size; i++)
+        data[i] = i * 7;
+    ASSERT( memcmp(data, imported_data, image.data_size) == 0 );
+
+    memset(imported_data, 0x5a, imported_image.data_size);
+    for (i = 0; i < image.data_size; i++)
+        ASSERT( data[i] == 0x5a );
+
+    unmap_surface(va_dpy2, &imported_image);
+    unmap_surface(va_dpy, &image);
+
+    /* Memory outlives the exporting surface */
+    va_status = vaDestroySurfaces(va_dpy, &surface, 1);
+    ASSERT( VA_STATUS_SUCCESS == va_status );
+
+    imported_data = map_surface(va_dpy2, imported_surface, &imported_image);
+    ASSERT( imported_data[0] == 0x5a );
+    unmap_surface(va_dpy2, &imported_image);
+
+    va_status = vaDestroySurfaces(va_dpy2, &imported_surface, 1);
+    ASSERT( VA_STATUS_SUCCESS == va_status );
+}
+
+void post()
+{
+    va_status = vaTerminate(va_dpy2);
+    ASSERT( VA_STATUS_SUCCESS == va_status );
+    close(drm_fd2);
+
+    test_terminate();
+}
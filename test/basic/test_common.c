@@ -25,6 +25,12 @@
 #include <va/va.h>
 #ifdef ANDROID
 #include <va/va_android.h>
+#elif defined(TEST_DRM)
+#ifdef IN_LIBVA
+#include "va/drm/va_drm.h"
+#else
+#include <va/va_drm.h>
+#endif
 #else
 #include <va/va_x11.h>
 #endif
@@ -41,6 +47,8 @@
 void status(const char *msg, ...);
 #ifdef ANDROID
 #include "test_android.c"
+#elif defined(TEST_DRM)
+#include "test_drm.c"
 #else
 #include "test_x11.c"
 #endif
@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2007 Intel Corporation. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ * 
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+ * IN NO EVENT SHALL PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR
+ * ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+
+/* No window system: the native display is the fd of a DRM device */
+#define Display int
+Display *dpy;
+VADisplay va_dpy;
+VAStatus va_status;
+VAProfile *profiles ;
+int major_version, minor_version;
+
+int test_open_drm_device()
+{
+    static const char *drm_device_paths[] = {
+        "/dev/dri/renderD128",
+        "/dev/dri/card0",
+        NULL
+    };
+    int i, fd = -1;
+
+    for (i = 0; drm_device_paths[i] && fd < 0; i++)
+        fd = open(drm_device_paths[i], O_RDWR);
+    return fd;
+}
+
+void test_init()
+{
+    dpy = (Display*)malloc(sizeof(Display));
+    ASSERT( dpy );
+    *dpy = test_open_drm_device();
+    ASSERT( *dpy >= 0 );
+    status("open DRM device: fd = %d\n", *dpy);
+
+    va_dpy = vaGetDisplayDRM(*dpy);
+    ASSERT( va_dpy );
+    status("vaGetDisplayDRM: va_dpy = %08x\n", va_dpy);
+
+    va_status = vaInitialize(va_dpy, &major_version, &minor_version);
+    ASSERT( VA_STATUS_SUCCESS == va_status );
+    status("vaInitialize: major = %d minor = %d\n", major_version, minor_version);
+}
+
+void test_terminate()
+{
+    va_status = vaTerminate(va_dpy);
+    ASSERT( VA_STATUS_SUCCESS == va_status );
+    status("vaTerminate\n");
+
+    close(*dpy);
+    free(dpy);
+    status("close DRM device\n");
+
+    if (profiles)
+    {
+        free(profiles);
+        profiles = NULL;
+    }
+}
@@ -0,0 +1,225 @@
+/*
+ * Copyright (c) 2015 Intel Corporation. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+ * IN NO EVENT SHALL PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR
+ * ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+#include "startcode.h"
+
+/*
+ * Bit i of the mask is set when p[i], p[i + 1] are zero and p[i + 2] is
+ * one (max == 1) or at most max (escapes). STARTCODE_STEP + 2 bytes are
+ * read.
+ */
+#if defined(__AVX2__)
+#define STARTCODE_STEP  32
+
+static inline unsigned int
+match_mask(const unsigned char *p, int max)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i b0 = _mm256_loadu_si256((const __m256i *)p);
+    __m256i b1 = _mm256_loadu_si256((const __m256i *)(p + 1));
+    __m256i b2 = _mm256_loadu_si256((const __m256i *)(p + 2));
+    __m256i third = max == 1 ?
+        _mm256_cmpeq_epi8(b2, _mm256_set1_epi8(1)) :
+        _mm256_cmpeq_epi8(_mm256_min_epu8(b2, _mm256_set1_epi8(max)), b2);
+
+    return _mm256_movemask_epi8(_mm256_and_si256(
+            _mm256_and_si256(_mm256_cmpeq_epi8(b0, zero), _mm256_cmpeq_epi8(b1, zero)), third));
+}
+#elif defined(__SSE2__)
+#define STARTCODE_STEP  16
+
+static inline unsigned int
+match_mask(const unsigned char *p, int max)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i b0 = _mm_loadu_si128((const __m128i *)p);
+    __m128i b1 = _mm_loadu_si128((const __m128i *)(p + 1));
+    __m128i b2 = _mm_loadu_si128((const __m128i *)(p + 2));
+    __m128i third = max == 1 ?
+        _mm_cmpeq_epi8(b2, _mm_set1_epi8(1)) :
+        _mm_cmpeq_epi8(_mm_min_epu8(b2, _mm_set1_epi8(max)), b2);
+
+    return _mm_movemask_epi8(_mm_and_si128(
+            _mm_and_si128(_mm_cmpeq_epi8(b0, zero), _mm_cmpeq_epi8(b1, zero)), third));
+}
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#define STARTCODE_STEP  16
+
+static inline unsigned int
+match_mask(const unsigned char *p, int max)
+{
+    static const uint8_t bit[16] = { 1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 };
+    uint8x16_t b0 = vld1q_u8(p), b1 = vld1q_u8(p + 1), b2 = vld1q_u8(p + 2);
+    uint8x16_t third = max == 1 ? vceqq_u8(b2, vdupq_n_u8(1)) : vcleq_u8(b2, vdupq_n_u8(max));
+    uint8x16_t m = vandq_u8(vandq_u8(vceqzq_u8(b0), vceqzq_u8(b1)), third);
+
+    /* one bit per byte, as movemask */
+    m = vandq_u8(m, vld1q_u8(bit));
+    return vaddv_u8(vget_low_u8(m)) | (vaddv_u8(vget_high_u8(m)) << 8);
+}
+#endif
+
+static inline const unsigned char *
+find_pattern(const unsigned char *p, const unsigned char *end, int max)
+{
+#ifdef STARTCODE_STEP
+    while (end - p >= STARTCODE_STEP + 2) {
+        unsigned int mask = match_mask(p, max);
+
+        if (mask)
+            return p + __builtin_ctz(mask);
+        p += STARTCODE_STEP;
+    }
+#endif
+    for (; end - p >= 3; p++) {
+        if (p[0] == 0 && p[1] == 0 && p[2] <= max && (max != 1 || p[2] == 1))
+            return p;
+    }
+    return end;
+}
+
+const unsigned char *
+startcode_find(const unsigned char *p, const unsigned char *end)
+{
+    return find_pattern(p, end, 1);
+}
+
+const unsigned char *
+startcode_find_escape(const unsigned char *p, const unsigned char *end)
+{
+    return find_pattern(p, end, 3);
+}
+
+size_t
+startcode_unescape(unsigned char *dst, const unsigned char *src, size_t size)
+{
+    const unsigned char *end = src + size, *p;
+    unsigned char *d = dst;
+
+    for (;;) {
+        p = startcode_find_escape(src, end);
+        if (p == end)
+            break;
+        /* 00 00 00..02 cannot occur in a NAL unit, only 00 00 03 is dropped */
+        memmove(d, src, p + 2 - src);
+        d += p + 2 - src;
+        src = p + 2;
+        if (*src == 3)
+            src++;
+    }
+    memmove(d, src, end - src);
+    return d + (end - src) - dst;
+}
+
+size_t
+startcode_trim_zeros(const unsigned char *p, size_t size)
+{
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+
+    while (size >= 16 &&
+           _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + size - 16)),
+                                            zero)) == 0xffff)
+        size -= 16;
+#endif
+    while (size && p[size - 1] == 0)
+        size--;
+    return size;
+}
+
+void
+startcode_stream_init(struct startcode_stream *s, const unsigned char *buf, size_t size)
+{
+    s->buf = s->pos = buf;
+    s->end = buf + size;
+    s->map_size = 0;
+}
+
+int
+startcode_stream_open(struct startcode_stream *s, const char *filename)
+{
+    struct stat st;
+    void *buf;
+    int fd;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        close(fd);
+        return -1;
+    }
+    buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (buf == MAP_FAILED)
+        return -1;
+    madvise(buf, st.st_size, MADV_SEQUENTIAL);
+
+    startcode_stream_init(s, buf, st.st_size);
+    s->map_size = st.st_size;
+    return 0;
+}
+
+int
+startcode_stream_next(struct startcode_stream *s, const unsigned char **unit, size_t *size)
+{
+    const unsigned char *start, *next;
+
+    start = startcode_find(s->pos, s->end);
+    if (start == s->end) {
+        s->pos = s->end;
+        return 0;
+    }
+    next = startcode_find(start + 3, s->end);
+    s->pos = next;
+
+    *unit = start;
+    *size = next == s->end ? (size_t)(next - start) : startcode_trim_zeros(start, next - start);
+    return 1;
+}
+
+void
+startcode_stream_rewind(struct startcode_stream *s)
+{
+    s->pos = s->buf;
+}
+
+void
+startcode_stream_close(struct startcode_stream *s)
+{
+    if (s->map_size)
+        munmap((void *)s->buf, s->map_size);
+    s->buf = s->end = s->pos = NULL;
+    s->map_size = 0;
+}
@@ -0,0 +1,107 @@
+/*
+ * Copyright (c) 2015 Intel Corporation. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+ * IN NO EVENT SHALL PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR
+ * ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Start code (00 00 01) and emulation prevention scanning for the stream
+ * parsers and writers of the test tools.
+ *
+ * The searches test 16 (SSE2, NEON) or 32 (AVX2) positions at a time when
+ * the compiler targets these instruction sets, and fall back to a byte loop
+ * otherwise and for the last bytes of a buffer.
+ *
+ * A startcode_stream walks a buffer, or a mapped file, one unit at a time:
+ *
+ *   struct startcode_stream s;
+ *   const unsigned char *unit;
+ *   size_t size;
+ *
+ *   if (startcode_stream_open(&s, "input.264") == 0) {
+ *       while (startcode_stream_next(&s, &unit, &size))
+ *           ;  // unit[0..2] is 00 00 01, unit[3] the NAL header or start code value
+ *       startcode_stream_close(&s);
+ *   }
+ */
+
+#ifndef STARTCODE_H
+#define STARTCODE_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Returns the first 00 00 01 in [p, end), or end */
+const unsigned char *
+startcode_find(const unsigned char *p, const unsigned char *end);
+
+/**
+ * Returns the first 00 00 xx with xx <= 3 in [p, end), or end: where an
+ * emulation_prevention_three_byte goes when escaping, or is found (xx == 3)
+ * when unescaping.
+ */
+const unsigned char *
+startcode_find_escape(const unsigned char *p, const unsigned char *end);
+
+/**
+ * Copies a NAL unit and removes its emulation_prevention_three_bytes,
+ * dst may be src. Returns the size of the RBSP.
+ */
+size_t
+startcode_unescape(unsigned char *dst, const unsigned char *src, size_t size);
+
+/** Size without the trailing zero bytes */
+size_t
+startcode_trim_zeros(const unsigned char *p, size_t size);
+
+struct startcode_stream {
+    const unsigned char *buf, *end, *pos;
+    size_t map_size;                    /* 0 if the buffer belongs to the caller */
+};
+
+void
+startcode_stream_init(struct startcode_stream *s, const unsigned char *buf, size_t size);
+
+/** Maps the file, returns -1 on errors */
+int
+startcode_stream_open(struct startcode_stream *s, const char *filename);
+
+/**
+ * Returns 1 with the next unit, from its start code to the next one, the
+ * zero bytes before the next start code excluded; 0 at the end.
+ */
+int
+startcode_stream_next(struct startcode_stream *s, const unsigned char **unit, size_t *size);
+
+void
+startcode_stream_rewind(struct startcode_stream *s);
+
+void
+startcode_stream_close(struct startcode_stream *s);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* STARTCODE_H */
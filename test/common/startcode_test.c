@@ -0,0 +1,248 @@
+/*
+ * Copyright (c) 2015 Intel Corporation. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+ * IN NO EVENT SHALL PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR
+ * ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Compares the start code scanning of startcode.c, in whichever variant
+ * (SSE2, AVX2, NEON or byte loop) the compiler flags selected, with plain
+ * byte loops. Exits with 1 on the first mismatch.
+ *
+ * Buffers end right before a PROT_NONE page, so reading past their end
+ * crashes instead of going unnoticed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "startcode.h"
+
+#if defined(__AVX2__)
+#define STARTCODE_VARIANT       "AVX2"
+#elif defined(__SSE2__)
+#define STARTCODE_VARIANT       "SSE2"
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#define STARTCODE_VARIANT       "NEON"
+#else
+#define STARTCODE_VARIANT       "byte loop"
+#endif
+
+/* past two 32 byte steps and the byte loop tail */
+#define MAX_SIZE                100
+#define RANDOM_ROUNDS           200000
+
+#define CHECK(cond)                                                     \
+    do {                                                                \
+        if (!(cond)) {                                                  \
+            printf("%s:%d: %s: check failed: %s\n",                     \
+                   __FILE__, __LINE__, __func__, #cond);                \
+            return 0;                                                   \
+        }                                                               \
+    } while (0)
+
+static unsigned char *guard_page;
+
+/* size bytes ending at the guard page */
+static unsigned char *
+guarded(size_t size)
+{
+    return guard_page - size;
+}
+
+static const unsigned char *
+ref_find(const unsigned char *p, const unsigned char *end, int max)
+{
+    for (; end - p >= 3; p++) {
+        if (p[0] == 0 && p[1] == 0 && (max == 1 ? p[2] == 1 : p[2] <= max))
+            return p;
+    }
+    return end;
+}
+
+static size_t
+ref_unescape(unsigned char *dst, const unsigned char *src, size_t size)
+{
+    size_t i, j = 0;
+    int zeros = 0;
+
+    for (i = 0; i < size; i++) {
+        if (zeros >= 2 && src[i] == 3) {
+            zeros = 0;
+            continue;
+        }
+        zeros = src[i] ? 0 : zeros + 1;
+        dst[j++] = src[i];
+    }
+    return j;
+}
+
+static size_t
+ref_trim_zeros(const unsigned char *p, size_t size)
+{
+    while (size && p[size - 1] == 0)
+        size--;
+    return size;
+}
+
+/* Both searches on [buf + offset, buf + size) */
+static int
+check_searches(const unsigned char *buf, size_t size, size_t offset)
+{
+    const unsigned char *p = buf + offset, *end = buf + size;
+
+    CHECK(startcode_find(p, end) == ref_find(p, end, 1));
+    CHECK(startcode_find_escape(p, end) == ref_find(p, end, 3));
+    return 1;
+}
+
+/*
+ * A single 00 00 xx at every position of every size up to MAX_SIZE, so
+ * across each vector step and into the byte loop tail, plus the 00 and
+ * 00 00 prefixes cut by the end of the buffer.
+ */
+static int
+check_positions(void)
+{
+    static const unsigned char values[] = { 0, 1, 2, 3, 4, 0xff };
+    size_t size, pos, offset;
+    unsigned int v;
+    unsigned char *buf;
+
+    for (size = 0; size <= MAX_SIZE; size++) {
+        buf = guarded(size);
+        for (v = 0; v < sizeof(values); v++) {
+            for (pos = 0; pos < size; pos++) {
+                memset(buf, 0xff, size);
+                buf[pos] = 0;
+                if (pos + 1 < size)
+                    buf[pos + 1] = 0;
+                if (pos + 2 < size)
+                    buf[pos + 2] = values[v];
+                for (offset = 0; offset <= pos; offset++) {
+                    if (!check_searches(buf, size, offset))
+                        return 0;
+                }
+            }
+        }
+    }
+    return 1;
+}
+
+/* Mostly zero and small bytes, so matches and near misses are dense */
+static void
+fill_random(unsigned char *buf, size_t size)
+{
+    size_t i;
+
+    for (i = 0; i < size; i++) {
+        int r = rand() % 8;
+
+        buf[i] = r < 4 ? 0 : r < 6 ? rand() % 5 : rand();
+    }
+}
+
+static int
+check_random(void)
+{
+    unsigned char nal[MAX_SIZE], ref[MAX_SIZE], *buf;
+    size_t size, offset, i;
+    int round;
+
+    srand(1);
+    for (round = 0; round < RANDOM_ROUNDS; round++) {
+        size = rand() % (MAX_SIZE + 1);
+        buf = guarded(size);
+        fill_random(buf, size);
+
+        offset = rand() % (size + 1);
+        if (!check_searches(buf, size, offset))
+            return 0;
+        CHECK(startcode_trim_zeros(buf, size) == ref_trim_zeros(buf, size));
+
+        /* a NAL unit holds no 00 00 00..02, the reference keeps those */
+        memcpy(nal, buf, size);
+        for (i = 2; i < size; i++) {
+            if (nal[i - 2] == 0 && nal[i - 1] == 0 && nal[i] < 3)
+                nal[i] = 5;
+        }
+        memcpy(buf, nal, size);
+        i = ref_unescape(ref, nal, size);
+        CHECK(startcode_unescape(nal, nal, size) == i);
+        CHECK(memcmp(nal, ref, i) == 0);
+        CHECK(startcode_unescape(nal, buf, size) == i);
+        CHECK(memcmp(nal, ref, i) == 0);
+    }
+    return 1;
+}
+
+/* Trailing zeros of every length, around the 16 byte blocks */
+static int
+check_trim(void)
+{
+    size_t size, zeros;
+    unsigned char *buf;
+
+    for (size = 0; size <= MAX_SIZE; size++) {
+        buf = guarded(size);
+        for (zeros = 0; zeros <= size; zeros++) {
+            memset(buf, 0x80, size - zeros);
+            memset(buf + size - zeros, 0, zeros);
+            CHECK(startcode_trim_zeros(buf, size) == size - zeros);
+        }
+    }
+    return 1;
+}
+
+int
+main(int argc, char **argv)
+{
+    size_t page_size;
+    unsigned char *pages;
+    int ok;
+
+    page_size = sysconf(_SC_PAGESIZE);
+    pages = mmap(NULL, 2 * page_size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (pages == MAP_FAILED) {
+        printf("Failed to map the test buffer\n");
+        return 1;
+    }
+    guard_page = pages + page_size;
+    if (mprotect(guard_page, page_size, PROT_NONE) != 0) {
+        printf("Failed to protect the guard page\n");
+        munmap(pages, 2 * page_size);
+        return 1;
+    }
+
+    ok = check_positions() && check_trim() && check_random();
+    munmap(pages, 2 * page_size);
+
+    if (!ok) {
+        printf("Start code scanning check FAILED (%s)\n", STARTCODE_VARIANT);
+        return 1;
+    }
+    printf("Start code scanning check passed (%s)\n", STARTCODE_VARIANT);
+
+    return 0;
+}
@@ -33,6 +33,7 @@
 #include "va_display.h"
 
 static int drm_fd = -1;
+static unsigned int drm_fd_refs;
 
 static VADisplay
 va_open_display_drm(void)
@@ -40,6 +41,14 @@ va_open_display_drm(void)
     VADisplay va_dpy;
     int i;
 
+    /* Each call returns a new VADisplay on the same DRM device */
+    if (drm_fd >= 0) {
+        va_dpy = vaGetDisplayDRM(drm_fd);
+        if (va_dpy)
+            drm_fd_refs++;
+        return va_dpy;
+    }
+
     static const char *drm_device_paths[] = {
         "/dev/dri/renderD128",
         "/dev/dri/card0",
@@ -52,8 +61,10 @@ va_open_display_drm(void)
             continue;
 
         va_dpy = vaGetDisplayDRM(drm_fd);
-        if (va_dpy)
+        if (va_dpy) {
+            drm_fd_refs = 1;
             return va_dpy;
+        }
 
         close(drm_fd);
         drm_fd = -1;
@@ -64,7 +75,7 @@ va_open_display_drm(void)
 static void
 va_close_display_drm(VADisplay va_dpy)
 {
-    if (drm_fd < 0)
+    if (drm_fd < 0 || --drm_fd_refs > 0)
         return;
 
     close(drm_fd);
@@ -29,22 +29,27 @@
 
 static Display *x11_display;
 static Window   x11_window;
+static unsigned int x11_display_refs;
 
 static VADisplay
 va_open_display_x11(void)
 {
-    x11_display = XOpenDisplay(NULL);
+    /* Each call returns a new VADisplay on the same X connection */
     if (!x11_display) {
-        fprintf(stderr, "error: can't connect to X server!\n");
-        return NULL;
+        x11_display = XOpenDisplay(NULL);
+        if (!x11_display) {
+            fprintf(stderr, "error: can't connect to X server!\n");
+            return NULL;
+        }
     }
+    x11_display_refs++;
     return vaGetDisplay(x11_display);
 }
 
 static void
 va_close_display_x11(VADisplay va_dpy)
 {
-    if (!x11_display)
+    if (!x11_display || --x11_display_refs > 0)
         return;
 
     if (x11_window) {
@@ -36,9 +36,23 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <time.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 #include "va_display.h"
 
+#define LOADJPEG_PATH_MAX	4096
+#define LOADJPEG_RING		64	/* images between the reader and the submission */
+#define LOADJPEG_MAX_THREADS	16
+#define LOADJPEG_HIST_BUCKETS	24	/* log2 of microseconds */
+
 static void exitmessage(const char *message) __attribute__((noreturn));
 static void exitmessage(const char *message)
 {
@@ -46,13 +60,66 @@ static void exitmessage(const char *message)
   exit(0);
 }
 
-static int filesize(FILE *fp)
+/**
+ * A jpeg file in memory: mapped, or read when the parser could run past the
+ * end of the mapping.
+ */
+struct jpeg_file
+{
+  unsigned char *buf;
+  unsigned int length;
+  int mapped;
+};
+
+static int load_one_image(const char *infilename, struct jpeg_file *file)
+{
+  struct stat st;
+  int fd;
+
+  memset(file, 0, sizeof(*file));
+  fd = open(infilename, O_RDONLY);
+  if (fd < 0)
+    return -1;
+  if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+    close(fd);
+    return -1;
+  }
+  file->length = st.st_size;
+
+  /* the bytes up to the end of the last page read as zeros */
+  if (file->length % sysconf(_SC_PAGESIZE) != 0) {
+    int flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+    flags |= MAP_POPULATE;
+#endif
+    file->buf = mmap(NULL, file->length, PROT_READ, flags, fd, 0);
+    if (file->buf != MAP_FAILED) {
+      file->mapped = 1;
+      close(fd);
+      return 0;
+    }
+  }
+
+  file->buf = (unsigned char *)calloc(1, file->length + 4);
+  if (file->buf == NULL)
+    exitmessage("Not enough memory for loading file\n");
+  if (read(fd, file->buf, file->length) != (ssize_t)file->length) {
+    free(file->buf);
+    file->buf = NULL;
+    close(fd);
+    return -1;
+  }
+  close(fd);
+  return 0;
+}
+
+static void unload_one_image(struct jpeg_file *file)
 {
-  long pos;
-  fseek(fp, 0, SEEK_END);
-  pos = ftell(fp);
-  fseek(fp, 0, SEEK_SET);
-  return pos;
+  if (file->mapped)
+    munmap(file->buf, file->length);
+  else
+    free(file->buf);
+  file->buf = NULL;
 }
 
 /**
@@ -60,29 +127,20 @@ static int filesize(FILE *fp)
  */
 int convert_one_image(const char *infilename)
 {
-  FILE *fp;
-  unsigned int length_of_file;
+  struct jpeg_file file;
   unsigned int width, height;
-  unsigned char *buf;
   struct jdec_private *jdec;
 
   /* Load the Jpeg into memory */
-  fp = fopen(infilename, "rb");
-  if (fp == NULL)
+  if (load_one_image(infilename, &file) < 0)
     exitmessage("Cannot open filename\n");
-  length_of_file = filesize(fp);
-  buf = (unsigned char *)malloc(length_of_file + 4);
-  if (buf == NULL)
-    exitmessage("Not enough memory for loading file\n");
-  fread(buf, length_of_file, 1, fp);
-  fclose(fp);
 
   /* Decompress it */
   jdec = tinyjpeg_init();
   if (jdec == NULL)
     exitmessage("Not enough memory to alloc the structure need for decompressing\n");
 
-  if (tinyjpeg_parse_header(jdec, buf, length_of_file)<0)
+  if (tinyjpeg_parse_header(jdec, file.buf, file.length)<0)
     exitmessage(tinyjpeg_get_errorstring(jdec));
 
   /* Get the size of the image */
@@ -94,13 +152,341 @@ int convert_one_image(const char *infilename)
 
   tinyjpeg_free(jdec);
 
-  free(buf);
+  unload_one_image(&file);
   return 0;
 }
 
+/*
+ * Batch decoding, in three stages:
+ *  - a reader thread maps the files in order
+ *  - parser threads run tinyjpeg_parse_header() on whatever has been read
+ *  - the main thread submits the parsed images to the decode session in
+ *    order, which keeps up to depth decodes in flight per context
+ * Up to LOADJPEG_RING images are between the reader and the submission.
+ */
+struct file_list
+{
+  char **names;
+  unsigned int num, size;
+};
+
+static void file_list_add(struct file_list *list, const char *name)
+{
+  if (list->num == list->size) {
+    list->size = list->size ? list->size * 2 : 256;
+    list->names = realloc(list->names, list->size * sizeof(*list->names));
+    if (list->names == NULL)
+      exitmessage("Not enough memory for the file list\n");
+  }
+  list->names[list->num] = strdup(name);
+  if (list->names[list->num] == NULL)
+    exitmessage("Not enough memory for the file list\n");
+  list->num++;
+}
+
+static int is_jpeg_name(const char *name)
+{
+  const char *ext = strrchr(name, '.');
+
+  return ext && (!strcasecmp(ext, ".jpg") || !strcasecmp(ext, ".jpeg"));
+}
+
+static int jpeg_filter(const struct dirent *entry)
+{
+  return is_jpeg_name(entry->d_name);
+}
+
+/**
+ * Adds a file, all the *.jpg / *.jpeg of a directory in name order, or the
+ * files named in a list ("-" for stdin), one per line. Returns the number
+ * of paths that could not be read.
+ */
+static unsigned int collect_path(struct file_list *list, const char *path, int is_list)
+{
+  char filename[LOADJPEG_PATH_MAX];
+  unsigned int failures = 0;
+  struct stat st;
+
+  if (is_list) {
+    FILE *list_fp = strcmp(path, "-") ? fopen(path, "r") : stdin;
+
+    if (list_fp == NULL) {
+      fprintf(stderr, "Cannot open list %s\n", path);
+      return 1;
+    }
+    while (fgets(filename, sizeof(filename), list_fp)) {
+      filename[strcspn(filename, "\r\n")] = 0;
+      if (filename[0] == 0 || filename[0] == '#')
+        continue;
+      failures += collect_path(list, filename, 0);
+    }
+    if (list_fp != stdin)
+      fclose(list_fp);
+    return failures;
+  }
+
+  if (stat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+    struct dirent **entries;
+    int i, n;
+
+    n = scandir(path, &entries, jpeg_filter, alphasort);
+    if (n < 0) {
+      fprintf(stderr, "Cannot read directory %s\n", path);
+      return 1;
+    }
+    for (i = 0; i < n; i++) {
+      snprintf(filename, sizeof(filename), "%s/%s", path, entries[i]->d_name);
+      file_list_add(list, filename);
+      free(entries[i]);
+    }
+    free(entries);
+    return 0;
+  }
+
+  file_list_add(list, path);
+  return 0;
+}
+
+static double wall_time(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+struct stage_stats
+{
+  const char *name;
+  unsigned int count;
+  double total, max;
+  unsigned int hist[LOADJPEG_HIST_BUCKETS];
+};
+
+static void stage_stats_add(struct stage_stats *stats, double seconds)
+{
+  unsigned int us = seconds * 1000000.0, bucket = 0;
+
+  while (us > 1 && bucket < LOADJPEG_HIST_BUCKETS - 1) {
+    us >>= 1;
+    bucket++;
+  }
+  stats->hist[bucket]++;
+  stats->count++;
+  stats->total += seconds;
+  if (seconds > stats->max)
+    stats->max = seconds;
+}
+
+static void stage_stats_print(const struct stage_stats *stats)
+{
+  int i, first = -1, last = -1;
+
+  if (stats->count == 0)
+    return;
+
+  printf("%-8s avg %8.1f us, max %8.1f us\n", stats->name,
+         stats->total * 1000000.0 / stats->count, stats->max * 1000000.0);
+  for (i = 0; i < LOADJPEG_HIST_BUCKETS; i++) {
+    if (stats->hist[i] == 0)
+      continue;
+    if (first < 0)
+      first = i;
+    last = i;
+  }
+  for (i = first; i <= last; i++)
+    printf("  < %8u us: %8u (%5.1f%%)\n", 2u << i, stats->hist[i],
+           100.0 * stats->hist[i] / stats->count);
+}
+
+enum image_state
+{
+  IMAGE_FREE,
+  IMAGE_READ,
+  IMAGE_PARSING,
+  IMAGE_PARSED,
+};
+
+struct batch_image
+{
+  enum image_state state;
+  int failed;
+  struct jpeg_file file;
+  struct jdec_private *jdec;
+  double t_read, t_parsed;		/* start of each stage */
+  double t_submit;
+};
+
+struct batch
+{
+  struct file_list *list;
+  struct batch_image ring[LOADJPEG_RING];
+  unsigned int read, parsed_next, submitted;	/* image counters */
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  struct stage_stats read_stats, parse_stats;
+};
+
+static void *reader_thread(void *arg)
+{
+  struct batch *batch = arg;
+  unsigned int i;
+
+  for (i = 0; i < batch->list->num; i++) {
+    struct batch_image *image = &batch->ring[i % LOADJPEG_RING];
+    double t;
+
+    pthread_mutex_lock(&batch->mutex);
+    while (i - batch->submitted >= LOADJPEG_RING)
+      pthread_cond_wait(&batch->cond, &batch->mutex);
+    pthread_mutex_unlock(&batch->mutex);
+
+    t = wall_time();
+    image->failed = load_one_image(batch->list->names[i], &image->file) < 0;
+    if (image->failed)
+      fprintf(stderr, "Cannot open %s\n", batch->list->names[i]);
+    image->t_read = t;
+
+    pthread_mutex_lock(&batch->mutex);
+    stage_stats_add(&batch->read_stats, wall_time() - t);
+    image->state = IMAGE_READ;
+    batch->read++;
+    pthread_cond_broadcast(&batch->cond);
+    pthread_mutex_unlock(&batch->mutex);
+  }
+
+  return NULL;
+}
+
+static void *parser_thread(void *arg)
+{
+  struct batch *batch = arg;
+
+  for (;;) {
+    struct batch_image *image;
+    unsigned int i;
+    double t;
+
+    pthread_mutex_lock(&batch->mutex);
+    while (batch->parsed_next < batch->list->num &&
+           batch->parsed_next == batch->read)
+      pthread_cond_wait(&batch->cond, &batch->mutex);
+    if (batch->parsed_next == batch->list->num) {
+      pthread_mutex_unlock(&batch->mutex);
+      break;
+    }
+    i = batch->parsed_next++;
+    image = &batch->ring[i % LOADJPEG_RING];
+    image->state = IMAGE_PARSING;
+    pthread_mutex_unlock(&batch->mutex);
+
+    t = wall_time();
+    if (!image->failed) {
+      image->jdec = tinyjpeg_init();
+      if (image->jdec == NULL)
+        exitmessage("Not enough memory to alloc the structure need for decompressing\n");
+      if (tinyjpeg_parse_header(image->jdec, image->file.buf, image->file.length) < 0) {
+        fprintf(stderr, "%s: %s\n", batch->list->names[i],
+                tinyjpeg_get_errorstring(image->jdec));
+        image->failed = 1;
+      }
+    }
+    image->t_parsed = t;
+
+    pthread_mutex_lock(&batch->mutex);
+    stage_stats_add(&batch->parse_stats, wall_time() - t);
+    image->state = IMAGE_PARSED;
+    pthread_cond_broadcast(&batch->cond);
+    pthread_mutex_unlock(&batch->mutex);
+  }
+
+  return NULL;
+}
+
+/**
+ * Decodes the listed images through the session, returns the failures.
+ */
+static unsigned int decode_batch(struct tinyjpeg_session *session, struct file_list *list,
+                                 int num_threads, double *elapsed)
+{
+  struct batch *batch;
+  pthread_t reader, parsers[LOADJPEG_MAX_THREADS];
+  struct stage_stats submit_stats = { "submit" }, total_stats = { "total" };
+  unsigned int i, failures = 0;
+  double start, t;
+  int j;
+
+  batch = calloc(1, sizeof(*batch));
+  if (batch == NULL)
+    exitmessage("Not enough memory for the batch\n");
+  batch->list = list;
+  batch->read_stats.name = "read";
+  batch->parse_stats.name = "parse";
+  pthread_mutex_init(&batch->mutex, NULL);
+  pthread_cond_init(&batch->cond, NULL);
+
+  start = wall_time();
+  pthread_create(&reader, NULL, reader_thread, batch);
+  for (j = 0; j < num_threads; j++)
+    pthread_create(&parsers[j], NULL, parser_thread, batch);
+
+  for (i = 0; i < list->num; i++) {
+    struct batch_image *image = &batch->ring[i % LOADJPEG_RING];
+
+    pthread_mutex_lock(&batch->mutex);
+    while (image->state != IMAGE_PARSED)
+      pthread_cond_wait(&batch->cond, &batch->mutex);
+    pthread_mutex_unlock(&batch->mutex);
+
+    t = wall_time();
+    if (!image->failed && tinyjpeg_session_decode(session, image->jdec) < 0) {
+      fprintf(stderr, "%s: %s\n", list->names[i], tinyjpeg_get_errorstring(image->jdec));
+      image->failed = 1;
+    }
+    stage_stats_add(&submit_stats, wall_time() - t);
+    stage_stats_add(&total_stats, wall_time() - image->t_read);
+    failures += image->failed;
+
+    if (image->jdec)
+      tinyjpeg_free(image->jdec);
+    if (image->file.buf)
+      unload_one_image(&image->file);
+    memset(image, 0, sizeof(*image));
+
+    pthread_mutex_lock(&batch->mutex);
+    batch->submitted++;
+    pthread_cond_broadcast(&batch->cond);
+    pthread_mutex_unlock(&batch->mutex);
+  }
+
+  pthread_join(reader, NULL);
+  for (j = 0; j < num_threads; j++)
+    pthread_join(parsers[j], NULL);
+
+  tinyjpeg_session_sync(session);
+  *elapsed = wall_time() - start;
+
+  stage_stats_print(&batch->read_stats);
+  stage_stats_print(&batch->parse_stats);
+  stage_stats_print(&submit_stats);
+  stage_stats_print(&total_stats);
+
+  pthread_cond_destroy(&batch->cond);
+  pthread_mutex_destroy(&batch->mutex);
+  free(batch);
+
+  return failures;
+}
+
 static void usage(void)
 {
-    fprintf(stderr, "Usage: loadjpeg <input_filename.jpeg> \n");
+    fprintf(stderr, "Usage: loadjpeg <input_filename.jpeg>\n");
+    fprintf(stderr, "       loadjpeg [--threads <n>] [--depth <k>] [--list <file|->] <file|directory>...\n");
+    fprintf(stderr, "  a single file is displayed, anything else is decoded as a batch\n");
+    fprintf(stderr, "  through one decode session, without display\n");
+    fprintf(stderr, "  --threads: header parser threads, default one per CPU\n");
+    fprintf(stderr, "  --depth: decodes in flight per surface size, 1 to %d, default 4\n",
+            TINYJPEG_SURFACE_MAX);
     exit(1);
 }
 
@@ -113,25 +499,83 @@ int main(int argc, char *argv[])
   char *input_filename;
   clock_t start_time, finish_time;
   unsigned int duration;
-  int current_argument;
+  struct tinyjpeg_session *session;
+  struct file_list list = { NULL, 0, 0 };
+  unsigned int failures = 0, decode_failures, i;
+  int num_threads, depth = 0, batch = 0;
+  double elapsed;
+  int c;
+  const struct option long_opts[] = {
+    {"threads", required_argument, NULL, 't' },
+    {"depth", required_argument, NULL, 'd' },
+    {"list", required_argument, NULL, 'l' },
+    {NULL, no_argument, NULL, 0 }
+  };
 
   va_init_display_args(&argc, argv);
 
-  if (argc < 2)
+  num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  while ((c = getopt_long(argc, argv, "", long_opts, NULL)) != -1) {
+    switch (c) {
+    case 't':
+      num_threads = atoi(optarg);
+      break;
+    case 'd':
+      depth = atoi(optarg);
+      if (depth < 1 || depth > TINYJPEG_SURFACE_MAX)
+        usage();
+      break;
+    case 'l':
+      failures += collect_path(&list, optarg, 1);
+      batch = 1;
+      break;
+    default:
+      usage();
+    }
+  }
+  if (num_threads < 1)
+    num_threads = 1;
+  else if (num_threads > LOADJPEG_MAX_THREADS)
+    num_threads = LOADJPEG_MAX_THREADS;
+
+  if (optind == argc && !batch)
     usage();
 
-  current_argument = 1;
-  input_filename = argv[current_argument];
+  if (optind == argc - 1 && !batch) {
+    struct stat st;
 
-  start_time = clock();
-  convert_one_image(input_filename);
-  finish_time = clock();
-  duration = finish_time - start_time;
-  printf("Decoding finished in %u ticks\n", duration);
+    input_filename = argv[optind];
+    if (stat(input_filename, &st) != 0 || !S_ISDIR(st.st_mode)) {
+      start_time = clock();
+      convert_one_image(input_filename);
+      finish_time = clock();
+      duration = finish_time - start_time;
+      printf("Decoding finished in %u ticks\n", duration);
 
-  return 0;
-}
+      return 0;
+    }
+  }
 
+  for (; optind < argc; optind++)
+    failures += collect_path(&list, argv[optind], 0);
 
+  session = tinyjpeg_session_create(0, depth);
+  if (session == NULL)
+    exitmessage("Failed to create the decode session\n");
 
+  decode_failures = decode_batch(session, &list, num_threads, &elapsed);
+  failures += decode_failures;
+  printf("Decoded %u images (%u failed) in %.3f s, %.1f images/s, "
+         "%d parser threads, %u contexts created, %u slices\n",
+         list.num - decode_failures, failures, elapsed,
+         elapsed > 0 ? (list.num - decode_failures) / elapsed : 0.0,
+         num_threads, tinyjpeg_session_contexts(session), tinyjpeg_session_slices(session));
 
+  tinyjpeg_session_destroy(session);
+
+  for (i = 0; i < list.num; i++)
+    free(list.names[i]);
+  free(list.names);
+
+  return failures ? 1 : 0;
+}
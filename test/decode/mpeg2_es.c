@@ -0,0 +1,421 @@
+/*
+ * Copyright (c) 2015 Intel Corporation. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+ * IN NO EVENT SHALL PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR
+ * ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "startcode.h"
+#include "mpeg2_es.h"
+
+#define SEQUENCE_HEADER_CODE    0xb3
+#define SEQUENCE_END_CODE       0xb7
+#define EXTENSION_START_CODE    0xb5
+#define GROUP_START_CODE        0xb8
+#define PICTURE_START_CODE      0x00
+#define SLICE_START_CODE_MIN    0x01
+#define SLICE_START_CODE_MAX    0xaf
+
+#define SEQUENCE_EXTENSION_ID           1
+#define QUANT_MATRIX_EXTENSION_ID       3
+#define PICTURE_CODING_EXTENSION_ID     8
+
+/* default intra matrix, in zig-zag order */
+static const unsigned char default_intra_qm[64] = {
+     8, 16, 16, 19, 16, 19, 22, 22,
+    22, 22, 22, 22, 26, 24, 26, 27,
+    27, 27, 26, 26, 26, 26, 27, 27,
+    27, 29, 29, 29, 34, 34, 34, 29,
+    29, 29, 27, 27, 29, 29, 32, 32,
+    34, 34, 37, 38, 37, 35, 35, 34,
+    35, 38, 38, 40, 40, 40, 48, 48,
+    46, 46, 56, 56, 58, 69, 69, 83
+};
+
+static const double frame_rates[16] = {
+    0, 24000.0 / 1001, 24, 25, 30000.0 / 1001, 30, 50, 60000.0 / 1001, 60,
+};
+
+struct bits {
+    const unsigned char *p, *end;
+    unsigned int pos;
+};
+
+static void
+bits_init(struct bits *b, const unsigned char *p, const unsigned char *end)
+{
+    b->p = p;
+    b->end = end;
+    b->pos = 0;
+}
+
+/* reads zeros past the end */
+static unsigned int
+peek_bits(const struct bits *b, int n)
+{
+    unsigned int val = 0, pos = b->pos;
+
+    while (n--) {
+        const unsigned char *byte = b->p + (pos >> 3);
+
+        val <<= 1;
+        if (byte < b->end)
+            val |= (*byte >> (7 - (pos & 7))) & 1;
+        pos++;
+    }
+    return val;
+}
+
+static unsigned int
+get_bits(struct bits *b, int n)
+{
+    unsigned int val = peek_bits(b, n);
+
+    b->pos += n;
+    return val;
+}
+
+static void
+get_matrix(struct bits *b, unsigned char *qm)
+{
+    int i;
+
+    for (i = 0; i < 64; i++)
+        qm[i] = get_bits(b, 8);
+}
+
+/* macroblock_address_increment, table B-1; 0 on invalid codes */
+static unsigned int
+get_mb_address_increment(struct bits *b)
+{
+    unsigned int increment = 0, v;
+
+    for (;;) {
+        v = peek_bits(b, 11);
+        if (v >= 1024) {
+            b->pos += 1;
+            return increment + 1;
+        } else if (v >= 512) {
+            b->pos += 3;
+            return increment + ((v >> 8) == 3 ? 2 : 3);
+        } else if (v >= 256) {
+            b->pos += 4;
+            return increment + ((v >> 7) == 3 ? 4 : 5);
+        } else if (v >= 128) {
+            b->pos += 5;
+            return increment + ((v >> 6) == 3 ? 6 : 7);
+        } else if (v >= 96) {
+            b->pos += 7;
+            return increment + 15 - (v >> 4);
+        } else if (v >= 48) {
+            b->pos += 8;
+            return increment + 21 - (v >> 3);
+        } else if (v >= 36) {
+            b->pos += 10;
+            return increment + 39 - (v >> 1);
+        } else if (v >= 24) {
+            b->pos += 11;
+            return increment + 57 - v;
+        } else if (v == 8) {            /* macroblock_escape */
+            b->pos += 11;
+            increment += 33;
+        } else if (v == 15) {           /* macroblock_stuffing */
+            b->pos += 11;
+        } else
+            return 0;
+    }
+}
+
+static void
+parse_sequence_header(struct mpeg2_es *es, struct bits *b)
+{
+    es->width = get_bits(b, 12);
+    es->height = get_bits(b, 12);
+    get_bits(b, 4);                     /* aspect_ratio_information */
+    es->frame_rate_code = get_bits(b, 4);
+    get_bits(b, 18 + 1 + 10 + 1);       /* bit_rate, marker, vbv_buffer_size, constrained */
+
+    if (get_bits(b, 1))
+        get_matrix(b, es->intra_qm);
+    else
+        memcpy(es->intra_qm, default_intra_qm, 64);
+    if (get_bits(b, 1))
+        get_matrix(b, es->non_intra_qm);
+    else
+        memset(es->non_intra_qm, 16, 64);
+    memcpy(es->chroma_intra_qm, es->intra_qm, 64);
+    memcpy(es->chroma_non_intra_qm, es->non_intra_qm, 64);
+    es->load_chroma_intra = es->load_chroma_non_intra = 0;
+
+    /* MPEG-1 until a sequence extension follows */
+    es->have_sequence = 0;
+    es->new_sequence = 1;
+}
+
+static void
+parse_sequence_extension(struct mpeg2_es *es, struct bits *b)
+{
+    get_bits(b, 8);                     /* profile_and_level_indication */
+    es->progressive_sequence = get_bits(b, 1);
+    es->chroma_format = get_bits(b, 2);
+    es->width |= get_bits(b, 2) << 12;
+    es->height |= get_bits(b, 2) << 12;
+    es->have_sequence = 1;
+}
+
+static void
+parse_quant_matrix_extension(struct mpeg2_es *es, struct bits *b)
+{
+    if (get_bits(b, 1)) {
+        get_matrix(b, es->intra_qm);
+        memcpy(es->chroma_intra_qm, es->intra_qm, 64);
+    }
+    if (get_bits(b, 1)) {
+        get_matrix(b, es->non_intra_qm);
+        memcpy(es->chroma_non_intra_qm, es->non_intra_qm, 64);
+    }
+    if (get_bits(b, 1)) {
+        get_matrix(b, es->chroma_intra_qm);
+        es->load_chroma_intra = 1;
+    }
+    if (get_bits(b, 1)) {
+        get_matrix(b, es->chroma_non_intra_qm);
+        es->load_chroma_non_intra = 1;
+    }
+}
+
+static void
+parse_picture_header(struct mpeg2_es *es, struct bits *b, struct mpeg2_picture *pic)
+{
+    VAPictureParameterBufferMPEG2 *pp = &pic->pic_param;
+
+    pic->temporal_reference = get_bits(b, 10);
+    pp->picture_coding_type = get_bits(b, 3);
+    get_bits(b, 16);                    /* vbv_delay, the f_codes are in the extension */
+
+    pp->horizontal_size = es->width;
+    pp->vertical_size = es->height;
+    pp->forward_reference_picture = VA_INVALID_SURFACE;
+    pp->backward_reference_picture = VA_INVALID_SURFACE;
+}
+
+static void
+parse_picture_coding_extension(struct mpeg2_es *es, struct bits *b, struct mpeg2_picture *pic)
+{
+    VAPictureParameterBufferMPEG2 *pp = &pic->pic_param;
+
+    pp->f_code = get_bits(b, 16);
+    pp->picture_coding_extension.value = 0;
+    pp->picture_coding_extension.bits.intra_dc_precision = get_bits(b, 2);
+    pp->picture_coding_extension.bits.picture_structure = get_bits(b, 2);
+    pp->picture_coding_extension.bits.top_field_first = get_bits(b, 1);
+    pp->picture_coding_extension.bits.frame_pred_frame_dct = get_bits(b, 1);
+    pp->picture_coding_extension.bits.concealment_motion_vectors = get_bits(b, 1);
+    pp->picture_coding_extension.bits.q_scale_type = get_bits(b, 1);
+    pp->picture_coding_extension.bits.intra_vlc_format = get_bits(b, 1);
+    pp->picture_coding_extension.bits.alternate_scan = get_bits(b, 1);
+    pp->picture_coding_extension.bits.repeat_first_field = get_bits(b, 1);
+    get_bits(b, 1);                     /* chroma_420_type */
+    pp->picture_coding_extension.bits.progressive_frame = get_bits(b, 1);
+
+    if (pp->picture_coding_extension.bits.picture_structure == MPEG2_FRAME_PICTURE) {
+        pp->picture_coding_extension.bits.is_first_field = 1;
+        es->second_field = 0;
+    } else {
+        pp->picture_coding_extension.bits.is_first_field = !es->second_field;
+        es->second_field = !es->second_field;
+    }
+}
+
+static int
+add_slice(struct mpeg2_es *es, struct mpeg2_picture *pic,
+          const unsigned char *start, const unsigned char *end)
+{
+    struct mpeg2_slice *slice;
+    struct bits b;
+    unsigned int increment;
+
+    if (pic->num_slices == es->max_slices) {
+        unsigned int max_slices = es->max_slices ? es->max_slices * 2 : 128;
+
+        slice = realloc(es->slices, max_slices * sizeof(*slice));
+        if (slice == NULL)
+            return -1;
+        es->slices = slice;
+        es->max_slices = max_slices;
+    }
+    if (pic->data == NULL)
+        pic->data = start;
+
+    slice = &es->slices[pic->num_slices];
+    slice->offset = start - pic->data;
+    slice->size = end - start;
+    slice->vertical_position = start[3] - 1;
+
+    bits_init(&b, start + 4, end);
+    if (es->height > 2800)
+        slice->vertical_position += get_bits(&b, 3) << 7;
+    slice->quantiser_scale_code = get_bits(&b, 5);
+    slice->intra_slice_flag = 0;
+    if (peek_bits(&b, 1)) {
+        slice->intra_slice_flag = get_bits(&b, 1);
+        get_bits(&b, 1 + 7);            /* intra_slice, reserved_bits */
+        while (get_bits(&b, 1))         /* extra_bit_slice */
+            get_bits(&b, 8);
+    } else
+        get_bits(&b, 1);
+    slice->macroblock_offset = 32 + b.pos;
+
+    increment = get_mb_address_increment(&b);
+    if (increment == 0)
+        return -1;
+    slice->horizontal_position = increment - 1;
+
+    pic->num_slices++;
+    pic->slices = es->slices;
+    pic->size = end - pic->data;
+    return 0;
+}
+
+void
+mpeg2_es_init(struct mpeg2_es *es, const unsigned char *buf, size_t size)
+{
+    memset(es, 0, sizeof(*es));
+    es->buf = es->pos = buf;
+    es->end = buf + size;
+    memcpy(es->intra_qm, default_intra_qm, 64);
+    memset(es->non_intra_qm, 16, 64);
+    memcpy(es->chroma_intra_qm, es->intra_qm, 64);
+    memcpy(es->chroma_non_intra_qm, es->non_intra_qm, 64);
+}
+
+int
+mpeg2_es_next_picture(struct mpeg2_es *es, struct mpeg2_picture *pic)
+{
+    const unsigned char *sc, *next;
+    int have_picture = 0, have_picture_extension = 0;
+    struct bits b;
+
+    memset(pic, 0, sizeof(*pic));
+
+    for (;;) {
+        sc = startcode_find(es->pos, es->end);
+        if (sc == es->end) {
+            es->pos = es->end;
+            break;
+        }
+
+        next = startcode_find(sc + 4, es->end);
+        if (sc[3] >= SLICE_START_CODE_MIN && sc[3] <= SLICE_START_CODE_MAX) {
+            es->pos = next;
+            if (!have_picture)
+                continue;
+            if (!have_picture_extension || add_slice(es, pic, sc, next) < 0)
+                return -1;
+            continue;
+        }
+
+        /* any other start code ends the picture */
+        if (pic->num_slices)
+            break;
+        es->pos = next;
+
+        bits_init(&b, sc + 4, next);
+        switch (sc[3]) {
+        case SEQUENCE_HEADER_CODE:
+            parse_sequence_header(es, &b);
+            have_picture = 0;
+            break;
+        case EXTENSION_START_CODE:
+            switch (get_bits(&b, 4)) {
+            case SEQUENCE_EXTENSION_ID:
+                parse_sequence_extension(es, &b);
+                break;
+            case QUANT_MATRIX_EXTENSION_ID:
+                parse_quant_matrix_extension(es, &b);
+                break;
+            case PICTURE_CODING_EXTENSION_ID:
+                if (have_picture) {
+                    parse_picture_coding_extension(es, &b, pic);
+                    have_picture_extension = 1;
+                }
+                break;
+            }
+            break;
+        case GROUP_START_CODE:
+            get_bits(&b, 25);           /* time_code */
+            es->closed_gop = get_bits(&b, 1);
+            es->broken_link = get_bits(&b, 1);
+            break;
+        case PICTURE_START_CODE:
+            if (!es->have_sequence)
+                return -1;
+            parse_picture_header(es, &b, pic);
+            have_picture = 1;
+            have_picture_extension = 0;
+            break;
+        default:
+            break;
+        }
+    }
+
+    if (pic->num_slices == 0)
+        return 0;
+
+    pic->new_sequence = es->new_sequence;
+    pic->closed_gop = es->closed_gop;
+    pic->broken_link = es->broken_link;
+    es->new_sequence = 0;
+    es->broken_link = 0;
+
+    pic->iq_matrix.load_intra_quantiser_matrix = 1;
+    pic->iq_matrix.load_non_intra_quantiser_matrix = 1;
+    pic->iq_matrix.load_chroma_intra_quantiser_matrix = es->load_chroma_intra;
+    pic->iq_matrix.load_chroma_non_intra_quantiser_matrix = es->load_chroma_non_intra;
+    memcpy(pic->iq_matrix.intra_quantiser_matrix, es->intra_qm, 64);
+    memcpy(pic->iq_matrix.non_intra_quantiser_matrix, es->non_intra_qm, 64);
+    memcpy(pic->iq_matrix.chroma_intra_quantiser_matrix, es->chroma_intra_qm, 64);
+    memcpy(pic->iq_matrix.chroma_non_intra_quantiser_matrix, es->chroma_non_intra_qm, 64);
+
+    return 1;
+}
+
+void
+mpeg2_es_rewind(struct mpeg2_es *es)
+{
+    es->pos = es->buf;
+    es->second_field = 0;
+}
+
+void
+mpeg2_es_fini(struct mpeg2_es *es)
+{
+    free(es->slices);
+    es->slices = NULL;
+    es->max_slices = 0;
+}
+
+double
+mpeg2_es_frame_rate(const struct mpeg2_es *es)
+{
+    return frame_rates[es->frame_rate_code & 15];
+}
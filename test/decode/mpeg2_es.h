@@ -0,0 +1,134 @@
+/*
+ * Copyright (c) 2015 Intel Corporation. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+ * IN NO EVENT SHALL PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR
+ * ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * MPEG-2 video elementary stream parser for VA decoding.
+ *
+ * The stream is walked start code by start code: sequence, GOP and
+ * extension headers update the parser state, and each picture comes out
+ * with its VA picture parameters and IQ matrix filled in and its slices
+ * located in the stream:
+ *
+ *   struct mpeg2_es es;
+ *   struct mpeg2_picture pic;
+ *
+ *   mpeg2_es_init(&es, buf, size);
+ *   while (mpeg2_es_next_picture(&es, &pic) > 0) {
+ *       // set pic.pic_param.forward/backward_reference_picture
+ *       // pic.data holds pic.size bytes of slices, pic.slices[] points
+ *       // into it
+ *   }
+ *   mpeg2_es_fini(&es);
+ *
+ * Only MPEG-2 streams are handled, MPEG-1 (no sequence extension) is
+ * reported as an error. The stream buffer must stay valid while the
+ * pictures are used.
+ */
+
+#ifndef MPEG2_ES_H
+#define MPEG2_ES_H
+
+#include <stddef.h>
+#include <va/va.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MPEG2_PICTURE_I         1
+#define MPEG2_PICTURE_P         2
+#define MPEG2_PICTURE_B         3
+
+#define MPEG2_FRAME_PICTURE     3
+
+struct mpeg2_slice {
+    unsigned int offset;                /* from pic->data, at the start code */
+    unsigned int size;
+    unsigned int macroblock_offset;     /* bits from the start code to the first macroblock */
+    unsigned int horizontal_position;   /* in macroblocks */
+    unsigned int vertical_position;
+    int quantiser_scale_code;
+    int intra_slice_flag;
+};
+
+struct mpeg2_picture {
+    VAPictureParameterBufferMPEG2 pic_param;    /* references left to the caller */
+    VAIQMatrixBufferMPEG2 iq_matrix;
+    unsigned int temporal_reference;
+    int new_sequence;                   /* a sequence header came first */
+    int closed_gop;
+    int broken_link;
+
+    const unsigned char *data;          /* from the first slice start code */
+    unsigned int size;
+    const struct mpeg2_slice *slices;
+    unsigned int num_slices;
+};
+
+struct mpeg2_es {
+    const unsigned char *buf, *end, *pos;
+
+    /* sequence */
+    unsigned int width, height;
+    unsigned int frame_rate_code;
+    int progressive_sequence;
+    int chroma_format;
+    int have_sequence;                  /* sequence header and extension */
+    int new_sequence;
+    int closed_gop, broken_link;
+
+    /* quantiser matrices in zig-zag order, kept until the next sequence header */
+    unsigned char intra_qm[64], non_intra_qm[64];
+    unsigned char chroma_intra_qm[64], chroma_non_intra_qm[64];
+    int load_chroma_intra, load_chroma_non_intra;
+
+    int second_field;                   /* the next field completes a frame */
+
+    struct mpeg2_slice *slices;
+    unsigned int max_slices;
+};
+
+void
+mpeg2_es_init(struct mpeg2_es *es, const unsigned char *buf, size_t size);
+
+/** Returns 1 with the next picture, 0 at the end of the stream, -1 on errors */
+int
+mpeg2_es_next_picture(struct mpeg2_es *es, struct mpeg2_picture *pic);
+
+/** Restarts from the beginning of the stream, the state is kept */
+void
+mpeg2_es_rewind(struct mpeg2_es *es);
+
+void
+mpeg2_es_fini(struct mpeg2_es *es);
+
+/** Frame rate of the sequence in frames per second, 0 if unknown */
+double
+mpeg2_es_frame_rate(const struct mpeg2_es *es);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MPEG2_ES_H */
@@ -0,0 +1,401 @@
+/*
+ * Copyright (c) 2015 Intel Corporation. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+ * IN NO EVENT SHALL PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR
+ * ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Decodes an MPEG-2 video elementary stream, for throughput measurements:
+ *
+ *   mpeg2vld [--depth <k>] [--loop <n>] [--frames <n>] <input.m2v>
+ *
+ * The pictures are submitted in decoding order, up to depth of them in
+ * flight, and only synced when their surface is needed again. Nothing is
+ * displayed. With LIBVA_FOOL_DECODE set, the driver does no work and the
+ * parser and submission costs are measured alone.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <va/va.h>
+#include "va_display.h"
+#include "mpeg2_es.h"
+
+#define CHECK_VASTATUS(va_status,func)                                  \
+    if (va_status != VA_STATUS_SUCCESS) {                                   \
+        fprintf(stderr,"%s:%s (%d) failed,exit\n", __func__, func, __LINE__); \
+        exit(1);                                                            \
+    }
+
+#define MPEG2VLD_DEPTH          4
+#define MPEG2VLD_MAX_DEPTH      32
+/* the two references and the picture being decoded */
+#define MPEG2VLD_MAX_SURFACES   (MPEG2VLD_MAX_DEPTH + 3)
+
+static VADisplay va_dpy;
+static VAConfigID config_id = VA_INVALID_ID;
+static VAContextID context_id = VA_INVALID_ID;
+static VASurfaceID surface_ids[MPEG2VLD_MAX_SURFACES];
+static int num_surfaces;
+static unsigned int surface_width, surface_height;
+static int depth = MPEG2VLD_DEPTH;
+
+/* decoded frames not synced yet, oldest first */
+static int in_flight[MPEG2VLD_MAX_DEPTH];
+static int num_in_flight;
+
+/* forward and backward references for the next B picture, -1 if none */
+static int past_ref = -1, future_ref = -1;
+
+static double
+wall_time(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+static void
+retire_oldest(void)
+{
+    VAStatus va_status;
+
+    va_status = vaSyncSurface(va_dpy, surface_ids[in_flight[0]]);
+    CHECK_VASTATUS(va_status, "vaSyncSurface");
+    num_in_flight--;
+    memmove(in_flight, in_flight + 1, num_in_flight * sizeof(in_flight[0]));
+}
+
+static void
+release_surfaces(void)
+{
+    while (num_in_flight)
+        retire_oldest();
+    if (context_id != VA_INVALID_ID)
+        vaDestroyContext(va_dpy, context_id);
+    if (num_surfaces)
+        vaDestroySurfaces(va_dpy, surface_ids, num_surfaces);
+    context_id = VA_INVALID_ID;
+    num_surfaces = 0;
+    past_ref = future_ref = -1;
+}
+
+static void
+setup_surfaces(unsigned int width, unsigned int height)
+{
+    VAStatus va_status;
+
+    if (num_surfaces && width == surface_width && height == surface_height)
+        return;
+    release_surfaces();
+
+    num_surfaces = depth + 3;
+    va_status = vaCreateSurfaces(va_dpy, VA_RT_FORMAT_YUV420, width, height,
+                                 surface_ids, num_surfaces, NULL, 0);
+    CHECK_VASTATUS(va_status, "vaCreateSurfaces");
+
+    va_status = vaCreateContext(va_dpy, config_id, width, ((height + 15) / 16) * 16,
+                                VA_PROGRESSIVE, surface_ids, num_surfaces, &context_id);
+    CHECK_VASTATUS(va_status, "vaCreateContext");
+
+    surface_width = width;
+    surface_height = height;
+}
+
+/* a surface that is neither a reference nor in flight, there is always one */
+static int
+get_free_surface(void)
+{
+    int i, j;
+
+    if (num_in_flight == depth)
+        retire_oldest();
+
+    for (i = 0; i < num_surfaces; i++) {
+        if (i == past_ref || i == future_ref)
+            continue;
+        for (j = 0; j < num_in_flight; j++) {
+            if (in_flight[j] == i)
+                break;
+        }
+        if (j == num_in_flight)
+            return i;
+    }
+    return -1;
+}
+
+static void
+decode_picture(struct mpeg2_picture *pic, int surface)
+{
+    VASliceParameterBufferMPEG2 slice_params[256], *slice_param = slice_params;
+    VABufferID buffers[4];
+    VAStatus va_status;
+    unsigned int i;
+
+    if (pic->num_slices > sizeof(slice_params) / sizeof(slice_params[0])) {
+        slice_param = malloc(pic->num_slices * sizeof(*slice_param));
+        if (slice_param == NULL) {
+            fprintf(stderr, "Out of memory for %u slices\n", pic->num_slices);
+            exit(1);
+        }
+    }
+    for (i = 0; i < pic->num_slices; i++) {
+        slice_param[i].slice_data_size = pic->slices[i].size;
+        slice_param[i].slice_data_offset = pic->slices[i].offset;
+        slice_param[i].slice_data_flag = VA_SLICE_DATA_FLAG_ALL;
+        slice_param[i].macroblock_offset = pic->slices[i].macroblock_offset;
+        slice_param[i].slice_horizontal_position = pic->slices[i].horizontal_position;
+        slice_param[i].slice_vertical_position = pic->slices[i].vertical_position;
+        slice_param[i].quantiser_scale_code = pic->slices[i].quantiser_scale_code;
+        slice_param[i].intra_slice_flag = pic->slices[i].intra_slice_flag;
+    }
+
+    va_status = vaCreateBuffer(va_dpy, context_id, VAPictureParameterBufferType,
+                               sizeof(pic->pic_param), 1, &pic->pic_param, &buffers[0]);
+    CHECK_VASTATUS(va_status, "vaCreateBuffer");
+    va_status = vaCreateBuffer(va_dpy, context_id, VAIQMatrixBufferType,
+                               sizeof(pic->iq_matrix), 1, &pic->iq_matrix, &buffers[1]);
+    CHECK_VASTATUS(va_status, "vaCreateBuffer");
+    va_status = vaCreateBuffer(va_dpy, context_id, VASliceParameterBufferType,
+                               sizeof(*slice_param), pic->num_slices, slice_param, &buffers[2]);
+    CHECK_VASTATUS(va_status, "vaCreateBuffer");
+    va_status = vaCreateBuffer(va_dpy, context_id, VASliceDataBufferType,
+                               pic->size, 1, (void *)pic->data, &buffers[3]);
+    CHECK_VASTATUS(va_status, "vaCreateBuffer");
+
+    if (slice_param != slice_params)
+        free(slice_param);
+
+    va_status = vaBeginPicture(va_dpy, context_id, surface_ids[surface]);
+    CHECK_VASTATUS(va_status, "vaBeginPicture");
+
+    /* the buffers are released by the driver once rendered */
+    va_status = vaRenderPicture(va_dpy, context_id, buffers, 4);
+    CHECK_VASTATUS(va_status, "vaRenderPicture");
+
+    va_status = vaEndPicture(va_dpy, context_id);
+    CHECK_VASTATUS(va_status, "vaEndPicture");
+}
+
+static void
+usage(const char *program)
+{
+    fprintf(stderr, "Usage: %s [--depth <k>] [--loop <n>] [--frames <n>] <input.m2v>\n", program);
+    fprintf(stderr, "  --depth: decodes in flight, 1 to %d, default %d\n",
+            MPEG2VLD_MAX_DEPTH, MPEG2VLD_DEPTH);
+    fprintf(stderr, "  --loop: decode the stream n times, default 1\n");
+    fprintf(stderr, "  --frames: stop after n frames\n");
+    exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+    const struct option long_opts[] = {
+        {"depth", required_argument, NULL, 'd' },
+        {"loop", required_argument, NULL, 'l' },
+        {"frames", required_argument, NULL, 'f' },
+        {NULL, no_argument, NULL, 0 }
+    };
+    struct mpeg2_es es;
+    struct mpeg2_picture pic;
+    unsigned char *stream;
+    struct stat st;
+    VAEntrypoint entrypoints[5];
+    int num_entrypoints, vld_entrypoint;
+    VAConfigAttrib attrib;
+    VAStatus va_status;
+    int major_ver, minor_ver;
+    int loops = 1, loop, c, fd, ret, surface = -1, skip_field = 1;
+    unsigned long long max_frames = 0, frames = 0, pictures = 0, skipped = 0, slices = 0;
+    unsigned long long type_count[4] = { 0 };
+    double start, elapsed, parse_time = 0, t;
+
+    va_init_display_args(&argc, argv);
+
+    while ((c = getopt_long(argc, argv, "", long_opts, NULL)) != -1) {
+        switch (c) {
+        case 'd':
+            depth = atoi(optarg);
+            if (depth < 1 || depth > MPEG2VLD_MAX_DEPTH)
+                usage(argv[0]);
+            break;
+        case 'l':
+            loops = atoi(optarg);
+            if (loops < 1)
+                usage(argv[0]);
+            break;
+        case 'f':
+            max_frames = strtoull(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1)
+        usage(argv[0]);
+
+    fd = open(argv[optind], O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0 || st.st_size == 0) {
+        fprintf(stderr, "Cannot open %s\n", argv[optind]);
+        return 1;
+    }
+    stream = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (stream == MAP_FAILED) {
+        fprintf(stderr, "Cannot map %s\n", argv[optind]);
+        return 1;
+    }
+
+    va_dpy = va_open_display();
+    va_status = vaInitialize(va_dpy, &major_ver, &minor_ver);
+    CHECK_VASTATUS(va_status, "vaInitialize");
+
+    va_status = vaQueryConfigEntrypoints(va_dpy, VAProfileMPEG2Main, entrypoints,
+                                         &num_entrypoints);
+    CHECK_VASTATUS(va_status, "vaQueryConfigEntrypoints");
+    for (vld_entrypoint = 0; vld_entrypoint < num_entrypoints; vld_entrypoint++) {
+        if (entrypoints[vld_entrypoint] == VAEntrypointVLD)
+            break;
+    }
+    if (vld_entrypoint == num_entrypoints) {
+        fprintf(stderr, "No MPEG-2 VLD entrypoint\n");
+        return 1;
+    }
+
+    attrib.type = VAConfigAttribRTFormat;
+    vaGetConfigAttributes(va_dpy, VAProfileMPEG2Main, VAEntrypointVLD, &attrib, 1);
+    if ((attrib.value & VA_RT_FORMAT_YUV420) == 0) {
+        fprintf(stderr, "No YUV420 render target\n");
+        return 1;
+    }
+    va_status = vaCreateConfig(va_dpy, VAProfileMPEG2Main, VAEntrypointVLD,
+                               &attrib, 1, &config_id);
+    CHECK_VASTATUS(va_status, "vaCreateConfig");
+
+    mpeg2_es_init(&es, stream, st.st_size);
+
+    start = wall_time();
+    for (loop = 0; loop < loops; loop++) {
+        mpeg2_es_rewind(&es);
+        past_ref = future_ref = -1;
+
+        for (;;) {
+            VAPictureParameterBufferMPEG2 *pp = &pic.pic_param;
+            int type, first_field, frame_picture;
+
+            if (max_frames && frames == max_frames)
+                break;
+
+            t = wall_time();
+            ret = mpeg2_es_next_picture(&es, &pic);
+            parse_time += wall_time() - t;
+            if (ret < 0) {
+                fprintf(stderr, "Invalid or MPEG-1 stream at offset %ld\n",
+                        (long)(es.pos - stream));
+                return 1;
+            }
+            if (ret == 0)
+                break;
+
+            type = pp->picture_coding_type;
+            first_field = pp->picture_coding_extension.bits.is_first_field;
+            frame_picture = pp->picture_coding_extension.bits.picture_structure == MPEG2_FRAME_PICTURE;
+
+            /*
+             * Leading B pictures of an open GOP, and P pictures before the
+             * first I, have nothing to refer to and are skipped. The second
+             * field follows the first one.
+             */
+            if (pic.broken_link && type == MPEG2_PICTURE_B)
+                past_ref = -1;
+            if (first_field)
+                skip_field = (type < MPEG2_PICTURE_I || type > MPEG2_PICTURE_B) ||
+                    (type == MPEG2_PICTURE_P && future_ref < 0) ||
+                    (type == MPEG2_PICTURE_B && (past_ref < 0 || future_ref < 0));
+            if (skip_field) {
+                skipped++;
+                continue;
+            }
+
+            setup_surfaces(pp->horizontal_size, pp->vertical_size);
+
+            /* the second field goes to the surface of the first one */
+            if (first_field) {
+                surface = get_free_surface();
+                if (surface < 0) {
+                    fprintf(stderr, "No free surface\n");
+                    return 1;
+                }
+            }
+
+            if (type == MPEG2_PICTURE_B) {
+                pp->forward_reference_picture = surface_ids[past_ref];
+                pp->backward_reference_picture = surface_ids[future_ref];
+            } else if (type == MPEG2_PICTURE_P) {
+                /* the second field of an I frame may only refer to the first one */
+                pp->forward_reference_picture = surface_ids[future_ref >= 0 ? future_ref : surface];
+            }
+
+            decode_picture(&pic, surface);
+            pictures++;
+            slices += pic.num_slices;
+            type_count[type]++;
+
+            /* the frame is done with its second field, or at once */
+            if (!frame_picture && first_field)
+                continue;
+            if (type != MPEG2_PICTURE_B) {
+                past_ref = future_ref;
+                future_ref = surface;
+            }
+            in_flight[num_in_flight++] = surface;
+            frames++;
+        }
+    }
+    while (num_in_flight)
+        retire_oldest();
+    elapsed = wall_time() - start;
+
+    printf("%llu frames (%llu pictures: %llu I, %llu P, %llu B; %llu slices) of %ux%u, %llu skipped\n",
+           frames, pictures, type_count[MPEG2_PICTURE_I], type_count[MPEG2_PICTURE_P],
+           type_count[MPEG2_PICTURE_B], slices, surface_width, surface_height, skipped);
+    printf("%.3f s, %.1f fps (stream %.2f fps), parsing %.1f%% of the time, depth %d\n",
+           elapsed, elapsed > 0 ? frames / elapsed : 0.0, mpeg2_es_frame_rate(&es),
+           elapsed > 0 ? 100.0 * parse_time / elapsed : 0.0, depth);
+
+    release_surfaces();
+    vaDestroyConfig(va_dpy, config_id);
+    mpeg2_es_fini(&es);
+    munmap(stream, st.st_size);
+
+    vaTerminate(va_dpy);
+    va_close_display(va_dpy);
+    return 0;
+}
@@ -115,6 +115,9 @@ struct jdec_private
   struct jpeg_sos cur_sos;  /* current sos values*/
   int default_huffman_table_initialized;
   int restart_interval;
+  int scan_num;			/* image being decoded in the stream */
+  int next_image_found;
+  char error_string[256];	/* last error found while decoding */
 };
 
 #endif
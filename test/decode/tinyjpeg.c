@@ -49,6 +49,9 @@
 #include <assert.h>
 #include <va/va.h>
 #include "va_display.h"
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 
 #define cY	0
@@ -76,14 +79,9 @@
 #define trace(fmt, args...) do { } while (0)
 #endif
 #define error(fmt, args...) do { \
-   snprintf(error_string, sizeof(error_string), fmt, ## args); \
+   snprintf(priv->error_string, sizeof(priv->error_string), fmt, ## args); \
    return -1; \
 } while(0)
-/* The variables for different image scans */
-static int scan_num=0;
-static int next_image_found=0;
-/* Global variable to return the last error found while deconding */
-static char error_string[256];
 static VAHuffmanTableBufferJPEGBaseline default_huffman_table_param={
     huffman_table:
     {
@@ -262,8 +260,8 @@ static int parse_SOF(struct jdec_private *priv, const unsigned char *stream)
            cid, c->Hfactor, c->Vfactor, Q_table );
 
   }
-  priv->width[scan_num] = width;
-  priv->height[scan_num] = height;
+  priv->width[priv->scan_num] = width;
+  priv->height[priv->scan_num] = height;
 
   trace("< SOF marker\n");
 
@@ -385,12 +383,45 @@ static int parse_DRI(struct jdec_private *priv, const unsigned char *stream)
   return 0;
 }
 
+/*
+ * Returns the first marker, 0xff followed by neither 0x00 (stuffing) nor
+ * 0xff (fill), in [stream, end), or end. The entropy-coded data is mostly
+ * free of 0xff, so it is checked 16 bytes at a time.
+ */
+static const unsigned char *find_marker(const unsigned char *stream, const unsigned char *end)
+{
+#if defined(__SSE2__)
+   const __m128i ff = _mm_set1_epi8((char)0xff);
+
+   while (end - stream > 16) {
+      unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(
+            _mm_loadu_si128((const __m128i *)stream), ff));
+
+      while (mask) {
+         int i = __builtin_ctz(mask);
+
+         if (stream[i + 1] != 0x00 && stream[i + 1] != 0xff)
+            return stream + i;
+         mask &= mask - 1;
+      }
+      stream += 16;
+   }
+#endif
+   for (; end - stream > 1; stream++) {
+      if (stream[0] == 0xff && stream[1] != 0x00 && stream[1] != 0xff)
+         return stream;
+   }
+   return end;
+}
+
 static int findEOI(struct jdec_private *priv,const unsigned char *stream)
 {
-   while (stream<=priv->stream_end&& !(*stream == 0xff  && *(stream+1) == 0xd9 )) //searching for the end of image marker
-   {
-      stream++;
-      continue;
+   /* only RSTn markers may come before the end of image */
+   for (;;) {
+      stream = find_marker(stream, priv->stream_end);
+      if (stream == priv->stream_end || stream[1] == EOI)
+         break;
+      stream += 2;
    }
   priv->stream_scan=stream;
   return 0;
@@ -421,7 +452,7 @@ static int parse_JFIF(struct jdec_private *priv, const unsigned char *stream)
   int dqt_marker_found = 0;
   const unsigned char *next_chunck;
 
-  next_image_found = findSOI(priv,stream);
+  priv->next_image_found = findSOI(priv,stream);
   stream=priv->stream;
 
    while (!sos_marker_found  && stream<=priv->stream_end)
@@ -465,7 +496,7 @@ static int parse_JFIF(struct jdec_private *priv, const unsigned char *stream)
      stream = next_chunck;
    }
 
-   if(next_image_found){
+   if(priv->next_image_found){
       if (!dht_marker_found) {
         trace("No Huffman table loaded, using the default one\n");
         build_default_huffman_tables(priv);
@@ -488,7 +519,7 @@ static int parse_JFIF(struct jdec_private *priv, const unsigned char *stream)
     printf("ERROR:Sampling other than 1x1 for Cr and Cb is not supported");
 #endif
   findEOI(priv,stream);
-  return next_image_found;
+  return priv->next_image_found;
 }
 
 /*******************************************************************************
@@ -551,43 +582,71 @@ int tinyjpeg_parse_header(struct jdec_private *priv, const unsigned char *buf, u
 }
 
 
-int tinyjpeg_decode(struct jdec_private *priv)
-{
 #define CHECK_VASTATUS(va_status,func)                                  \
     if (va_status != VA_STATUS_SUCCESS) {                                   \
         fprintf(stderr,"%s:%s (%d) failed,exit\n", __func__, func, __LINE__); \
         exit(1);                                                            \
     }
 
+/*
+ * Decode session: the display and config are set up once, and the contexts
+ * with their surfaces are kept in a small pool keyed by size and chroma
+ * format, so that images of a known shape only cost their own buffers.
+ * Each context decodes into a ring of surfaces, as many as decodes may be
+ * in flight; a surface is only synced before it is reused, or right away
+ * when the images are displayed.
+ */
+#define TINYJPEG_CONTEXT_NUM	8
+#define TINYJPEG_SURFACE_NUM	4	/* default depth */
+
+struct tinyjpeg_context
+{
+    unsigned int width, height;
+    unsigned int fourcc;		/* 0: unused entry */
+    unsigned int last_used;
+    VAContextID context_id;
+    VASurfaceID surface_ids[TINYJPEG_SURFACE_MAX];
+    int surface_busy[TINYJPEG_SURFACE_MAX];
+    int next_surface;
+};
+
+struct tinyjpeg_session
+{
+    VADisplay va_dpy;
+    VAConfigID config_id;
+    int putsurface;
+    int depth;
+    struct tinyjpeg_context contexts[TINYJPEG_CONTEXT_NUM];
+    unsigned int clock;
+    unsigned int contexts_created;
+    VASliceParameterBufferJPEGBaseline *slices;
+    unsigned int max_slices;
+    unsigned int slices_submitted;
+};
+
+/* depth: decodes in flight per context, 0 for the default */
+struct tinyjpeg_session *tinyjpeg_session_create(int putsurface, int depth)
+{
+    struct tinyjpeg_session *session;
     VAEntrypoint entrypoints[5];
     int num_entrypoints,vld_entrypoint;
     VAConfigAttrib attrib;
-    VAConfigID config_id;
-    VASurfaceID surface_id;
-    VAContextID context_id;
-    VABufferID pic_param_buf,iqmatrix_buf,huffmantable_buf,slice_param_buf,slice_data_buf;
     int major_ver, minor_ver;
-    VADisplay	va_dpy;
     VAStatus va_status;
-    int max_h_factor, max_v_factor;
-    int putsurface=1;
-    unsigned int i, j;
-
-    int surface_type;
-    char *type;
-    int ChromaTypeIndex;
 
-    VASurfaceAttrib forcc;
-    forcc.type =VASurfaceAttribPixelFormat;
-    forcc.flags=VA_SURFACE_ATTRIB_SETTABLE;
-    forcc.value.type=VAGenericValueTypeInteger;
-     
+    session = calloc(1, sizeof(*session));
+    if (session == NULL)
+        return NULL;
+    session->putsurface = putsurface;
+    if (depth <= 0)
+        depth = TINYJPEG_SURFACE_NUM;
+    session->depth = depth < TINYJPEG_SURFACE_MAX ? depth : TINYJPEG_SURFACE_MAX;
 
-    va_dpy = va_open_display();
-    va_status = vaInitialize(va_dpy, &major_ver, &minor_ver);
+    session->va_dpy = va_open_display();
+    va_status = vaInitialize(session->va_dpy, &major_ver, &minor_ver);
     assert(va_status == VA_STATUS_SUCCESS);
     
-    va_status = vaQueryConfigEntrypoints(va_dpy, VAProfileJPEGBaseline, entrypoints, 
+    va_status = vaQueryConfigEntrypoints(session->va_dpy, VAProfileJPEGBaseline, entrypoints, 
                              &num_entrypoints);
     CHECK_VASTATUS(va_status, "vaQueryConfigEntrypoints");
 
@@ -602,19 +661,185 @@ int tinyjpeg_decode(struct jdec_private *priv)
 
     /* Assuming finding VLD, find out the format for the render target */
     attrib.type = VAConfigAttribRTFormat;
-    vaGetConfigAttributes(va_dpy, VAProfileJPEGBaseline, VAEntrypointVLD,
+    vaGetConfigAttributes(session->va_dpy, VAProfileJPEGBaseline, VAEntrypointVLD,
                           &attrib, 1);
     if ((attrib.value & VA_RT_FORMAT_YUV420) == 0) {
         /* not find desired YUV420 RT format */
         assert(0);
     }
     
-    va_status = vaCreateConfig(va_dpy, VAProfileJPEGBaseline, VAEntrypointVLD,
-                              &attrib, 1,&config_id);
+    va_status = vaCreateConfig(session->va_dpy, VAProfileJPEGBaseline, VAEntrypointVLD,
+                              &attrib, 1,&session->config_id);
     CHECK_VASTATUS(va_status, "vaQueryConfigEntrypoints");
 
-    while (next_image_found){  
+    return session;
+}
+
+static void tinyjpeg_context_release(struct tinyjpeg_session *session, struct tinyjpeg_context *ctx)
+{
+    int i;
+
+    if (!ctx->fourcc)
+        return;
+
+    /* an evicted context may still be decoding into its surfaces */
+    for (i = 0; i < session->depth; i++) {
+        if (!ctx->surface_busy[i])
+            continue;
+        vaSyncSurface(session->va_dpy, ctx->surface_ids[i]);
+        ctx->surface_busy[i] = 0;
+    }
+
+    vaDestroyContext(session->va_dpy, ctx->context_id);
+    vaDestroySurfaces(session->va_dpy, ctx->surface_ids, session->depth);
+    ctx->fourcc = 0;
+}
+
+/* Returns the pooled context for the size and format, evicting the least recently used one */
+static struct tinyjpeg_context *tinyjpeg_context_get(struct tinyjpeg_session *session,
+                                                     unsigned int width, unsigned int height,
+                                                     int surface_type, unsigned int fourcc)
+{
+    struct tinyjpeg_context *ctx = NULL;
+    VASurfaceAttrib forcc;
+    VAStatus va_status;
+    int i;
+
+    for (i = 0; i < TINYJPEG_CONTEXT_NUM; i++) {
+        struct tinyjpeg_context *c = &session->contexts[i];
+
+        if (c->fourcc == fourcc && c->width == width && c->height == height) {
+            c->last_used = ++session->clock;
+            return c;
+        }
+        if (ctx == NULL || !c->fourcc || (ctx->fourcc && c->last_used < ctx->last_used))
+            ctx = c;
+    }
+
+    tinyjpeg_context_release(session, ctx);
+
+    forcc.type =VASurfaceAttribPixelFormat;
+    forcc.flags=VA_SURFACE_ATTRIB_SETTABLE;
+    forcc.value.type=VAGenericValueTypeInteger;
+    forcc.value.value.i = fourcc;
+
+    va_status = vaCreateSurfaces(session->va_dpy,surface_type,
+                                 width,height, //alignment?
+                                 ctx->surface_ids, session->depth, &forcc, 1);
+    CHECK_VASTATUS(va_status, "vaCreateSurfaces");
+  
+    /* Create a context for this decode pipe */
+    va_status = vaCreateContext(session->va_dpy, session->config_id,
+                               width, height, // alignment?
+                               VA_PROGRESSIVE,
+                               ctx->surface_ids,
+                               session->depth,
+                               &ctx->context_id);
+    CHECK_VASTATUS(va_status, "vaCreateContext");
+
+    ctx->width = width;
+    ctx->height = height;
+    ctx->fourcc = fourcc;
+    ctx->last_used = ++session->clock;
+    memset(ctx->surface_busy, 0, sizeof(ctx->surface_busy));
+    ctx->next_surface = 0;
+    session->contexts_created++;
+
+    return ctx;
+}
+
+/*
+ * Splits the scan at its RSTn markers, one slice per restart interval, so
+ * that the driver may decode the intervals in parallel. The slices share
+ * the data buffer of the whole scan, markers excluded. Returns the number
+ * of slices in session->slices, a single one for the whole scan when there
+ * is no restart interval or the markers do not match it.
+ */
+static unsigned int tinyjpeg_split_scan(struct tinyjpeg_session *session, struct jdec_private *priv,
+                                        const VASliceParameterBufferJPEGBaseline *scan,
+                                        unsigned int mcus_per_row)
+{
+    VASliceParameterBufferJPEGBaseline *slice;
+    const unsigned char *stream = priv->stream, *start = priv->stream, *marker;
+    unsigned int interval = scan->restart_interval;
+    unsigned int num_slices, n = 0;
+
+    if (session->max_slices == 0) {
+        session->slices = malloc(sizeof(*session->slices));
+        if (session->slices == NULL)
+            return 0;
+        session->max_slices = 1;
+    }
+    session->slices[0] = *scan;
+
+    if (interval == 0 || scan->num_mcus <= interval)
+        return 1;
+
+    num_slices = (scan->num_mcus + interval - 1) / interval;
+    if (num_slices > session->max_slices) {
+        slice = realloc(session->slices, num_slices * sizeof(*slice));
+        if (slice == NULL)
+            return 1;
+        session->slices = slice;
+        session->max_slices = num_slices;
+    }
+
+    for (;;) {
+        marker = find_marker(stream, priv->stream_scan);
+        if (marker == priv->stream_scan)
+            break;
+        /* RSTn count modulo 8, and there is one slice less than markers */
+        if (marker[1] != RST + (n & 7) || n + 1 == num_slices)
+            break;
+        session->slices[n].slice_data_offset = start - priv->stream;
+        session->slices[n].slice_data_size = marker - start;
+        n++;
+        start = stream = marker + 2;
+    }
+    if (marker != priv->stream_scan || n + 1 != num_slices) {
+        session->slices[0] = *scan;
+        return 1;
+    }
+    session->slices[n].slice_data_offset = start - priv->stream;
+    session->slices[n].slice_data_size = priv->stream_scan - start;
+
+    for (n = 0; n < num_slices; n++) {
+        unsigned int mcu = n * interval;
+        unsigned int offset = session->slices[n].slice_data_offset;
+        unsigned int size = session->slices[n].slice_data_size;
+
+        slice = &session->slices[n];
+        *slice = *scan;
+        slice->slice_data_offset = offset;
+        slice->slice_data_size = size;
+        slice->slice_horizontal_position = mcu % mcus_per_row;
+        slice->slice_vertical_position = mcu / mcus_per_row;
+        slice->num_mcus = MIN(interval, scan->num_mcus - mcu);
+    }
+
+    return num_slices;
+}
+
+/* Decodes all the images of the stream parsed by tinyjpeg_parse_header() */
+int tinyjpeg_session_decode(struct tinyjpeg_session *session, struct jdec_private *priv)
+{
+    VABufferID pic_param_buf,iqmatrix_buf,huffmantable_buf,slice_param_buf,slice_data_buf;
+    VABufferID render_ids[5];
+    VADisplay	va_dpy = session->va_dpy;
+    VAStatus va_status;
+    int max_h_factor, max_v_factor;
+    unsigned int i, j;
+    unsigned int mcus_per_row, num_slices;
+
+    int surface_type;
+    unsigned int fourcc;
+    struct tinyjpeg_context *ctx;
+    VASurfaceID surface_id;
+
+    while (priv->next_image_found){  
        VAPictureParameterBufferJPEGBaseline pic_param;
+       int scan_num = priv->scan_num;
+
        memset(&pic_param, 0, sizeof(pic_param));
        pic_param.picture_width = priv->width[scan_num];
        pic_param.picture_height = priv->height[scan_num];
@@ -639,80 +864,62 @@ int tinyjpeg_decode(struct jdec_private *priv)
                v1 == 2 && v2 == 1 && v3 == 1) {
            //surface_type = VA_RT_FORMAT_IMC3;
            surface_type = VA_RT_FORMAT_YUV420;
-           forcc.value.value.i = VA_FOURCC_IMC3;
-           ChromaTypeIndex = 1;
-           type = "VA_FOURCC_IMC3";
+           fourcc = VA_FOURCC_IMC3;
        }
        else if (h1 == 2 && h2 == 1 && h3 == 1 &&
                v1 == 1 && v2 == 1 && v3 == 1) {
            //surface_type = VA_RT_FORMAT_YUV422H;
            surface_type = VA_RT_FORMAT_YUV422;
-           forcc.value.value.i = VA_FOURCC_422H;
-           ChromaTypeIndex = 2;
-           type = "VA_FOURCC_422H";
+           fourcc = VA_FOURCC_422H;
        }
        else if (h1 == 1 && h2 == 1 && h3 == 1 &&
                v1 == 1 && v2 == 1 && v3 == 1) {
            surface_type = VA_RT_FORMAT_YUV444;
-           forcc.value.value.i = VA_FOURCC_444P;
-           //forcc.value.value.i = VA_FOURCC_RGBP;
-           ChromaTypeIndex = 3;
-           type = "VA_FOURCC_444P";
+           fourcc = VA_FOURCC_444P;
+           //fourcc = VA_FOURCC_RGBP;
        }
        else if (h1 == 4 && h2 == 1 && h3 == 1 &&
                v1 == 1 && v2 == 1 && v3 == 1) {
            surface_type = VA_RT_FORMAT_YUV411;
-           forcc.value.value.i = VA_FOURCC_411P;
-           ChromaTypeIndex = 4;
-           type = "VA_FOURCC_411P";
+           fourcc = VA_FOURCC_411P;
        }
        else if (h1 == 1 && h2 == 1 && h3 == 1 &&
                v1 == 2 && v2 == 1 && v3 == 1) {
            //surface_type = VA_RT_FORMAT_YUV422V;
            surface_type = VA_RT_FORMAT_YUV422;
-           forcc.value.value.i = VA_FOURCC_422V;
-           ChromaTypeIndex = 5;
-           type = "VA_FOURCC_422V";
+           fourcc = VA_FOURCC_422V;
        }
        else if (h1 == 2 && h2 == 1 && h3 == 1 &&
                v1 == 2 && v2 == 2 && v3 == 2) {
            //surface_type = VA_RT_FORMAT_YUV422H;
            surface_type = VA_RT_FORMAT_YUV422;
-           forcc.value.value.i = VA_FOURCC_422H;
-           ChromaTypeIndex = 6;
-           type = "VA_FOURCC_422H";
+           fourcc = VA_FOURCC_422H;
        }
        else if (h2 == 2 && h2 == 2 && h3 == 2 &&
                v1 == 2 && v2 == 1 && v3 == 1) {
            //surface_type = VA_RT_FORMAT_YUV422V;
            surface_type = VA_RT_FORMAT_YUV422;
-           forcc.value.value.i = VA_FOURCC_422V;
-           ChromaTypeIndex = 7;
-           type = "VA_FOURCC_422V";
+           fourcc = VA_FOURCC_422V;
        }
        else
        {
            surface_type = VA_RT_FORMAT_YUV400;
-           forcc.value.value.i = VA_FOURCC('Y','8','0','0');
-           ChromaTypeIndex = 0;
-           type = "Format_400P";
+           fourcc = VA_FOURCC('Y','8','0','0');
        }
 
-       va_status = vaCreateSurfaces(va_dpy,surface_type,
-                                    priv->width[scan_num],priv->height[scan_num], //alignment?
-                                    &surface_id, 1, &forcc, 1);
-       CHECK_VASTATUS(va_status, "vaCreateSurfaces");
-  
-       /* Create a context for this decode pipe */
-       va_status = vaCreateContext(va_dpy, config_id,
-                                  priv->width[scan_num], priv->height[scan_num], // alignment?
-                                  VA_PROGRESSIVE,
-                                  &surface_id,
-                                  1,
-                                  &context_id);
-       CHECK_VASTATUS(va_status, "vaCreateContext");
-
-       va_status = vaCreateBuffer(va_dpy, context_id,
+       ctx = tinyjpeg_context_get(session, priv->width[scan_num], priv->height[scan_num],
+                                  surface_type, fourcc);
+
+       /* the surface may still hold an image decoded depth images ago */
+       surface_id = ctx->surface_ids[ctx->next_surface];
+       if (ctx->surface_busy[ctx->next_surface]) {
+           va_status = vaSyncSurface(va_dpy, surface_id);
+           CHECK_VASTATUS(va_status, "vaSyncSurface");
+       }
+       ctx->surface_busy[ctx->next_surface] = 1;
+       ctx->next_surface = (ctx->next_surface + 1) % session->depth;
+
+       va_status = vaCreateBuffer(va_dpy, ctx->context_id,
                                  VAPictureParameterBufferType, // VAPictureParameterBufferJPEGBaseline?
                                  sizeof(VAPictureParameterBufferJPEGBaseline),
                                  1, &pic_param,
@@ -731,7 +938,7 @@ int tinyjpeg_decode(struct jdec_private *priv)
            for (j = 0; j < 64; j++)
                iq_matrix.quantiser_table[i][j] = priv->Q_tables[i][j];
        }
-       va_status = vaCreateBuffer(va_dpy, context_id,
+       va_status = vaCreateBuffer(va_dpy, ctx->context_id,
                                  VAIQMatrixBufferType, // VAIQMatrixBufferJPEGBaseline?
                                  sizeof(VAIQMatrixBufferJPEGBaseline),
                                  1, &iq_matrix,
@@ -761,17 +968,18 @@ int tinyjpeg_decode(struct jdec_private *priv)
            memset(huffman_table.huffman_table[i].pad, 0,
                   sizeof(huffman_table.huffman_table[i].pad));
        }
-       va_status = vaCreateBuffer(va_dpy, context_id,
+       va_status = vaCreateBuffer(va_dpy, ctx->context_id,
                                  VAHuffmanTableBufferType, // VAHuffmanTableBufferJPEGBaseline?
                                  sizeof(VAHuffmanTableBufferJPEGBaseline),
                                  1, &huffman_table,
                                  &huffmantable_buf );
        CHECK_VASTATUS(va_status, "vaCreateBuffer");
     
-       // one slice for whole image?
+       // one slice for whole image, split at the restart markers
        max_h_factor = priv->component_infos[0].Hfactor;
        max_v_factor = priv->component_infos[0].Vfactor;
-       static VASliceParameterBufferJPEGBaseline slice_param;
+       VASliceParameterBufferJPEGBaseline slice_param;
+       memset(&slice_param, 0, sizeof(slice_param));
        slice_param.slice_data_size = (priv->stream_scan - priv->stream);
        slice_param.slice_data_offset = 0;
        slice_param.slice_data_flag = VA_SLICE_DATA_FLAG_ALL;
@@ -784,17 +992,23 @@ int tinyjpeg_decode(struct jdec_private *priv)
            slice_param.components[i].ac_table_selector = priv->cur_sos.components[i].ac_selector;  /* FIXME: set to values specified in SOS  */
        }
        slice_param.restart_interval = priv->restart_interval;
-       slice_param.num_mcus = ((priv->width[scan_num]+max_h_factor*8-1)/(max_h_factor*8))*
+       mcus_per_row = (priv->width[scan_num]+max_h_factor*8-1)/(max_h_factor*8);
+       slice_param.num_mcus = mcus_per_row*
                              ((priv->height[scan_num]+max_v_factor*8-1)/(max_v_factor*8)); // ?? 720/16? 
- 
-       va_status = vaCreateBuffer(va_dpy, context_id,
+
+       num_slices = tinyjpeg_split_scan(session, priv, &slice_param, mcus_per_row);
+       if (num_slices == 0)
+           return -1;
+       session->slices_submitted += num_slices;
+
+       va_status = vaCreateBuffer(va_dpy, ctx->context_id,
                                  VASliceParameterBufferType, // VASliceParameterBufferJPEGBaseline?
                                  sizeof(VASliceParameterBufferJPEGBaseline),
-                                 1,
-                                 &slice_param, &slice_param_buf);
+                                 num_slices,
+                                 session->slices, &slice_param_buf);
        CHECK_VASTATUS(va_status, "vaCreateBuffer");
 
-       va_status = vaCreateBuffer(va_dpy, context_id,
+       va_status = vaCreateBuffer(va_dpy, ctx->context_id,
                                  VASliceDataBufferType,
                                  priv->stream_scan - priv->stream,
                                  1,
@@ -802,33 +1016,27 @@ int tinyjpeg_decode(struct jdec_private *priv)
                                  &slice_data_buf);
        CHECK_VASTATUS(va_status, "vaCreateBuffer");
 
-       va_status = vaBeginPicture(va_dpy, context_id, surface_id);
+       va_status = vaBeginPicture(va_dpy, ctx->context_id, surface_id);
        CHECK_VASTATUS(va_status, "vaBeginPicture");   
 
-       va_status = vaRenderPicture(va_dpy,context_id, &pic_param_buf, 1);
-       CHECK_VASTATUS(va_status, "vaRenderPicture");
-   
-       va_status = vaRenderPicture(va_dpy,context_id, &iqmatrix_buf, 1);
-       CHECK_VASTATUS(va_status, "vaRenderPicture");
-
-       va_status = vaRenderPicture(va_dpy,context_id, &huffmantable_buf, 1);
-       CHECK_VASTATUS(va_status, "vaRenderPicture");
-   
-       va_status = vaRenderPicture(va_dpy,context_id, &slice_param_buf, 1);
+       /* the buffers are released by the driver once rendered */
+       render_ids[0] = pic_param_buf;
+       render_ids[1] = iqmatrix_buf;
+       render_ids[2] = huffmantable_buf;
+       render_ids[3] = slice_param_buf;
+       render_ids[4] = slice_data_buf;
+       va_status = vaRenderPicture(va_dpy,ctx->context_id, render_ids, 5);
        CHECK_VASTATUS(va_status, "vaRenderPicture");
     
-       va_status = vaRenderPicture(va_dpy,context_id, &slice_data_buf, 1);
-       CHECK_VASTATUS(va_status, "vaRenderPicture");
-    
-       va_status = vaEndPicture(va_dpy,context_id);
+       va_status = vaEndPicture(va_dpy,ctx->context_id);
        CHECK_VASTATUS(va_status, "vaEndPicture");
 
-       va_status = vaSyncSurface(va_dpy, surface_id);
-       CHECK_VASTATUS(va_status, "vaSyncSurface");
-
-       if (putsurface) {
+       if (session->putsurface) {
            VARectangle src_rect, dst_rect;
 
+           va_status = vaSyncSurface(va_dpy, surface_id);
+           CHECK_VASTATUS(va_status, "vaSyncSurface");
+
            src_rect.x      = 0;
            src_rect.y      = 0;
            src_rect.width  = priv->width[scan_num];
@@ -838,32 +1046,89 @@ int tinyjpeg_decode(struct jdec_private *priv)
            va_status = va_put_surface(va_dpy, surface_id, &src_rect, &dst_rect);
            CHECK_VASTATUS(va_status, "vaPutSurface");
        }
-       scan_num++;
 
-       vaDestroySurfaces(va_dpy,&surface_id,1);
-       vaDestroyConfig(va_dpy,config_id);
-       vaDestroyContext(va_dpy,context_id);
-    
-       parse_JFIF(priv,priv->stream);
-       if(priv->width[scan_num] == 0 && priv->height[scan_num] == 0)
+       if (++priv->scan_num == JPEG_SCAN_MAX)
+          break;
+       priv->width[priv->scan_num] = priv->height[priv->scan_num] = 0;
+       if (parse_JFIF(priv,priv->stream) < 0)
+          return -1;
+       if(priv->width[priv->scan_num] == 0 && priv->height[priv->scan_num] == 0)
           break;
     }
-   // va_close_display(va_dpy);
-    vaTerminate(va_dpy);
+
+    return 0;
+}
+
+/* Waits for all the images decoded so far */
+void tinyjpeg_session_sync(struct tinyjpeg_session *session)
+{
+    int i, j;
+
+    for (i = 0; i < TINYJPEG_CONTEXT_NUM; i++) {
+        struct tinyjpeg_context *ctx = &session->contexts[i];
+
+        if (!ctx->fourcc)
+            continue;
+        for (j = 0; j < session->depth; j++) {
+            if (!ctx->surface_busy[j])
+                continue;
+            vaSyncSurface(session->va_dpy, ctx->surface_ids[j]);
+            ctx->surface_busy[j] = 0;
+        }
+    }
+}
+
+/* Number of contexts created so far, to check how well the pool works */
+unsigned int tinyjpeg_session_contexts(struct tinyjpeg_session *session)
+{
+    return session->contexts_created;
+}
+
+/* Number of slices submitted so far, more than the images with restart markers */
+unsigned int tinyjpeg_session_slices(struct tinyjpeg_session *session)
+{
+    return session->slices_submitted;
+}
+
+void tinyjpeg_session_destroy(struct tinyjpeg_session *session)
+{
+    int i;
+
+    if (session == NULL)
+        return;
+
+    tinyjpeg_session_sync(session);
+    for (i = 0; i < TINYJPEG_CONTEXT_NUM; i++)
+        tinyjpeg_context_release(session, &session->contexts[i]);
+    vaDestroyConfig(session->va_dpy, session->config_id);
+    vaTerminate(session->va_dpy);
+    free(session->slices);
+    free(session);
+}
+
+int tinyjpeg_decode(struct jdec_private *priv)
+{
+    struct tinyjpeg_session *session;
+    int ret;
+
+    session = tinyjpeg_session_create(1, 0);
+    if (session == NULL)
+        return -1;
+    ret = tinyjpeg_session_decode(session, priv);
+    tinyjpeg_session_destroy(session);
+
     printf("press any key to exit23\n");
     getchar();
-    return 0;
+    return ret;
 }
 const char *tinyjpeg_get_errorstring(struct jdec_private *priv)
 {
-  /* FIXME: the error string must be store in the context */
-  priv = priv;
-  return error_string;
+  return priv->error_string;
 }
 void tinyjpeg_get_size(struct jdec_private *priv, unsigned int *width, unsigned int *height)
 {
-  *width = priv->width[scan_num];
-  *height = priv->height[scan_num];
+  *width = priv->width[priv->scan_num];
+  *height = priv->height[priv->scan_num];
 }
 
 
@@ -41,6 +41,7 @@ extern "C" {
 #endif
 
 struct jdec_private;
+struct tinyjpeg_session;
 
 /* Flags that can be set by any applications */
 #define TINYJPEG_FLAGS_MJPEG_TABLE	(1<<1)
@@ -61,6 +62,16 @@ int tinyjpeg_decode(struct jdec_private *priv);
 const char *tinyjpeg_get_errorstring(struct jdec_private *priv);
 void tinyjpeg_get_size(struct jdec_private *priv, unsigned int *width, unsigned int *height);
 
+/* Keeps the display, config, contexts and surfaces across images */
+#define TINYJPEG_SURFACE_MAX	16	/* decodes in flight per context */
+
+struct tinyjpeg_session *tinyjpeg_session_create(int putsurface, int depth);
+int tinyjpeg_session_decode(struct tinyjpeg_session *session, struct jdec_private *priv);
+void tinyjpeg_session_sync(struct tinyjpeg_session *session);
+unsigned int tinyjpeg_session_contexts(struct tinyjpeg_session *session);
+unsigned int tinyjpeg_session_slices(struct tinyjpeg_session *session);
+void tinyjpeg_session_destroy(struct tinyjpeg_session *session);
+
 #ifdef __cplusplus
 }
 #endif
@@ -8,7 +8,13 @@ include $(CLEAR_VARS)
 LOCAL_SRC_FILES := \
   ../common/va_display.c \
   ../common/va_display_android.cpp \
-  h264encode.c
+  ../common/startcode.c \
+  h264encode.c \
+  coded_sink.c \
+  gop_planner.c \
+  hrd_sim.c \
+  quality_metrics.c \
+  yuv_io.c
 
 LOCAL_CFLAGS += \
     -DANDROID
@@ -31,7 +37,10 @@ include $(CLEAR_VARS)
 LOCAL_SRC_FILES := \
 	../common/va_display.c			\
 	../common/va_display_android.cpp	\
-	avcenc.c
+	../common/startcode.c			\
+	avcenc.c				\
+	coded_sink.c				\
+	gop_planner.c
 
 LOCAL_CFLAGS += \
 	-DANDROID
@@ -47,6 +47,9 @@
 #include <va/va.h>
 #include <va/va_enc_h264.h>
 #include "va_display.h"
+#include "gop_planner.h"
+#include "bitstream.h"
+#include "coded_sink.h"
 
 #define NAL_REF_IDC_NONE        0
 #define NAL_REF_IDC_LOW         1
@@ -63,7 +66,7 @@
 #define SLICE_TYPE_B            1
 #define SLICE_TYPE_I            2
 
-#define FRAME_IDR 7
+#define FRAME_IDR GOP_FRAME_IDR
 
 #define ENTROPY_MODE_CAVLC      0
 #define ENTROPY_MODE_CABAC      1
@@ -85,6 +88,13 @@ static int picture_height, picture_height_in_mbs;
 static int frame_size;
 static unsigned char *newImageBuffer = 0;
 
+/* Input frames are read straight into these when the driver can wrap
+   them as USER_PTR surfaces, one per SID_INPUT_PICTURE_x */
+static unsigned char *input_frame_buffers[2];
+static int use_user_ptr_input = 0;
+static unsigned long long upload_copy_usec = 0;
+static int upload_copy_frames = 0;
+
 static int qp_value = 26;
 
 static int intra_period = 30;
@@ -270,6 +280,9 @@ static unsigned int current_poc;
 
 static  unsigned int num_ref_frames = 2;
 static  unsigned int numShortTerm = 0;
+
+/* packed headers of the frame being encoded */
+static struct bitstream_arena header_arena;
 /***************************************************/
 
 static int get_free_slot()
@@ -299,15 +312,98 @@ upload_thread_function(void *data)
     return NULL;
 }
 
+#ifndef VA_FOURCC_I420
+#define VA_FOURCC_I420          0x30323449
+#endif
+
+/* Wraps the input frame buffers into surfaces so that upload is a plain fread() */
+static int create_user_ptr_input_surfaces()
+{
+    VASurfaceAttribExternalBuffers ext_buffers;
+    VASurfaceAttrib attribs[3];
+    unsigned long buffers[2];
+    int y_size = picture_width * picture_height;
+    int u_size = (picture_width >> 1) * (picture_height >> 1);
+    long page_size = sysconf(_SC_PAGESIZE);
+    size_t alloc_size = (frame_size + page_size - 1) & ~(page_size - 1);
+    VAStatus va_status;
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        if (posix_memalign((void **)&input_frame_buffers[i], page_size, alloc_size))
+            goto error;
+        buffers[i] = (unsigned long)input_frame_buffers[i];
+    }
+
+    memset(&ext_buffers, 0, sizeof(ext_buffers));
+    ext_buffers.pixel_format = VA_FOURCC_I420;
+    ext_buffers.width = picture_width;
+    ext_buffers.height = picture_height;
+    ext_buffers.data_size = frame_size;
+    ext_buffers.num_planes = 3;
+    ext_buffers.pitches[0] = picture_width;
+    ext_buffers.pitches[1] = picture_width / 2;
+    ext_buffers.pitches[2] = picture_width / 2;
+    ext_buffers.offsets[0] = 0;
+    ext_buffers.offsets[1] = y_size;
+    ext_buffers.offsets[2] = y_size + u_size;
+    ext_buffers.buffers = buffers;
+    ext_buffers.num_buffers = 2;
+
+    attribs[0].type = VASurfaceAttribPixelFormat;
+    attribs[0].flags = VA_SURFACE_ATTRIB_SETTABLE;
+    attribs[0].value.type = VAGenericValueTypeInteger;
+    attribs[0].value.value.i = VA_FOURCC_I420;
+    attribs[1].type = VASurfaceAttribMemoryType;
+    attribs[1].flags = VA_SURFACE_ATTRIB_SETTABLE;
+    attribs[1].value.type = VAGenericValueTypeInteger;
+    attribs[1].value.value.i = VA_SURFACE_ATTRIB_MEM_TYPE_USER_PTR;
+    attribs[2].type = VASurfaceAttribExternalBufferDescriptor;
+    attribs[2].flags = VA_SURFACE_ATTRIB_SETTABLE;
+    attribs[2].value.type = VAGenericValueTypePointer;
+    attribs[2].value.value.p = &ext_buffers;
+
+    /* SID_INPUT_PICTURE_0 and SID_INPUT_PICTURE_1 */
+    va_status = vaCreateSurfaces(
+        va_dpy,
+        VA_RT_FORMAT_YUV420, picture_width, picture_height,
+        &surface_ids[SID_INPUT_PICTURE_0], 2,
+        attribs, 3
+    );
+    if (va_status == VA_STATUS_SUCCESS)
+        return 1;
+
+error:
+    for (i = 0; i < 2; i++) {
+        free(input_frame_buffers[i]);
+        input_frame_buffers[i] = NULL;
+    }
+    return 0;
+}
+
 static void alloc_encode_resource(FILE *yuv_fp)
 {
     VAStatus va_status;
 
+    // Create input surfaces, wrapping our own frame buffers if possible
+    use_user_ptr_input = !getenv("AVCENC_COPY_UPLOAD") && create_user_ptr_input_surfaces();
+    if (!use_user_ptr_input) {
+        va_status = vaCreateSurfaces(
+            va_dpy,
+            VA_RT_FORMAT_YUV420, picture_width, picture_height,
+            &surface_ids[SID_INPUT_PICTURE_0], 2,
+            NULL, 0
+        );
+        CHECK_VASTATUS(va_status, "vaCreateSurfaces");
+    }
+    printf("input upload: %s\n", use_user_ptr_input ?
+           "zero-copy (USER_PTR surfaces)" : "copy into derived image");
+
     // Create surface
     va_status = vaCreateSurfaces(
         va_dpy,
         VA_RT_FORMAT_YUV420, picture_width, picture_height,
-        surface_ids, SID_NUMBER,
+        &surface_ids[SID_REFERENCE_PICTURE_L0], SID_NUMBER - SID_REFERENCE_PICTURE_L0,
         NULL, 0
     );
 
@@ -326,6 +422,11 @@ static void alloc_encode_resource(FILE *yuv_fp)
 
     newImageBuffer = (unsigned char *)malloc(frame_size);
 
+    if (!bitstream_arena_init(&header_arena, BITSTREAM_ARENA_SIZE)) {
+        fprintf(stderr, "Failed to allocate the packed header arena\n");
+        exit(1);
+    }
+
     /* firstly upload YUV data to SID_INPUT_PICTURE_1 */
     avcenc_context.upload_thread_param.yuv_fp = yuv_fp;
     avcenc_context.upload_thread_param.surface_id = surface_ids[SID_INPUT_PICTURE_1];
@@ -340,9 +441,12 @@ static void release_encode_resource()
 {
     pthread_join(avcenc_context.upload_thread_id, NULL);
     free(newImageBuffer);
+    bitstream_arena_fini(&header_arena);
 
     // Release all the surfaces resource
     vaDestroySurfaces(va_dpy, surface_ids, SID_NUMBER);
+    free(input_frame_buffers[0]);
+    free(input_frame_buffers[1]);
     // Release all the reference surfaces
     vaDestroySurfaces(va_dpy, ref_surface, SURFACE_NUM);
 }
@@ -383,88 +487,19 @@ static void avcenc_update_sei_param(int is_idr)
 				(length_in_bits + 7) / 8, 1, packed_sei_buffer,
 				&avcenc_context.packed_sei_buf_id);
 	CHECK_VASTATUS(va_status,"vaCreateBuffer");
-	free(packed_sei_buffer);
 	return;
 }
 
-#define partition(ref, field, key, ascending)   \
-    while (i <= j) {                            \
-        if (ascending) {                        \
-            while (ref[i].field < key)          \
-                i++;                            \
-            while (ref[j].field > key)          \
-                j--;                            \
-        } else {                                \
-            while (ref[i].field > key)          \
-                i++;                            \
-            while (ref[j].field < key)          \
-                j--;                            \
-        }                                       \
-        if (i <= j) {                           \
-            tmp = ref[i];                       \
-            ref[i] = ref[j];                    \
-            ref[j] = tmp;                       \
-            i++;                                \
-            j--;                                \
-        }                                       \
-    }                                           \
-
-static void sort_one(VAPictureH264 ref[], int left, int right,
-                     int ascending, int frame_idx)
-{
-    int i = left, j = right;
-    unsigned int key;
-    VAPictureH264 tmp;
-
-    if (frame_idx) {
-        key = ref[(left + right) / 2].frame_idx;
-        partition(ref, frame_idx, key, ascending);
-    } else {
-        key = ref[(left + right) / 2].TopFieldOrderCnt;
-        partition(ref, TopFieldOrderCnt, (signed int)key, ascending);
-    }
-
-    /* recursion */
-    if (left < j)
-        sort_one(ref, left, j, ascending, frame_idx);
-
-    if (i < right)
-        sort_one(ref, i, right, ascending, frame_idx);
-}
-
-static void sort_two(VAPictureH264 ref[], int left, int right, unsigned int key, unsigned int frame_idx,
-                     int partition_ascending, int list0_ascending, int list1_ascending)
-{
-    int i = left, j = right;
-    VAPictureH264 tmp;
-
-    if (frame_idx) {
-        partition(ref, frame_idx, key, partition_ascending);
-    } else {
-        partition(ref, TopFieldOrderCnt, (signed int)key, partition_ascending);
-    }
-
-    sort_one(ref, left, i-1, list0_ascending, frame_idx);
-    sort_one(ref, j+1, right, list1_ascending, frame_idx);
-}
-
 static int update_RefPicList()
 {
 
-    if (current_frame_type == SLICE_TYPE_P) {
-        memcpy(RefPicList0, ReferenceFrames, numShortTerm * sizeof(VAPictureH264));
-        sort_one(RefPicList0, 0, numShortTerm-1, 0, 1);
-    }
-
-    if (current_frame_type == SLICE_TYPE_B) {
-        memcpy(RefPicList0, ReferenceFrames, numShortTerm * sizeof(VAPictureH264));
-        sort_two(RefPicList0, 0, numShortTerm-1, current_poc, 0,
-                 1, 0, 1);
+    if (current_frame_type == SLICE_TYPE_P)
+        gop_ref_list_p(ReferenceFrames, numShortTerm, current_frame_num, MaxFrameNum,
+                       RefPicList0);
 
-        memcpy(RefPicList1, ReferenceFrames, numShortTerm * sizeof(VAPictureH264));
-        sort_two(RefPicList1, 0, numShortTerm-1, current_poc, 0,
-                 0, 1, 0);
-    }
+    if (current_frame_type == SLICE_TYPE_B)
+        gop_ref_lists_b(ReferenceFrames, numShortTerm, current_poc,
+                        RefPicList0, RefPicList1);
 
     return 0;
 }
@@ -512,10 +547,6 @@ static void avcenc_update_picture_parameter(int slice_type, int is_idr)
 
 }
 
-#ifndef VA_FOURCC_I420
-#define VA_FOURCC_I420          0x30323449
-#endif
-
 static void upload_yuv_to_surface(FILE *yuv_fp, VASurfaceID surface_id)
 {
     VAImage surface_image;
@@ -527,11 +558,24 @@ static void upload_yuv_to_surface(FILE *yuv_fp, VASurfaceID surface_id)
     int u_size = (picture_width >> 1) * (picture_height >> 1);
     int row, col;
     size_t n_items;
+    struct timeval copy_start, copy_end;
+
+    if (use_user_ptr_input) {
+        unsigned char *frame = input_frame_buffers[
+            surface_id == surface_ids[SID_INPUT_PICTURE_0] ? 0 : 1];
+
+        /* The surface is backed by frame, nothing else to do */
+        do {
+            n_items = fread(frame, frame_size, 1, yuv_fp);
+        } while (n_items != 1);
+        return;
+    }
 
     do {
         n_items = fread(newImageBuffer, frame_size, 1, yuv_fp);
     } while (n_items != 1);
 
+    gettimeofday(&copy_start, NULL);
     va_status = vaDeriveImage(va_dpy, surface_id, &surface_image);
     CHECK_VASTATUS(va_status,"vaDeriveImage");
 
@@ -584,6 +628,11 @@ static void upload_yuv_to_surface(FILE *yuv_fp, VASurfaceID surface_id)
 
     vaUnmapBuffer(va_dpy, surface_image.buf);
     vaDestroyImage(va_dpy, surface_image.image_id);
+
+    gettimeofday(&copy_end, NULL);
+    upload_copy_usec += 1000000ULL * (copy_end.tv_sec - copy_start.tv_sec) +
+        copy_end.tv_usec - copy_start.tv_usec;
+    upload_copy_frames++;
 }
 
 static void avcenc_update_slice_parameter(int slice_type)
@@ -713,6 +762,7 @@ static int begin_picture(FILE *yuv_fp, int frame_num, int display_num, int slice
     pthread_join(avcenc_context.upload_thread_id, NULL);
 
     avcenc_context.upload_thread_value = -1;
+    bitstream_arena_reset(&header_arena);
 
     if (avcenc_context.current_input_surface == SID_INPUT_PICTURE_0)
         avcenc_context.current_input_surface = SID_INPUT_PICTURE_1;
@@ -761,9 +811,6 @@ static int begin_picture(FILE *yuv_fp, int frame_num, int display_num, int slice
                                    (length_in_bits + 7) / 8, 1, packed_pic_buffer,
                                    &avcenc_context.packed_pic_buf_id);
         CHECK_VASTATUS(va_status,"vaCreateBuffer");
-
-        free(packed_seq_buffer);
-        free(packed_pic_buffer);
     }
 
     /* sequence parameter set */
@@ -899,16 +946,6 @@ static void end_picture()
     avcenc_context.num_slices = 0;
 }
 
-#define BITSTREAM_ALLOCATE_STEPPING     4096
-
-struct __bitstream {
-    unsigned int *buffer;
-    int bit_offset;
-    int max_size_in_dword;
-};
-
-typedef struct __bitstream bitstream;
-
 #if 0
 static int 
 get_coded_bitsteam_length(unsigned char *buffer, int buffer_length)
@@ -927,120 +964,6 @@ get_coded_bitsteam_length(unsigned char *buffer, int buffer_length)
 }
 #endif
 
-static unsigned int 
-va_swap32(unsigned int val)
-{
-    unsigned char *pval = (unsigned char *)&val;
-
-    return ((pval[0] << 24)     |
-            (pval[1] << 16)     |
-            (pval[2] << 8)      |
-            (pval[3] << 0));
-}
-
-static void
-bitstream_start(bitstream *bs)
-{
-    bs->max_size_in_dword = BITSTREAM_ALLOCATE_STEPPING;
-    bs->buffer = calloc(bs->max_size_in_dword * sizeof(int), 1);
-    bs->bit_offset = 0;
-}
-
-static void
-bitstream_end(bitstream *bs)
-{
-    int pos = (bs->bit_offset >> 5);
-    int bit_offset = (bs->bit_offset & 0x1f);
-    int bit_left = 32 - bit_offset;
-
-    if (bit_offset) {
-        bs->buffer[pos] = va_swap32((bs->buffer[pos] << bit_left));
-    }
-}
- 
-static void
-bitstream_put_ui(bitstream *bs, unsigned int val, int size_in_bits)
-{
-    int pos = (bs->bit_offset >> 5);
-    int bit_offset = (bs->bit_offset & 0x1f);
-    int bit_left = 32 - bit_offset;
-
-    if (!size_in_bits)
-        return;
-
-    bs->bit_offset += size_in_bits;
-
-    if (bit_left > size_in_bits) {
-        bs->buffer[pos] = (bs->buffer[pos] << size_in_bits | val);
-    } else {
-        size_in_bits -= bit_left;
-        bs->buffer[pos] = (bs->buffer[pos] << bit_left) | (val >> size_in_bits);
-        bs->buffer[pos] = va_swap32(bs->buffer[pos]);
-
-        if (pos + 1 == bs->max_size_in_dword) {
-            bs->max_size_in_dword += BITSTREAM_ALLOCATE_STEPPING;
-            bs->buffer = realloc(bs->buffer, bs->max_size_in_dword * sizeof(unsigned int));
-        }
-
-        bs->buffer[pos + 1] = val;
-    }
-}
-
-static void
-bitstream_put_ue(bitstream *bs, unsigned int val)
-{
-    int size_in_bits = 0;
-    int tmp_val = ++val;
-
-    while (tmp_val) {
-        tmp_val >>= 1;
-        size_in_bits++;
-    }
-
-    bitstream_put_ui(bs, 0, size_in_bits - 1); // leading zero
-    bitstream_put_ui(bs, val, size_in_bits);
-}
-
-static void
-bitstream_put_se(bitstream *bs, int val)
-{
-    unsigned int new_val;
-
-    if (val <= 0)
-        new_val = -2 * val;
-    else
-        new_val = 2 * val - 1;
-
-    bitstream_put_ue(bs, new_val);
-}
-
-static void
-bitstream_byte_aligning(bitstream *bs, int bit)
-{
-    int bit_offset = (bs->bit_offset & 0x7);
-    int bit_left = 8 - bit_offset;
-    int new_val;
-
-    if (!bit_offset)
-        return;
-
-    assert(bit == 0 || bit == 1);
-
-    if (bit)
-        new_val = (1 << bit_left) - 1;
-    else
-        new_val = 0;
-
-    bitstream_put_ui(bs, new_val, bit_left);
-}
-
-static void 
-rbsp_trailing_bits(bitstream *bs)
-{
-    bitstream_put_ui(bs, 1, 1);
-    bitstream_byte_aligning(bs, 0);
-}
-
 static void nal_start_code_prefix(bitstream *bs)
 {
     bitstream_put_ui(bs, 0x00000001, 32);
@@ -1232,7 +1155,7 @@ build_packed_pic_buffer(unsigned char **header_buffer)
 {
     bitstream bs;
 
-    bitstream_start(&bs);
+    bitstream_start_arena(&bs, &header_arena);
     nal_start_code_prefix(&bs);
     nal_header(&bs, NAL_REF_IDC_HIGH, NAL_PPS);
     pps_rbsp(&bs);
@@ -1247,7 +1170,7 @@ build_packed_seq_buffer(unsigned char **header_buffer)
 {
     bitstream bs;
 
-    bitstream_start(&bs);
+    bitstream_start_arena(&bs, &header_arena);
     nal_start_code_prefix(&bs);
     nal_header(&bs, NAL_REF_IDC_HIGH, NAL_SPS);
     sps_rbsp(&bs);
@@ -1263,14 +1186,13 @@ build_packed_idr_sei_buffer_timing(unsigned int init_cpb_removal_delay_length,
 				unsigned int dpb_output_length,
 				unsigned char **sei_buffer)
 {
-    unsigned char *byte_buf;
-    int bp_byte_size, i, pic_byte_size;
+    int bp_byte_size, pic_byte_size;
     unsigned int cpb_removal_delay;
 
     bitstream nal_bs;
     bitstream sei_bp_bs, sei_pic_bs;
 
-    bitstream_start(&sei_bp_bs);
+    bitstream_start_arena(&sei_bp_bs, &header_arena);
     bitstream_put_ue(&sei_bp_bs, 0);       /*seq_parameter_set_id*/
     /* SEI buffer period info */
     /* NALHrdBpPresentFlag == 1 */
@@ -1285,7 +1207,7 @@ build_packed_idr_sei_buffer_timing(unsigned int init_cpb_removal_delay_length,
     bp_byte_size = (sei_bp_bs.bit_offset + 7) / 8;
     
     /* SEI pic timing info */
-    bitstream_start(&sei_pic_bs);
+    bitstream_start_arena(&sei_pic_bs, &header_arena);
     /* The info of CPB and DPB delay is controlled by CpbDpbDelaysPresentFlag,
      * which is derived as 1 if one of the following conditions is true:
      * nal_hrd_parameters_present_flag is present in the bitstream and is equal to 1,
@@ -1305,7 +1227,7 @@ build_packed_idr_sei_buffer_timing(unsigned int init_cpb_removal_delay_length,
     bitstream_end(&sei_pic_bs);
     pic_byte_size = (sei_pic_bs.bit_offset + 7) / 8;
     
-    bitstream_start(&nal_bs);
+    bitstream_start_arena(&nal_bs, &header_arena);
     nal_start_code_prefix(&nal_bs);
     nal_header(&nal_bs, NAL_REF_IDC_NONE, NAL_SEI);
 
@@ -1313,20 +1235,12 @@ build_packed_idr_sei_buffer_timing(unsigned int init_cpb_removal_delay_length,
     bitstream_put_ui(&nal_bs, 0, 8);
     bitstream_put_ui(&nal_bs, bp_byte_size, 8);
     
-    byte_buf = (unsigned char *)sei_bp_bs.buffer;
-    for(i = 0; i < bp_byte_size; i++) {
-        bitstream_put_ui(&nal_bs, byte_buf[i], 8);
-    }
-    free(byte_buf);
+    bitstream_put_bytes(&nal_bs, sei_bp_bs.buffer, bp_byte_size);
 	/* write the SEI pic timing data */
     bitstream_put_ui(&nal_bs, 0x01, 8);
     bitstream_put_ui(&nal_bs, pic_byte_size, 8);
     
-    byte_buf = (unsigned char *)sei_pic_bs.buffer;
-    for(i = 0; i < pic_byte_size; i++) {
-        bitstream_put_ui(&nal_bs, byte_buf[i], 8);
-    }
-    free(byte_buf);
+    bitstream_put_bytes(&nal_bs, sei_pic_bs.buffer, pic_byte_size);
 
     rbsp_trailing_bits(&nal_bs);
     bitstream_end(&nal_bs);
@@ -1341,14 +1255,13 @@ build_packed_sei_pic_timing(unsigned int cpb_removal_length,
 				unsigned int dpb_output_length,
 				unsigned char **sei_buffer)
 {
-    unsigned char *byte_buf;
-    int i, pic_byte_size;
+    int pic_byte_size;
     unsigned int cpb_removal_delay;
 
     bitstream nal_bs;
     bitstream sei_pic_bs;
 
-    bitstream_start(&sei_pic_bs);
+    bitstream_start_arena(&sei_pic_bs, &header_arena);
     /* The info of CPB and DPB delay is controlled by CpbDpbDelaysPresentFlag,
      * which is derived as 1 if one of the following conditions is true:
      * nal_hrd_parameters_present_flag is present in the bitstream and is equal to 1,
@@ -1369,7 +1282,7 @@ build_packed_sei_pic_timing(unsigned int cpb_removal_length,
     bitstream_end(&sei_pic_bs);
     pic_byte_size = (sei_pic_bs.bit_offset + 7) / 8;
 
-    bitstream_start(&nal_bs);
+    bitstream_start_arena(&nal_bs, &header_arena);
     nal_start_code_prefix(&nal_bs);
     nal_header(&nal_bs, NAL_REF_IDC_NONE, NAL_SEI);
 
@@ -1377,11 +1290,7 @@ build_packed_sei_pic_timing(unsigned int cpb_removal_length,
     bitstream_put_ui(&nal_bs, 0x01, 8);
     bitstream_put_ui(&nal_bs, pic_byte_size, 8);
 
-    byte_buf = (unsigned char *)sei_pic_bs.buffer;
-    for(i = 0; i < pic_byte_size; i++) {
-        bitstream_put_ui(&nal_bs, byte_buf[i], 8);
-    }
-    free(byte_buf);
+    bitstream_put_bytes(&nal_bs, sei_pic_bs.buffer, pic_byte_size);
 
     rbsp_trailing_bits(&nal_bs);
     bitstream_end(&nal_bs);
@@ -1503,14 +1412,11 @@ build_nal_slice(FILE *avc_fp, int frame_num, int display_frame, int slice_type,
 #endif
 
 static int
-store_coded_buffer(FILE *avc_fp, int slice_type)
+store_coded_buffer(struct coded_sink *avc_sink, int slice_type)
 {
-    VACodedBufferSegment *coded_buffer_segment;
-    unsigned char *coded_mem;
     int slice_data_length;
     VAStatus va_status;
     VASurfaceStatus surface_status;
-    size_t w_items;
 
     va_status = vaSyncSurface(va_dpy, surface_ids[avcenc_context.current_input_surface]);
     CHECK_VASTATUS(va_status,"vaSyncSurface");
@@ -1519,95 +1425,27 @@ store_coded_buffer(FILE *avc_fp, int slice_type)
     va_status = vaQuerySurfaceStatus(va_dpy, surface_ids[avcenc_context.current_input_surface], &surface_status);
     CHECK_VASTATUS(va_status,"vaQuerySurfaceStatus");
 
-    va_status = vaMapBuffer(va_dpy, avcenc_context.codedbuf_buf_id, (void **)(&coded_buffer_segment));
-    CHECK_VASTATUS(va_status,"vaMapBuffer");
-    coded_mem = coded_buffer_segment->buf;
+    slice_data_length = coded_sink_write(avc_sink, va_dpy, avcenc_context.codedbuf_buf_id, 1);
 
-    if (coded_buffer_segment->status & VA_CODED_BUF_STATUS_SLICE_OVERFLOW_MASK) {
+    if (slice_data_length == CODED_SINK_OVERFLOW) {
         if (slice_type == SLICE_TYPE_I)
             avcenc_context.codedbuf_i_size *= 2;
         else
             avcenc_context.codedbuf_pb_size *= 2;
 
-        vaUnmapBuffer(va_dpy, avcenc_context.codedbuf_buf_id);
         return -1;
     }
 
-    slice_data_length = coded_buffer_segment->size;
-
-    do {
-        w_items = fwrite(coded_mem, slice_data_length, 1, avc_fp);
-    } while (w_items != 1);
-
-    vaUnmapBuffer(va_dpy, avcenc_context.codedbuf_buf_id);
-
-    return 0;
-}
-
-/*
- * It is from the h264encode.c but it simplifies something.
- * For example: When one frame is encoded as I-frame under the scenario with
- * P-B frames, it will be regarded as IDR frame(key-frame) and then new GOP is
- * started. If the video clip is encoded as all I-frames, the first frame
- * is regarded as IDR and the remaining is regarded as I-frame.
- *
- */
-
-static void encoding2display_order(
-    unsigned long long encoding_order,int gop_size,
-    int ip_period,
-    unsigned long long *displaying_order,
-    int *frame_type)
-{
-    int encoding_order_gop = 0;
-
-    /* When ip_period is 0, all are I/IDR frames */
-    if (ip_period == 0) { /* all are I/IDR frames */
-        if (encoding_order == 0)
-            *frame_type = FRAME_IDR;
-        else
-            *frame_type = SLICE_TYPE_I;
-
-        *displaying_order = encoding_order;
-        return;
+    if (slice_data_length < 0) {
+        fprintf(stderr, "Failed to write the coded data\n");
+        exit(1);
     }
 
-    /* new sequence like
-     * IDR PPPPP IDRPPPPP
-     * IDR (PBB)(PBB)(PBB)(PBB) IDR (PBB)(PBB)(PBB)(PBB)
-     */
-    encoding_order_gop = encoding_order % gop_size;
-
-    if (encoding_order_gop == 0) { /* the first frame */
-        *frame_type = FRAME_IDR;
-        *displaying_order = encoding_order;
-    } else {
-        int gop_delta;
-
-        gop_delta = 1;
-
-        if ((ip_period != 1) && ((gop_size - 1) % ip_period)) {
-            int ipb_size;
-            ipb_size = (gop_size - 1) / ip_period * ip_period + 1;
-            if (encoding_order_gop >= ipb_size) {
-                gop_delta = ipb_size;
-                ip_period = gop_size - ipb_size;
-            }
-        }
-
-        if (((encoding_order_gop - gop_delta) % ip_period) == 0) { /* P frames */
-            *frame_type = SLICE_TYPE_P;
-	    *displaying_order = encoding_order + ip_period - 1;
-        } else {
-	    *frame_type = SLICE_TYPE_B;
-	    *displaying_order = encoding_order - 1;
-        }
-    }
+    return 0;
 }
 
-
 static void
-encode_picture(FILE *yuv_fp, FILE *avc_fp,
+encode_picture(FILE *yuv_fp, struct coded_sink *avc_sink,
                int frame_num, int display_num,
                int is_idr,
                int slice_type, int next_is_bpic,
@@ -1673,7 +1511,7 @@ encode_picture(FILE *yuv_fp, FILE *avc_fp,
 
         avcenc_render_picture();
 
-        ret = store_coded_buffer(avc_fp, slice_type);
+        ret = store_coded_buffer(avc_sink, slice_type);
     } while (ret);
 
     end_picture(slice_type, next_is_bpic);
@@ -1846,10 +1684,13 @@ int main(int argc, char *argv[])
     int f;
     FILE *yuv_fp;
     FILE *avc_fp;
+    struct coded_sink *avc_sink;
     off_t file_size;
     int mode_value;
     struct timeval tpstart,tpend; 
     float  timeuse;
+    struct gop_params gop_params;
+    struct gop_planner *gop_planner;
 
     va_init_display_args(&argc, argv);
 
@@ -1924,23 +1765,53 @@ int main(int argc, char *argv[])
         printf("Can't open output avc file\n");
         return -1;
     }	
+    avc_sink = coded_sink_create(fileno(avc_fp), 0);
+    if (avc_sink == NULL) {
+        fclose(yuv_fp);
+        fclose(avc_fp);
+        printf("Can't allocate the avc output\n");
+        return -1;
+    }
     gettimeofday(&tpstart,NULL);	
     avcenc_context_init(picture_width, picture_height);
     create_encode_pipe();
     alloc_encode_resource(yuv_fp);
 
+    /*
+     * Closed GOPs of intra_period frames starting with an IDR, the last
+     * B frames of a GOP are dropped so that they don't follow the next IDR.
+     * All frames are intra when ip_period is 0.
+     */
+    memset(&gop_params, 0, sizeof(gop_params));
+    gop_params.intra_period = ip_period ? intra_period : 1;
+    gop_params.intra_idr_period = ip_period ? intra_period : 0;
+    gop_params.ip_period = ip_period ? ip_period : 1;
+    gop_params.num_frames = frame_number;
+    gop_planner = gop_planner_create(&gop_params);
+    if (gop_planner == NULL) {
+        printf("Failed to create the GOP planner\n");
+        return -1;
+    }
+
     enc_frame_number = 0;
     for ( f = 0; f < frame_number; f++) {		//picture level loop
         unsigned long long next_frame_display;
         int next_frame_type;
+        struct gop_frame frame;
 
-        enc_frame_number = f;
-
-        encoding2display_order(enc_frame_number, intra_period, ip_period,
-                               &current_frame_display, &current_frame_type);
+        if (!gop_planner_next(gop_planner, &frame))
+            break;
+        enc_frame_number = frame.encoding_order;
+        current_frame_display = frame.display_order;
+        current_frame_type = frame.type;
 
-        encoding2display_order(enc_frame_number + 1, intra_period, ip_period,
-                               &next_frame_display, &next_frame_type);
+        if (gop_planner_peek(gop_planner, &frame)) {
+            next_frame_display = frame.display_order;
+            next_frame_type = frame.type;
+        } else {
+            next_frame_display = frame_number - 1;
+            next_frame_type = SLICE_TYPE_P;
+        }
 
         if (current_frame_type == FRAME_IDR) {
             numShortTerm = 0;
@@ -1991,7 +1862,7 @@ int main(int argc, char *argv[])
         /* use the simple mechanism to calc the POC */
         current_poc = (current_frame_display - current_IDR_display) * 2;
 
-        encode_picture(yuv_fp, avc_fp, frame_number, current_frame_display,
+        encode_picture(yuv_fp, avc_sink, frame_number, current_frame_display,
                       (current_frame_type == FRAME_IDR) ? 1 : 0,
                       (current_frame_type == FRAME_IDR) ? SLICE_TYPE_I : current_frame_type,
                       (next_frame_type == SLICE_TYPE_B) ? 1 : 0,
@@ -2007,15 +1878,22 @@ int main(int argc, char *argv[])
         fflush(stdout);
     }
 
+    gop_planner_destroy(gop_planner);
+
     gettimeofday(&tpend,NULL);
     timeuse=1000000*(tpend.tv_sec-tpstart.tv_sec)+ tpend.tv_usec-tpstart.tv_usec;
     timeuse/=1000000;
     printf("\ndone!\n");
     printf("encode %d frames in %f secondes, FPS is %.1f\n",frame_number, timeuse, frame_number/timeuse);
     release_encode_resource();
+    if (upload_copy_frames)
+        printf("input upload copied %d frames in %.3f ms (%.3f ms/frame)\n",
+               upload_copy_frames, upload_copy_usec / 1000.0,
+               upload_copy_usec / 1000.0 / upload_copy_frames);
     destory_encode_pipe();
 
     fclose(yuv_fp);
+    coded_sink_destroy(avc_sink);
     fclose(avc_fp);
 
     return 0;
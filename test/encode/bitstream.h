@@ -0,0 +1,345 @@
+/*
+ * Copyright (c) 2015 Intel Corporation. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+ * IN NO EVENT SHALL PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR
+ * ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * MSB-first bit writer for the packed headers built by the encode tools.
+ *
+ * Bits are gathered in a 64-bit cache and stored 32 at a time, big endian.
+ * The buffer either comes from malloc(), and the caller frees it once
+ * bitstream_end() has been called, or from an arena that is released as a
+ * whole, typically once per frame:
+ *
+ *   bitstream bs;
+ *
+ *   bitstream_start_arena(&bs, &arena);  // or bitstream_start(&bs)
+ *   bitstream_put_ui(&bs, 0x00000001, 32);
+ *   bitstream_put_ue(&bs, 5);
+ *   rbsp_trailing_bits(&bs);
+ *   bitstream_end(&bs);
+ *   // bs.buffer holds (bs.bit_offset + 7) / 8 bytes
+ *
+ * Only one bitstream at a time is carved from an arena, the others spill
+ * to the heap and are still released by bitstream_arena_reset().
+ */
+
+#ifndef BITSTREAM_H
+#define BITSTREAM_H
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "startcode.h"
+
+#define BITSTREAM_ALLOCATE_STEPPING     4096
+#define BITSTREAM_ARENA_SIZE            (64 * 1024)
+
+struct bitstream_spill {
+    struct bitstream_spill *next;
+    unsigned char *buffer;
+};
+
+struct bitstream_arena {
+    unsigned char *base;
+    int size;
+    int used;
+    struct bitstream_spill *spill;
+};
+
+struct __bitstream {
+    unsigned char *buffer;
+    int bit_offset;                     /* bits written, cached ones included */
+    int max_size;                       /* buffer size in bytes */
+    uint64_t cache;                     /* pending bits, LSB aligned */
+    int cache_bits;
+    struct bitstream_arena *arena;      /* NULL if the caller owns the buffer */
+    struct bitstream_spill *spill;
+};
+
+typedef struct __bitstream bitstream;
+
+static inline int
+bitstream_arena_init(struct bitstream_arena *arena, int size)
+{
+    arena->base = malloc(size);
+    arena->size = arena->base ? size : 0;
+    arena->used = 0;
+    arena->spill = NULL;
+
+    return arena->base != NULL;
+}
+
+/* Releases every buffer handed out since the last reset */
+static inline void
+bitstream_arena_reset(struct bitstream_arena *arena)
+{
+    struct bitstream_spill *spill;
+
+    while ((spill = arena->spill) != NULL) {
+        arena->spill = spill->next;
+        free(spill->buffer);
+        free(spill);
+    }
+    arena->used = 0;
+}
+
+static inline void
+bitstream_arena_fini(struct bitstream_arena *arena)
+{
+    bitstream_arena_reset(arena);
+    free(arena->base);
+    arena->base = NULL;
+    arena->size = 0;
+}
+
+static inline void
+bitstream_start(bitstream *bs)
+{
+    bs->max_size = BITSTREAM_ALLOCATE_STEPPING;
+    bs->buffer = malloc(bs->max_size);
+    assert(bs->buffer);
+    bs->bit_offset = 0;
+    bs->cache = 0;
+    bs->cache_bits = 0;
+    bs->arena = NULL;
+    bs->spill = NULL;
+}
+
+/* Takes the free part of the arena until bitstream_end() */
+static inline void
+bitstream_start_arena(bitstream *bs, struct bitstream_arena *arena)
+{
+    bs->buffer = arena->base + arena->used;
+    bs->max_size = arena->size - arena->used;
+    bs->bit_offset = 0;
+    bs->cache = 0;
+    bs->cache_bits = 0;
+    bs->arena = arena;
+    bs->spill = NULL;
+    arena->used = arena->size;
+}
+
+/* used: bytes stored so far, min_size: bytes needed */
+static inline void
+bitstream_grow(bitstream *bs, int used, int min_size)
+{
+    int size = bs->max_size * 2;
+    unsigned char *buffer;
+
+    if (size < min_size + BITSTREAM_ALLOCATE_STEPPING)
+        size = min_size + BITSTREAM_ALLOCATE_STEPPING;
+
+    if (bs->arena && bs->spill == NULL) {
+        /* move out of the arena, the bytes written so far are still valid */
+        bs->arena->used = bs->buffer - bs->arena->base;
+        bs->spill = malloc(sizeof(*bs->spill));
+        buffer = malloc(size);
+        assert(bs->spill && buffer);
+        memcpy(buffer, bs->buffer, used);
+        bs->spill->buffer = buffer;
+        bs->spill->next = bs->arena->spill;
+        bs->arena->spill = bs->spill;
+    } else {
+        buffer = realloc(bs->buffer, size);
+        assert(buffer);
+        if (bs->spill)
+            bs->spill->buffer = buffer;
+    }
+    bs->buffer = buffer;
+    bs->max_size = size;
+}
+
+static inline void
+bitstream_store32(unsigned char *p, uint32_t val)
+{
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    val = __builtin_bswap32(val);
+    memcpy(p, &val, 4);
+#else
+    p[0] = val >> 24;
+    p[1] = val >> 16;
+    p[2] = val >> 8;
+    p[3] = val;
+#endif
+}
+
+/* Stores the cached bits, the last byte padded with zeros */
+static inline void
+bitstream_flush(bitstream *bs)
+{
+    int pos = (bs->bit_offset - bs->cache_bits) >> 3;
+    int size = (bs->cache_bits + 7) >> 3;
+    uint64_t bits;
+
+    if (pos + size > bs->max_size)
+        bitstream_grow(bs, pos, pos + size);
+
+    bits = bs->cache << (size * 8 - bs->cache_bits);
+    while (size--)
+        bs->buffer[pos++] = bits >> (size * 8);
+    bs->cache_bits = 0;
+}
+
+/* bit_offset is kept, bs->buffer holds (bit_offset + 7) / 8 bytes */
+static inline void
+bitstream_end(bitstream *bs)
+{
+    bitstream_flush(bs);
+
+    /* give back the unused part of the arena */
+    if (bs->arena && bs->spill == NULL)
+        bs->arena->used = ((bs->buffer - bs->arena->base) + ((bs->bit_offset + 7) >> 3) + 15) & ~15;
+}
+
+static inline void
+bitstream_put_ui(bitstream *bs, unsigned int val, int size_in_bits)
+{
+    int pos;
+
+    if (!size_in_bits)
+        return;
+
+    if (size_in_bits < 32)
+        val &= ((1U << size_in_bits) - 1);
+
+    /* at most 31 bits are left in the cache, so this fits in 64 bits */
+    bs->cache = (bs->cache << size_in_bits) | val;
+    bs->cache_bits += size_in_bits;
+    bs->bit_offset += size_in_bits;
+
+    if (bs->cache_bits < 32)
+        return;
+
+    bs->cache_bits -= 32;
+    pos = (bs->bit_offset - bs->cache_bits - 32) >> 3;
+    if (pos + 4 > bs->max_size)
+        bitstream_grow(bs, pos, pos + 4);
+    bitstream_store32(bs->buffer + pos, (uint32_t)(bs->cache >> bs->cache_bits));
+}
+
+/* ue(v): the prefix zeros and val + 1 are written in one go below 2^16 */
+static inline void
+bitstream_put_ue(bitstream *bs, unsigned int val)
+{
+    uint64_t code = (uint64_t)val + 1;
+    int size_in_bits = 64 - __builtin_clzll(code);
+
+    if (size_in_bits <= 16) {
+        bitstream_put_ui(bs, (unsigned int)code, 2 * size_in_bits - 1);
+        return;
+    }
+
+    bitstream_put_ui(bs, 0, size_in_bits - 1); /* leading zero */
+    if (size_in_bits > 32) {
+        bitstream_put_ui(bs, 1, 1);
+        size_in_bits = 32;
+    }
+    bitstream_put_ui(bs, (unsigned int)code, size_in_bits);
+}
+
+static inline void
+bitstream_put_se(bitstream *bs, int val)
+{
+    unsigned int new_val;
+
+    if (val <= 0)
+        new_val = -2 * (int64_t)val;
+    else
+        new_val = 2 * (unsigned int)val - 1;
+
+    bitstream_put_ue(bs, new_val);
+}
+
+static inline void
+bitstream_put_bytes(bitstream *bs, const unsigned char *data, int size)
+{
+    int pos;
+
+    if (bs->bit_offset & 0x7) {
+        while (size--)
+            bitstream_put_ui(bs, *data++, 8);
+        return;
+    }
+
+    bitstream_flush(bs);
+    pos = bs->bit_offset >> 3;
+    if (pos + size > bs->max_size)
+        bitstream_grow(bs, pos, pos + size);
+    memcpy(bs->buffer + pos, data, size);
+    bs->bit_offset += size * 8;
+}
+
+static inline void
+bitstream_byte_aligning(bitstream *bs, int bit)
+{
+    int bit_offset = (bs->bit_offset & 0x7);
+    int bit_left = 8 - bit_offset;
+    int new_val;
+
+    if (!bit_offset)
+        return;
+
+    assert(bit == 0 || bit == 1);
+
+    if (bit)
+        new_val = (1 << bit_left) - 1;
+    else
+        new_val = 0;
+
+    bitstream_put_ui(bs, new_val, bit_left);
+}
+
+static inline void
+rbsp_trailing_bits(bitstream *bs)
+{
+    bitstream_put_ui(bs, 1, 1);
+    bitstream_byte_aligning(bs, 0);
+}
+
+/*
+ * Copies a NAL unit and inserts emulation_prevention_three_byte wherever
+ * two zero bytes are followed by a byte <= 3. The first skip bytes (start
+ * code and NAL header) are copied as is. dst must hold size * 3 / 2 bytes.
+ * Returns the size of the escaped NAL unit.
+ */
+static inline int
+bitstream_insert_emulation_prevention(unsigned char *dst, const unsigned char *src,
+                                      int size, int skip)
+{
+    const unsigned char *end = src + size, *p = src + skip, *escape;
+    unsigned char *d = dst + skip;
+
+    memcpy(dst, src, skip);
+    while ((escape = startcode_find_escape(p, end)) != end) {
+        memcpy(d, p, escape + 2 - p);
+        d += escape + 2 - p;
+        *d++ = 3;
+        p = escape + 2;
+    }
+    memcpy(d, p, end - p);
+
+    return d + (end - p) - dst;
+}
+
+#endif /* BITSTREAM_H */
@@ -0,0 +1,614 @@
+/*
+ * Copyright (c) 2015 Intel Corporation. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+ * IN NO EVENT SHALL PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR
+ * ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Checks the packed-header writer of bitstream.h against the dword-based
+ * writer the encode tools used before, byte for byte, then times both on
+ * SPS/PPS/slice-header sized streams. Exits with 1 on the first mismatch.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <time.h>
+#include "bitstream.h"
+
+/* The former writer, kept as the reference */
+struct legacy_bitstream {
+    unsigned int *buffer;
+    int bit_offset;
+    int max_size_in_dword;
+};
+
+static unsigned int
+legacy_swap32(unsigned int val)
+{
+    unsigned char *pval = (unsigned char *)&val;
+
+    return ((pval[0] << 24)     |
+            (pval[1] << 16)     |
+            (pval[2] << 8)      |
+            (pval[3] << 0));
+}
+
+static void
+legacy_start(struct legacy_bitstream *bs)
+{
+    bs->max_size_in_dword = BITSTREAM_ALLOCATE_STEPPING;
+    bs->buffer = calloc(bs->max_size_in_dword * sizeof(int), 1);
+    bs->bit_offset = 0;
+}
+
+static void
+legacy_end(struct legacy_bitstream *bs)
+{
+    int pos = (bs->bit_offset >> 5);
+    int bit_offset = (bs->bit_offset & 0x1f);
+    int bit_left = 32 - bit_offset;
+
+    if (bit_offset) {
+        bs->buffer[pos] = legacy_swap32((bs->buffer[pos] << bit_left));
+    }
+}
+
+static void
+legacy_put_ui(struct legacy_bitstream *bs, unsigned int val, int size_in_bits)
+{
+    int pos = (bs->bit_offset >> 5);
+    int bit_offset = (bs->bit_offset & 0x1f);
+    int bit_left = 32 - bit_offset;
+
+    if (!size_in_bits)
+        return;
+
+    bs->bit_offset += size_in_bits;
+
+    if (bit_left > size_in_bits) {
+        bs->buffer[pos] = (bs->buffer[pos] << size_in_bits | val);
+    } else {
+        size_in_bits -= bit_left;
+        bs->buffer[pos] = (bs->buffer[pos] << bit_left) | (val >> size_in_bits);
+        bs->buffer[pos] = legacy_swap32(bs->buffer[pos]);
+
+        if (pos + 1 == bs->max_size_in_dword) {
+            bs->max_size_in_dword += BITSTREAM_ALLOCATE_STEPPING;
+            bs->buffer = realloc(bs->buffer, bs->max_size_in_dword * sizeof(unsigned int));
+        }
+
+        bs->buffer[pos + 1] = val;
+    }
+}
+
+static void
+legacy_put_ue(struct legacy_bitstream *bs, unsigned int val)
+{
+    int size_in_bits = 0;
+    int tmp_val = ++val;
+
+    while (tmp_val) {
+        tmp_val >>= 1;
+        size_in_bits++;
+    }
+
+    legacy_put_ui(bs, 0, size_in_bits - 1); // leading zero
+    legacy_put_ui(bs, val, size_in_bits);
+}
+
+static void
+legacy_put_se(struct legacy_bitstream *bs, int val)
+{
+    unsigned int new_val;
+
+    if (val <= 0)
+        new_val = -2 * val;
+    else
+        new_val = 2 * val - 1;
+
+    legacy_put_ue(bs, new_val);
+}
+
+static void
+legacy_byte_aligning(struct legacy_bitstream *bs, int bit)
+{
+    int bit_offset = (bs->bit_offset & 0x7);
+    int bit_left = 8 - bit_offset;
+
+    if (!bit_offset)
+        return;
+
+    legacy_put_ui(bs, bit ? (1 << bit_left) - 1 : 0, bit_left);
+}
+
+/*
+ * Both writers are driven by the same pseudo-random operation list, with
+ * values in the range of each syntax element: the former writer did not
+ * mask out-of-range values, and a 32-bit write at a dword boundary picked
+ * up stale bits (shift by 32), so u(v) is limited to 31 bits here.
+ */
+enum {
+    OP_UI,
+    OP_UE,
+    OP_SE,
+    OP_ALIGN,
+    OP_TRAILING,
+    OP_BYTES,
+    OP_COUNT
+};
+
+struct op {
+    int type;
+    unsigned int val;
+    int size;
+    unsigned char bytes[8];
+};
+
+static unsigned int rand_state = 1;
+
+static unsigned int
+next_rand(void)
+{
+    /* xorshift32, reproducible across libcs */
+    rand_state ^= rand_state << 13;
+    rand_state ^= rand_state >> 17;
+    rand_state ^= rand_state << 5;
+    return rand_state;
+}
+
+static void
+make_ops(struct op *ops, int num_ops)
+{
+    int i, j;
+
+    for (i = 0; i < num_ops; i++) {
+        struct op *op = &ops[i];
+
+        op->type = next_rand() % OP_COUNT;
+        op->size = 1 + next_rand() % 31;
+        op->val = next_rand();
+        switch (op->type) {
+        case OP_UI:
+            if (op->size < 32)
+                op->val &= (1U << op->size) - 1;
+            break;
+        case OP_UE:
+        case OP_SE:
+            /* mostly small values, as in real headers, below 2^30 */
+            op->val >>= (next_rand() & 1) ? 2 + next_rand() % 30 : 20;
+            break;
+        case OP_BYTES:
+            op->size = 1 + next_rand() % 8;
+            for (j = 0; j < op->size; j++)
+                op->bytes[j] = next_rand();
+            break;
+        default:
+            op->val &= 1;
+            break;
+        }
+    }
+}
+
+static void
+run_ops(bitstream *bs, const struct op *ops, int num_ops)
+{
+    int i;
+
+    for (i = 0; i < num_ops; i++) {
+        switch (ops[i].type) {
+        case OP_UI:
+            bitstream_put_ui(bs, ops[i].val, ops[i].size);
+            break;
+        case OP_UE:
+            bitstream_put_ue(bs, ops[i].val);
+            break;
+        case OP_SE:
+            bitstream_put_se(bs, (int)ops[i].val * ((ops[i].size & 1) ? -1 : 1));
+            break;
+        case OP_ALIGN:
+            bitstream_byte_aligning(bs, ops[i].val);
+            break;
+        case OP_TRAILING:
+            rbsp_trailing_bits(bs);
+            break;
+        case OP_BYTES:
+            bitstream_put_bytes(bs, ops[i].bytes, ops[i].size);
+            break;
+        }
+    }
+}
+
+static void
+legacy_run_ops(struct legacy_bitstream *bs, const struct op *ops, int num_ops)
+{
+    int i, j;
+
+    for (i = 0; i < num_ops; i++) {
+        switch (ops[i].type) {
+        case OP_UI:
+            legacy_put_ui(bs, ops[i].val, ops[i].size);
+            break;
+        case OP_UE:
+            legacy_put_ue(bs, ops[i].val);
+            break;
+        case OP_SE:
+            legacy_put_se(bs, (int)ops[i].val * ((ops[i].size & 1) ? -1 : 1));
+            break;
+        case OP_ALIGN:
+            legacy_byte_aligning(bs, ops[i].val);
+            break;
+        case OP_TRAILING:
+            legacy_put_ui(bs, 1, 1);
+            legacy_byte_aligning(bs, 0);
+            break;
+        case OP_BYTES:
+            for (j = 0; j < ops[i].size; j++)
+                legacy_put_ui(bs, ops[i].bytes[j], 8);
+            break;
+        }
+    }
+}
+
+static int
+compare(const char *test, const bitstream *bs, const struct legacy_bitstream *ref)
+{
+    const unsigned char *ref_bytes = (const unsigned char *)ref->buffer;
+    int i, size = (ref->bit_offset + 7) / 8;
+
+    if (bs->bit_offset != ref->bit_offset) {
+        printf("%s: %d bits written, expected %d\n", test, bs->bit_offset, ref->bit_offset);
+        return 0;
+    }
+    for (i = 0; i < size; i++) {
+        if (bs->buffer[i] != ref_bytes[i]) {
+            printf("%s: byte %d is 0x%02x, expected 0x%02x\n", test, i, bs->buffer[i], ref_bytes[i]);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Random operation lists, heap and arena backed */
+static int
+check_random(int rounds)
+{
+    struct bitstream_arena arena;
+    struct op ops[256];
+    int round, num_ops, ok = 1;
+
+    bitstream_arena_init(&arena, BITSTREAM_ARENA_SIZE);
+    for (round = 0; round < rounds && ok; round++) {
+        struct legacy_bitstream ref;
+        bitstream bs, abs;
+
+        num_ops = 1 + next_rand() % 256;
+        make_ops(ops, num_ops);
+
+        legacy_start(&ref);
+        legacy_run_ops(&ref, ops, num_ops);
+        legacy_end(&ref);
+
+        bitstream_start(&bs);
+        run_ops(&bs, ops, num_ops);
+        bitstream_end(&bs);
+        ok = compare("random", &bs, &ref);
+        free(bs.buffer);
+
+        if ((round & 63) == 0)
+            bitstream_arena_reset(&arena);
+        bitstream_start_arena(&abs, &arena);
+        run_ops(&abs, ops, num_ops);
+        bitstream_end(&abs);
+        ok = ok && compare("random, arena", &abs, &ref);
+
+        free(ref.buffer);
+    }
+    bitstream_arena_fini(&arena);
+
+    return ok;
+}
+
+/* Streams larger than the initial buffer and than the arena */
+static int
+check_growth(void)
+{
+    struct bitstream_arena arena;
+    struct legacy_bitstream ref;
+    bitstream bs, abs, nested;
+    int i, ok;
+
+    legacy_start(&ref);
+    bitstream_start(&bs);
+    bitstream_arena_init(&arena, 256);
+    bitstream_start_arena(&abs, &arena);
+    /* a second stream opened meanwhile spills to the heap right away */
+    bitstream_start_arena(&nested, &arena);
+    for (i = 0; i < 100000; i++) {
+        legacy_put_ue(&ref, i);
+        bitstream_put_ue(&bs, i);
+        bitstream_put_ue(&abs, i);
+        bitstream_put_ue(&nested, i);
+    }
+    legacy_end(&ref);
+    bitstream_end(&bs);
+    bitstream_end(&abs);
+    bitstream_end(&nested);
+
+    ok = compare("growth", &bs, &ref) &&
+        compare("growth, arena", &abs, &ref) &&
+        compare("growth, nested arena", &nested, &ref);
+
+    free(ref.buffer);
+    free(bs.buffer);
+    bitstream_arena_fini(&arena);
+
+    return ok;
+}
+
+/* Exp-Golomb codes of 32 bits and more, which the former writer got wrong */
+static int
+check_long_codes(void)
+{
+    /* ue(2^32 - 1): 32 zeros, 1, 32 zeros */
+    static const unsigned char ue_max[] = {
+        0x00, 0x00, 0x00, 0x00, 0x80, 0x00, 0x00, 0x00, 0x00,
+    };
+    /* se(-(2^31 - 1)) = ue(2^32 - 2): 31 zeros, 32 ones */
+    static const unsigned char se_min[] = {
+        0x00, 0x00, 0x00, 0x01, 0xff, 0xff, 0xff, 0xfe,
+    };
+    bitstream bs;
+    int ok;
+
+    bitstream_start(&bs);
+    bitstream_put_ue(&bs, 0xffffffff);
+    bitstream_end(&bs);
+    ok = bs.bit_offset == 65 && !memcmp(bs.buffer, ue_max, sizeof(ue_max));
+    free(bs.buffer);
+
+    bitstream_start(&bs);
+    bitstream_put_se(&bs, -2147483647);
+    bitstream_end(&bs);
+    ok = ok && bs.bit_offset == 63 && !memcmp(bs.buffer, se_min, sizeof(se_min));
+    free(bs.buffer);
+
+    if (!ok)
+        printf("long codes: wrong ue(v)/se(v) beyond 32 bits\n");
+    return ok;
+}
+
+static int
+check_emulation_prevention(void)
+{
+    static const struct {
+        unsigned char in[12];
+        int in_size;
+        unsigned char out[16];
+        int out_size;
+    } vectors[] = {
+        { { 0, 0, 0, 1, 0x67, 0, 0, 1 }, 8, { 0, 0, 0, 1, 0x67, 0, 0, 3, 1 }, 9 },
+        { { 0, 0, 0, 1, 0x06, 0, 0, 0, 0, 0 }, 10, { 0, 0, 0, 1, 0x06, 0, 0, 3, 0, 0, 3, 0 }, 12 },
+        { { 0, 0, 0, 1, 0x68, 0, 0, 4, 0, 0, 2 }, 11, { 0, 0, 0, 1, 0x68, 0, 0, 4, 0, 0, 3, 2 }, 12 },
+        { { 0, 0, 0, 1, 0x65, 0, 0, 3, 0, 0x80 }, 10, { 0, 0, 0, 1, 0x65, 0, 0, 3, 3, 0, 0x80 }, 11 },
+        { { 0, 0, 0, 1, 0x41, 0, 0x80, 0, 0 }, 9, { 0, 0, 0, 1, 0x41, 0, 0x80, 0, 0 }, 9 },
+    };
+    unsigned char out[16];
+    unsigned int i;
+    int size;
+
+    for (i = 0; i < sizeof(vectors) / sizeof(vectors[0]); i++) {
+        size = bitstream_insert_emulation_prevention(out, vectors[i].in, vectors[i].in_size, 5);
+        if (size != vectors[i].out_size || memcmp(out, vectors[i].out, size)) {
+            printf("emulation prevention: vector %u differs\n", i);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static double
+get_time(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+legacy_trailing_bits(struct legacy_bitstream *bs)
+{
+    legacy_put_ui(bs, 1, 1);
+    legacy_byte_aligning(bs, 0);
+}
+
+/*
+ * Roughly the syntax elements of a 1080p SPS, PPS and P slice header, as
+ * straight-line code so that both writers are timed the way the encoders
+ * call them.
+ */
+#define HEADER_SET(bs, put_ui, put_ue, put_se, trailing_bits)           \
+    do {                                                                \
+        put_ui(bs, 1, 32); put_ui(bs, 0x67, 8); put_ui(bs, 100, 8);     \
+        put_ui(bs, 0, 8); put_ui(bs, 41, 8); put_ue(bs, 0);             \
+        put_ue(bs, 1); put_ue(bs, 0); put_ue(bs, 0); put_ui(bs, 0, 2);  \
+        put_ue(bs, 8); put_ue(bs, 0); put_ue(bs, 8); put_ue(bs, 2);     \
+        put_ui(bs, 0, 1); put_ue(bs, 119); put_ue(bs, 67);              \
+        put_ui(bs, 1, 1); put_ui(bs, 1, 1); put_ui(bs, 1, 1);           \
+        put_ue(bs, 0); put_ue(bs, 0); put_ue(bs, 0); put_ue(bs, 4);     \
+        put_ui(bs, 0, 1); trailing_bits(bs);                            \
+                                                                        \
+        put_ui(bs, 1, 32); put_ui(bs, 0x68, 8); put_ue(bs, 0);          \
+        put_ue(bs, 0); put_ui(bs, 1, 1); put_ui(bs, 0, 1);              \
+        put_ue(bs, 0); put_ue(bs, 1); put_ue(bs, 0); put_ui(bs, 0, 1);  \
+        put_ui(bs, 0, 2); put_se(bs, 0); put_se(bs, 0); put_se(bs, 0);  \
+        put_ui(bs, 1, 1); put_ui(bs, 0, 1); put_ui(bs, 0, 1);           \
+        put_ui(bs, 1, 1); put_ui(bs, 0, 1); put_se(bs, 0);              \
+        trailing_bits(bs);                                              \
+                                                                        \
+        put_ui(bs, 1, 32); put_ui(bs, 0x21, 8); put_ue(bs, 0);          \
+        put_ue(bs, 5); put_ue(bs, 0); put_ui(bs, 37, 8);                \
+        put_ui(bs, 74, 10); put_ui(bs, 0, 1); put_ui(bs, 1, 1);         \
+        put_ue(bs, 0); put_ui(bs, 0, 1); put_ui(bs, 0, 1);              \
+        put_ue(bs, 0); put_se(bs, -3); put_ue(bs, 0); put_se(bs, 0);    \
+        put_se(bs, 0);                                                  \
+    } while (0)
+
+static void
+write_headers(bitstream *bs)
+{
+    HEADER_SET(bs, bitstream_put_ui, bitstream_put_ue, bitstream_put_se,
+               rbsp_trailing_bits);
+}
+
+static void
+legacy_write_headers(struct legacy_bitstream *bs)
+{
+    HEADER_SET(bs, legacy_put_ui, legacy_put_ue, legacy_put_se,
+               legacy_trailing_bits);
+}
+
+static int
+check_headers(void)
+{
+    struct legacy_bitstream ref;
+    bitstream bs;
+    int ok;
+
+    legacy_start(&ref);
+    legacy_write_headers(&ref);
+    legacy_end(&ref);
+    bitstream_start(&bs);
+    write_headers(&bs);
+    bitstream_end(&bs);
+
+    ok = compare("headers", &bs, &ref);
+    free(ref.buffer);
+    free(bs.buffer);
+
+    return ok;
+}
+
+static void
+benchmark(int iterations)
+{
+    struct bitstream_arena arena;
+    double start, legacy_time, heap_time, arena_time;
+    unsigned int sum = 0;
+    int i;
+
+    start = get_time();
+    for (i = 0; i < iterations; i++) {
+        struct legacy_bitstream ref;
+
+        legacy_start(&ref);
+        legacy_write_headers(&ref);
+        legacy_end(&ref);
+        sum += ((unsigned char *)ref.buffer)[(ref.bit_offset - 1) / 8];
+        free(ref.buffer);
+    }
+    legacy_time = get_time() - start;
+
+    start = get_time();
+    for (i = 0; i < iterations; i++) {
+        bitstream bs;
+
+        bitstream_start(&bs);
+        write_headers(&bs);
+        bitstream_end(&bs);
+        sum += bs.buffer[(bs.bit_offset - 1) / 8];
+        free(bs.buffer);
+    }
+    heap_time = get_time() - start;
+
+    bitstream_arena_init(&arena, BITSTREAM_ARENA_SIZE);
+    start = get_time();
+    for (i = 0; i < iterations; i++) {
+        bitstream bs;
+
+        /* once per frame in the encoders */
+        bitstream_arena_reset(&arena);
+        bitstream_start_arena(&bs, &arena);
+        write_headers(&bs);
+        bitstream_end(&bs);
+        sum += bs.buffer[(bs.bit_offset - 1) / 8];
+    }
+    arena_time = get_time() - start;
+    bitstream_arena_fini(&arena);
+
+    printf("SPS + PPS + slice header, %d iterations (checksum %u)\n", iterations, sum);
+    printf("  former writer     : %7.1f ns\n", legacy_time * 1e9 / iterations);
+    printf("  bitstream.h, heap : %7.1f ns (%.2fx)\n",
+           heap_time * 1e9 / iterations, legacy_time / heap_time);
+    printf("  bitstream.h, arena: %7.1f ns (%.2fx)\n",
+           arena_time * 1e9 / iterations, legacy_time / arena_time);
+}
+
+static void
+print_help(const char *name)
+{
+    printf("%s [-n iterations] [--check-only]\n", name);
+    printf("  -n: header sets written per writer in the benchmark, default 200000\n");
+    printf("  --check-only: only compare the writers\n");
+}
+
+int
+main(int argc, char **argv)
+{
+    struct option long_opts[] = {
+        {"help", no_argument, NULL, 0 },
+        {"check-only", no_argument, NULL, 1 },
+        {NULL, no_argument, NULL, 0 }};
+    int iterations = 200000, check_only = 0;
+    int c, long_index;
+
+    while ((c = getopt_long_only(argc, argv, "n:?", long_opts, &long_index)) != EOF) {
+        switch (c) {
+        case 'n':
+            iterations = atoi(optarg);
+            break;
+        case 1:
+            check_only = 1;
+            break;
+        default:
+            print_help(argv[0]);
+            return c == 0 ? 0 : 1;
+        }
+    }
+    if (iterations <= 0) {
+        print_help(argv[0]);
+        return 1;
+    }
+
+    if (!check_headers() || !check_random(20000) || !check_growth() ||
+        !check_long_codes() || !check_emulation_prevention()) {
+        printf("bitstream writer check FAILED\n");
+        return 1;
+    }
+    printf("bitstream writer check passed\n");
+
+    if (!check_only)
+        benchmark(iterations);
+
+    return 0;
+}
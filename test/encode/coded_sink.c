@@ -0,0 +1,199 @@
+/*
+ * Copyright (c) 2015 Intel Corporation. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+ * IN NO EVENT SHALL PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR
+ * ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include "coded_sink.h"
+
+#ifndef IOV_MAX
+#define IOV_MAX                 1024
+#endif
+
+#define CODED_SINK_MAX_IOV      64
+
+struct coded_sink {
+    int fd;
+    int error;
+
+    unsigned char *buffer;              /* staging buffer, or NULL */
+    size_t buffer_size;                 /* flush threshold, half the allocation */
+    size_t buffer_used;
+};
+
+struct coded_sink *
+coded_sink_create(int fd, size_t buffer_size)
+{
+    struct coded_sink *sink;
+
+    sink = calloc(1, sizeof(*sink));
+    if (sink == NULL)
+        return NULL;
+
+    sink->fd = fd;
+    if (buffer_size) {
+        sink->buffer = malloc(2 * buffer_size);
+        if (sink->buffer == NULL) {
+            free(sink);
+            return NULL;
+        }
+        sink->buffer_size = buffer_size;
+    }
+
+    return sink;
+}
+
+/* Writes all of iov, resuming after short writes; iov is modified */
+static int
+coded_sink_writev(int fd, struct iovec *iov, int iovcnt)
+{
+    ssize_t ret;
+
+    while (iovcnt > 0) {
+        ret = writev(fd, iov, iovcnt > IOV_MAX ? IOV_MAX : iovcnt);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        while (iovcnt > 0 && (size_t)ret >= iov->iov_len) {
+            ret -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (unsigned char *)iov->iov_base + ret;
+            iov->iov_len -= ret;
+        }
+    }
+
+    return 0;
+}
+
+int
+coded_sink_flush(struct coded_sink *sink)
+{
+    struct iovec iov;
+
+    if (sink->buffer_used == 0)
+        return sink->error ? -1 : 0;
+
+    iov.iov_base = sink->buffer;
+    iov.iov_len = sink->buffer_used;
+    if (coded_sink_writev(sink->fd, &iov, 1))
+        sink->error = 1;
+    sink->buffer_used = 0;
+
+    return sink->error ? -1 : 0;
+}
+
+/* Writes the segment list straight from the mapped buffer */
+static int
+coded_sink_write_segments(struct coded_sink *sink, VACodedBufferSegment *segment)
+{
+    struct iovec iov[CODED_SINK_MAX_IOV];
+    int iovcnt = 0;
+
+    /* keep the file in order if frames were staged before */
+    if (coded_sink_flush(sink))
+        return -1;
+
+    for (; segment; segment = segment->next) {
+        if (segment->size == 0)
+            continue;
+        iov[iovcnt].iov_base = segment->buf;
+        iov[iovcnt].iov_len = segment->size;
+        if (++iovcnt == CODED_SINK_MAX_IOV) {
+            if (coded_sink_writev(sink->fd, iov, iovcnt))
+                return -1;
+            iovcnt = 0;
+        }
+    }
+
+    return coded_sink_writev(sink->fd, iov, iovcnt);
+}
+
+int
+coded_sink_write(struct coded_sink *sink, VADisplay dpy, VABufferID coded_buf, int check_overflow)
+{
+    VACodedBufferSegment *buf_list = NULL, *segment;
+    size_t coded_size = 0;
+    int ret = 0;
+
+    if (vaMapBuffer(dpy, coded_buf, (void **)&buf_list) != VA_STATUS_SUCCESS)
+        return -1;
+
+    if (check_overflow && buf_list &&
+        (buf_list->status & VA_CODED_BUF_STATUS_SLICE_OVERFLOW_MASK)) {
+        vaUnmapBuffer(dpy, coded_buf);
+        return CODED_SINK_OVERFLOW;
+    }
+
+    for (segment = buf_list; segment; segment = segment->next)
+        coded_size += segment->size;
+
+    if (coded_size > INT_MAX) {
+        vaUnmapBuffer(dpy, coded_buf);
+        return -1;
+    }
+
+    if (sink->buffer && coded_size <= sink->buffer_size) {
+        /* less than buffer_size is staged, so there is room behind it */
+        for (segment = buf_list; segment; segment = segment->next) {
+            memcpy(sink->buffer + sink->buffer_used, segment->buf, segment->size);
+            sink->buffer_used += segment->size;
+        }
+        vaUnmapBuffer(dpy, coded_buf);
+
+        if (sink->buffer_used >= sink->buffer_size)
+            ret = coded_sink_flush(sink);
+    } else {
+        ret = coded_sink_write_segments(sink, buf_list);
+        vaUnmapBuffer(dpy, coded_buf);
+        if (ret)
+            sink->error = 1;
+    }
+
+    return ret ? -1 : (int)coded_size;
+}
+
+int
+coded_sink_destroy(struct coded_sink *sink)
+{
+    int ret;
+
+    if (sink == NULL)
+        return 0;
+
+    ret = coded_sink_flush(sink);
+    free(sink->buffer);
+    free(sink);
+
+    return ret;
+}
@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2015 Intel Corporation. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+ * IN NO EVENT SHALL PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR
+ * ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Coded-buffer output for the encode tools.
+ *
+ * All the VACodedBufferSegment entries of a coded buffer are gathered into
+ * one writev() and the buffer is unmapped as soon as the call returns, so the
+ * driver gets it back without a stdio copy per segment. With a staging
+ * buffer, the segments of a frame that fits are copied out instead and the
+ * buffer is unmapped before any system call; the staged frames are written
+ * together once they fill the staging buffer, or by coded_sink_flush().
+ * Frames larger than the staging buffer are written as without one.
+ */
+
+#ifndef CODED_SINK_H
+#define CODED_SINK_H
+
+#include <stddef.h>
+#include <va/va.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* returned by coded_sink_write() when the driver ran out of coded buffer */
+#define CODED_SINK_OVERFLOW     (-2)
+
+struct coded_sink;
+
+/**
+ * Writes to fd, which stays owned by the caller. buffer_size is the size of
+ * the staging buffer, 0 writes every frame straight from the mapped buffer.
+ * Twice buffer_size is allocated, so that a frame always fits behind the
+ * staged ones. Returns NULL on failure.
+ */
+struct coded_sink *
+coded_sink_create(int fd, size_t buffer_size);
+
+/**
+ * Maps coded_buf, writes or stages all its segments and unmaps it. Returns
+ * the coded size in bytes, -1 on a mapping or write error, or
+ * CODED_SINK_OVERFLOW, with nothing written, if check_overflow is set and the
+ * driver reported a slice overflow. Calls must not overlap.
+ */
+int
+coded_sink_write(struct coded_sink *sink, VADisplay dpy, VABufferID coded_buf, int check_overflow);
+
+/** Writes the staged frames, returns -1 on a write error */
+int
+coded_sink_flush(struct coded_sink *sink);
+
+/** Flushes and frees the sink, returns -1 if some data could not be written */
+int
+coded_sink_destroy(struct coded_sink *sink);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CODED_SINK_H */
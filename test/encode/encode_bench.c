@@ -0,0 +1,577 @@
+/*
+ * Copyright (c) 2015 Intel Corporation. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+ * IN NO EVENT SHALL PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR
+ * ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Multi-stream H.264 encode benchmark: runs N independent encode sessions,
+ * each on its own VADisplay or all on a shared one, driven by a pool of
+ * worker threads. Reports per-session and aggregate throughput, frame
+ * latency percentiles and CPU time per frame.
+ *
+ * Without a GPU, run it on the dummy driver (LIBVA_DRIVER_NAME=dummy) or
+ * with LIBVA_FOOL_ENCODE set. VA fool keeps its state per display, so use it
+ * with one session per display (the default).
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <va/va.h>
+#include <va/va_enc_h264.h>
+#include "va_display.h"
+#include "mpmc_queue.h"
+
+#define CHECK_VASTATUS(va_status,func)                                  \
+    if (va_status != VA_STATUS_SUCCESS) {                               \
+        fprintf(stderr,"%s:%s (%d) failed,exit\n", __func__, func, __LINE__); \
+        exit(1);                                                        \
+    }
+
+/* Every session is queued at most once, so this bounds the session count */
+#define MAX_SESSIONS            MPMC_QUEUE_SIZE
+#define MAX_THREADS             64
+#define SURFACE_NUM             2
+
+#define SLICE_TYPE_P            0
+#define SLICE_TYPE_I            2
+
+struct session {
+    unsigned int index;
+    VADisplay va_dpy;
+    unsigned int display_index;
+    VAConfigID config_id;
+    VAContextID context_id;
+    VASurfaceID src_surface[SURFACE_NUM];
+    VASurfaceID ref_surface[SURFACE_NUM];
+    VABufferID coded_buf[SURFACE_NUM];
+    int upload;
+
+    unsigned int frames_done;
+    unsigned long long coded_bytes;
+    double *latency_ms;                 /* one entry per frame */
+    double cpu_ms;                      /* worker thread CPU time spent on this session */
+    double first_start, last_end;       /* seconds */
+};
+
+static unsigned int num_sessions = 4;
+static unsigned int num_threads;
+static unsigned int num_frames = 300;
+static unsigned int frame_width = 1280;
+static unsigned int frame_height = 720;
+static unsigned int intra_period = 30;
+static int shared_display;
+static int upload_frames = 1;
+
+static VADisplay displays[MAX_SESSIONS];
+static unsigned int num_displays;
+static struct session sessions[MAX_SESSIONS];
+static struct mpmc_queue session_queue;
+static unsigned int sessions_running;
+
+static double
+clock_seconds(clockid_t clock)
+{
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static VAProfile
+find_encode_profile(VADisplay va_dpy)
+{
+    static const VAProfile profiles[] = {
+        VAProfileH264High, VAProfileH264Main, VAProfileH264Baseline,
+        VAProfileH264ConstrainedBaseline
+    };
+    VAEntrypoint *entrypoints;
+    int num_entrypoints, i;
+    unsigned int p;
+    VAProfile profile = VAProfileNone;
+
+    entrypoints = malloc(vaMaxNumEntrypoints(va_dpy) * sizeof(*entrypoints));
+    if (!entrypoints)
+        return VAProfileNone;
+
+    for (p = 0; p < sizeof(profiles) / sizeof(profiles[0]) && profile == VAProfileNone; p++) {
+        if (vaQueryConfigEntrypoints(va_dpy, profiles[p], entrypoints,
+                                     &num_entrypoints) != VA_STATUS_SUCCESS)
+            continue;
+        for (i = 0; i < num_entrypoints; i++) {
+            if (entrypoints[i] == VAEntrypointEncSlice) {
+                profile = profiles[p];
+                break;
+            }
+        }
+    }
+    free(entrypoints);
+
+    return profile;
+}
+
+static void
+session_init(struct session *s)
+{
+    VAConfigAttrib attrib;
+    VAProfile profile;
+    VAStatus va_status;
+    unsigned int i;
+
+    profile = find_encode_profile(s->va_dpy);
+    if (profile == VAProfileNone) {
+        fprintf(stderr, "Can't find VAEntrypointEncSlice for H264 profiles\n");
+        exit(1);
+    }
+
+    attrib.type = VAConfigAttribRTFormat;
+    attrib.value = VA_RT_FORMAT_YUV420;
+    va_status = vaCreateConfig(s->va_dpy, profile, VAEntrypointEncSlice,
+                               &attrib, 1, &s->config_id);
+    CHECK_VASTATUS(va_status, "vaCreateConfig");
+
+    va_status = vaCreateSurfaces(s->va_dpy, VA_RT_FORMAT_YUV420,
+                                 frame_width, frame_height,
+                                 s->src_surface, SURFACE_NUM, NULL, 0);
+    CHECK_VASTATUS(va_status, "vaCreateSurfaces");
+
+    va_status = vaCreateSurfaces(s->va_dpy, VA_RT_FORMAT_YUV420,
+                                 frame_width, frame_height,
+                                 s->ref_surface, SURFACE_NUM, NULL, 0);
+    CHECK_VASTATUS(va_status, "vaCreateSurfaces");
+
+    va_status = vaCreateContext(s->va_dpy, s->config_id,
+                                frame_width, ((frame_height + 15) / 16) * 16,
+                                VA_PROGRESSIVE, s->ref_surface, SURFACE_NUM,
+                                &s->context_id);
+    CHECK_VASTATUS(va_status, "vaCreateContext");
+
+    for (i = 0; i < SURFACE_NUM; i++) {
+        /* same worst case as h264encode */
+        va_status = vaCreateBuffer(s->va_dpy, s->context_id, VAEncCodedBufferType,
+                                   frame_width * frame_height * 400 / (16 * 16),
+                                   1, NULL, &s->coded_buf[i]);
+        CHECK_VASTATUS(va_status, "vaCreateBuffer");
+    }
+
+    s->upload = upload_frames;
+    s->latency_ms = calloc(num_frames, sizeof(*s->latency_ms));
+    if (!s->latency_ms) {
+        fprintf(stderr, "Failed to allocate latency samples\n");
+        exit(1);
+    }
+}
+
+static void
+session_fini(struct session *s)
+{
+    unsigned int i;
+
+    for (i = 0; i < SURFACE_NUM; i++)
+        vaDestroyBuffer(s->va_dpy, s->coded_buf[i]);
+    vaDestroyContext(s->va_dpy, s->context_id);
+    vaDestroySurfaces(s->va_dpy, s->ref_surface, SURFACE_NUM);
+    vaDestroySurfaces(s->va_dpy, s->src_surface, SURFACE_NUM);
+    vaDestroyConfig(s->va_dpy, s->config_id);
+    free(s->latency_ms);
+}
+
+/* Writes a moving luma ramp into the source surface, like a capture would */
+static void
+upload_frame(struct session *s, VASurfaceID surface, unsigned int frame)
+{
+    VAImage image;
+    unsigned char *data, *row;
+    unsigned int x, y;
+
+    if (vaDeriveImage(s->va_dpy, surface, &image) != VA_STATUS_SUCCESS) {
+        /* nothing to time on drivers that can't map their surfaces */
+        s->upload = 0;
+        return;
+    }
+    if (vaMapBuffer(s->va_dpy, image.buf, (void **)&data) == VA_STATUS_SUCCESS) {
+        for (y = 0; y < image.height; y++) {
+            row = data + image.offsets[0] + y * image.pitches[0];
+            for (x = 0; x < image.width; x++)
+                row[x] = (unsigned char)(x + y + frame);
+        }
+        for (y = 1; y < image.num_planes; y++)
+            memset(data + image.offsets[y], 0x80,
+                   image.pitches[y] * ((image.height + 1) / 2));
+        vaUnmapBuffer(s->va_dpy, image.buf);
+    }
+    vaDestroyImage(s->va_dpy, image.image_id);
+}
+
+static void
+render_buffer(struct session *s, VABufferType type, unsigned int size, void *data)
+{
+    VABufferID buf;
+    VAStatus va_status;
+
+    va_status = vaCreateBuffer(s->va_dpy, s->context_id, type, size, 1, data, &buf);
+    CHECK_VASTATUS(va_status, "vaCreateBuffer");
+    va_status = vaRenderPicture(s->va_dpy, s->context_id, &buf, 1);
+    CHECK_VASTATUS(va_status, "vaRenderPicture");
+    vaDestroyBuffer(s->va_dpy, buf);
+}
+
+/* Encodes frame s->frames_done as an IDR or a P frame off the previous one */
+static void
+encode_frame(struct session *s)
+{
+    VAEncSequenceParameterBufferH264 seq_param;
+    VAEncPictureParameterBufferH264 pic_param;
+    VAEncSliceParameterBufferH264 slice_param;
+    VACodedBufferSegment *segment;
+    unsigned int frame = s->frames_done;
+    unsigned int slot = frame % SURFACE_NUM;
+    unsigned int gop_frame = frame % intra_period;
+    int is_idr = (gop_frame == 0);
+    unsigned int width_in_mbs = (frame_width + 15) / 16;
+    unsigned int height_in_mbs = (frame_height + 15) / 16;
+    VAStatus va_status;
+    unsigned int i;
+
+    if (s->upload)
+        upload_frame(s, s->src_surface[slot], frame);
+
+    va_status = vaBeginPicture(s->va_dpy, s->context_id, s->src_surface[slot]);
+    CHECK_VASTATUS(va_status, "vaBeginPicture");
+
+    if (is_idr) {
+        memset(&seq_param, 0, sizeof(seq_param));
+        seq_param.level_idc = 41;
+        seq_param.intra_period = intra_period;
+        seq_param.intra_idr_period = intra_period;
+        seq_param.ip_period = 1;
+        seq_param.max_num_ref_frames = 1;
+        seq_param.picture_width_in_mbs = width_in_mbs;
+        seq_param.picture_height_in_mbs = height_in_mbs;
+        seq_param.seq_fields.bits.frame_mbs_only_flag = 1;
+        seq_param.seq_fields.bits.chroma_format_idc = 1;
+        seq_param.seq_fields.bits.direct_8x8_inference_flag = 1;
+        seq_param.seq_fields.bits.log2_max_frame_num_minus4 = 4;
+        seq_param.seq_fields.bits.log2_max_pic_order_cnt_lsb_minus4 = 4;
+        seq_param.time_scale = 60;
+        seq_param.num_units_in_tick = 1;
+        render_buffer(s, VAEncSequenceParameterBufferType, sizeof(seq_param), &seq_param);
+    }
+
+    memset(&pic_param, 0, sizeof(pic_param));
+    pic_param.CurrPic.picture_id = s->ref_surface[slot];
+    pic_param.CurrPic.TopFieldOrderCnt = 2 * gop_frame;
+    for (i = 0; i < 16; i++) {
+        pic_param.ReferenceFrames[i].picture_id = VA_INVALID_SURFACE;
+        pic_param.ReferenceFrames[i].flags = VA_PICTURE_H264_INVALID;
+    }
+    if (!is_idr) {
+        pic_param.ReferenceFrames[0].picture_id = s->ref_surface[(frame - 1) % SURFACE_NUM];
+        pic_param.ReferenceFrames[0].flags = VA_PICTURE_H264_SHORT_TERM_REFERENCE;
+        pic_param.ReferenceFrames[0].TopFieldOrderCnt = 2 * (gop_frame - 1);
+    }
+    pic_param.coded_buf = s->coded_buf[slot];
+    pic_param.frame_num = gop_frame;
+    pic_param.pic_init_qp = 26;
+    pic_param.pic_fields.bits.idr_pic_flag = is_idr;
+    pic_param.pic_fields.bits.reference_pic_flag = 1;
+    render_buffer(s, VAEncPictureParameterBufferType, sizeof(pic_param), &pic_param);
+
+    memset(&slice_param, 0, sizeof(slice_param));
+    slice_param.num_macroblocks = width_in_mbs * height_in_mbs;
+    slice_param.slice_type = is_idr ? SLICE_TYPE_I : SLICE_TYPE_P;
+    slice_param.idr_pic_id = frame / intra_period;
+    slice_param.pic_order_cnt_lsb = 2 * gop_frame;
+    for (i = 0; i < 32; i++) {
+        slice_param.RefPicList0[i].picture_id = VA_INVALID_SURFACE;
+        slice_param.RefPicList0[i].flags = VA_PICTURE_H264_INVALID;
+        slice_param.RefPicList1[i].picture_id = VA_INVALID_SURFACE;
+        slice_param.RefPicList1[i].flags = VA_PICTURE_H264_INVALID;
+    }
+    if (!is_idr)
+        slice_param.RefPicList0[0] = pic_param.ReferenceFrames[0];
+    render_buffer(s, VAEncSliceParameterBufferType, sizeof(slice_param), &slice_param);
+
+    va_status = vaEndPicture(s->va_dpy, s->context_id);
+    CHECK_VASTATUS(va_status, "vaEndPicture");
+
+    va_status = vaSyncSurface(s->va_dpy, s->src_surface[slot]);
+    CHECK_VASTATUS(va_status, "vaSyncSurface");
+
+    va_status = vaMapBuffer(s->va_dpy, s->coded_buf[slot], (void **)&segment);
+    CHECK_VASTATUS(va_status, "vaMapBuffer");
+    for (; segment; segment = segment->next)
+        s->coded_bytes += segment->size;
+    vaUnmapBuffer(s->va_dpy, s->coded_buf[slot]);
+}
+
+static void *
+worker_thread(void *data)
+{
+    struct session *s;
+    double start, end, cpu_start;
+
+    /* a session is in the queue at most once, so only one thread drives it */
+    while ((s = mpmc_queue_pop_wait(&session_queue)) != NULL) {
+        cpu_start = clock_seconds(CLOCK_THREAD_CPUTIME_ID);
+        start = clock_seconds(CLOCK_MONOTONIC);
+
+        encode_frame(s);
+
+        end = clock_seconds(CLOCK_MONOTONIC);
+        s->cpu_ms += (clock_seconds(CLOCK_THREAD_CPUTIME_ID) - cpu_start) * 1000;
+        if (s->frames_done == 0)
+            s->first_start = start;
+        s->last_end = end;
+        s->latency_ms[s->frames_done++] = (end - start) * 1000;
+
+        if (s->frames_done < num_frames)
+            mpmc_queue_push(&session_queue, s);
+        else if (__atomic_sub_fetch(&sessions_running, 1, __ATOMIC_ACQ_REL) == 0)
+            mpmc_queue_close(&session_queue);
+    }
+    return NULL;
+}
+
+static int
+compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+/* Nearest-rank percentile of sorted samples */
+static double
+percentile(const double *sorted, unsigned int n, double p)
+{
+    unsigned int rank = (unsigned int)(p / 100 * n + 0.999999);
+
+    if (n == 0)
+        return 0;
+    if (rank < 1)
+        rank = 1;
+    return sorted[(rank > n ? n : rank) - 1];
+}
+
+static double
+timeval_seconds(const struct timeval *tv)
+{
+    return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+static void
+print_report(double wall, double process_cpu)
+{
+    double *all, *sorted;
+    unsigned long long total_bytes = 0;
+    unsigned int total_frames = 0, i;
+    double session_time;
+
+    all = malloc(num_sessions * num_frames * sizeof(*all));
+    sorted = malloc(num_frames * sizeof(*sorted));
+    if (!all || !sorted) {
+        fprintf(stderr, "Failed to allocate report buffers\n");
+        exit(1);
+    }
+
+    printf("\n");
+    printf("sessions %d, threads %d, displays %d%s, %dx%d, %d frames each%s\n",
+           num_sessions, num_threads, num_displays,
+           shared_display ? " (shared)" : "",
+           frame_width, frame_height, num_frames,
+           upload_frames ? "" : ", no upload");
+    printf("\n");
+    printf("session display  frames      fps  p50(ms)  p99(ms)  cpu/frame(ms)  kbytes/frame\n");
+
+    for (i = 0; i < num_sessions; i++) {
+        struct session * const s = &sessions[i];
+
+        memcpy(sorted, s->latency_ms, s->frames_done * sizeof(*sorted));
+        memcpy(all + total_frames, s->latency_ms, s->frames_done * sizeof(*all));
+        qsort(sorted, s->frames_done, sizeof(*sorted), compare_double);
+
+        session_time = s->last_end - s->first_start;
+        printf("%7d %7d %7d %8.1f %8.3f %8.3f %14.3f %13.1f\n",
+               i, s->display_index, s->frames_done,
+               session_time > 0 ? s->frames_done / session_time : 0,
+               percentile(sorted, s->frames_done, 50),
+               percentile(sorted, s->frames_done, 99),
+               s->frames_done ? s->cpu_ms / s->frames_done : 0,
+               s->frames_done ? s->coded_bytes / 1024.0 / s->frames_done : 0);
+
+        total_frames += s->frames_done;
+        total_bytes += s->coded_bytes;
+    }
+
+    qsort(all, total_frames, sizeof(*all), compare_double);
+    printf("    all       - %7d %8.1f %8.3f %8.3f %14.3f %13.1f\n",
+           total_frames,
+           wall > 0 ? total_frames / wall : 0,
+           percentile(all, total_frames, 50),
+           percentile(all, total_frames, 99),
+           total_frames ? process_cpu * 1000 / total_frames : 0,
+           total_frames ? total_bytes / 1024.0 / total_frames : 0);
+    printf("\n");
+    printf("wall time %.3f s, process CPU time %.3f s (%.0f%% of one core)\n",
+           wall, process_cpu, wall > 0 ? process_cpu * 100 / wall : 0);
+
+    free(sorted);
+    free(all);
+}
+
+static void
+print_help(const char *name)
+{
+    printf("%s <options>\n", name);
+    printf("   -n <sessions>         concurrent encode sessions (1..%d, default 4)\n", MAX_SESSIONS);
+    printf("   -t <threads>          worker threads (1..%d, default one per session)\n", MAX_THREADS);
+    printf("   -f <frames>           frames per session (default 300)\n");
+    printf("   -w <width> -h <height>\n");
+    printf("   --intra_period <number>\n");
+    printf("   --shared-display      run all sessions on a single VADisplay\n");
+    printf("   --no-upload           don't write the source surfaces\n");
+    printf("\n");
+    printf("Without a GPU, run on the dummy driver (LIBVA_DRIVER_NAME=dummy)\n");
+    printf("or with LIBVA_FOOL_ENCODE; VA fool needs one session per display.\n");
+}
+
+static void
+process_cmdline(int argc, char *argv[])
+{
+    const struct option long_opts[] = {
+        {"help", no_argument, NULL, 0 },
+        {"intra_period", required_argument, NULL, 1 },
+        {"shared-display", no_argument, NULL, 2 },
+        {"no-upload", no_argument, NULL, 3 },
+        {NULL, no_argument, NULL, 0 }};
+    int c, long_index;
+
+    while ((c = getopt_long_only(argc, argv, "n:t:f:w:h:?", long_opts, &long_index)) != EOF) {
+        switch (c) {
+        case 'n':
+            num_sessions = atoi(optarg);
+            break;
+        case 't':
+            num_threads = atoi(optarg);
+            break;
+        case 'f':
+            num_frames = atoi(optarg);
+            break;
+        case 'w':
+            frame_width = atoi(optarg);
+            break;
+        case 'h':
+            frame_height = atoi(optarg);
+            break;
+        case 1:
+            intra_period = atoi(optarg);
+            break;
+        case 2:
+            shared_display = 1;
+            break;
+        case 3:
+            upload_frames = 0;
+            break;
+        case 0:
+        case '?':
+        default:
+            print_help(argv[0]);
+            exit(0);
+        }
+    }
+
+    if (num_threads == 0)
+        num_threads = num_sessions;
+    if (num_sessions < 1 || num_sessions > MAX_SESSIONS ||
+        num_threads > MAX_THREADS || num_frames < 1 ||
+        frame_width < 16 || frame_height < 16 || intra_period < 1) {
+        print_help(argv[0]);
+        exit(1);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    pthread_t threads[MAX_THREADS];
+    struct rusage usage_start, usage_end;
+    double wall_start, wall;
+    int major_ver, minor_ver;
+    VAStatus va_status;
+    unsigned int i;
+
+    va_init_display_args(&argc, argv);
+    process_cmdline(argc, argv);
+
+    num_displays = shared_display ? 1 : num_sessions;
+    for (i = 0; i < num_displays; i++) {
+        displays[i] = va_open_display();
+        va_status = vaInitialize(displays[i], &major_ver, &minor_ver);
+        CHECK_VASTATUS(va_status, "vaInitialize");
+    }
+
+    for (i = 0; i < num_sessions; i++) {
+        sessions[i].index = i;
+        sessions[i].display_index = shared_display ? 0 : i;
+        sessions[i].va_dpy = displays[sessions[i].display_index];
+        session_init(&sessions[i]);
+    }
+
+    mpmc_queue_init(&session_queue);
+    sessions_running = num_sessions;
+    for (i = 0; i < num_sessions; i++)
+        mpmc_queue_push(&session_queue, &sessions[i]);
+
+    getrusage(RUSAGE_SELF, &usage_start);
+    wall_start = clock_seconds(CLOCK_MONOTONIC);
+
+    for (i = 0; i < num_threads; i++) {
+        if (pthread_create(&threads[i], NULL, worker_thread, NULL) != 0) {
+            fprintf(stderr, "Failed to create worker thread\n");
+            exit(1);
+        }
+    }
+    for (i = 0; i < num_threads; i++)
+        pthread_join(threads[i], NULL);
+
+    wall = clock_seconds(CLOCK_MONOTONIC) - wall_start;
+    getrusage(RUSAGE_SELF, &usage_end);
+    mpmc_queue_destroy(&session_queue);
+
+    print_report(wall,
+                 timeval_seconds(&usage_end.ru_utime) - timeval_seconds(&usage_start.ru_utime) +
+                 timeval_seconds(&usage_end.ru_stime) - timeval_seconds(&usage_start.ru_stime));
+
+    for (i = 0; i < num_sessions; i++)
+        session_fini(&sessions[i]);
+    for (i = 0; i < num_displays; i++) {
+        vaTerminate(displays[i]);
+        va_close_display(displays[i]);
+    }
+
+    return 0;
+}
@@ -0,0 +1,450 @@
+/*
+ * Copyright (c) 2015 Intel Corporation. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+ * IN NO EVENT SHALL PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR
+ * ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "gop_planner.h"
+
+/* The lookahead works on 8x8 block averages of the luma plane */
+#define GOP_BLOCK_SIZE          8
+
+/* A scene cut also needs this many times the recent average difference */
+#define GOP_SCENECUT_RATIO      3
+
+#define GOP_MAX_REF_FRAMES      16
+
+struct gop_planner {
+    struct gop_params params;
+
+    /* planned frames of the current mini-GOP, in encoding order */
+    struct gop_frame *queue;
+    unsigned int head, queued;
+
+    unsigned long long next_display;    /* first frame not planned yet */
+    unsigned long long encoding_order;
+    unsigned long long last_idr, last_intra;
+
+    /* lookahead */
+    int analyse;
+    unsigned int window;
+    unsigned long long analysed;        /* first frame not analysed yet */
+    unsigned int blocks_x, blocks_y;
+    unsigned char *thumb, *prev_thumb;  /* 8x8 block averages */
+    int have_prev_thumb;
+    unsigned int mean_diff;             /* recent average, 8 bits of fraction */
+    unsigned char *cuts;                /* per frame of the window */
+};
+
+/* Reference B frames in a run of n B frames */
+static unsigned int
+pyramid_refs(unsigned int n)
+{
+    if (n < 2)
+        return 0;
+    return 1 + pyramid_refs((n - 1) / 2) + pyramid_refs(n - 1 - (n - 1) / 2);
+}
+
+unsigned int
+gop_planner_num_ref_frames(const struct gop_params *params)
+{
+    unsigned int refs;
+
+    if (params->ip_period <= 1)
+        return 1;
+    if (!params->b_pyramid)
+        return 2;
+
+    /*
+     * With sliding-window marking, the past anchor must survive the
+     * reference B frames of the previous mini-GOP and of the current one.
+     */
+    refs = 2 * pyramid_refs(params->ip_period - 1) + 2;
+    return refs > GOP_MAX_REF_FRAMES ? GOP_MAX_REF_FRAMES : refs;
+}
+
+/* Sums of the 8x8 blocks of one row of blocks, divided by 64 */
+static void
+thumb_row(const unsigned char *src, unsigned int pitch, unsigned int blocks_x,
+          unsigned char *dst)
+{
+    unsigned int x = 0, y;
+
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+
+    /* psadbw against zero sums each half of a 16-byte row */
+    for (; x + 2 <= blocks_x; x += 2) {
+        __m128i sum = zero;
+
+        for (y = 0; y < GOP_BLOCK_SIZE; y++) {
+            __m128i row = _mm_loadu_si128((const __m128i *)(src + y * pitch + x * GOP_BLOCK_SIZE));
+            sum = _mm_add_epi64(sum, _mm_sad_epu8(row, zero));
+        }
+        dst[x] = (unsigned char)((_mm_cvtsi128_si32(sum) + 32) >> 6);
+        dst[x + 1] = (unsigned char)((_mm_cvtsi128_si32(_mm_srli_si128(sum, 8)) + 32) >> 6);
+    }
+#endif
+    for (; x < blocks_x; x++) {
+        unsigned int sum = 0, i;
+
+        for (y = 0; y < GOP_BLOCK_SIZE; y++) {
+            const unsigned char *p = src + y * pitch + x * GOP_BLOCK_SIZE;
+
+            for (i = 0; i < GOP_BLOCK_SIZE; i++)
+                sum += p[i];
+        }
+        dst[x] = (unsigned char)((sum + 32) >> 6);
+    }
+}
+
+static unsigned int
+thumb_sad(const unsigned char *a, const unsigned char *b, unsigned int size)
+{
+    unsigned int sad = 0, i = 0;
+
+#ifdef __SSE2__
+    __m128i sum = _mm_setzero_si128();
+
+    for (; i + 16 <= size; i += 16)
+        sum = _mm_add_epi64(sum, _mm_sad_epu8(_mm_loadu_si128((const __m128i *)(a + i)),
+                                              _mm_loadu_si128((const __m128i *)(b + i))));
+    sad = _mm_cvtsi128_si32(sum) + _mm_cvtsi128_si32(_mm_srli_si128(sum, 8));
+#endif
+    for (; i < size; i++)
+        sad += a[i] > b[i] ? a[i] - b[i] : b[i] - a[i];
+
+    return sad;
+}
+
+/* Flags frame n as a scene cut when it differs too much from frame n - 1 */
+static void
+analyse_frame(struct gop_planner *gp, unsigned long long n)
+{
+    const unsigned int size = gp->blocks_x * gp->blocks_y;
+    const unsigned char *luma;
+    unsigned char *tmp;
+    unsigned int pitch = 0, diff, y;
+    int cut = 0;
+
+    luma = gp->params.get_luma(gp->params.data, n, &pitch);
+    if (luma == NULL) {
+        gp->have_prev_thumb = 0;
+        gp->cuts[n % gp->window] = 0;
+        return;
+    }
+
+    for (y = 0; y < gp->blocks_y; y++)
+        thumb_row(luma + y * GOP_BLOCK_SIZE * pitch, pitch, gp->blocks_x,
+                  gp->thumb + y * gp->blocks_x);
+
+    if (gp->have_prev_thumb) {
+        /* mean absolute difference per block, 8 bits of fraction */
+        diff = (unsigned int)(((uint64_t)thumb_sad(gp->thumb, gp->prev_thumb, size) << 8) / size);
+
+        /* the ratio keeps steady motion such as pans from triggering cuts */
+        cut = diff >= (gp->params.scenecut << 8) &&
+              diff >= GOP_SCENECUT_RATIO * gp->mean_diff;
+        if (!cut)
+            gp->mean_diff = gp->mean_diff ? (7 * gp->mean_diff + diff) / 8 : diff;
+    }
+    gp->cuts[n % gp->window] = cut;
+
+    tmp = gp->prev_thumb;
+    gp->prev_thumb = gp->thumb;
+    gp->thumb = tmp;
+    gp->have_prev_thumb = 1;
+}
+
+static void
+analyse_until(struct gop_planner *gp, unsigned long long end)
+{
+    if (end > gp->params.num_frames)
+        end = gp->params.num_frames;
+    for (; gp->analysed < end; gp->analysed++)
+        analyse_frame(gp, gp->analysed);
+}
+
+static int
+idr_due(struct gop_planner *gp, unsigned long long n, int *scenecut)
+{
+    const struct gop_params * const params = &gp->params;
+
+    *scenecut = 0;
+    if (n == 0)
+        return 1;
+    if (params->intra_idr_period && n - gp->last_idr >= params->intra_idr_period)
+        return 1;
+    if (gp->analyse && n > gp->last_idr && gp->cuts[n % gp->window]) {
+        *scenecut = 1;
+        return 1;
+    }
+    return 0;
+}
+
+static void
+queue_frame(struct gop_planner *gp, unsigned long long display_order, int type,
+            int is_reference, unsigned int pyramid_level, int scenecut)
+{
+    struct gop_frame * const frame = &gp->queue[(gp->head + gp->queued) % gp->params.ip_period];
+
+    frame->display_order = display_order;
+    frame->encoding_order = gp->encoding_order++;
+    frame->type = type;
+    frame->is_reference = is_reference;
+    frame->pyramid_level = pyramid_level;
+    frame->scenecut = scenecut;
+    gp->queued++;
+}
+
+/* B frames strictly between the references at display orders lo and hi */
+static void
+queue_b_frames(struct gop_planner *gp, unsigned long long lo, unsigned long long hi,
+               unsigned int level)
+{
+    unsigned long long n, mid;
+
+    if (hi - lo < 2)
+        return;
+
+    if (!gp->params.b_pyramid || hi - lo < 3) {
+        for (n = lo + 1; n < hi; n++)
+            queue_frame(gp, n, GOP_FRAME_B, 0, level, 0);
+        return;
+    }
+
+    mid = lo + (hi - lo) / 2;
+    queue_frame(gp, mid, GOP_FRAME_B, 1, level, 0);
+    queue_b_frames(gp, lo, mid, level + 1);
+    queue_b_frames(gp, mid, hi, level + 1);
+}
+
+/* Plans the next mini-GOP: an IDR alone, or B frames up to an I/P anchor */
+static int
+plan_mini_gop(struct gop_planner *gp)
+{
+    const struct gop_params * const params = &gp->params;
+    unsigned long long start = gp->next_display, end, n;
+    int type = GOP_FRAME_P, scenecut;
+
+    if (start >= params->num_frames)
+        return 0;
+
+    if (gp->analyse)
+        analyse_until(gp, start + gp->window);
+
+    if (idr_due(gp, start, &scenecut)) {
+        queue_frame(gp, start, GOP_FRAME_IDR, 1, 0, scenecut);
+        gp->last_idr = gp->last_intra = start;
+        gp->next_display = start + 1;
+        return 1;
+    }
+
+    end = start + params->ip_period - 1;
+    if (end >= params->num_frames)
+        end = params->num_frames - 1;
+
+    /* an IDR can't have B frames before it, end the mini-GOP early */
+    for (n = start + 1; n <= end; n++) {
+        if (idr_due(gp, n, &scenecut)) {
+            end = n - 1;
+            break;
+        }
+    }
+
+    /* an I frame becomes the anchor */
+    if (params->intra_period) {
+        for (n = start; n <= end; n++) {
+            if (n - gp->last_intra >= params->intra_period) {
+                end = n;
+                type = GOP_FRAME_I;
+                gp->last_intra = n;
+                break;
+            }
+        }
+    }
+
+    queue_frame(gp, end, type, 1, 0, 0);
+    queue_b_frames(gp, start - 1, end, 1);
+    gp->next_display = end + 1;
+
+    return 1;
+}
+
+struct gop_planner *
+gop_planner_create(const struct gop_params *params)
+{
+    struct gop_planner *gp;
+
+    if (params->ip_period < 1 || params->num_frames == 0)
+        return NULL;
+
+    gp = calloc(1, sizeof(*gp));
+    if (gp == NULL)
+        return NULL;
+
+    gp->params = *params;
+    gp->queue = calloc(params->ip_period, sizeof(*gp->queue));
+    if (gp->queue == NULL)
+        goto error;
+
+    gp->analyse = params->lookahead && params->scenecut && params->get_luma &&
+                  params->width >= GOP_BLOCK_SIZE && params->height >= GOP_BLOCK_SIZE;
+    if (gp->analyse) {
+        /* every frame of a mini-GOP is analysed before it is planned */
+        gp->window = params->lookahead < params->ip_period ?
+                     params->ip_period : params->lookahead;
+        gp->blocks_x = params->width / GOP_BLOCK_SIZE;
+        gp->blocks_y = params->height / GOP_BLOCK_SIZE;
+        gp->thumb = malloc(gp->blocks_x * gp->blocks_y);
+        gp->prev_thumb = malloc(gp->blocks_x * gp->blocks_y);
+        gp->cuts = calloc(gp->window, 1);
+        if (!gp->thumb || !gp->prev_thumb || !gp->cuts)
+            goto error;
+    }
+    return gp;
+
+error:
+    gop_planner_destroy(gp);
+    return NULL;
+}
+
+int
+gop_planner_peek(struct gop_planner *gp, struct gop_frame *frame)
+{
+    if (gp->queued == 0 && !plan_mini_gop(gp))
+        return 0;
+
+    *frame = gp->queue[gp->head];
+    return 1;
+}
+
+int
+gop_planner_next(struct gop_planner *gp, struct gop_frame *frame)
+{
+    if (!gop_planner_peek(gp, frame))
+        return 0;
+
+    gp->head = (gp->head + 1) % gp->params.ip_period;
+    gp->queued--;
+    return 1;
+}
+
+void
+gop_planner_destroy(struct gop_planner *gp)
+{
+    if (gp == NULL)
+        return;
+
+    free(gp->cuts);
+    free(gp->prev_thumb);
+    free(gp->thumb);
+    free(gp->queue);
+    free(gp);
+}
+
+struct ref_key {
+    int64_t key;
+    unsigned int index;
+};
+
+static int
+compare_ref_keys(const void *a, const void *b)
+{
+    const struct ref_key *x = a, *y = b;
+
+    return (x->key > y->key) - (x->key < y->key);
+}
+
+static void
+sort_refs(const VAPictureH264 *refs, struct ref_key *keys, unsigned int num_refs,
+          VAPictureH264 *list)
+{
+    unsigned int i;
+
+    qsort(keys, num_refs, sizeof(*keys), compare_ref_keys);
+    for (i = 0; i < num_refs; i++)
+        list[i] = refs[keys[i].index];
+}
+
+void
+gop_ref_list_p(const VAPictureH264 *refs, unsigned int num_refs,
+               unsigned int frame_num, unsigned int max_frame_num,
+               VAPictureH264 *list0)
+{
+    struct ref_key keys[GOP_MAX_REF_FRAMES];
+    unsigned int i;
+    int64_t frame_num_wrap;
+
+    if (num_refs > GOP_MAX_REF_FRAMES)
+        num_refs = GOP_MAX_REF_FRAMES;
+
+    for (i = 0; i < num_refs; i++) {
+        frame_num_wrap = refs[i].frame_idx;
+        if (refs[i].frame_idx > frame_num)
+            frame_num_wrap -= max_frame_num;
+        keys[i].key = -frame_num_wrap;
+        keys[i].index = i;
+    }
+    sort_refs(refs, keys, num_refs, list0);
+}
+
+void
+gop_ref_lists_b(const VAPictureH264 *refs, unsigned int num_refs, int poc,
+                VAPictureH264 *list0, VAPictureH264 *list1)
+{
+    struct ref_key keys0[GOP_MAX_REF_FRAMES], keys1[GOP_MAX_REF_FRAMES];
+    const int64_t after = (int64_t)1 << 32;
+    VAPictureH264 tmp;
+    unsigned int i;
+    int64_t distance;
+
+    if (num_refs > GOP_MAX_REF_FRAMES)
+        num_refs = GOP_MAX_REF_FRAMES;
+
+    for (i = 0; i < num_refs; i++) {
+        distance = (int64_t)refs[i].TopFieldOrderCnt - poc;
+        keys0[i].key = distance < 0 ? -distance : after + distance;
+        keys1[i].key = distance > 0 ? distance : after - distance;
+        keys0[i].index = keys1[i].index = i;
+    }
+    sort_refs(refs, keys0, num_refs, list0);
+    sort_refs(refs, keys1, num_refs, list1);
+
+    /* 8.2.4.2.3: list1 must differ from list0 when it has several entries */
+    if (num_refs > 1) {
+        for (i = 0; i < num_refs; i++) {
+            if (list0[i].picture_id != list1[i].picture_id)
+                break;
+        }
+        if (i == num_refs) {
+            tmp = list1[0];
+            list1[0] = list1[1];
+            list1[1] = tmp;
+        }
+    }
+}
@@ -0,0 +1,134 @@
+/*
+ * Copyright (c) 2015 Intel Corporation. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+ * IN NO EVENT SHALL PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR
+ * ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Frame-level GOP planning for the H.264 encode tools: frame types and
+ * encoding order, hierarchical-B pyramids, scene-cut IDR insertion from a
+ * lookahead pass, and default reference list initialization.
+ *
+ * All periods are display-order distances:
+ *
+ *  intra_period intra_idr_period ip_period  sequence (display order)
+ *  0            0                1          IDR P P P P P P ...
+ *  0            0                3          IDR B B P B B P ...
+ *  1            0                any        IDR I I I I I ...
+ *  1            3                any        IDR I I IDR I I ...
+ *  6            0                3          IDR B B P B B I B B P B B I ...
+ *  6            12               3          IDR B B P B B I B B P B P IDR ...
+ *
+ * A mini-GOP is the run of B frames up to the next I/P anchor; it is
+ * shortened when an IDR (periodic or scene cut) would fall inside it, so
+ * that GOPs stay closed. With b_pyramid, the middle B frame of each run of
+ * two or more is encoded right after the anchor as a reference, recursively.
+ *
+ * References are expected to be marked with the sliding window, with at
+ * least gop_planner_num_ref_frames() frames.
+ */
+
+#ifndef GOP_PLANNER_H
+#define GOP_PLANNER_H
+
+#include <va/va.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Same values as the H.264 slice_type, plus IDR */
+#define GOP_FRAME_P             0
+#define GOP_FRAME_B             1
+#define GOP_FRAME_I             2
+#define GOP_FRAME_IDR           7
+
+struct gop_planner;
+
+/** \brief Returns the luma plane of a source frame, or NULL if unavailable */
+typedef const unsigned char *(*gop_luma_func)(void *data, unsigned long long display_order,
+                                              unsigned int *pitch);
+
+struct gop_params {
+    unsigned int intra_period;          /* 0: only the first frame is intra */
+    unsigned int intra_idr_period;      /* 0: only the first frame is IDR */
+    unsigned int ip_period;             /* distance between anchors, 1: no B frames */
+    int b_pyramid;
+    unsigned long long num_frames;
+
+    /* scene-cut detection, off if lookahead, scenecut or get_luma is 0 */
+    unsigned int lookahead;             /* frames analysed ahead, at least ip_period */
+    unsigned int scenecut;              /* mean 8x8 luma difference threshold */
+    unsigned int width, height;
+    gop_luma_func get_luma;
+    void *data;
+};
+
+struct gop_frame {
+    unsigned long long display_order;
+    unsigned long long encoding_order;
+    int type;                           /* GOP_FRAME_* */
+    int is_reference;                   /* nal_ref_idc != 0 */
+    unsigned int pyramid_level;         /* 0 for I/P, 1.. for B frames */
+    int scenecut;                       /* IDR inserted on a scene change */
+};
+
+/** Returns NULL on invalid parameters or allocation failure */
+struct gop_planner *
+gop_planner_create(const struct gop_params *params);
+
+/** Next frame in encoding order. Returns 0 after the last frame */
+int
+gop_planner_next(struct gop_planner *gp, struct gop_frame *frame);
+
+/** Same as gop_planner_next() but leaves the frame queued */
+int
+gop_planner_peek(struct gop_planner *gp, struct gop_frame *frame);
+
+void
+gop_planner_destroy(struct gop_planner *gp);
+
+/** Reference frames needed for the GOP structure with sliding-window marking */
+unsigned int
+gop_planner_num_ref_frames(const struct gop_params *params);
+
+/**
+ * Default P list: short-term references by descending FrameNumWrap, relative
+ * to the current frame_num. list0 gets num_refs entries.
+ */
+void
+gop_ref_list_p(const VAPictureH264 *refs, unsigned int num_refs,
+               unsigned int frame_num, unsigned int max_frame_num,
+               VAPictureH264 *list0);
+
+/**
+ * Default B lists: past references by descending POC then future ones by
+ * ascending POC for list0, the other way round for list1.
+ */
+void
+gop_ref_lists_b(const VAPictureH264 *refs, unsigned int num_refs, int poc,
+                VAPictureH264 *list0, VAPictureH264 *list1);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* GOP_PLANNER_H */
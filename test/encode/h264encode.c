@@ -39,6 +39,13 @@
 #include <va/va.h>
 #include <va/va_enc_h264.h>
 #include "va_display.h"
+#include "quality_metrics.h"
+#include "yuv_io.h"
+#include "mpmc_queue.h"
+#include "gop_planner.h"
+#include "bitstream.h"
+#include "coded_sink.h"
+#include "hrd_sim.h"
 
 #define CHECK_VASTATUS(va_status,func)                                  \
     if (va_status != VA_STATUS_SUCCESS) {                               \
@@ -74,10 +81,9 @@
 #define PROFILE_IDC_MAIN        77
 #define PROFILE_IDC_HIGH        100
    
-#define BITSTREAM_ALLOCATE_STEPPING     4096
-
 #define SURFACE_NUM 16 /* 16 surfaces for source YUV */
 #define SURFACE_NUM 16 /* 16 surfaces for reference */
+#define MAX_SLICES 256
 static  VADisplay va_dpy;
 static  VAProfile h264_profile = ~0;
 static  VAConfigAttrib attrib[VAConfigAttribTypeMax];
@@ -110,7 +116,13 @@ static  char *coded_fn = NULL, *srcyuv_fn = NULL, *recyuv_fn = NULL;
 static  FILE *coded_fp = NULL, *srcyuv_fp = NULL, *recyuv_fp = NULL;
 static  unsigned long long srcyuv_frames = 0;
 static  int srcyuv_fourcc = VA_FOURCC_NV12;
+static  struct yuv_source *srcyuv_source = NULL;
+static  struct yuv_writer *recyuv_writer = NULL;
+#define RECYUV_WRITE_BUFFERS 4
 static  int calc_psnr = 0;
+static  char *quality_csv_fn = NULL;
+static  struct quality_metrics *quality = NULL;
+static  struct quality_summary quality_summary;
 
 static  int frame_width = 176;
 static  int frame_height = 144;
@@ -118,7 +130,6 @@ static  int frame_width_mbaligned;
 static  int frame_height_mbaligned;
 static  int frame_rate = 30;
 static  unsigned int frame_count = 60;
-static  unsigned int frame_coded = 0;
 static  unsigned int frame_bitrate = 0;
 static  unsigned int frame_slices = 1;
 static  double frame_size = 0;
@@ -141,28 +152,51 @@ static  unsigned long long current_frame_display = 0;
 static  unsigned long long current_IDR_display = 0;
 static  unsigned int current_frame_num = 0;
 static  int current_frame_type;
+static  int current_frame_is_ref;
 #define current_slot (current_frame_display % SURFACE_NUM)
 
+static  struct gop_planner *gop_planner = NULL;
+static  int b_pyramid = 0;
+static  unsigned int lookahead = 0;
+static  unsigned int scenecut_threshold = 20;
+static  unsigned int scenecut_frames = 0;
+
+static  int hrd_enable = 0;
+static  int hrd_qp = 0;
+static  unsigned int hrd_cpb_size = 0;
+static  unsigned int hrd_window = 0;
+static  char *hrd_csv_fn = NULL;
+static  struct coded_sink *coded_sink = NULL;
+static  unsigned int coded_sink_buffer = 0;
+static  struct hrd_sim *hrd = NULL;
+static  struct hrd_summary hrd_summary;
+
 static  int misc_priv_type = 0;
 static  int misc_priv_value = 0;
 
 #define MIN(a, b) ((a)>(b)?(b):(a))
 #define MAX(a, b) ((a)>(b)?(a):(b))
 
-/* thread to save coded data/upload source YUV */
+/* threads to save coded data/upload source YUV */
 struct storage_task_t {
-    void *next;
     unsigned long long display_order;
     unsigned long long encode_order;
 };
-static  struct storage_task_t *storage_task_header = NULL, *storage_task_tail = NULL;
+/* at most one task per source surface is in flight */
+static  struct storage_task_t storage_tasks[SURFACE_NUM];
+static  struct mpmc_queue storage_queue;
 #define SRC_SURFACE_IN_ENCODING 0
 #define SRC_SURFACE_IN_STORAGE  1
 static  int srcsurface_status[SURFACE_NUM];
 static  int encode_syncmode = 0;
+#define MAX_STORAGE_WORKERS 16
+static  int storage_workers = 1;
+static  pthread_t storage_threads[MAX_STORAGE_WORKERS];
 static  pthread_mutex_t encode_mutex = PTHREAD_MUTEX_INITIALIZER;
-static  pthread_cond_t  encode_cond = PTHREAD_COND_INITIALIZER;
-static  pthread_t encode_thread;
+static  pthread_cond_t  srcsurface_cond = PTHREAD_COND_INITIALIZER;
+/* coded data is written in encoding order, whichever worker syncs first */
+static  unsigned long long coded_next_order = 0;
+static  pthread_cond_t  coded_cond = PTHREAD_COND_INITIALIZER;
     
 /* for performance profiling */
 static unsigned int UploadPictureTicks=0;
@@ -173,127 +207,12 @@ static unsigned int SyncPictureTicks=0;
 static unsigned int SavePictureTicks=0;
 static unsigned int TotalTicks=0;
 
-struct __bitstream {
-    unsigned int *buffer;
-    int bit_offset;
-    int max_size_in_dword;
-};
-typedef struct __bitstream bitstream;
-
-
-static unsigned int 
-va_swap32(unsigned int val)
-{
-    unsigned char *pval = (unsigned char *)&val;
-
-    return ((pval[0] << 24)     |
-            (pval[1] << 16)     |
-            (pval[2] << 8)      |
-            (pval[3] << 0));
-}
-
-static void
-bitstream_start(bitstream *bs)
-{
-    bs->max_size_in_dword = BITSTREAM_ALLOCATE_STEPPING;
-    bs->buffer = calloc(bs->max_size_in_dword * sizeof(int), 1);
-    bs->bit_offset = 0;
-}
-
-static void
-bitstream_end(bitstream *bs)
-{
-    int pos = (bs->bit_offset >> 5);
-    int bit_offset = (bs->bit_offset & 0x1f);
-    int bit_left = 32 - bit_offset;
+/* storage workers update the per-stage ticks concurrently */
+#define ADD_TICKS(ticks, start) \
+    __atomic_add_fetch(&(ticks), GetTickCount() - (start), __ATOMIC_RELAXED)
 
-    if (bit_offset) {
-        bs->buffer[pos] = va_swap32((bs->buffer[pos] << bit_left));
-    }
-}
- 
-static void
-bitstream_put_ui(bitstream *bs, unsigned int val, int size_in_bits)
-{
-    int pos = (bs->bit_offset >> 5);
-    int bit_offset = (bs->bit_offset & 0x1f);
-    int bit_left = 32 - bit_offset;
-
-    if (!size_in_bits)
-        return;
-
-    bs->bit_offset += size_in_bits;
-
-    if (bit_left > size_in_bits) {
-        bs->buffer[pos] = (bs->buffer[pos] << size_in_bits | val);
-    } else {
-        size_in_bits -= bit_left;
-        bs->buffer[pos] = (bs->buffer[pos] << bit_left) | (val >> size_in_bits);
-        bs->buffer[pos] = va_swap32(bs->buffer[pos]);
-
-        if (pos + 1 == bs->max_size_in_dword) {
-            bs->max_size_in_dword += BITSTREAM_ALLOCATE_STEPPING;
-            bs->buffer = realloc(bs->buffer, bs->max_size_in_dword * sizeof(unsigned int));
-        }
-
-        bs->buffer[pos + 1] = val;
-    }
-}
-
-static void
-bitstream_put_ue(bitstream *bs, unsigned int val)
-{
-    int size_in_bits = 0;
-    int tmp_val = ++val;
-
-    while (tmp_val) {
-        tmp_val >>= 1;
-        size_in_bits++;
-    }
-
-    bitstream_put_ui(bs, 0, size_in_bits - 1); // leading zero
-    bitstream_put_ui(bs, val, size_in_bits);
-}
-
-static void
-bitstream_put_se(bitstream *bs, int val)
-{
-    unsigned int new_val;
-
-    if (val <= 0)
-        new_val = -2 * val;
-    else
-        new_val = 2 * val - 1;
-
-    bitstream_put_ue(bs, new_val);
-}
-
-static void
-bitstream_byte_aligning(bitstream *bs, int bit)
-{
-    int bit_offset = (bs->bit_offset & 0x7);
-    int bit_left = 8 - bit_offset;
-    int new_val;
-
-    if (!bit_offset)
-        return;
-
-    assert(bit == 0 || bit == 1);
-
-    if (bit)
-        new_val = (1 << bit_left) - 1;
-    else
-        new_val = 0;
-
-    bitstream_put_ui(bs, new_val, bit_left);
-}
-
-static void 
-rbsp_trailing_bits(bitstream *bs)
-{
-    bitstream_put_ui(bs, 1, 1);
-    bitstream_byte_aligning(bs, 0);
-}
+/* packed headers of the frame being rendered */
+static struct bitstream_arena header_arena;
 
 static void nal_start_code_prefix(bitstream *bs)
 {
@@ -438,13 +357,13 @@ static void pps_rbsp(bitstream *bs)
     rbsp_trailing_bits(bs);
 }
 
-static void slice_header(bitstream *bs)
+static void slice_header(bitstream *bs, const VAEncSliceParameterBufferH264 *slice)
 {
-    int first_mb_in_slice = slice_param.macroblock_address;
+    int first_mb_in_slice = slice->macroblock_address;
 
     bitstream_put_ue(bs, first_mb_in_slice);        /* first_mb_in_slice: 0 */
-    bitstream_put_ue(bs, slice_param.slice_type);   /* slice_type */
-    bitstream_put_ue(bs, slice_param.pic_parameter_set_id);        /* pic_parameter_set_id: 0 */
+    bitstream_put_ue(bs, slice->slice_type);   /* slice_type */
+    bitstream_put_ue(bs, slice->pic_parameter_set_id);        /* pic_parameter_set_id: 0 */
     bitstream_put_ui(bs, pic_param.frame_num, seq_param.seq_fields.bits.log2_max_frame_num_minus4 + 4); /* frame_num */
 
     /* frame_mbs_only_flag == 1 */
@@ -454,7 +373,7 @@ static void slice_header(bitstream *bs)
     }
 
     if (pic_param.pic_fields.bits.idr_pic_flag)
-        bitstream_put_ue(bs, slice_param.idr_pic_id);		/* idr_pic_id: 0 */
+        bitstream_put_ue(bs, slice->idr_pic_id);		/* idr_pic_id: 0 */
 
     if (seq_param.seq_fields.bits.pic_order_cnt_type == 0) {
         bitstream_put_ui(bs, pic_param.CurrPic.TopFieldOrderCnt, seq_param.seq_fields.bits.log2_max_pic_order_cnt_lsb_minus4 + 4);
@@ -466,22 +385,22 @@ static void slice_header(bitstream *bs)
 
     /* redundant_pic_cnt_present_flag == 0 */
     /* slice type */
-    if (IS_P_SLICE(slice_param.slice_type)) {
-        bitstream_put_ui(bs, slice_param.num_ref_idx_active_override_flag, 1);            /* num_ref_idx_active_override_flag: */
+    if (IS_P_SLICE(slice->slice_type)) {
+        bitstream_put_ui(bs, slice->num_ref_idx_active_override_flag, 1);            /* num_ref_idx_active_override_flag: */
 
-        if (slice_param.num_ref_idx_active_override_flag)
-            bitstream_put_ue(bs, slice_param.num_ref_idx_l0_active_minus1);
+        if (slice->num_ref_idx_active_override_flag)
+            bitstream_put_ue(bs, slice->num_ref_idx_l0_active_minus1);
 
         /* ref_pic_list_reordering */
         bitstream_put_ui(bs, 0, 1);            /* ref_pic_list_reordering_flag_l0: 0 */
-    } else if (IS_B_SLICE(slice_param.slice_type)) {
-        bitstream_put_ui(bs, slice_param.direct_spatial_mv_pred_flag, 1);            /* direct_spatial_mv_pred: 1 */
+    } else if (IS_B_SLICE(slice->slice_type)) {
+        bitstream_put_ui(bs, slice->direct_spatial_mv_pred_flag, 1);            /* direct_spatial_mv_pred: 1 */
 
-        bitstream_put_ui(bs, slice_param.num_ref_idx_active_override_flag, 1);       /* num_ref_idx_active_override_flag: */
+        bitstream_put_ui(bs, slice->num_ref_idx_active_override_flag, 1);       /* num_ref_idx_active_override_flag: */
 
-        if (slice_param.num_ref_idx_active_override_flag) {
-            bitstream_put_ue(bs, slice_param.num_ref_idx_l0_active_minus1);
-            bitstream_put_ue(bs, slice_param.num_ref_idx_l1_active_minus1);
+        if (slice->num_ref_idx_active_override_flag) {
+            bitstream_put_ue(bs, slice->num_ref_idx_l0_active_minus1);
+            bitstream_put_ue(bs, slice->num_ref_idx_l1_active_minus1);
         }
 
         /* ref_pic_list_reordering */
@@ -490,9 +409,9 @@ static void slice_header(bitstream *bs)
     }
 
     if ((pic_param.pic_fields.bits.weighted_pred_flag &&
-         IS_P_SLICE(slice_param.slice_type)) ||
+         IS_P_SLICE(slice->slice_type)) ||
         ((pic_param.pic_fields.bits.weighted_bipred_idc == 1) &&
-         IS_B_SLICE(slice_param.slice_type))) {
+         IS_B_SLICE(slice->slice_type))) {
         /* FIXME: fill weight/offset table */
         assert(0);
     }
@@ -512,19 +431,19 @@ static void slice_header(bitstream *bs)
     }
 
     if (pic_param.pic_fields.bits.entropy_coding_mode_flag &&
-        !IS_I_SLICE(slice_param.slice_type))
-        bitstream_put_ue(bs, slice_param.cabac_init_idc);               /* cabac_init_idc: 0 */
+        !IS_I_SLICE(slice->slice_type))
+        bitstream_put_ue(bs, slice->cabac_init_idc);               /* cabac_init_idc: 0 */
 
-    bitstream_put_se(bs, slice_param.slice_qp_delta);                   /* slice_qp_delta: 0 */
+    bitstream_put_se(bs, slice->slice_qp_delta);                   /* slice_qp_delta: 0 */
 
     /* ignore for SP/SI */
 
     if (pic_param.pic_fields.bits.deblocking_filter_control_present_flag) {
-        bitstream_put_ue(bs, slice_param.disable_deblocking_filter_idc);           /* disable_deblocking_filter_idc: 0 */
+        bitstream_put_ue(bs, slice->disable_deblocking_filter_idc);           /* disable_deblocking_filter_idc: 0 */
 
-        if (slice_param.disable_deblocking_filter_idc != 1) {
-            bitstream_put_se(bs, slice_param.slice_alpha_c0_offset_div2);          /* slice_alpha_c0_offset_div2: 2 */
-            bitstream_put_se(bs, slice_param.slice_beta_offset_div2);              /* slice_beta_offset_div2: 2 */
+        if (slice->disable_deblocking_filter_idc != 1) {
+            bitstream_put_se(bs, slice->slice_alpha_c0_offset_div2);          /* slice_alpha_c0_offset_div2: 2 */
+            bitstream_put_se(bs, slice->slice_beta_offset_div2);              /* slice_beta_offset_div2: 2 */
         }
     }
 
@@ -538,7 +457,7 @@ build_packed_pic_buffer(unsigned char **header_buffer)
 {
     bitstream bs;
 
-    bitstream_start(&bs);
+    bitstream_start_arena(&bs, &header_arena);
     nal_start_code_prefix(&bs);
     nal_header(&bs, NAL_REF_IDC_HIGH, NAL_PPS);
     pps_rbsp(&bs);
@@ -553,7 +472,7 @@ build_packed_seq_buffer(unsigned char **header_buffer)
 {
     bitstream bs;
 
-    bitstream_start(&bs);
+    bitstream_start_arena(&bs, &header_arena);
     nal_start_code_prefix(&bs);
     nal_header(&bs, NAL_REF_IDC_HIGH, NAL_SPS);
     sps_rbsp(&bs);
@@ -573,13 +492,12 @@ build_packed_sei_buffer_timing(unsigned int init_cpb_removal_length,
 				unsigned int dpb_output_delay,
 				unsigned char **sei_buffer)
 {
-    unsigned char *byte_buf;
-    int bp_byte_size, i, pic_byte_size;
+    int bp_byte_size, pic_byte_size;
 
     bitstream nal_bs;
     bitstream sei_bp_bs, sei_pic_bs;
 
-    bitstream_start(&sei_bp_bs);
+    bitstream_start_arena(&sei_bp_bs, &header_arena);
     bitstream_put_ue(&sei_bp_bs, 0);       /*seq_parameter_set_id*/
     bitstream_put_ui(&sei_bp_bs, init_cpb_removal_delay, cpb_removal_length); 
     bitstream_put_ui(&sei_bp_bs, init_cpb_removal_delay_offset, cpb_removal_length); 
@@ -589,7 +507,7 @@ build_packed_sei_buffer_timing(unsigned int init_cpb_removal_length,
     bitstream_end(&sei_bp_bs);
     bp_byte_size = (sei_bp_bs.bit_offset + 7) / 8;
     
-    bitstream_start(&sei_pic_bs);
+    bitstream_start_arena(&sei_pic_bs, &header_arena);
     bitstream_put_ui(&sei_pic_bs, cpb_removal_delay, cpb_removal_length); 
     bitstream_put_ui(&sei_pic_bs, dpb_output_delay, dpb_output_length); 
     if ( sei_pic_bs.bit_offset & 0x7) {
@@ -598,7 +516,7 @@ build_packed_sei_buffer_timing(unsigned int init_cpb_removal_length,
     bitstream_end(&sei_pic_bs);
     pic_byte_size = (sei_pic_bs.bit_offset + 7) / 8;
     
-    bitstream_start(&nal_bs);
+    bitstream_start_arena(&nal_bs, &header_arena);
     nal_start_code_prefix(&nal_bs);
     nal_header(&nal_bs, NAL_REF_IDC_NONE, NAL_SEI);
 
@@ -606,20 +524,12 @@ build_packed_sei_buffer_timing(unsigned int init_cpb_removal_length,
     bitstream_put_ui(&nal_bs, 0, 8);
     bitstream_put_ui(&nal_bs, bp_byte_size, 8);
     
-    byte_buf = (unsigned char *)sei_bp_bs.buffer;
-    for(i = 0; i < bp_byte_size; i++) {
-        bitstream_put_ui(&nal_bs, byte_buf[i], 8);
-    }
-    free(byte_buf);
+    bitstream_put_bytes(&nal_bs, sei_bp_bs.buffer, bp_byte_size);
 	/* write the SEI timing data */
     bitstream_put_ui(&nal_bs, 0x01, 8);
     bitstream_put_ui(&nal_bs, pic_byte_size, 8);
     
-    byte_buf = (unsigned char *)sei_pic_bs.buffer;
-    for(i = 0; i < pic_byte_size; i++) {
-        bitstream_put_ui(&nal_bs, byte_buf[i], 8);
-    }
-    free(byte_buf);
+    bitstream_put_bytes(&nal_bs, sei_pic_bs.buffer, pic_byte_size);
 
     rbsp_trailing_bits(&nal_bs);
     bitstream_end(&nal_bs);
@@ -629,25 +539,26 @@ build_packed_sei_buffer_timing(unsigned int init_cpb_removal_length,
     return nal_bs.bit_offset;
 }
 
-static int build_packed_slice_buffer(unsigned char **header_buffer)
+static int build_packed_slice_buffer(const VAEncSliceParameterBufferH264 *slice,
+                                     unsigned char **header_buffer)
 {
     bitstream bs;
     int is_idr = !!pic_param.pic_fields.bits.idr_pic_flag;
     int is_ref = !!pic_param.pic_fields.bits.reference_pic_flag;
 
-    bitstream_start(&bs);
+    bitstream_start_arena(&bs, &header_arena);
     nal_start_code_prefix(&bs);
 
-    if (IS_I_SLICE(slice_param.slice_type)) {
+    if (IS_I_SLICE(slice->slice_type)) {
         nal_header(&bs, NAL_REF_IDC_HIGH, is_idr ? NAL_IDR : NAL_NON_IDR);
-    } else if (IS_P_SLICE(slice_param.slice_type)) {
+    } else if (IS_P_SLICE(slice->slice_type)) {
         nal_header(&bs, NAL_REF_IDC_MEDIUM, NAL_NON_IDR);
     } else {
-        assert(IS_B_SLICE(slice_param.slice_type));
+        assert(IS_B_SLICE(slice->slice_type));
         nal_header(&bs, is_ref ? NAL_REF_IDC_LOW : NAL_REF_IDC_NONE, NAL_NON_IDR);
     }
 
-    slice_header(&bs);
+    slice_header(&bs, slice);
     bitstream_end(&bs);
 
     *header_buffer = (unsigned char *)bs.buffer;
@@ -666,88 +577,11 @@ static unsigned int GetTickCount()
     return tv.tv_usec/1000+tv.tv_sec*1000;
 }
 
-/*
-  Assume frame sequence is: Frame#0,#1,#2,...,#M,...,#X,... (encoding order)
-  1) period between Frame #X and Frame #N = #X - #N
-  2) 0 means infinite for intra_period/intra_idr_period, and 0 is invalid for ip_period
-  3) intra_idr_period % intra_period (intra_period > 0) and intra_period % ip_period must be 0
-  4) intra_period and intra_idr_period take precedence over ip_period
-  5) if ip_period > 1, intra_period and intra_idr_period are not  the strict periods 
-     of I/IDR frames, see bellow examples
-  -------------------------------------------------------------------
-  intra_period intra_idr_period ip_period frame sequence (intra_period/intra_idr_period/ip_period)
-  0            ignored          1          IDRPPPPPPP ...     (No IDR/I any more)
-  0            ignored        >=2          IDR(PBB)(PBB)...   (No IDR/I any more)
-  1            0                ignored    IDRIIIIIII...      (No IDR any more)
-  1            1                ignored    IDR IDR IDR IDR...
-  1            >=2              ignored    IDRII IDRII IDR... (1/3/ignore)
-  >=2          0                1          IDRPPP IPPP I...   (3/0/1)
-  >=2          0              >=2          IDR(PBB)(PBB)(IBB) (6/0/3)
-                                              (PBB)(IBB)(PBB)(IBB)... 
-  >=2          >=2              1          IDRPPPPP IPPPPP IPPPPP (6/18/1)
-                                           IDRPPPPP IPPPPP IPPPPP...
-  >=2          >=2              >=2        {IDR(PBB)(PBB)(IBB)(PBB)(IBB)(PBB)} (6/18/3)
-                                           {IDR(PBB)(PBB)(IBB)(PBB)(IBB)(PBB)}...
-                                           {IDR(PBB)(PBB)(IBB)(PBB)}           (6/12/3)
-                                           {IDR(PBB)(PBB)(IBB)(PBB)}...
-                                           {IDR(PBB)(PBB)}                     (6/6/3)
-                                           {IDR(PBB)(PBB)}.
-*/
-
-/*
- * Return displaying order with specified periods and encoding order
- * displaying_order: displaying order
- * frame_type: frame type 
- */
-#define FRAME_P 0
-#define FRAME_B 1
-#define FRAME_I 2
-#define FRAME_IDR 7
-void encoding2display_order(
-    unsigned long long encoding_order,int intra_period,
-    int intra_idr_period,int ip_period,
-    unsigned long long *displaying_order,
-    int *frame_type)
-{
-    int encoding_order_gop = 0;
-
-    if (intra_period == 1) { /* all are I/IDR frames */
-        *displaying_order = encoding_order;
-        if (intra_idr_period == 0)
-            *frame_type = (encoding_order == 0)?FRAME_IDR:FRAME_I;
-        else
-            *frame_type = (encoding_order % intra_idr_period == 0)?FRAME_IDR:FRAME_I;
-        return;
-    }
-
-    if (intra_period == 0)
-        intra_idr_period = 0;
-
-    /* new sequence like
-     * IDR PPPPP IPPPPP
-     * IDR (PBB)(PBB)(IBB)(PBB)
-     */
-    encoding_order_gop = (intra_idr_period == 0)? encoding_order:
-        (encoding_order % (intra_idr_period + ((ip_period == 1)?0:1)));
-         
-    if (encoding_order_gop == 0) { /* the first frame */
-        *frame_type = FRAME_IDR;
-        *displaying_order = encoding_order;
-    } else if (((encoding_order_gop - 1) % ip_period) != 0) { /* B frames */
-	*frame_type = FRAME_B;
-        *displaying_order = encoding_order - 1;
-    } else if ((intra_period != 0) && /* have I frames */
-               (encoding_order_gop >= 2) &&
-               ((ip_period == 1 && encoding_order_gop % intra_period == 0) || /* for IDR PPPPP IPPPP */
-                /* for IDR (PBB)(PBB)(IBB) */
-                (ip_period >= 2 && ((encoding_order_gop - 1) / ip_period % (intra_period / ip_period)) == 0))) {
-	*frame_type = FRAME_I;
-	*displaying_order = encoding_order + ip_period - 1;
-    } else {
-	*frame_type = FRAME_P;
-	*displaying_order = encoding_order + ip_period - 1;
-    }
-}
+/* frame types and GOP structure, see gop_planner.h */
+#define FRAME_P GOP_FRAME_P
+#define FRAME_B GOP_FRAME_B
+#define FRAME_I GOP_FRAME_I
+#define FRAME_IDR GOP_FRAME_IDR
 
 
 static char *fourcc_to_string(int fourcc)
@@ -842,15 +676,30 @@ static int print_help(void)
     printf("   --intra_period <number>\n");
     printf("   --idr_period <number>\n");
     printf("   --ip_period <number>\n");
+    printf("   --b_pyramid: use the middle B frames of each mini-GOP as references\n");
+    printf("   --lookahead <number> frames analysed ahead for scene cuts (needs --srcyuv)\n");
+    printf("   --scenecut <number> insert an IDR when the mean 8x8 luma difference\n");
+    printf("      exceeds it (default 20, 0 disables)\n");
     printf("   --bitrate <bitrate>\n");
     printf("   --initialqp <number>\n");
     printf("   --minqp <number>\n");
     printf("   --rcmode <NONE|CBR|VBR|VCM|CQP|VBR_CONTRAINED>\n");
+    printf("   --slices <number> slices per frame, of whole MB rows (default 1, max %d)\n", MAX_SLICES);
+    printf("   --hrd: check the coded frame sizes against a leaky-bucket CPB at --bitrate\n");
+    printf("   --hrd_cpb_size <bits> CPB size (default one second at --bitrate)\n");
+    printf("   --hrd_window <number> frames per bitrate window (default one second)\n");
+    printf("   --hrd_csv <filename> save per-window bitrate and CPB fullness (implies --hrd)\n");
+    printf("   --hrd_qp: adjust the slice QP from the CPB fullness, needs --rcmode CQP (implies --hrd)\n");
     printf("   --syncmode: sequentially upload source, encoding, save result, no multi-thread\n");
+    printf("   --workers <number> threads to sync, save results and reload sources (default 1, max %d)\n",
+           MAX_STORAGE_WORKERS);
+    printf("   --write_buffer <KB> stage coded frames and write them in bigger chunks (default 0,\n");
+    printf("      write each frame from the mapped coded buffer)\n");
     printf("   --srcyuv <filename> load YUV from a file\n");
     printf("   --fourcc <NV12|IYUV|YV12> source YUV fourcc\n");
     printf("   --recyuv <filename> save reconstructed YUV into a file\n");
-    printf("   --enablePSNR calculate PSNR of recyuv vs. srcyuv\n");
+    printf("   --enablePSNR calculate per-frame PSNR/SSIM of reconstructed vs. source frames\n");
+    printf("   --quality-csv <filename> save per-frame, per-plane PSNR/SSIM (implies --enablePSNR)\n");
     printf("   --entropy <0|1>, 1 means cabac, 0 cavlc\n");
     printf("   --profile <BP|MP|HP>\n");
     return 0;
@@ -878,6 +727,18 @@ static int process_cmdline(int argc, char *argv[])
         {"framecount", required_argument, NULL, 16 },
         {"entropy", required_argument, NULL, 17 },
         {"profile", required_argument, NULL, 18 },
+        {"quality-csv", required_argument, NULL, 19 },
+        {"workers", required_argument, NULL, 20 },
+        {"b_pyramid", no_argument, NULL, 21 },
+        {"lookahead", required_argument, NULL, 22 },
+        {"scenecut", required_argument, NULL, 23 },
+        {"hrd", no_argument, NULL, 24 },
+        {"hrd_cpb_size", required_argument, NULL, 25 },
+        {"hrd_window", required_argument, NULL, 26 },
+        {"hrd_csv", required_argument, NULL, 27 },
+        {"hrd_qp", no_argument, NULL, 28 },
+        {"write_buffer", required_argument, NULL, 29 },
+        {"slices", required_argument, NULL, 30 },
         {NULL, no_argument, NULL, 0 }};
     int long_index;
     
@@ -965,6 +826,49 @@ static int process_cmdline(int argc, char *argv[])
             else
                 h264_profile = 0;
             break;
+        case 19:
+            quality_csv_fn = strdup(optarg);
+            calc_psnr = 1;
+            break;
+        case 20:
+            storage_workers = atoi(optarg);
+            if (storage_workers < 1 || storage_workers > MAX_STORAGE_WORKERS) {
+                print_help();
+                exit(1);
+            }
+            break;
+        case 21:
+            b_pyramid = 1;
+            break;
+        case 22:
+            lookahead = atoi(optarg);
+            break;
+        case 23:
+            scenecut_threshold = atoi(optarg);
+            break;
+        case 24:
+            hrd_enable = 1;
+            break;
+        case 25:
+            hrd_cpb_size = atoi(optarg);
+            break;
+        case 26:
+            hrd_window = atoi(optarg);
+            break;
+        case 27:
+            hrd_csv_fn = strdup(optarg);
+            hrd_enable = 1;
+            break;
+        case 28:
+            hrd_qp = 1;
+            hrd_enable = 1;
+            break;
+        case 29:
+            coded_sink_buffer = atoi(optarg) * 1024;
+            break;
+        case 30:
+            frame_slices = atoi(optarg);
+            break;
         case ':':
         case '?':
             print_help();
@@ -984,6 +888,20 @@ static int process_cmdline(int argc, char *argv[])
 	printf(" intra_idr_period must be a multiplier of intra_period\n");
         exit(0);        
     }
+    /* reference surfaces are reused every SURFACE_NUM frames in display order */
+    if (b_pyramid && ip_period > 5) {
+	printf(" b_pyramid supports up to 4 B frames (ip_period <= 5)\n");
+        exit(0);
+    }
+    if (frame_slices < 1 || frame_slices > MAX_SLICES) {
+	printf(" slices must be between 1 and %d\n", MAX_SLICES);
+        exit(0);
+    }
+    /* the driver rate control would fight the QP offsets */
+    if (hrd_qp && rc_mode != VA_RC_CQP) {
+	printf(" hrd_qp needs --rcmode CQP\n");
+        exit(0);
+    }
 
     if (frame_bitrate == 0)
         frame_bitrate = frame_width * frame_height * 12 * frame_rate / 50;
@@ -994,11 +912,13 @@ static int process_cmdline(int argc, char *argv[])
     
         if (srcyuv_fp == NULL)
             printf("Open source YUV file %s failed, use auto-generated YUV data\n", srcyuv_fn);
-        else {
-            struct stat tmp;
-
-            fstat(fileno(srcyuv_fp), &tmp);
-            srcyuv_frames = tmp.st_size / (frame_width * frame_height * 1.5);
+        else if ((srcyuv_source = yuv_source_open(fileno(srcyuv_fp),
+                                                  frame_width * frame_height * 3 / 2)) == NULL) {
+            printf("Map source YUV file %s failed, use auto-generated YUV data\n", srcyuv_fn);
+            fclose(srcyuv_fp);
+            srcyuv_fp = NULL;
+        } else {
+            srcyuv_frames = yuv_source_frames(srcyuv_source);
             printf("Source YUV file %s with %llu frames\n", srcyuv_fn, srcyuv_frames);
 
             if (frame_count == 0)
@@ -1012,6 +932,16 @@ static int process_cmdline(int argc, char *argv[])
     
         if (recyuv_fp == NULL)
             printf("Open reconstructed YUV file %s failed\n", recyuv_fn);
+        else {
+            recyuv_writer = yuv_writer_create(fileno(recyuv_fp),
+                                              frame_width * frame_height * 3 / 2,
+                                              RECYUV_WRITE_BUFFERS);
+            if (recyuv_writer == NULL) {
+                printf("Failed to start reconstructed YUV writer\n");
+                fclose(recyuv_fp);
+                recyuv_fp = NULL;
+            }
+        }
     }
     
     if (coded_fn == NULL) {
@@ -1030,6 +960,11 @@ static int process_cmdline(int argc, char *argv[])
         printf("Open file %s failed, exit\n", coded_fn);
         exit(1);
     }
+    coded_sink = coded_sink_create(fileno(coded_fp), coded_sink_buffer);
+    if (coded_sink == NULL) {
+        printf("Failed to allocate the coded output, exit\n");
+        exit(1);
+    }
 
     frame_width_mbaligned = (frame_width + 15) & (~15);
     frame_height_mbaligned = (frame_height + 15) & (~15);
@@ -1040,6 +975,10 @@ static int process_cmdline(int argc, char *argv[])
                frame_width_mbaligned, frame_height_mbaligned
                );
     }
+    if (frame_slices > frame_height_mbaligned / 16) {
+        frame_slices = frame_height_mbaligned / 16;
+        printf("Only %d MB rows, use %d slices\n", frame_slices, frame_slices);
+    }
     
     return 0;
 }
@@ -1234,9 +1173,16 @@ static int init_va(void)
                h264_maxref & 0xffff, (h264_maxref >> 16) & 0xffff );
     }
 
-    if (attrib[VAConfigAttribEncMaxSlices].value != VA_ATTRIB_NOT_SUPPORTED)
+    if (attrib[VAConfigAttribEncMaxSlices].value != VA_ATTRIB_NOT_SUPPORTED) {
         printf("Support %d slices\n", attrib[VAConfigAttribEncMaxSlices].value);
 
+        if (attrib[VAConfigAttribEncMaxSlices].value &&
+            frame_slices > attrib[VAConfigAttribEncMaxSlices].value) {
+            frame_slices = attrib[VAConfigAttribEncMaxSlices].value;
+            printf("Use %d slices\n", frame_slices);
+        }
+    }
+
     if (attrib[VAConfigAttribEncSliceStructure].value != VA_ATTRIB_NOT_SUPPORTED) {
         int tmp = attrib[VAConfigAttribEncSliceStructure].value;
         
@@ -1296,6 +1242,11 @@ static int setup_encode()
     CHECK_VASTATUS(va_status, "vaCreateContext");
     free(tmp_surfaceid);
 
+    if (!bitstream_arena_init(&header_arena, BITSTREAM_ARENA_SIZE)) {
+        printf("Failed to allocate the packed header arena\n");
+        exit(1);
+    }
+
     codedbuf_size = (frame_width_mbaligned * frame_height_mbaligned * 400) / (16*16);
 
     for (i = 0; i < SURFACE_NUM; i++) {
@@ -1315,73 +1266,11 @@ static int setup_encode()
 
 
 
-#define partition(ref, field, key, ascending)   \
-    while (i <= j) {                            \
-        if (ascending) {                        \
-            while (ref[i].field < key)          \
-                i++;                            \
-            while (ref[j].field > key)          \
-                j--;                            \
-        } else {                                \
-            while (ref[i].field > key)          \
-                i++;                            \
-            while (ref[j].field < key)          \
-                j--;                            \
-        }                                       \
-        if (i <= j) {                           \
-            tmp = ref[i];                       \
-            ref[i] = ref[j];                    \
-            ref[j] = tmp;                       \
-            i++;                                \
-            j--;                                \
-        }                                       \
-    }                                           \
-
-static void sort_one(VAPictureH264 ref[], int left, int right,
-                     int ascending, int frame_idx)
-{
-    int i = left, j = right;
-    unsigned int key;
-    VAPictureH264 tmp;
-
-    if (frame_idx) {
-        key = ref[(left + right) / 2].frame_idx;
-        partition(ref, frame_idx, key, ascending);
-    } else {
-        key = ref[(left + right) / 2].TopFieldOrderCnt;
-        partition(ref, TopFieldOrderCnt, (signed int)key, ascending);
-    }
-    
-    /* recursion */
-    if (left < j)
-        sort_one(ref, left, j, ascending, frame_idx);
-    
-    if (i < right)
-        sort_one(ref, i, right, ascending, frame_idx);
-}
-
-static void sort_two(VAPictureH264 ref[], int left, int right, unsigned int key, unsigned int frame_idx,
-                     int partition_ascending, int list0_ascending, int list1_ascending)
-{
-    int i = left, j = right;
-    VAPictureH264 tmp;
-
-    if (frame_idx) {
-        partition(ref, frame_idx, key, partition_ascending);
-    } else {
-        partition(ref, TopFieldOrderCnt, (signed int)key, partition_ascending);
-    }
-    
-
-    sort_one(ref, left, i-1, list0_ascending, frame_idx);
-    sort_one(ref, j+1, right, list1_ascending, frame_idx);
-}
-
 static int update_ReferenceFrames(void)
 {
     int i;
     
-    if (current_frame_type == FRAME_B)
+    if (!current_frame_is_ref)
         return 0;
 
     CurrentCurrPic.flags = VA_PICTURE_H264_SHORT_TERM_REFERENCE;
@@ -1392,8 +1281,7 @@ static int update_ReferenceFrames(void)
         ReferenceFrames[i] = ReferenceFrames[i-1];
     ReferenceFrames[0] = CurrentCurrPic;
     
-    if (current_frame_type != FRAME_B)
-        current_frame_num++;
+    current_frame_num++;
     if (current_frame_num > MaxFrameNum)
         current_frame_num = 0;
     
@@ -1403,22 +1291,15 @@ static int update_ReferenceFrames(void)
 
 static int update_RefPicList(void)
 {
-    unsigned int current_poc = CurrentCurrPic.TopFieldOrderCnt;
+    int current_poc = CurrentCurrPic.TopFieldOrderCnt;
     
-    if (current_frame_type == FRAME_P) {
-        memcpy(RefPicList0_P, ReferenceFrames, numShortTerm * sizeof(VAPictureH264));
-        sort_one(RefPicList0_P, 0, numShortTerm-1, 0, 1);
-    }
-    
-    if (current_frame_type == FRAME_B) {
-        memcpy(RefPicList0_B, ReferenceFrames, numShortTerm * sizeof(VAPictureH264));
-        sort_two(RefPicList0_B, 0, numShortTerm-1, current_poc, 0,
-                 1, 0, 1);
+    if (current_frame_type == FRAME_P)
+        gop_ref_list_p(ReferenceFrames, numShortTerm, current_frame_num, MaxFrameNum,
+                       RefPicList0_P);
 
-        memcpy(RefPicList1_B, ReferenceFrames, numShortTerm * sizeof(VAPictureH264));
-        sort_two(RefPicList1_B, 0, numShortTerm-1, current_poc, 0,
-                 0, 1, 0);
-    }
+    if (current_frame_type == FRAME_B)
+        gop_ref_lists_b(ReferenceFrames, numShortTerm, current_poc,
+                        RefPicList0_B, RefPicList1_B);
     
     return 0;
 }
@@ -1529,7 +1410,7 @@ static int calc_poc(int pic_order_cnt_lsb)
     
     TopFieldOrderCnt = PicOrderCntMsb + pic_order_cnt_lsb;
 
-    if (current_frame_type != FRAME_B) {
+    if (current_frame_is_ref) {
         PicOrderCntMsb_ref = PicOrderCntMsb;
         pic_order_cnt_lsb_ref = pic_order_cnt_lsb;
     }
@@ -1568,7 +1449,7 @@ static int render_picture(void)
     }
     
     pic_param.pic_fields.bits.idr_pic_flag = (current_frame_type == FRAME_IDR);
-    pic_param.pic_fields.bits.reference_pic_flag = (current_frame_type != FRAME_B);
+    pic_param.pic_fields.bits.reference_pic_flag = current_frame_is_ref;
     pic_param.pic_fields.bits.entropy_coding_mode_flag = h264_entropy_mode;
     pic_param.pic_fields.bits.deblocking_filter_control_present_flag = 1;
     pic_param.frame_num = current_frame_num;
@@ -1619,8 +1500,6 @@ static int render_packedsequence(void)
     va_status = vaRenderPicture(va_dpy,context_id, render_id, 2);
     CHECK_VASTATUS(va_status,"vaRenderPicture");
 
-    free(packedseq_buffer);
-    
     return 0;
 }
 
@@ -1657,8 +1536,6 @@ static int render_packedpicture(void)
     va_status = vaRenderPicture(va_dpy,context_id, render_id, 2);
     CHECK_VASTATUS(va_status,"vaRenderPicture");
 
-    free(packedpic_buffer);
-    
     return 0;
 }
 
@@ -1718,9 +1595,6 @@ static void render_packedsei(void)
     va_status = vaRenderPicture(va_dpy,context_id, render_id, 2);
     CHECK_VASTATUS(va_status,"vaRenderPicture");
 
-    
-    free(packed_sei_buffer);
-        
     return;
 }
 
@@ -1761,15 +1635,16 @@ static int render_hrd(void)
     return 0;
 }
 
-static void render_packedslice()
+/* Creates the packed header buffers of one slice, render_id gets their two IDs */
+static void create_packedslice(const VAEncSliceParameterBufferH264 *slice, VABufferID *render_id)
 {
     VAEncPackedHeaderParameterBuffer packedheader_param_buffer;
-    VABufferID packedslice_para_bufid, packedslice_data_bufid, render_id[2];
+    VABufferID packedslice_para_bufid, packedslice_data_bufid;
     unsigned int length_in_bits;
     unsigned char *packedslice_buffer = NULL;
     VAStatus va_status;
 
-    length_in_bits = build_packed_slice_buffer(&packedslice_buffer);
+    length_in_bits = build_packed_slice_buffer(slice, &packedslice_buffer);
     packedheader_param_buffer.type = VAEncPackedHeaderSlice;
     packedheader_param_buffer.bit_length = length_in_bits;
     packedheader_param_buffer.has_emulation_bytes = 0;
@@ -1790,23 +1665,23 @@ static void render_packedslice()
 
     render_id[0] = packedslice_para_bufid;
     render_id[1] = packedslice_data_bufid;
-    va_status = vaRenderPicture(va_dpy,context_id, render_id, 2);
-    CHECK_VASTATUS(va_status,"vaRenderPicture");
-
-    free(packedslice_buffer);
 }
 
 static int render_slice(void)
 {
-    VABufferID slice_param_buf;
+    VAEncSliceParameterBufferH264 slice;
+    VABufferID render_id[MAX_SLICES * 3];
+    int num_render_id = 0, packed_slice;
+    int width_in_mbs = frame_width_mbaligned / 16;
+    int height_in_mbs = frame_height_mbaligned / 16;
     VAStatus va_status;
     int i;
 
     update_RefPicList();
     
-    /* one frame, one slice */
+    /* the fields shared by all the slices of the frame */
     slice_param.macroblock_address = 0;
-    slice_param.num_macroblocks = frame_width_mbaligned * frame_height_mbaligned/(16*16); /* Measured by MB */
+    slice_param.num_macroblocks = width_in_mbs * height_in_mbs; /* Measured by MB */
     slice_param.slice_type = (current_frame_type == FRAME_IDR)?2:current_frame_type;
     if (current_frame_type == FRAME_IDR) {
         if (current_frame_encoding != 0)
@@ -1840,17 +1715,47 @@ static int render_slice(void)
     slice_param.slice_beta_offset_div2 = 0;
     slice_param.direct_spatial_mv_pred_flag = 1;
     slice_param.pic_order_cnt_lsb = (current_frame_display - current_IDR_display) % MaxPicOrderCntLsb;
+
+    /* the CPB model only sees frames that are already stored, so it lags
+     * the frame being rendered by the encode pipeline depth */
+    if (hrd_qp && hrd) {
+        int qp = initial_qp + hrd_sim_qp_delta(hrd);
+
+        if (qp < minimal_qp)
+            qp = minimal_qp;
+        else if (qp > 51)
+            qp = 51;
+        slice_param.slice_qp_delta = qp - initial_qp;
+    }
     
 
-    if (h264_packedheader &&
-        config_attrib[enc_packed_header_idx].value & VA_ENC_PACKED_HEADER_SLICE)
-        render_packedslice();
+    packed_slice = h264_packedheader &&
+        (config_attrib[enc_packed_header_idx].value & VA_ENC_PACKED_HEADER_SLICE);
 
-    va_status = vaCreateBuffer(va_dpy,context_id,VAEncSliceParameterBufferType,
-                               sizeof(slice_param),1,&slice_param,&slice_param_buf);
-    CHECK_VASTATUS(va_status,"vaCreateBuffer");;
+    /*
+     * Whole MB rows per slice, the first slices get the extra rows. The
+     * drivers tie a packed slice header to the slice parameter buffer that
+     * follows it, so the buffers are interleaved and submitted at once.
+     */
+    slice = slice_param;
+    for (i = 0; i < frame_slices; i++) {
+        int rows = height_in_mbs / frame_slices + (i < height_in_mbs % frame_slices);
 
-    va_status = vaRenderPicture(va_dpy,context_id, &slice_param_buf, 1);
+        slice.num_macroblocks = rows * width_in_mbs;
+
+        if (packed_slice) {
+            create_packedslice(&slice, &render_id[num_render_id]);
+            num_render_id += 2;
+        }
+
+        va_status = vaCreateBuffer(va_dpy,context_id,VAEncSliceParameterBufferType,
+                                   sizeof(slice),1,&slice,&render_id[num_render_id++]);
+        CHECK_VASTATUS(va_status,"vaCreateBuffer");
+
+        slice.macroblock_address += slice.num_macroblocks;
+    }
+
+    va_status = vaRenderPicture(va_dpy,context_id, render_id, num_render_id);
     CHECK_VASTATUS(va_status,"vaRenderPicture");
     
     return 0;
@@ -1878,27 +1783,12 @@ static int upload_source_YUV_once_for_all()
 static int load_surface(VASurfaceID surface_id, unsigned long long display_order)
 {
     unsigned char *srcyuv_ptr = NULL, *src_Y = NULL, *src_U = NULL, *src_V = NULL;
-    unsigned long long frame_start, mmap_start;
-    char *mmap_ptr = NULL;
-    int frame_size, mmap_size;
     
-    if (srcyuv_fp == NULL)
+    if (srcyuv_source == NULL)
         return 0;
     
-    /* allow encoding more than srcyuv_frames */    
-    display_order = display_order % srcyuv_frames;
-    frame_size = frame_width * frame_height * 3 / 2; /* for YUV420 */
-    frame_start = display_order * frame_size;
-    
-    mmap_start = frame_start & (~0xfff);
-    mmap_size = (frame_size + (frame_start & 0xfff) + 0xfff) & (~0xfff);
-    mmap_ptr = mmap(0, mmap_size, PROT_READ, MAP_SHARED,
-                    fileno(srcyuv_fp), mmap_start);
-    if (mmap_ptr == MAP_FAILED) {
-        printf("Failed to mmap YUV file (%s)\n", strerror(errno));
-        return 1;
-    }
-    srcyuv_ptr = (unsigned char *)mmap_ptr +  (frame_start & 0xfff);
+    /* wraps around, to allow encoding more than srcyuv_frames */
+    srcyuv_ptr = (unsigned char *)yuv_source_frame(srcyuv_source, display_order);
     if (srcyuv_fourcc == VA_FOURCC_NV12) {
         src_Y = srcyuv_ptr;
         src_U = src_Y + frame_width * frame_height;
@@ -1921,8 +1811,6 @@ static int load_surface(VASurfaceID surface_id, unsigned long long display_order
     upload_surface_yuv(va_dpy, surface_id,
                        srcyuv_fourcc, frame_width, frame_height,
                        src_Y, src_U, src_V);
-    if (mmap_ptr)
-        munmap(mmap_ptr, mmap_size);
 
     return 0;
 }
@@ -1933,20 +1821,21 @@ static int save_recyuv(VASurfaceID surface_id,
                        unsigned long long encode_order)
 {
     unsigned char *dst_Y = NULL, *dst_U = NULL, *dst_V = NULL;
+    int uv_size = (frame_width/2) * (frame_height/2);
 
-    if (recyuv_fp == NULL)
+    if (recyuv_writer == NULL)
         return 0;
 
+    /* the writer thread owns the buffer once queued */
+    dst_Y = yuv_writer_get_buffer(recyuv_writer);
     if (srcyuv_fourcc == VA_FOURCC_NV12) {
-        int uv_size = 2 * (frame_width/2) * (frame_height/2);
-        dst_Y = malloc(2*uv_size);
-        dst_U = malloc(uv_size);
-    } else if (srcyuv_fourcc == VA_FOURCC_IYUV ||
-               srcyuv_fourcc == VA_FOURCC_YV12) {
-        int uv_size = (frame_width/2) * (frame_height/2);
-        dst_Y = malloc(4*uv_size);
-        dst_U = malloc(uv_size);
-        dst_V = malloc(uv_size);
+        dst_U = dst_Y + frame_width * frame_height;
+    } else if (srcyuv_fourcc == VA_FOURCC_IYUV) {
+        dst_U = dst_Y + frame_width * frame_height;
+        dst_V = dst_U + uv_size;
+    } else if (srcyuv_fourcc == VA_FOURCC_YV12) {
+        dst_V = dst_Y + frame_width * frame_height;
+        dst_U = dst_V + uv_size;
     } else {
         printf("Unsupported source YUV format\n");
         exit(1);
@@ -1955,37 +1844,7 @@ static int save_recyuv(VASurfaceID surface_id,
     download_surface_yuv(va_dpy, surface_id,
                          srcyuv_fourcc, frame_width, frame_height,
                          dst_Y, dst_U, dst_V);
-    fseek(recyuv_fp, display_order * frame_width * frame_height * 1.5, SEEK_SET);
-
-    if (srcyuv_fourcc == VA_FOURCC_NV12) {
-        int uv_size = 2 * (frame_width/2) * (frame_height/2);
-        fwrite(dst_Y, uv_size * 2, 1, recyuv_fp);
-        fwrite(dst_U, uv_size, 1, recyuv_fp);
-    } else if (srcyuv_fourcc == VA_FOURCC_IYUV ||
-               srcyuv_fourcc == VA_FOURCC_YV12) {
-        int uv_size = (frame_width/2) * (frame_height/2);
-        fwrite(dst_Y, uv_size * 4, 1, recyuv_fp);
-        
-        if (srcyuv_fourcc == VA_FOURCC_IYUV) {
-            fwrite(dst_U, uv_size, 1, recyuv_fp);
-            fwrite(dst_V, uv_size, 1, recyuv_fp);
-        } else {
-            fwrite(dst_V, uv_size, 1, recyuv_fp);
-            fwrite(dst_U, uv_size, 1, recyuv_fp);
-        }
-    } else {
-        printf("Unsupported YUV format\n");
-        exit(1);
-    }
-    
-    if (dst_Y)
-        free(dst_Y);
-    if (dst_U)
-        free(dst_U);
-    if (dst_V)
-        free(dst_V);
-
-    fflush(recyuv_fp);
+    yuv_writer_queue(recyuv_writer, dst_Y, display_order);
 
     return 0;
 }
@@ -1993,19 +1852,19 @@ static int save_recyuv(VASurfaceID surface_id,
 
 static int save_codeddata(unsigned long long display_order, unsigned long long encode_order)
 {    
-    VACodedBufferSegment *buf_list = NULL;
-    VAStatus va_status;
-    unsigned int coded_size = 0;
-
-    va_status = vaMapBuffer(va_dpy,coded_buf[display_order % SURFACE_NUM],(void **)(&buf_list));
-    CHECK_VASTATUS(va_status,"vaMapBuffer");
-    while (buf_list != NULL) {
-        coded_size += fwrite(buf_list->buf, 1, buf_list->size, coded_fp);
-        buf_list = (VACodedBufferSegment *) buf_list->next;
+    int coded_size;
 
-        frame_size += coded_size;
+    /* the coded buffer is unmapped before this returns */
+    coded_size = coded_sink_write(coded_sink, va_dpy, coded_buf[display_order % SURFACE_NUM], 0);
+    if (coded_size < 0) {
+        printf("Failed to save coded frame %lld into %s\n", encode_order, coded_fn);
+        exit(1);
     }
-    vaUnmapBuffer(va_dpy,coded_buf[display_order % SURFACE_NUM]);
+    frame_size += coded_size;
+
+    /* called in encode order, which is the CPB removal order */
+    if (hrd)
+        hrd_sim_add_frame(hrd, encode_order, coded_size);
 
     printf("\r      "); /* return back to startpoint */
     switch (encode_order % 4) {
@@ -2024,54 +1883,63 @@ static int save_codeddata(unsigned long long display_order, unsigned long long e
     }
     printf("%08lld", encode_order);
     printf("(%06d bytes coded)",coded_size);
-
-    fflush(coded_fp);
     
     return 0;
 }
 
 
-static struct storage_task_t * storage_task_dequeue(void)
+static int storage_task_queue(unsigned long long display_order, unsigned long long encode_order)
 {
-    struct storage_task_t *header;
+    struct storage_task_t *task = &storage_tasks[display_order % SURFACE_NUM];
 
     pthread_mutex_lock(&encode_mutex);
+    srcsurface_status[display_order % SURFACE_NUM] = SRC_SURFACE_IN_STORAGE;
+    pthread_mutex_unlock(&encode_mutex);
 
-    header = storage_task_header;    
-    if (storage_task_header != NULL) {
-        if (storage_task_tail == storage_task_header)
-            storage_task_tail = NULL;
-        storage_task_header = header->next;
+    task->display_order = display_order;
+    task->encode_order = encode_order;
+    if (!mpmc_queue_push(&storage_queue, task)) {
+        /* can't happen, the queue is larger than SURFACE_NUM */
+        printf("Storage task queue is full\n");
+        exit(1);
     }
     
-    pthread_mutex_unlock(&encode_mutex);
-    
-    return header;
+    return 0;
 }
 
-static int storage_task_queue(unsigned long long display_order, unsigned long long encode_order)
+/* Hands the source and reconstructed frames over to the quality metrics worker */
+static int submit_quality_metrics(unsigned long long display_order)
 {
-    struct storage_task_t *tmp;
+    VAImage src_image, rec_image;
+    void *src_data = NULL, *rec_data = NULL;
+    struct quality_frame src_frame, rec_frame;
+    VAStatus va_status;
 
-    tmp = calloc(1, sizeof(struct storage_task_t));
-    tmp->display_order = display_order;
-    tmp->encode_order = encode_order;
+    if (quality == NULL)
+        return 0;
 
-    pthread_mutex_lock(&encode_mutex);
-    
-    if (storage_task_header == NULL) {
-        storage_task_header = tmp;
-        storage_task_tail = tmp;
-    } else {
-        storage_task_tail->next = tmp;
-        storage_task_tail = tmp;
+    va_status = vaDeriveImage(va_dpy, src_surface[display_order % SURFACE_NUM], &src_image);
+    CHECK_VASTATUS(va_status,"vaDeriveImage");
+    va_status = vaDeriveImage(va_dpy, ref_surface[display_order % SURFACE_NUM], &rec_image);
+    CHECK_VASTATUS(va_status,"vaDeriveImage");
+
+    va_status = vaMapBuffer(va_dpy, src_image.buf, &src_data);
+    CHECK_VASTATUS(va_status,"vaMapBuffer");
+    va_status = vaMapBuffer(va_dpy, rec_image.buf, &rec_data);
+    CHECK_VASTATUS(va_status,"vaMapBuffer");
+
+    if (quality_frame_from_image(&src_frame, &src_image, src_data) ||
+        quality_frame_from_image(&rec_frame, &rec_image, rec_data) ||
+        quality_metrics_submit(quality, display_order, &src_frame, &rec_frame)) {
+        printf("Unsupported surface format for PSNR/SSIM calculation\n");
+        exit(1);
     }
 
-    srcsurface_status[display_order % SURFACE_NUM] = SRC_SURFACE_IN_STORAGE;
-    pthread_cond_signal(&encode_cond);
-    
-    pthread_mutex_unlock(&encode_mutex);
-    
+    vaUnmapBuffer(va_dpy, rec_image.buf);
+    vaUnmapBuffer(va_dpy, src_image.buf);
+    vaDestroyImage(va_dpy, rec_image.image_id);
+    vaDestroyImage(va_dpy, src_image.image_id);
+
     return 0;
 }
 
@@ -2083,57 +1951,97 @@ static void storage_task(unsigned long long display_order, unsigned long long en
     tmp = GetTickCount();
     va_status = vaSyncSurface(va_dpy, src_surface[display_order % SURFACE_NUM]);
     CHECK_VASTATUS(va_status,"vaSyncSurface");
-    SyncPictureTicks += GetTickCount() - tmp;
+    ADD_TICKS(SyncPictureTicks, tmp);
+
+    pthread_mutex_lock(&encode_mutex);
+    while (coded_next_order != encode_order)
+        pthread_cond_wait(&coded_cond, &encode_mutex);
+    pthread_mutex_unlock(&encode_mutex);
+
     tmp = GetTickCount();
     save_codeddata(display_order, encode_order);
-    SavePictureTicks += GetTickCount() - tmp;
+    ADD_TICKS(SavePictureTicks, tmp);
+
+    pthread_mutex_lock(&encode_mutex);
+    coded_next_order++;
+    pthread_cond_broadcast(&coded_cond);
+    pthread_mutex_unlock(&encode_mutex);
 
     save_recyuv(ref_surface[display_order % SURFACE_NUM], display_order, encode_order);
 
+    /* before the source surface gets reloaded */
+    submit_quality_metrics(display_order);
+
     /* reload a new frame data */
     tmp = GetTickCount();
     if (srcyuv_fp != NULL)
         load_surface(src_surface[display_order % SURFACE_NUM], display_order + SURFACE_NUM);
-    UploadPictureTicks += GetTickCount() - tmp;
+    ADD_TICKS(UploadPictureTicks, tmp);
 
     pthread_mutex_lock(&encode_mutex);
     srcsurface_status[display_order % SURFACE_NUM] = SRC_SURFACE_IN_ENCODING;
+    pthread_cond_signal(&srcsurface_cond);
     pthread_mutex_unlock(&encode_mutex);
 }
 
         
 static void * storage_task_thread(void *t)
 {
-    while (1) {
-        struct storage_task_t *current;
-        
-        current = storage_task_dequeue();
-        if (current == NULL) {
-            pthread_mutex_lock(&encode_mutex);
-            pthread_cond_wait(&encode_cond, &encode_mutex);
-            pthread_mutex_unlock(&encode_mutex);
-            continue;
-        }
-        
-        storage_task(current->display_order, current->encode_order);
-        
-        free(current);
+    struct storage_task_t *current;
 
-        /* all frames are saved, exit the thread */
-        if (++frame_coded >= frame_count)
-            break;
-    }
+    /* exits once the queue is closed and all frames are saved */
+    while ((current = mpmc_queue_pop_wait(&storage_queue)) != NULL)
+        storage_task(current->display_order, current->encode_order);
 
     return 0;
 }
 
 
+static const unsigned char *gop_source_luma(void *data, unsigned long long display_order,
+                                            unsigned int *pitch)
+{
+    /* all the supported source fourccs start with a full-size luma plane */
+    *pitch = frame_width;
+    return yuv_source_frame(srcyuv_source, display_order);
+}
+
+static void init_gop_planner(void)
+{
+    struct gop_params params;
+
+    memset(&params, 0, sizeof(params));
+    params.intra_period = intra_period;
+    params.intra_idr_period = intra_period ? intra_idr_period : 0;
+    params.ip_period = ip_period;
+    params.b_pyramid = b_pyramid;
+    params.num_frames = frame_count;
+    if (srcyuv_source) {
+        params.lookahead = lookahead;
+        params.scenecut = scenecut_threshold;
+        params.width = frame_width;
+        params.height = frame_height;
+        params.get_luma = gop_source_luma;
+    }
+
+    gop_planner = gop_planner_create(&params);
+    if (gop_planner == NULL) {
+        printf("Failed to create the GOP planner\n");
+        exit(1);
+    }
+
+    /* B pyramids need more references with sliding-window marking */
+    num_ref_frames = MAX(num_ref_frames, gop_planner_num_ref_frames(&params));
+}
+
 static int encode_frames(void)
 {
     unsigned int i, tmp;
     VAStatus va_status;
+    struct gop_frame frame;
     //VASurfaceStatus surface_status;
 
+    init_gop_planner();
+
     /* upload RAW YUV data into all surfaces */
     tmp = GetTickCount();
     if (srcyuv_fp != NULL) {
@@ -2150,22 +2058,29 @@ static int encode_frames(void)
     memset(&pic_param, 0, sizeof(pic_param));
     memset(&slice_param, 0, sizeof(slice_param));
 
-    if (encode_syncmode == 0)
-        pthread_create(&encode_thread, NULL, storage_task_thread, NULL);
+    if (encode_syncmode == 0) {
+        mpmc_queue_init(&storage_queue);
+        for (i = 0; i < storage_workers; i++)
+            pthread_create(&storage_threads[i], NULL, storage_task_thread, NULL);
+    }
     
-    for (current_frame_encoding = 0; current_frame_encoding < frame_count; current_frame_encoding++) {
-        encoding2display_order(current_frame_encoding, intra_period, intra_idr_period, ip_period,
-                               &current_frame_display, &current_frame_type);
+    while (gop_planner_next(gop_planner, &frame)) {
+        current_frame_encoding = frame.encoding_order;
+        current_frame_display = frame.display_order;
+        current_frame_type = frame.type;
+        current_frame_is_ref = frame.is_reference;
+        scenecut_frames += frame.scenecut;
         if (current_frame_type == FRAME_IDR) {
             numShortTerm = 0;
             current_frame_num = 0;
             current_IDR_display = current_frame_display;
         }
 
-        /* check if the source frame is ready */
-        while (srcsurface_status[current_slot] != SRC_SURFACE_IN_ENCODING) {
-            usleep(1);
-        }
+        /* wait for the source frame to be ready */
+        pthread_mutex_lock(&encode_mutex);
+        while (srcsurface_status[current_slot] != SRC_SURFACE_IN_ENCODING)
+            pthread_cond_wait(&srcsurface_cond, &encode_mutex);
+        pthread_mutex_unlock(&encode_mutex);
         
         tmp = GetTickCount();
         va_status = vaBeginPicture(va_dpy, context_id, src_surface[current_slot]);
@@ -2173,6 +2088,7 @@ static int encode_frames(void)
         BeginPictureTicks += GetTickCount() - tmp;
         
         tmp = GetTickCount();
+        bitstream_arena_reset(&header_arena);
         if (current_frame_type == FRAME_IDR) {
             render_sequence();
             render_picture();            
@@ -2207,9 +2123,14 @@ static int encode_frames(void)
     }
 
     if (encode_syncmode == 0) {
-        int ret;
-        pthread_join(encode_thread, (void **)&ret);
+        mpmc_queue_close(&storage_queue);
+        for (i = 0; i < storage_workers; i++)
+            pthread_join(storage_threads[i], NULL);
+        mpmc_queue_destroy(&storage_queue);
     }
+
+    gop_planner_destroy(gop_planner);
+    gop_planner = NULL;
     
     return 0;
 }
@@ -2228,6 +2149,12 @@ static int release_encode()
     vaDestroyContext(va_dpy,context_id);
     vaDestroyConfig(va_dpy,config_id);
 
+    bitstream_arena_fini(&header_arena);
+
+    if (coded_sink_destroy(coded_sink))
+        printf("Failed to write some coded frames into %s\n", coded_fn);
+    coded_sink = NULL;
+
     return 0;
 }
 
@@ -2253,9 +2180,17 @@ static int print_input()
     printf("INPUT: Slieces      : %d\n", frame_slices);
     printf("INPUT: IntraPeriod  : %d\n", intra_period);
     printf("INPUT: IDRPeriod    : %d\n", intra_idr_period);
-    printf("INPUT: IpPeriod     : %d\n", ip_period);
+    printf("INPUT: IpPeriod     : %d%s\n", ip_period, b_pyramid ? " (B pyramid)" : "");
+    if (lookahead && scenecut_threshold)
+        printf("INPUT: Lookahead    : %d frames, scene cut threshold %d\n",
+               lookahead, scenecut_threshold);
     printf("INPUT: Initial QP   : %d\n", initial_qp);
     printf("INPUT: Min QP       : %d\n", minimal_qp);
+    if (hrd_enable)
+        printf("INPUT: HRD check    : CPB %d bits, %d frames window%s%s%s\n",
+               hrd_cpb_size ? hrd_cpb_size : frame_bitrate, hrd_window ? hrd_window : frame_rate,
+               hrd_qp ? ", QP adjusted" : "",
+               hrd_csv_fn ? ", CSV " : "", hrd_csv_fn ? hrd_csv_fn : "");
     printf("INPUT: Source YUV   : %s", srcyuv_fp?"FILE":"AUTO generated");
     if (srcyuv_fp) 
         printf(":%s (fourcc %s)\n", srcyuv_fn, fourcc_to_string(srcyuv_fourcc));
@@ -2273,53 +2208,11 @@ static int print_input()
     return 0;
 }
 
-static int calc_PSNR(double *psnr)
-{
-    char *srcyuv_ptr = NULL, *recyuv_ptr = NULL, tmp;
-    unsigned long long min_size;
-    unsigned long long i, sse=0;
-    double ssemean;
-    int fourM = 0x400000; /* 4M */
-
-    min_size = MIN(srcyuv_frames, frame_count) * frame_width * frame_height * 1.5;
-    for (i=0; i<min_size; i++) {
-        unsigned long long j = i % fourM;
-        
-        if ((i % fourM) == 0) {
-            if (srcyuv_ptr)
-                munmap(srcyuv_ptr, fourM);
-            if (recyuv_ptr)
-                munmap(recyuv_ptr, fourM);
-            
-            srcyuv_ptr = mmap(0, fourM, PROT_READ, MAP_SHARED, fileno(srcyuv_fp), i);
-            recyuv_ptr = mmap(0, fourM, PROT_READ, MAP_SHARED, fileno(recyuv_fp), i);
-            if ((srcyuv_ptr == MAP_FAILED) || (recyuv_ptr == MAP_FAILED)) {
-                printf("Failed to mmap YUV files\n");
-                return 1;
-            }
-        }
-        tmp = srcyuv_ptr[j] - recyuv_ptr[j];
-        sse += tmp * tmp;
-    }
-    ssemean = (double)sse/(double)min_size;
-    *psnr = 20.0*log10(255) - 10.0*log10(ssemean);
-
-    if (srcyuv_ptr)
-        munmap(srcyuv_ptr, fourM);
-    if (recyuv_ptr)
-        munmap(recyuv_ptr, fourM);
-    
-    return 0;
-}
-
 static int print_performance(unsigned int PictureCount)
 {
-    unsigned int psnr_ret = 1, others = 0;
-    double psnr = 0, total_size = frame_width * frame_height * 1.5 * frame_count;
+    unsigned int others = 0;
+    double total_size = frame_width * frame_height * 1.5 * frame_count;
 
-    if (calc_psnr && srcyuv_fp && recyuv_fp)
-        psnr_ret = calc_PSNR(&psnr);
-    
     others = TotalTicks - UploadPictureTicks - BeginPictureTicks
         - RenderPictureTicks - EndPictureTicks - SyncPictureTicks - SavePictureTicks;
 
@@ -2329,9 +2222,31 @@ static int print_performance(unsigned int PictureCount)
            (double) 1000*PictureCount / TotalTicks, PictureCount,
            TotalTicks, ((double)  TotalTicks) / (double) PictureCount);
     printf("PERFORMANCE:   Compression ratio    : %d:1\n", (unsigned int)(total_size / frame_size));
-    if (psnr_ret == 0)
-        printf("PERFORMANCE:   PSNR                 : %.2f (%lld frames calculated)\n",
-               psnr, MIN(frame_count, srcyuv_frames));
+    if (lookahead && scenecut_threshold)
+        printf("PERFORMANCE:   Scene cuts           : %d IDR frames inserted\n", scenecut_frames);
+    if (quality_summary.frames) {
+        printf("PERFORMANCE:   PSNR                 : %.2f (Y %.2f U %.2f V %.2f, %d frames calculated)\n",
+               quality_summary.psnr_yuv, quality_summary.psnr[0],
+               quality_summary.psnr[1], quality_summary.psnr[2], quality_summary.frames);
+        printf("PERFORMANCE:   SSIM                 : Y %.4f U %.4f V %.4f\n",
+               quality_summary.ssim[0], quality_summary.ssim[1], quality_summary.ssim[2]);
+    }
+    if (hrd_summary.frames) {
+        printf("PERFORMANCE:   HRD bitrate          : %.0f bps (target %d, %+.1f%%), "
+               "per window %+.1f%% .. %+.1f%%, %d of %d windows off by more than 10%%\n",
+               hrd_summary.bitrate, frame_bitrate, (hrd_summary.bitrate / frame_bitrate - 1.0) * 100,
+               hrd_summary.min_deviation * 100, hrd_summary.max_deviation * 100,
+               hrd_summary.windows_off, hrd_summary.windows);
+        printf("PERFORMANCE:   HRD CPB fullness     : %.1f%% .. %.1f%%\n",
+               hrd_summary.min_fullness * 100, hrd_summary.max_fullness * 100);
+        printf("PERFORMANCE:   HRD underflows       : %d", hrd_summary.underflows);
+        if (hrd_summary.underflows)
+            printf(" (first at frame %lld)", hrd_summary.first_underflow);
+        printf(", overflows %d", hrd_summary.overflows);
+        if (hrd_summary.overflows)
+            printf(" (first at frame %lld)", hrd_summary.first_overflow);
+        printf("\n");
+    }
 
     printf("PERFORMANCE:     UploadPicture      : %d ms (%.2f, %.2f%% percent)\n",
            (int) UploadPictureTicks, ((double)  UploadPictureTicks) / (double) PictureCount,
@@ -2356,7 +2271,8 @@ static int print_performance(unsigned int PictureCount)
            others/(double) TotalTicks/0.01);
 
     if (encode_syncmode == 0)
-        printf("(Multithread enabled, the timing is only for reference)\n");
+        printf("(Multithread enabled with %d storage workers, the timing is only for reference)\n",
+               storage_workers);
     
     return 0;
 }
@@ -2374,12 +2290,46 @@ int main(int argc,char **argv)
     
     init_va();
     setup_encode();
-    
+
+    if (hrd_enable) {
+        struct hrd_params params;
+
+        memset(&params, 0, sizeof(params));
+        params.bit_rate = frame_bitrate;
+        params.cpb_size = hrd_cpb_size;
+        params.frame_rate_num = frame_rate;
+        params.frame_rate_den = 1;
+        params.cbr = (rc_mode == VA_RC_CBR);
+        params.window = hrd_window;
+        params.csv_fn = hrd_csv_fn;
+        hrd = hrd_sim_create(&params);
+        if (hrd == NULL)
+            printf("Failed to start the HRD check\n");
+    }
+
+    if (calc_psnr) {
+        quality = quality_metrics_create(frame_width, frame_height, quality_csv_fn);
+        if (quality == NULL)
+            printf("Failed to start PSNR/SSIM calculation\n");
+    }
+
     encode_frames();
 
+    /* waits for the metrics and reconstructed frames of the last frames */
+    quality_metrics_destroy(quality, &quality_summary);
+    quality = NULL;
+    hrd_sim_destroy(hrd, &hrd_summary);
+    hrd = NULL;
+    if (yuv_writer_destroy(recyuv_writer))
+        printf("Failed to write some reconstructed frames into %s\n", recyuv_fn);
+    recyuv_writer = NULL;
+
     release_encode();
     deinit_va();
 
+    yuv_source_close(srcyuv_source);
+    srcyuv_source = NULL;
+
     TotalTicks += GetTickCount() - start;
     print_performance(frame_count);
     
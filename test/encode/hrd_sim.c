@@ -0,0 +1,256 @@
+/*
+ * Copyright (c) 2015 Intel Corporation. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+ * IN NO EVENT SHALL PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR
+ * ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "hrd_sim.h"
+
+#define HRD_DEFAULT_TOLERANCE   0.1
+
+/* QP offset range, and QP steps for a CPB going from full to empty */
+#define HRD_MAX_QP_DELTA        12
+#define HRD_FULLNESS_GAIN       12.0
+
+struct hrd_window {
+    unsigned long long first_frame;
+    unsigned int frames;
+    double bits;
+    double min_fullness, max_fullness;
+    unsigned int underflows, overflows;
+};
+
+struct hrd_sim {
+    struct hrd_params params;
+    double frame_bits;                  /* arriving per frame period */
+    double fullness;                    /* bits in the CPB */
+    FILE *csv_fp;
+
+    struct hrd_window window;
+    double total_bits;
+
+    /* sliding window for the QP offset, sizes[] is a ring of params.window */
+    unsigned int *sizes;
+    unsigned int next_size, num_sizes;
+    double recent_bits;
+    int qp_delta;
+
+    struct hrd_summary summary;
+};
+
+struct hrd_sim *
+hrd_sim_create(const struct hrd_params *params)
+{
+    struct hrd_sim *hrd;
+
+    if (params->bit_rate == 0 || params->frame_rate_num == 0 || params->frame_rate_den == 0)
+        return NULL;
+
+    hrd = calloc(1, sizeof(*hrd));
+    if (hrd == NULL)
+        return NULL;
+
+    hrd->params = *params;
+    if (hrd->params.cpb_size == 0)
+        hrd->params.cpb_size = params->bit_rate;
+    if (hrd->params.initial_fullness == 0 || hrd->params.initial_fullness > hrd->params.cpb_size)
+        hrd->params.initial_fullness = hrd->params.cpb_size / 2;
+    if (hrd->params.window == 0)
+        hrd->params.window = (params->frame_rate_num + params->frame_rate_den - 1) / params->frame_rate_den;
+    if (hrd->params.tolerance <= 0)
+        hrd->params.tolerance = HRD_DEFAULT_TOLERANCE;
+
+    hrd->frame_bits = (double)params->bit_rate * params->frame_rate_den / params->frame_rate_num;
+    hrd->fullness = hrd->params.initial_fullness;
+
+    hrd->sizes = calloc(hrd->params.window, sizeof(*hrd->sizes));
+    if (hrd->sizes == NULL) {
+        free(hrd);
+        return NULL;
+    }
+
+    if (params->csv_fn) {
+        hrd->csv_fp = fopen(params->csv_fn, "w");
+        if (hrd->csv_fp == NULL) {
+            printf("Open HRD CSV file %s failed\n", params->csv_fn);
+            free(hrd->sizes);
+            free(hrd);
+            return NULL;
+        }
+        fprintf(hrd->csv_fp, "window,first_frame,frames,bitrate,deviation,"
+                "min_fullness,max_fullness,underflows,overflows\n");
+    }
+
+    hrd->summary.min_fullness = 1.0;
+    hrd->summary.min_deviation = HUGE_VAL;
+    hrd->summary.max_deviation = -HUGE_VAL;
+
+    return hrd;
+}
+
+static void
+hrd_close_window(struct hrd_sim *hrd)
+{
+    struct hrd_window *w = &hrd->window;
+    double rate_num = hrd->params.frame_rate_num, rate_den = hrd->params.frame_rate_den;
+    double bitrate, deviation;
+
+    if (w->frames == 0)
+        return;
+
+    bitrate = w->bits * rate_num / (rate_den * w->frames);
+    deviation = bitrate / hrd->params.bit_rate - 1.0;
+
+    if (hrd->csv_fp)
+        fprintf(hrd->csv_fp, "%u,%llu,%u,%.0f,%.4f,%.4f,%.4f,%u,%u\n",
+                hrd->summary.windows, w->first_frame, w->frames, bitrate, deviation,
+                w->min_fullness, w->max_fullness, w->underflows, w->overflows);
+
+    /* a short last window says little about the bitrate */
+    if (w->frames * 2 >= hrd->params.window) {
+        if (deviation < hrd->summary.min_deviation)
+            hrd->summary.min_deviation = deviation;
+        if (deviation > hrd->summary.max_deviation)
+            hrd->summary.max_deviation = deviation;
+        if (fabs(deviation) > hrd->params.tolerance)
+            hrd->summary.windows_off++;
+    }
+    hrd->summary.windows++;
+
+    memset(w, 0, sizeof(*w));
+}
+
+static void
+hrd_update_qp_delta(struct hrd_sim *hrd)
+{
+    double target = (double)hrd->params.initial_fullness / hrd->params.cpb_size;
+    double fullness = hrd->fullness / hrd->params.cpb_size;
+    double rate_ratio = hrd->recent_bits / (hrd->num_sizes * hrd->frame_bits);
+    double delta;
+    int qp_delta;
+
+    /* 6 QP steps halve the bits; drift back towards the initial fullness */
+    if (rate_ratio < 1.0 / 64)
+        rate_ratio = 1.0 / 64;
+    delta = 6.0 * log2(rate_ratio) + HRD_FULLNESS_GAIN * (target - fullness);
+
+    qp_delta = (int)lround(delta);
+    if (qp_delta > HRD_MAX_QP_DELTA)
+        qp_delta = HRD_MAX_QP_DELTA;
+    else if (qp_delta < -HRD_MAX_QP_DELTA)
+        qp_delta = -HRD_MAX_QP_DELTA;
+
+    __atomic_store_n(&hrd->qp_delta, qp_delta, __ATOMIC_RELAXED);
+}
+
+void
+hrd_sim_add_frame(struct hrd_sim *hrd, unsigned long long frame_num, unsigned int size_in_bytes)
+{
+    struct hrd_window *w = &hrd->window;
+    double bits = 8.0 * size_in_bytes;
+    double cpb_size = hrd->params.cpb_size;
+
+    if (w->frames == 0) {
+        w->first_frame = frame_num;
+        w->min_fullness = 1.0;
+    }
+
+    /* removal: the whole frame must have arrived */
+    if (hrd->fullness > w->max_fullness * cpb_size)
+        w->max_fullness = hrd->fullness / cpb_size;
+    if (bits > hrd->fullness) {
+        if (hrd->summary.underflows == 0)
+            hrd->summary.first_underflow = frame_num;
+        hrd->summary.underflows++;
+        w->underflows++;
+        hrd->fullness = 0;
+    } else
+        hrd->fullness -= bits;
+    if (hrd->fullness < w->min_fullness * cpb_size)
+        w->min_fullness = hrd->fullness / cpb_size;
+
+    /* arrival until the next removal */
+    hrd->fullness += hrd->frame_bits;
+    if (hrd->fullness > cpb_size) {
+        if (hrd->params.cbr) {
+            if (hrd->summary.overflows == 0)
+                hrd->summary.first_overflow = frame_num;
+            hrd->summary.overflows++;
+            w->overflows++;
+        }
+        hrd->fullness = cpb_size;
+    }
+
+    w->bits += bits;
+    hrd->total_bits += bits;
+    hrd->summary.frames++;
+    if (w->min_fullness < hrd->summary.min_fullness)
+        hrd->summary.min_fullness = w->min_fullness;
+    if (w->max_fullness > hrd->summary.max_fullness)
+        hrd->summary.max_fullness = w->max_fullness;
+
+    if (++w->frames == hrd->params.window)
+        hrd_close_window(hrd);
+
+    /* sliding window for the QP offset */
+    if (hrd->num_sizes == hrd->params.window)
+        hrd->recent_bits -= 8.0 * hrd->sizes[hrd->next_size];
+    else
+        hrd->num_sizes++;
+    hrd->sizes[hrd->next_size] = size_in_bytes;
+    hrd->recent_bits += bits;
+    if (++hrd->next_size == hrd->params.window)
+        hrd->next_size = 0;
+
+    hrd_update_qp_delta(hrd);
+}
+
+int
+hrd_sim_qp_delta(struct hrd_sim *hrd)
+{
+    return __atomic_load_n(&hrd->qp_delta, __ATOMIC_RELAXED);
+}
+
+void
+hrd_sim_destroy(struct hrd_sim *hrd, struct hrd_summary *summary)
+{
+    if (hrd == NULL)
+        return;
+
+    hrd_close_window(hrd);
+    if (hrd->summary.frames)
+        hrd->summary.bitrate = hrd->total_bits * hrd->params.frame_rate_num /
+            ((double)hrd->params.frame_rate_den * hrd->summary.frames);
+    if (hrd->summary.min_deviation > hrd->summary.max_deviation)
+        hrd->summary.min_deviation = hrd->summary.max_deviation = 0;
+
+    if (summary)
+        *summary = hrd->summary;
+
+    if (hrd->csv_fp)
+        fclose(hrd->csv_fp);
+    free(hrd->sizes);
+    free(hrd);
+}
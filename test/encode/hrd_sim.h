@@ -0,0 +1,106 @@
+/*
+ * Copyright (c) 2015 Intel Corporation. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+ * IN NO EVENT SHALL PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR
+ * ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Leaky-bucket HRD (CPB/VBV) model of the coded stream, fed with the size of
+ * each coded frame in decoding order.
+ *
+ * Bits arrive at bit_rate, the CPB holds initial_fullness bits when the first
+ * frame is removed and one frame is removed every frame period:
+ *  - underflow: a frame is larger than the CPB fullness at its removal time
+ *  - overflow (CBR only): the CPB is full while bits keep arriving; with VBR
+ *    the arrival just pauses
+ *
+ * The bitrate is also measured over consecutive windows of frames and
+ * compared with bit_rate. hrd_sim_qp_delta() turns the CPB fullness and the
+ * recent bitrate into a QP offset, for an application-level rate control
+ * on top of CQP.
+ *
+ * Adding a frame is O(1) and does not allocate.
+ */
+
+#ifndef HRD_SIM_H
+#define HRD_SIM_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct hrd_sim;
+
+struct hrd_params {
+    unsigned int bit_rate;              /* bits per second */
+    unsigned int cpb_size;              /* bits, 0: one second at bit_rate */
+    unsigned int initial_fullness;      /* bits, 0: half of cpb_size */
+    unsigned int frame_rate_num;
+    unsigned int frame_rate_den;
+    int cbr;
+    unsigned int window;                /* frames per bitrate window, 0: one second */
+    double tolerance;                   /* windows off by more are reported, 0: 10% */
+    const char *csv_fn;                 /* one row per window, or NULL */
+};
+
+/** \brief Whole-stream results */
+struct hrd_summary {
+    unsigned long long frames;
+    unsigned int underflows;
+    unsigned int overflows;
+    unsigned int windows;
+    unsigned int windows_off;           /* bitrate off by more than the tolerance */
+    double bitrate;                     /* bits per second over the whole stream */
+    double min_deviation;               /* per window, relative to bit_rate */
+    double max_deviation;
+    double min_fullness;                /* after removal, fraction of cpb_size */
+    double max_fullness;                /* before removal */
+    unsigned long long first_underflow; /* frame number, if underflows != 0 */
+    unsigned long long first_overflow;
+};
+
+/** Returns NULL on invalid parameters or failure to open csv_fn */
+struct hrd_sim *
+hrd_sim_create(const struct hrd_params *params);
+
+/**
+ * Removes the next frame, in decoding order, from the CPB. Calls must not
+ * overlap; the frame number is only used for reporting.
+ */
+void
+hrd_sim_add_frame(struct hrd_sim *hrd, unsigned long long frame_num, unsigned int size_in_bytes);
+
+/**
+ * QP offset suggested after the last added frame: positive when the CPB is
+ * draining or the bitrate is above target. Can be called from any thread.
+ */
+int
+hrd_sim_qp_delta(struct hrd_sim *hrd);
+
+/** Closes the last window and the CSV file, and releases everything */
+void
+hrd_sim_destroy(struct hrd_sim *hrd, struct hrd_summary *summary);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HRD_SIM_H */
@@ -0,0 +1,227 @@
+/*
+ * Copyright (c) 2015 Intel Corporation. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+ * IN NO EVENT SHALL PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR
+ * ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Drives the HRD model of hrd_sim.h with frame size sequences whose CPB
+ * fullness is easy to follow by hand, and checks what it reports. Exits
+ * with 1 on the first mismatch.
+ *
+ * All cases run at 240 kbit/s and 30 fps, so 8000 bits arrive per frame,
+ * into a CPB of 80000 bits that starts half full.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include "hrd_sim.h"
+
+#define BIT_RATE        240000
+#define CPB_SIZE        80000
+#define FRAME_BYTES     1000            /* exactly the arrival per frame */
+
+#define CHECK(cond)                                                     \
+    do {                                                                \
+        if (!(cond)) {                                                  \
+            printf("%s:%d: %s: check failed: %s\n",                     \
+                   __FILE__, __LINE__, __func__, #cond);                \
+            return 0;                                                   \
+        }                                                               \
+    } while (0)
+
+#define CHECK_NEAR(a, b)        CHECK(fabs((a) - (b)) < 1e-9)
+
+static struct hrd_sim *
+create(int cbr, unsigned int window, const char *csv_fn)
+{
+    struct hrd_params params;
+
+    memset(&params, 0, sizeof(params));
+    params.bit_rate = BIT_RATE;
+    params.cpb_size = CPB_SIZE;
+    params.initial_fullness = CPB_SIZE / 2;
+    params.frame_rate_num = 30;
+    params.frame_rate_den = 1;
+    params.cbr = cbr;
+    params.window = window;
+    params.csv_fn = csv_fn;
+
+    return hrd_sim_create(&params);
+}
+
+/* Frames of exactly the arriving size keep the CPB where it started */
+static int
+check_steady(void)
+{
+    struct hrd_summary summary;
+    struct hrd_sim *hrd;
+    int i;
+
+    hrd = create(1, 0, NULL);
+    CHECK(hrd);
+    for (i = 0; i < 90; i++)
+        hrd_sim_add_frame(hrd, i, FRAME_BYTES);
+    CHECK(hrd_sim_qp_delta(hrd) == 0);
+    hrd_sim_destroy(hrd, &summary);
+
+    CHECK(summary.frames == 90);
+    CHECK(summary.underflows == 0);
+    CHECK(summary.overflows == 0);
+    CHECK(summary.windows == 3);
+    CHECK(summary.windows_off == 0);
+    CHECK_NEAR(summary.bitrate, BIT_RATE);
+    CHECK_NEAR(summary.min_fullness, 0.4);
+    CHECK_NEAR(summary.max_fullness, 0.5);
+    return 1;
+}
+
+/*
+ * Frame 3 is 56000 bits while the CPB holds 40000: it underflows and
+ * empties the CPB, which then stays at one frame's worth. Fullness before
+ * each removal is followed through the per-window CSV, one frame a window.
+ */
+static int
+check_underflow(void)
+{
+    static const double before[] = { 0.5, 0.5, 0.5, 0.5, 0.1, 0.1, 0.1, 0.1 };
+    static const double after[]  = { 0.4, 0.4, 0.4, 0.0, 0.0, 0.0, 0.0, 0.0 };
+    const int num_frames = sizeof(before) / sizeof(before[0]);
+    char csv_fn[] = "/tmp/hrd_sim_test.XXXXXX";
+    struct hrd_summary summary;
+    struct hrd_sim *hrd;
+    char line[256];
+    FILE *fp;
+    int fd, i, ok = 1;
+
+    fd = mkstemp(csv_fn);
+    CHECK(fd >= 0);
+    close(fd);
+
+    hrd = create(1, 1, csv_fn);
+    CHECK(hrd);
+    for (i = 0; i < num_frames; i++)
+        hrd_sim_add_frame(hrd, i, i == 3 ? 7 * FRAME_BYTES : FRAME_BYTES);
+    /* the CPB is far below its initial fullness */
+    CHECK(hrd_sim_qp_delta(hrd) > 0);
+    hrd_sim_destroy(hrd, &summary);
+
+    CHECK(summary.underflows == 1);
+    CHECK(summary.first_underflow == 3);
+    CHECK(summary.overflows == 0);
+    CHECK_NEAR(summary.min_fullness, 0.0);
+    CHECK_NEAR(summary.max_fullness, 0.5);
+
+    fp = fopen(csv_fn, "r");
+    CHECK(fp);
+    if (!fgets(line, sizeof(line), fp))
+        ok = 0;
+    for (i = 0; ok && i < num_frames; i++) {
+        unsigned int window, frames, underflows, overflows;
+        unsigned long long first_frame;
+        double bitrate, deviation, min_fullness, max_fullness;
+
+        ok = fgets(line, sizeof(line), fp) &&
+            sscanf(line, "%u,%llu,%u,%lf,%lf,%lf,%lf,%u,%u", &window, &first_frame,
+                   &frames, &bitrate, &deviation, &min_fullness, &max_fullness,
+                   &underflows, &overflows) == 9 &&
+            first_frame == (unsigned long long)i && frames == 1 &&
+            fabs(max_fullness - before[i]) < 1e-4 &&
+            fabs(min_fullness - after[i]) < 1e-4 &&
+            underflows == (i == 3) && overflows == 0;
+        if (!ok)
+            printf("check_underflow: frame %d: unexpected CSV row %s", i, line);
+    }
+    fclose(fp);
+    unlink(csv_fn);
+
+    return ok;
+}
+
+/*
+ * 800-bit frames let the CPB fill by 7200 bits a frame, from 40000: it is
+ * full after frame 5. With CBR, every frame from there overflows; with VBR,
+ * arrival just pauses.
+ */
+static int
+check_overflow(void)
+{
+    struct hrd_summary summary;
+    struct hrd_sim *hrd;
+    int cbr, i;
+
+    for (cbr = 0; cbr <= 1; cbr++) {
+        hrd = create(cbr, 0, NULL);
+        CHECK(hrd);
+        for (i = 0; i < 10; i++)
+            hrd_sim_add_frame(hrd, i, FRAME_BYTES / 10);
+        CHECK(hrd_sim_qp_delta(hrd) < 0);
+        hrd_sim_destroy(hrd, &summary);
+
+        CHECK(summary.underflows == 0);
+        CHECK(summary.overflows == (cbr ? 5 : 0));
+        if (cbr)
+            CHECK(summary.first_overflow == 5);
+        CHECK_NEAR(summary.max_fullness, 1.0);
+        CHECK_NEAR(summary.min_fullness, 0.49);
+    }
+    return 1;
+}
+
+/* Twice the bitrate: every full window is off, and the QP goes up */
+static int
+check_bitrate(void)
+{
+    struct hrd_summary summary;
+    struct hrd_sim *hrd;
+    int i;
+
+    hrd = create(0, 0, NULL);
+    CHECK(hrd);
+    for (i = 0; i < 75; i++)
+        hrd_sim_add_frame(hrd, i, 2 * FRAME_BYTES);
+    CHECK(hrd_sim_qp_delta(hrd) > 0);
+    hrd_sim_destroy(hrd, &summary);
+
+    /* the last window, of 15 frames, still counts, one of 10 would not */
+    CHECK(summary.windows == 3);
+    CHECK(summary.windows_off == 3);
+    CHECK_NEAR(summary.bitrate, 2 * BIT_RATE);
+    CHECK_NEAR(summary.min_deviation, 1.0);
+    CHECK_NEAR(summary.max_deviation, 1.0);
+    return 1;
+}
+
+int
+main(int argc, char **argv)
+{
+    if (!check_steady() || !check_underflow() || !check_overflow() ||
+        !check_bitrate()) {
+        printf("HRD model check FAILED\n");
+        return 1;
+    }
+    printf("HRD model check passed\n");
+
+    return 0;
+}
@@ -27,6 +27,8 @@
  * Usage:
  * ./jpegenc <width> <height> <input file> <output file> <input filetype 0(I420)/1(NV12)/2(UYVY)/3(YUY2)/4(Y8)/5(RGBA)> q <quality>
  * Currently supporting only I420/NV12/UYVY/YUY2/Y8 input file formats.
+ * ./jpegenc --batch <job list> encodes one image per line of the list, the line holding the
+ * same arguments, and keeps the VA context, surfaces and tables alive across the images.
  * 
  * NOTE: The intel-driver expects a packed header sent to it. So, the app is responsible to pack the header
  * and send to the driver through LibVA. This unit test also showcases how to send the header to the driver.
@@ -69,6 +71,9 @@ void show_help()
     printf("Usage: ./jpegenc <width> <height> <input file> <output file> <fourcc value 0(I420)/1(NV12)/2(UYVY)/3(YUY2)/4(Y8)/5(RGBA)> q <quality>\n");
     printf("Currently supporting only I420/NV12/UYVY/YUY2/Y8 input file formats.\n");
     printf("Example: ./jpegenc 1024 768 input_file.yuv output.jpeg 0 50\n\n");
+    printf("Usage: ./jpegenc --batch <job list, - for stdin>\n");
+    printf("Each line of the job list is \"<width> <height> <input file> <output file> <fourcc value> <quality>\",\n");
+    printf("the VA context, surfaces and tables are kept across the images.\n\n");
     return;
 }
 
@@ -483,14 +488,13 @@ int build_packed_jpeg_header_buffer(unsigned char **header_buffer, YUVComponentS
     return bs.bit_offset;
 }
 
-//Upload the yuv image from the file to the VASurface
-void upload_yuv_to_surface(VADisplay va_dpy, FILE *yuv_fp, VASurfaceID surface_id, YUVComponentSpecs yuvComp, int picture_width, int picture_height, int frame_size)
+//Upload the yuv image from the file to the VASurface, newImageBuffer holds frame_size bytes
+int upload_yuv_to_surface(VADisplay va_dpy, FILE *yuv_fp, VASurfaceID surface_id, YUVComponentSpecs yuvComp, int picture_width, int picture_height, int frame_size, unsigned char *newImageBuffer)
 {
 
     VAImage surface_image;
     VAStatus va_status;
     void *surface_p = NULL;
-    unsigned char newImageBuffer[frame_size];
     unsigned char *y_src, *u_src, *v_src;
     unsigned char *y_dst, *u_dst;
     int y_size = picture_width * picture_height;
@@ -501,10 +505,9 @@ void upload_yuv_to_surface(VADisplay va_dpy, FILE *yuv_fp, VASurfaceID surface_i
     //u_size is used for I420, NV12 formats only
     u_size = ((picture_width >> 1) * (picture_height >> 1));
 
-    memset(newImageBuffer,0,frame_size);
-    do {
-        n_items = fread(newImageBuffer, frame_size, 1, yuv_fp);
-    } while (n_items != 1);
+    n_items = fread(newImageBuffer, frame_size, 1, yuv_fp);
+    if (n_items != 1)
+        return -1;
 
     va_status = vaDeriveImage(va_dpy, surface_id, &surface_image);
     CHECK_VASTATUS(va_status,"vaDeriveImage");
@@ -576,6 +579,7 @@ void upload_yuv_to_surface(VADisplay va_dpy, FILE *yuv_fp, VASurfaceID surface_i
     vaUnmapBuffer(va_dpy, surface_image.buf);
     vaDestroyImage(va_dpy, surface_image.image_id);
     
+    return 0;
 }
 
 
@@ -667,50 +671,110 @@ void init_yuv_component(YUVComponentSpecs *yuvComponent, int yuv_type, int *surf
     
 }
 
-int encode_input_image(FILE *yuv_fp, FILE *jpeg_fp, int picture_width, int picture_height, int frame_size, int yuv_type, int quality)
+/*
+ * Encode session: the display, config, context, input surfaces and coded
+ * buffers are kept across images, and recreated only when the picture size
+ * or input format changes. Images go through a ring of JPEG_SURFACE_NUM
+ * surfaces: the upload of the next images overlaps the encode of the
+ * previous ones, which are synced and written when their slot comes back.
+ */
+#define JPEG_SURFACE_NUM        4
+#define JPEG_PARAMS_CACHE_NUM   8
+#define JPEG_BATCH_PATH_MAX     4096
+
+/* Table and header buffers for one quality, at the session size and format */
+/*
+ * Buffer contents for one quality. VA buffers are released by the driver
+ * once rendered, so they are created from these for every image.
+ */
+struct jpegenc_params {
+    int quality;                                /* 0: unused entry */
+    unsigned int last_used;
+    VAQMatrixBufferJPEG qmatrix;                /* Quantization Matrix */
+    VAHuffmanTableBufferJPEGBaseline hufftable; /* Huffman tables */
+    VAEncSliceParameterBufferJPEG slice_param;  /* only 1 slice per frame in jpeg encode */
+    VAEncPackedHeaderParameterBuffer packed_header_param;
+    unsigned char *packed_header;               /* Packed JPEG headers */
+};
+
+struct jpegenc_slot {
+    VASurfaceID surface_id;
+    VABufferID codedbuf_buf_id;                 /* Output buffer id, compressed data */
+    VAEncPictureParameterBufferJPEG pic_param;  /* Picture parameters, for pic_param_quality */
+    int pic_param_quality;
+    VABufferID render_ids[6];                   /* Destroyed once the image is encoded */
+    int busy;
+    FILE *jpeg_fp;
+    int close_fp;
+    char *jpeg_fn;
+};
+
+struct jpegenc_session {
+    VADisplay va_dpy;
+    VAConfigID config_id;
+    VAContextID context_id;
+
+    /* current size and format, 0x0 before the first image */
+    int picture_width;
+    int picture_height;
+    int yuv_type;
+    int frame_size;
+    int surface_type;
+    VASurfaceAttrib fourcc;
+    YUVComponentSpecs yuvComponent;
+    unsigned char *frame_buffer;
+
+    struct jpegenc_slot slots[JPEG_SURFACE_NUM];
+    int next_slot;
+
+    struct jpegenc_params params[JPEG_PARAMS_CACHE_NUM];
+    unsigned int params_clock;
+
+    unsigned int images;
+    unsigned int failures;
+    unsigned long long coded_bytes;
+};
+
+//Size of one input frame, 0 for an unsupported format
+int yuv_frame_size(int yuv_type, int picture_width, int picture_height)
 {
+    //<input file type: 0(I420)/1(NV12)/2(UYVY)/3(YUY2)/4(Y8)/5(RGBA)>
+    switch(yuv_type)
+    {
+        case 0 :   //I420 
+        case 1 :   //NV12
+            return picture_width * picture_height + ((picture_width * picture_height) >> 1);
+        case 2:    //UYVY
+        case 3:    //YUY2
+            return 2 * (picture_width * picture_height);
+        case 4:    //Y8
+            return picture_width * picture_height;
+        case 5:    //RGBA
+            return 4 * (picture_width * picture_height);
+        default:
+            return 0;
+    }
+}
+
+struct jpegenc_session *jpegenc_session_create(void)
+{
+    struct jpegenc_session *session;
     int num_entrypoints,enc_entrypoint;
     int major_ver, minor_ver;
-    int surface_type;
     VAEntrypoint entrypoints[5];
-    VASurfaceAttrib fourcc;
     VAConfigAttrib attrib[2];
-    VADisplay   va_dpy;
     VAStatus va_status;
-    VAConfigID config_id;
-    VASurfaceID surface_id;
-    VAContextID context_id;
-    VABufferID pic_param_buf_id;                /* Picture parameter id*/
-    VABufferID slice_param_buf_id;              /* Slice parameter id, only 1 slice per frame in jpeg encode */
-    VABufferID codedbuf_buf_id;                 /* Output buffer id, compressed data */
-    VABufferID packed_raw_header_param_buf_id;  /* Header parameter buffer id */
-    VABufferID packed_raw_header_buf_id;        /* Header buffer id */
-    VABufferID qmatrix_buf_id;                  /* Quantization Matrix id */
-    VABufferID huffmantable_buf_id;             /* Huffman table id*/
-    VAEncPictureParameterBufferJPEG pic_param;  /* Picture parameter buffer */
-    VAEncSliceParameterBufferJPEG slice_param;  /* Slice parameter buffer */
-    VAQMatrixBufferJPEG quantization_param;     /* Quantization Matrix buffer */
-    VAHuffmanTableBufferJPEGBaseline hufftable_param; /* Huffmantable buffer */
-    YUVComponentSpecs yuvComponent;
-    int writeToFile = 1;
-    
-    //Clamp the quality factor value to [1,100]
-    if(quality >= 100) quality=100;
-    if(quality <= 0) quality=1;
-    
-    fourcc.type =VASurfaceAttribPixelFormat;
-    fourcc.flags=VA_SURFACE_ATTRIB_SETTABLE;
-    fourcc.value.type=VAGenericValueTypeInteger;
-    
-    init_yuv_component(&yuvComponent, yuv_type, &surface_type, &fourcc);
+
+    session = calloc(1, sizeof(*session));
+    assert(session);
     
     /* 1. Initialize the va driver */
-    va_dpy = va_open_display();
-    va_status = vaInitialize(va_dpy, &major_ver, &minor_ver);
+    session->va_dpy = va_open_display();
+    va_status = vaInitialize(session->va_dpy, &major_ver, &minor_ver);
     assert(va_status == VA_STATUS_SUCCESS);
     
     /* 2. Query for the entrypoints for the JPEGBaseline profile */
-    va_status = vaQueryConfigEntrypoints(va_dpy, VAProfileJPEGBaseline, entrypoints, &num_entrypoints);
+    va_status = vaQueryConfigEntrypoints(session->va_dpy, VAProfileJPEGBaseline, entrypoints, &num_entrypoints);
     CHECK_VASTATUS(va_status, "vaQueryConfigEntrypoints");
     // We need picture level encoding (VAEntrypointEncPicture). Find if it is supported. 
     for (enc_entrypoint = 0; enc_entrypoint < num_entrypoints; enc_entrypoint++) {
@@ -725,7 +789,7 @@ int encode_input_image(FILE *yuv_fp, FILE *jpeg_fp, int picture_width, int pictu
     /* 3. Query for the Render Target format supported */
     attrib[0].type = VAConfigAttribRTFormat;
     attrib[1].type = VAConfigAttribEncJPEG;
-    vaGetConfigAttributes(va_dpy, VAProfileJPEGBaseline, VAEntrypointEncPicture, &attrib[0], 2);
+    vaGetConfigAttributes(session->va_dpy, VAProfileJPEGBaseline, VAEntrypointEncPicture, &attrib[0], 2);
 
     // RT should be one of below.
     if(!((attrib[0].value & VA_RT_FORMAT_YUV420) || (attrib[0].value & VA_RT_FORMAT_YUV422) || (attrib[0].value & VA_RT_FORMAT_RGB32)
@@ -748,159 +812,438 @@ int encode_input_image(FILE *yuv_fp, FILE *jpeg_fp, int picture_width, int pictu
     
     /* 4. Create Config for the profile=VAProfileJPEGBaseline, entrypoint=VAEntrypointEncPicture,
      * with RT format attribute */
-    va_status = vaCreateConfig(va_dpy, VAProfileJPEGBaseline, VAEntrypointEncPicture, 
-                               &attrib[0], 2, &config_id);
+    va_status = vaCreateConfig(session->va_dpy, VAProfileJPEGBaseline, VAEntrypointEncPicture, 
+                               &attrib[0], 2, &session->config_id);
     CHECK_VASTATUS(va_status, "vaQueryConfigEntrypoints");
+
+    session->context_id = VA_INVALID_ID;
+
+    return session;
+}
+
+//Waits for the image in the slot and writes it out
+static int jpegenc_session_finish(struct jpegenc_session *session, struct jpegenc_slot *slot)
+{
+    VADisplay va_dpy = session->va_dpy;
+    VAStatus va_status;
+    VASurfaceStatus surface_status;
+    VACodedBufferSegment *coded_buffer_segment, *segment;
+    int i, ret = 0;
+
+    if (!slot->busy)
+        return 0;
+    slot->busy = 0;
+
+    va_status = vaSyncSurface(va_dpy, slot->surface_id);
+    CHECK_VASTATUS(va_status, "vaSyncSurface");
+
+    for (i = 0; i < 6; i++)
+        vaDestroyBuffer(va_dpy, slot->render_ids[i]);
     
-    /* 5. Create Surface for the input picture */
-    va_status = vaCreateSurfaces(va_dpy, surface_type, picture_width, picture_height, 
-                                 &surface_id, 1, &fourcc, 1);
-    CHECK_VASTATUS(va_status, "vaCreateSurfaces");
+    surface_status = 0;
+    va_status = vaQuerySurfaceStatus(va_dpy, slot->surface_id, &surface_status);
+    CHECK_VASTATUS(va_status,"vaQuerySurfaceStatus");
+
+    va_status = vaMapBuffer(va_dpy, slot->codedbuf_buf_id, (void **)(&coded_buffer_segment));
+    CHECK_VASTATUS(va_status,"vaMapBuffer");
+
+    if (coded_buffer_segment->status & VA_CODED_BUF_STATUS_SLICE_OVERFLOW_MASK) {
+        printf("ERROR......Coded buffer too small for %s\n", slot->jpeg_fn);
+        ret = -1;
+    } else {
+        for (segment = coded_buffer_segment; segment && !ret; segment = segment->next) {
+            if (segment->size && fwrite(segment->buf, segment->size, 1, slot->jpeg_fp) != 1) {
+                printf("ERROR......Can't write %s\n", slot->jpeg_fn);
+                ret = -1;
+            }
+            session->coded_bytes += segment->size;
+        }
+    }
+
+    va_status = vaUnmapBuffer(va_dpy, slot->codedbuf_buf_id);
+    CHECK_VASTATUS(va_status, "vaUnmapBuffer");
+
+    if (slot->close_fp && fclose(slot->jpeg_fp) != 0 && !ret) {
+        printf("ERROR......Can't write %s\n", slot->jpeg_fn);
+        ret = -1;
+    }
+    slot->jpeg_fp = NULL;
+    free(slot->jpeg_fn);
+    slot->jpeg_fn = NULL;
+
+    if (ret)
+        session->failures++;
+    else
+        session->images++;
+
+    return ret;
+}
+
+//Writes out all the images in flight, in submission order
+int jpegenc_session_flush(struct jpegenc_session *session)
+{
+    int i, ret = 0;
+
+    for (i = 0; i < JPEG_SURFACE_NUM; i++) {
+        struct jpegenc_slot *slot = &session->slots[(session->next_slot + i) % JPEG_SURFACE_NUM];
+
+        if (jpegenc_session_finish(session, slot))
+            ret = -1;
+    }
+
+    return ret;
+}
+
+static void jpegenc_session_release_context(struct jpegenc_session *session)
+{
+    VADisplay va_dpy = session->va_dpy;
+    int i;
+
+    if (session->context_id == VA_INVALID_ID)
+        return;
+
+    jpegenc_session_flush(session);
+
+    for (i = 0; i < JPEG_PARAMS_CACHE_NUM; i++) {
+        struct jpegenc_params *params = &session->params[i];
+
+        if (!params->quality)
+            continue;
+        free(params->packed_header);
+        params->packed_header = NULL;
+        params->quality = 0;
+    }
+
+    for (i = 0; i < JPEG_SURFACE_NUM; i++) {
+        struct jpegenc_slot *slot = &session->slots[i];
+
+        slot->pic_param_quality = 0;
+        vaDestroyBuffer(va_dpy, slot->codedbuf_buf_id);
+        vaDestroySurfaces(va_dpy, &slot->surface_id, 1);
+    }
+
+    vaDestroyContext(va_dpy, session->context_id);
+    session->context_id = VA_INVALID_ID;
+
+    free(session->frame_buffer);
+    session->frame_buffer = NULL;
+    session->picture_width = session->picture_height = 0;
+}
+
+//(Re)creates the surfaces, context and coded buffers when the size or format changes
+static void jpegenc_session_setup(struct jpegenc_session *session, int picture_width, int picture_height, int yuv_type)
+{
+    VADisplay va_dpy = session->va_dpy;
+    VASurfaceID surface_ids[JPEG_SURFACE_NUM];
+    VAStatus va_status;
+    int i;
+
+    if (session->context_id != VA_INVALID_ID &&
+        session->picture_width == picture_width &&
+        session->picture_height == picture_height &&
+        session->yuv_type == yuv_type)
+        return;
+
+    jpegenc_session_release_context(session);
+
+    session->picture_width = picture_width;
+    session->picture_height = picture_height;
+    session->yuv_type = yuv_type;
+    session->frame_size = yuv_frame_size(yuv_type, picture_width, picture_height);
+    session->frame_buffer = malloc(session->frame_size);
+    assert(session->frame_buffer);
+
+    session->fourcc.type =VASurfaceAttribPixelFormat;
+    session->fourcc.flags=VA_SURFACE_ATTRIB_SETTABLE;
+    session->fourcc.value.type=VAGenericValueTypeInteger;
     
-    //Map the input yuv file to the input surface created with the surface_id
-    upload_yuv_to_surface(va_dpy, yuv_fp, surface_id, yuvComponent, picture_width, picture_height, frame_size);
+    init_yuv_component(&session->yuvComponent, yuv_type, &session->surface_type, &session->fourcc);
     
+    /* 5. Create Surfaces for the input pictures */
+    va_status = vaCreateSurfaces(va_dpy, session->surface_type, picture_width, picture_height, 
+                                 surface_ids, JPEG_SURFACE_NUM, &session->fourcc, 1);
+    CHECK_VASTATUS(va_status, "vaCreateSurfaces");
+
     /* 6. Create Context for the encode pipe*/
-    va_status = vaCreateContext(va_dpy, config_id, picture_width, picture_height, 
-                                VA_PROGRESSIVE, &surface_id, 1, &context_id);
+    va_status = vaCreateContext(va_dpy, session->config_id, picture_width, picture_height, 
+                                VA_PROGRESSIVE, surface_ids, JPEG_SURFACE_NUM, &session->context_id);
     CHECK_VASTATUS(va_status, "vaCreateContext");
 
-    /* Create buffer for Encoded data to be stored */
-    va_status =  vaCreateBuffer(va_dpy, context_id, VAEncCodedBufferType,
-                                   frame_size, 1, NULL, &codedbuf_buf_id);
-    CHECK_VASTATUS(va_status,"vaCreateBuffer");
+    for (i = 0; i < JPEG_SURFACE_NUM; i++) {
+        struct jpegenc_slot *slot = &session->slots[i];
+
+        slot->surface_id = surface_ids[i];
+
+        /* Create buffer for Encoded data to be stored */
+        va_status =  vaCreateBuffer(va_dpy, session->context_id, VAEncCodedBufferType,
+                                    session->frame_size, 1, NULL, &slot->codedbuf_buf_id);
+        CHECK_VASTATUS(va_status,"vaCreateBuffer");
+    }
+    session->next_slot = 0;
+}
+
+//Returns the table and header contents for quality, computing them on first use
+static struct jpegenc_params *jpegenc_session_params(struct jpegenc_session *session, int quality)
+{
+    YUVComponentSpecs yuvComponent = session->yuvComponent;
+    struct jpegenc_params *params = NULL;
+    unsigned int length_in_bits;
+    int i;
+
+    for (i = 0; i < JPEG_PARAMS_CACHE_NUM; i++) {
+        if (session->params[i].quality == quality) {
+            params = &session->params[i];
+            params->last_used = ++session->params_clock;
+            return params;
+        }
+        //evict the least recently used entry when full
+        if (params == NULL || !session->params[i].quality ||
+            (params->quality && session->params[i].last_used < params->last_used))
+            params = &session->params[i];
+    }
+
+    if (params->quality) {
+        free(params->packed_header);
+        params->packed_header = NULL;
+    }
+    params->quality = quality;
+    params->last_used = ++session->params_clock;
+    
+    //Load the QMatrix 
+    jpegenc_qmatrix_init(&params->qmatrix, yuvComponent);
     
-    //Initialize the picture parameter buffer
-    pic_param.coded_buf = codedbuf_buf_id;
-    jpegenc_pic_param_init(&pic_param, picture_width, picture_height, quality, yuvComponent);
+    //Load the Huffman Tables
+    jpegenc_hufftable_init(&params->hufftable, yuvComponent);
     
+    //Initialize the slice parameter buffer
+    jpegenc_slice_param_init(&params->slice_param, yuvComponent);
+    
+    //Pack headers and send using Raw data buffer
+    length_in_bits = build_packed_jpeg_header_buffer(&params->packed_header, yuvComponent,
+                                                     session->picture_width, session->picture_height,
+                                                     params->slice_param.restart_interval, quality);
+    params->packed_header_param.type = VAEncPackedHeaderRawData;
+    params->packed_header_param.bit_length = length_in_bits;
+    params->packed_header_param.has_emulation_bytes = 0;
+
+    return params;
+}
+
+/*
+ * Uploads one image from yuv_fp and starts its encode. The coded image is
+ * written into jpeg_fp, and jpeg_fp closed if close_fp is set, once its
+ * surface is needed again or by jpegenc_session_flush(). Returns -1 if the
+ * image could not be read.
+ */
+int jpegenc_session_submit(struct jpegenc_session *session, FILE *yuv_fp, FILE *jpeg_fp, int close_fp, const char *jpeg_fn,
+                           int picture_width, int picture_height, int yuv_type, int quality)
+{
+    VADisplay va_dpy = session->va_dpy;
+    struct jpegenc_slot *slot;
+    struct jpegenc_params *params;
+    VAContextID context_id;
+    VABufferID *render_ids;
+    VAStatus va_status;
+
+    //Clamp the quality factor value to [1,100]
+    if(quality >= 100) quality=100;
+    if(quality <= 0) quality=1;
+
+    jpegenc_session_setup(session, picture_width, picture_height, yuv_type);
+    context_id = session->context_id;
+
+    slot = &session->slots[session->next_slot];
+    jpegenc_session_finish(session, slot);
+
+    //Map the input yuv file to the input surface of the slot
+    if (upload_yuv_to_surface(va_dpy, yuv_fp, slot->surface_id, session->yuvComponent,
+                              picture_width, picture_height, session->frame_size, session->frame_buffer)) {
+        if (close_fp)
+            fclose(jpeg_fp);
+        session->failures++;
+        return -1;
+    }
+
+    params = jpegenc_session_params(session, quality);
+    render_ids = slot->render_ids;
+
+    if (slot->pic_param_quality != quality) {
+        //Initialize the picture parameter buffer
+        slot->pic_param.coded_buf = slot->codedbuf_buf_id;
+        jpegenc_pic_param_init(&slot->pic_param, picture_width, picture_height, quality, session->yuvComponent);
+        slot->pic_param_quality = quality;
+    }
+
     /* 7. Create buffer for the picture parameter */
     va_status = vaCreateBuffer(va_dpy, context_id, VAEncPictureParameterBufferType,
-                               sizeof(VAEncPictureParameterBufferJPEG), 1, &pic_param, &pic_param_buf_id);
+                               sizeof(VAEncPictureParameterBufferJPEG), 1, &slot->pic_param, &render_ids[0]);
     CHECK_VASTATUS(va_status,"vaCreateBuffer");
-    
-    //Load the QMatrix 
-    jpegenc_qmatrix_init(&quantization_param, yuvComponent);
-    
+
     /* 8. Create buffer for Quantization Matrix */
     va_status = vaCreateBuffer(va_dpy, context_id, VAQMatrixBufferType, 
-                               sizeof(VAQMatrixBufferJPEG), 1, &quantization_param, &qmatrix_buf_id);
+                               sizeof(VAQMatrixBufferJPEG), 1, &params->qmatrix, &render_ids[1]);
     CHECK_VASTATUS(va_status, "vaCreateBuffer");
-    
-    //Load the Huffman Tables
-    jpegenc_hufftable_init(&hufftable_param, yuvComponent);
-    
+
     /* 9. Create buffer for Huffman Tables */
     va_status = vaCreateBuffer(va_dpy, context_id, VAHuffmanTableBufferType, 
-                               sizeof(VAHuffmanTableBufferJPEGBaseline), 1, &hufftable_param, &huffmantable_buf_id);
+                               sizeof(VAHuffmanTableBufferJPEGBaseline), 1, &params->hufftable, &render_ids[2]);
     CHECK_VASTATUS(va_status, "vaCreateBuffer");
-    
-    //Initialize the slice parameter buffer
-    jpegenc_slice_param_init(&slice_param, yuvComponent);
-    
+
     /* 10. Create buffer for slice parameter */
     va_status = vaCreateBuffer(va_dpy, context_id, VAEncSliceParameterBufferType, 
-                            sizeof(slice_param), 1, &slice_param, &slice_param_buf_id);
+                               sizeof(params->slice_param), 1, &params->slice_param, &render_ids[3]);
     CHECK_VASTATUS(va_status, "vaCreateBuffer");
 
-    //Pack headers and send using Raw data buffer
-    VAEncPackedHeaderParameterBuffer packed_header_param_buffer;
-    unsigned int length_in_bits;
-    unsigned char *packed_header_buffer = NULL;
-
-    length_in_bits = build_packed_jpeg_header_buffer(&packed_header_buffer, yuvComponent, picture_width, picture_height, slice_param.restart_interval, quality);
-    packed_header_param_buffer.type = VAEncPackedHeaderRawData;
-    packed_header_param_buffer.bit_length = length_in_bits;
-    packed_header_param_buffer.has_emulation_bytes = 0;
-    
     /* 11. Create raw buffer for header */
     va_status = vaCreateBuffer(va_dpy,
                                context_id,
                                VAEncPackedHeaderParameterBufferType,
-                               sizeof(packed_header_param_buffer), 1, &packed_header_param_buffer,
-                               &packed_raw_header_param_buf_id);
+                               sizeof(params->packed_header_param), 1, &params->packed_header_param,
+                               &render_ids[4]);
     CHECK_VASTATUS(va_status,"vaCreateBuffer");
 
     va_status = vaCreateBuffer(va_dpy,
                                context_id,
                                VAEncPackedHeaderDataBufferType,
-                               (length_in_bits + 7) / 8, 1, packed_header_buffer,
-                               &packed_raw_header_buf_id);
+                               (params->packed_header_param.bit_length + 7) / 8, 1, params->packed_header,
+                               &render_ids[5]);
     CHECK_VASTATUS(va_status,"vaCreateBuffer");
     
     /* 12. Begin picture */
-    va_status = vaBeginPicture(va_dpy, context_id, surface_id);
+    va_status = vaBeginPicture(va_dpy, context_id, slot->surface_id);
     CHECK_VASTATUS(va_status, "vaBeginPicture");   
 
-    /* 13. Render picture for all the VA buffers created */
-    va_status = vaRenderPicture(va_dpy,context_id, &pic_param_buf_id, 1);
-    CHECK_VASTATUS(va_status, "vaRenderPicture");
-   
-    va_status = vaRenderPicture(va_dpy,context_id, &qmatrix_buf_id, 1);
-    CHECK_VASTATUS(va_status, "vaRenderPicture");
-
-    va_status = vaRenderPicture(va_dpy,context_id, &huffmantable_buf_id, 1);
-    CHECK_VASTATUS(va_status, "vaRenderPicture");
-   
-    va_status = vaRenderPicture(va_dpy,context_id, &slice_param_buf_id, 1);
+    /* 13. Render picture for all the VA buffers, they are ours to destroy once it is encoded */
+    va_status = vaRenderPicture(va_dpy, context_id, render_ids, 6);
     CHECK_VASTATUS(va_status, "vaRenderPicture");
     
-    va_status = vaRenderPicture(va_dpy,context_id, &packed_raw_header_param_buf_id, 1);
-    CHECK_VASTATUS(va_status, "vaRenderPicture");
-    
-    va_status = vaRenderPicture(va_dpy,context_id, &packed_raw_header_buf_id, 1);
-    CHECK_VASTATUS(va_status, "vaRenderPicture");
-    
-    va_status = vaEndPicture(va_dpy,context_id);
+    va_status = vaEndPicture(va_dpy, context_id);
     CHECK_VASTATUS(va_status, "vaEndPicture");
 
-    if (writeToFile) {
-        VASurfaceStatus surface_status;
-        size_t w_items;
-        VACodedBufferSegment *coded_buffer_segment;
-        unsigned char *coded_mem;
-        int slice_data_length;
+    slot->busy = 1;
+    slot->jpeg_fp = jpeg_fp;
+    slot->close_fp = close_fp;
+    slot->jpeg_fn = strdup(jpeg_fn);
+    session->next_slot = (session->next_slot + 1) % JPEG_SURFACE_NUM;
 
-        va_status = vaSyncSurface(va_dpy, surface_id);
-        CHECK_VASTATUS(va_status, "vaSyncSurface");
-    
-        surface_status = 0;
-        va_status = vaQuerySurfaceStatus(va_dpy, surface_id, &surface_status);
-        CHECK_VASTATUS(va_status,"vaQuerySurfaceStatus");
+    return 0;
+}
 
-        va_status = vaMapBuffer(va_dpy, codedbuf_buf_id, (void **)(&coded_buffer_segment));
-        CHECK_VASTATUS(va_status,"vaMapBuffer");
+void jpegenc_session_destroy(struct jpegenc_session *session)
+{
+    jpegenc_session_release_context(session);
+    vaDestroyConfig(session->va_dpy, session->config_id);
+    vaTerminate(session->va_dpy);
+    va_close_display(session->va_dpy);
+    free(session);
+}
 
-        coded_mem = coded_buffer_segment->buf;
-  
-       if (coded_buffer_segment->status & VA_CODED_BUF_STATUS_SLICE_OVERFLOW_MASK) {
-            vaUnmapBuffer(va_dpy, codedbuf_buf_id);
-            printf("ERROR......Coded buffer too small\n");
-        }
+int encode_input_image(FILE *yuv_fp, FILE *jpeg_fp, int picture_width, int picture_height, int frame_size, int yuv_type, int quality)
+{
+    struct jpegenc_session *session;
+    int ret;
+
+    session = jpegenc_session_create();
+    ret = jpegenc_session_submit(session, yuv_fp, jpeg_fp, 0, "output", picture_width, picture_height, yuv_type, quality);
+    if (jpegenc_session_flush(session))
+        ret = -1;
+    jpegenc_session_destroy(session);
 
+    return ret;
+}
 
-        slice_data_length = coded_buffer_segment->size;
+/*
+ * Batch mode: one image per line of the job list, with the same fields as
+ * the command line, "<width> <height> <input file> <output file> <fourcc> <quality>".
+ * Empty lines and lines starting with '#' are skipped, "-" reads the list
+ * from stdin so that jobs can be fed as they come.
+ */
+int encode_batch(const char *list_fn)
+{
+    struct jpegenc_session *session;
+    FILE *list_fp;
+    char line[2 * JPEG_BATCH_PATH_MAX + 64];
+    char yuv_fn[JPEG_BATCH_PATH_MAX], jpeg_fn[JPEG_BATCH_PATH_MAX];
+    int picture_width, picture_height, yuv_type, quality;
+    unsigned int line_num = 0;
+    struct timeval tpstart, tpend;
+    double elapsed;
+    
+    if (strcmp(list_fn, "-") == 0)
+        list_fp = stdin;
+    else
+        list_fp = fopen(list_fn, "r");
+    if (list_fp == NULL) {
+        printf("Can't open the job list %s\n", list_fn);
+        return -1;
+    }
 
-        do {
-            w_items = fwrite(coded_mem, slice_data_length, 1, jpeg_fp);
-        } while (w_items != 1);
+    session = jpegenc_session_create();
+    gettimeofday(&tpstart, NULL);
+
+    while (fgets(line, sizeof(line), list_fp)) {
+        FILE *yuv_fp, *jpeg_fp;
+        off_t file_size;
+        int frame_size;
+        char *p = line;
+
+        line_num++;
+        while (*p == ' ' || *p == '\t')
+            p++;
+        if (*p == '#' || *p == '\n' || *p == '\0')
+            continue;
+
+        if (sscanf(p, "%d %d %4095s %4095s %d %d", &picture_width, &picture_height,
+                   yuv_fn, jpeg_fn, &yuv_type, &quality) != 6 ||
+            picture_width <= 0 || picture_height <= 0 ||
+            (frame_size = yuv_frame_size(yuv_type, picture_width, picture_height)) == 0) {
+            printf("Line %u: invalid job\n", line_num);
+            session->failures++;
+            continue;
+        }
 
-        va_status = vaUnmapBuffer(va_dpy, codedbuf_buf_id);
-        CHECK_VASTATUS(va_status, "vaUnmapBuffer");
+        yuv_fp = fopen(yuv_fn, "rb");
+        if (yuv_fp == NULL) {
+            printf("Line %u: can't open input YUV file %s\n", line_num, yuv_fn);
+            session->failures++;
+            continue;
+        }
+        fseeko(yuv_fp, (off_t)0, SEEK_END);
+        file_size = ftello(yuv_fp);
+        fseeko(yuv_fp, (off_t)0, SEEK_SET);
+        if (file_size < frame_size) {
+            printf("Line %u: %s is smaller than one %dx%d frame\n", line_num, yuv_fn,
+                   picture_width, picture_height);
+            fclose(yuv_fp);
+            session->failures++;
+            continue;
+        }
+
+        jpeg_fp = fopen(jpeg_fn, "wb");
+        if (jpeg_fp == NULL) {
+            printf("Line %u: can't open output jpeg file %s\n", line_num, jpeg_fn);
+            fclose(yuv_fp);
+            session->failures++;
+            continue;
+        }
+
+        if (jpegenc_session_submit(session, yuv_fp, jpeg_fp, 1, jpeg_fn,
+                                   picture_width, picture_height, yuv_type, quality))
+            printf("Line %u: can't read %s\n", line_num, yuv_fn);
+        fclose(yuv_fp);
     }
-       
-    vaDestroyBuffer(va_dpy, pic_param_buf_id);
-    vaDestroyBuffer(va_dpy, qmatrix_buf_id);
-    vaDestroyBuffer(va_dpy, slice_param_buf_id);
-    vaDestroyBuffer(va_dpy, huffmantable_buf_id);
-    vaDestroyBuffer(va_dpy, codedbuf_buf_id);
-    vaDestroyBuffer(va_dpy, packed_raw_header_param_buf_id);
-    vaDestroyBuffer(va_dpy, packed_raw_header_buf_id);
-    vaDestroySurfaces(va_dpy,&surface_id,1);
-    vaDestroyContext(va_dpy,context_id);
-    vaDestroyConfig(va_dpy,config_id);
-    vaTerminate(va_dpy);
-    va_close_display(va_dpy);
+    jpegenc_session_flush(session);
+
+    gettimeofday(&tpend, NULL);
+    elapsed = (tpend.tv_sec - tpstart.tv_sec) + (tpend.tv_usec - tpstart.tv_usec) / 1000000.0;
+
+    printf("Encoded %u images (%u failed) in %.3f s, %.1f images/s, %.2f MB coded\n",
+           session->images, session->failures, elapsed,
+           elapsed > 0 ? session->images / elapsed : 0.0, session->coded_bytes / 1048576.0);
+
+    jpegenc_session_destroy(session);
+    if (list_fp != stdin)
+        fclose(list_fp);
 
     return 0;
 }
@@ -920,6 +1263,9 @@ int main(int argc, char *argv[])
     unsigned int frame_size = 0;
     
     va_init_display_args(&argc, argv);
+
+    if (argc == 3 && strcmp(argv[1], "--batch") == 0)
+        return encode_batch(argv[2]);
     
     if(argc != 7) {
         show_help();
@@ -940,37 +1286,12 @@ int main(int argc, char *argv[])
     fseeko(yuv_fp, (off_t)0, SEEK_END);
     file_size = ftello(yuv_fp);
     
-    //<input file type: 0(I420)/1(NV12)/2(UYVY)/3(YUY2)/4(Y8)/5(RGBA)>
-    switch(yuv_type)
-    {
-        case 0 :   //I420 
-        case 1 : { //NV12
-            frame_size = picture_width * picture_height +  ((picture_width * picture_height) >> 1) ; 
-            break;
-        }
-        
-        case 2:  //UYVY
-        case 3: { //YUY2
-           frame_size = 2 * (picture_width * picture_height); 
-           break;
-        }
-        
-        case 4: { //Y8
-            frame_size = picture_width * picture_height;
-            break;
-        }
-        
-        case 5: { //RGBA
-            frame_size = 4 * (picture_width * picture_height) ;
-            break;
-        }
-        
-        default: {
-            printf("Unsupported format:\n");
-            show_help();
-            break;
-        }
-        
+    frame_size = yuv_frame_size(yuv_type, picture_width, picture_height);
+    if (frame_size == 0) {
+        fclose(yuv_fp);
+        printf("Unsupported format:\n");
+        show_help();
+        return -1;
     }
     
     if ( (file_size < frame_size) || (file_size % frame_size) ) {
@@ -998,4 +1319,3 @@ int main(int argc, char *argv[])
     
     return 0;   
 }
-
@@ -41,6 +41,8 @@
 #include <va/va_enc_mpeg2.h>
 
 #include "va_display.h"
+#include "bitstream.h"
+#include "coded_sink.h"
 
 #define START_CODE_PICUTRE      0x00000100
 #define START_CODE_SLICE        0x00000101
@@ -110,6 +112,7 @@ struct mpeg2enc_context {
     int qp;
     FILE *ifp;
     FILE *ofp;
+    struct coded_sink *osink;
     unsigned char *frame_data_buffer;
     int intra_period;
     int ip_period;
@@ -150,98 +153,6 @@ struct mpeg2enc_context {
 /*
  * mpeg2enc helpers
  */
-#define BITSTREAM_ALLOCATE_STEPPING     4096
-
-struct __bitstream {
-    unsigned int *buffer;
-    int bit_offset;
-    int max_size_in_dword;
-};
-
-typedef struct __bitstream bitstream;
-
-static unsigned int 
-swap32(unsigned int val)
-{
-    unsigned char *pval = (unsigned char *)&val;
-
-    return ((pval[0] << 24)     |
-            (pval[1] << 16)     |
-            (pval[2] << 8)      |
-            (pval[3] << 0));
-}
-
-static void
-bitstream_start(bitstream *bs)
-{
-    bs->max_size_in_dword = BITSTREAM_ALLOCATE_STEPPING;
-    bs->buffer = calloc(bs->max_size_in_dword * sizeof(int), 1);
-    bs->bit_offset = 0;
-}
-
-static void
-bitstream_end(bitstream *bs)
-{
-    int pos = (bs->bit_offset >> 5);
-    int bit_offset = (bs->bit_offset & 0x1f);
-    int bit_left = 32 - bit_offset;
-
-    if (bit_offset) {
-        bs->buffer[pos] = swap32((bs->buffer[pos] << bit_left));
-    }
-}
- 
-static void
-bitstream_put_ui(bitstream *bs, unsigned int val, int size_in_bits)
-{
-    int pos = (bs->bit_offset >> 5);
-    int bit_offset = (bs->bit_offset & 0x1f);
-    int bit_left = 32 - bit_offset;
-
-    if (!size_in_bits)
-        return;
-
-    if (size_in_bits < 32)
-        val &= ((1 << size_in_bits) - 1);
-
-    bs->bit_offset += size_in_bits;
-
-    if (bit_left > size_in_bits) {
-        bs->buffer[pos] = (bs->buffer[pos] << size_in_bits | val);
-    } else {
-        size_in_bits -= bit_left;
-        bs->buffer[pos] = (bs->buffer[pos] << bit_left) | (val >> size_in_bits);
-        bs->buffer[pos] = swap32(bs->buffer[pos]);
-
-        if (pos + 1 == bs->max_size_in_dword) {
-            bs->max_size_in_dword += BITSTREAM_ALLOCATE_STEPPING;
-            bs->buffer = realloc(bs->buffer, bs->max_size_in_dword * sizeof(unsigned int));
-        }
-
-        bs->buffer[pos + 1] = val;
-    }
-}
-
-static void
-bitstream_byte_aligning(bitstream *bs, int bit)
-{
-    int bit_offset = (bs->bit_offset & 0x7);
-    int bit_left = 8 - bit_offset;
-    int new_val;
-
-    if (!bit_offset)
-        return;
-
-    assert(bit == 0 || bit == 1);
-
-    if (bit)
-        new_val = (1 << bit_left) - 1;
-    else
-        new_val = 0;
-
-    bitstream_put_ui(bs, new_val, bit_left);
-}
-
 static struct mpeg2_frame_rate {
     int code;
     float value;
@@ -511,6 +422,11 @@ mpeg2enc_exit(struct mpeg2enc_context *ctx, int exit_code)
         ctx->ifp = NULL;
     }
 
+    if (ctx->osink) {
+        coded_sink_destroy(ctx->osink);
+        ctx->osink = NULL;
+    }
+
     if (ctx->ofp) {
         fclose(ctx->ofp);
         ctx->ofp = NULL;
@@ -624,6 +540,13 @@ parse_args(struct mpeg2enc_context *ctx, int argc, char **argv)
         goto err_exit;
     }
 
+    ctx->osink = coded_sink_create(fileno(ctx->ofp), 0);
+
+    if (ctx->osink == NULL) {
+        fprintf(stderr, "Can't allocate the output\n");
+        goto err_exit;
+    }
+
     opterr = 0;
     ctx->fps = 30;
     ctx->qp = 8;
@@ -1307,12 +1230,9 @@ end_picture(struct mpeg2enc_context *ctx, VAEncPictureType picture_type, int nex
 static int
 store_coded_buffer(struct mpeg2enc_context *ctx, VAEncPictureType picture_type)
 {
-    VACodedBufferSegment *coded_buffer_segment;
-    unsigned char *coded_mem;
     int slice_data_length;
     VAStatus va_status;
     VASurfaceStatus surface_status;
-    size_t w_items;
 
     va_status = vaSyncSurface(ctx->va_dpy, surface_ids[ctx->current_input_surface]);
     CHECK_VASTATUS(va_status,"vaSyncSurface");
@@ -1321,25 +1241,21 @@ store_coded_buffer(struct mpeg2enc_context *ctx, VAEncPictureType picture_type)
     va_status = vaQuerySurfaceStatus(ctx->va_dpy, surface_ids[ctx->current_input_surface], &surface_status);
     CHECK_VASTATUS(va_status,"vaQuerySurfaceStatus");
 
-    va_status = vaMapBuffer(ctx->va_dpy, ctx->codedbuf_buf_id, (void **)(&coded_buffer_segment));
-    CHECK_VASTATUS(va_status,"vaMapBuffer");
-    coded_mem = coded_buffer_segment->buf;
+    slice_data_length = coded_sink_write(ctx->osink, ctx->va_dpy, ctx->codedbuf_buf_id, 1);
 
-    if (coded_buffer_segment->status & VA_CODED_BUF_STATUS_SLICE_OVERFLOW_MASK) {
+    if (slice_data_length == CODED_SINK_OVERFLOW) {
         if (picture_type == VAEncPictureTypeIntra)
             ctx->codedbuf_i_size *= 2;
         else
             ctx->codedbuf_pb_size *= 2;
 
-        vaUnmapBuffer(ctx->va_dpy, ctx->codedbuf_buf_id);
         return -1;
     }
 
-    slice_data_length = coded_buffer_segment->size;
-
-    do {
-        w_items = fwrite(coded_mem, slice_data_length, 1, ctx->ofp);
-    } while (w_items != 1);
+    if (slice_data_length < 0) {
+        fprintf(stderr, "Failed to write the coded data\n");
+        mpeg2enc_exit(ctx, 1);
+    }
 
     if (picture_type == VAEncPictureTypeIntra) {
         if (ctx->codedbuf_i_size > slice_data_length * 3 / 2) {
@@ -1355,8 +1271,6 @@ store_coded_buffer(struct mpeg2enc_context *ctx, VAEncPictureType picture_type)
         }
     }
 
-    vaUnmapBuffer(ctx->va_dpy, ctx->codedbuf_buf_id);
-
     return 0;
 }
 
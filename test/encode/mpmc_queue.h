@@ -0,0 +1,200 @@
+/*
+ * Copyright (c) 2015 Intel Corporation. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+ * IN NO EVENT SHALL PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR
+ * ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Bounded lock-free multi-producer/multi-consumer queue of pointers
+ * (D. Vyukov's sequence-numbered ring), plus a blocking pop that sleeps
+ * on a condition variable only when the queue is empty.
+ *
+ * Usage:
+ *   struct mpmc_queue q;
+ *   mpmc_queue_init(&q);
+ *   mpmc_queue_push(&q, item);         // returns 0 when full
+ *   item = mpmc_queue_pop_wait(&q);    // NULL once closed and drained
+ *   mpmc_queue_close(&q);
+ */
+
+#ifndef MPMC_QUEUE_H
+#define MPMC_QUEUE_H
+
+#include <pthread.h>
+
+/* Must be a power of two */
+#define MPMC_QUEUE_SIZE 32
+
+struct mpmc_queue_cell {
+    unsigned long sequence;
+    void *data;
+};
+
+struct mpmc_queue {
+    struct mpmc_queue_cell cells[MPMC_QUEUE_SIZE];
+    /* keep producers and consumers on separate cache lines */
+    char pad0[64];
+    unsigned long enqueue_pos;
+    char pad1[64];
+    unsigned long dequeue_pos;
+    char pad2[64];
+
+    /* sleeping consumers */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int sleepers;
+    int closed;
+};
+
+static inline void
+mpmc_queue_init(struct mpmc_queue *q)
+{
+    unsigned long i;
+
+    for (i = 0; i < MPMC_QUEUE_SIZE; i++)
+        __atomic_store_n(&q->cells[i].sequence, i, __ATOMIC_RELAXED);
+    __atomic_store_n(&q->enqueue_pos, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&q->dequeue_pos, 0, __ATOMIC_RELAXED);
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->cond, NULL);
+    q->sleepers = 0;
+    q->closed = 0;
+}
+
+static inline void
+mpmc_queue_destroy(struct mpmc_queue *q)
+{
+    pthread_cond_destroy(&q->cond);
+    pthread_mutex_destroy(&q->lock);
+}
+
+static inline int
+mpmc_queue_try_push(struct mpmc_queue *q, void *data)
+{
+    struct mpmc_queue_cell *cell;
+    unsigned long pos = __atomic_load_n(&q->enqueue_pos, __ATOMIC_RELAXED);
+    long diff;
+
+    for (;;) {
+        cell = &q->cells[pos & (MPMC_QUEUE_SIZE - 1)];
+        diff = (long)__atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE) - (long)pos;
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&q->enqueue_pos, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0)
+            return 0;           /* full */
+        else
+            pos = __atomic_load_n(&q->enqueue_pos, __ATOMIC_RELAXED);
+    }
+    cell->data = data;
+    __atomic_store_n(&cell->sequence, pos + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+static inline void *
+mpmc_queue_try_pop(struct mpmc_queue *q)
+{
+    struct mpmc_queue_cell *cell;
+    unsigned long pos = __atomic_load_n(&q->dequeue_pos, __ATOMIC_RELAXED);
+    void *data;
+    long diff;
+
+    for (;;) {
+        cell = &q->cells[pos & (MPMC_QUEUE_SIZE - 1)];
+        diff = (long)__atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE) - (long)(pos + 1);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&q->dequeue_pos, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0)
+            return NULL;        /* empty */
+        else
+            pos = __atomic_load_n(&q->dequeue_pos, __ATOMIC_RELAXED);
+    }
+    data = cell->data;
+    __atomic_store_n(&cell->sequence, pos + MPMC_QUEUE_SIZE, __ATOMIC_RELEASE);
+    return data;
+}
+
+static inline int
+mpmc_queue_is_empty(struct mpmc_queue *q)
+{
+    unsigned long pos = __atomic_load_n(&q->dequeue_pos, __ATOMIC_SEQ_CST);
+    struct mpmc_queue_cell *cell = &q->cells[pos & (MPMC_QUEUE_SIZE - 1)];
+
+    return __atomic_load_n(&cell->sequence, __ATOMIC_SEQ_CST) != pos + 1;
+}
+
+/* Pushes and wakes up a sleeping consumer, if any. Returns 0 when full */
+static inline int
+mpmc_queue_push(struct mpmc_queue *q, void *data)
+{
+    if (!mpmc_queue_try_push(q, data))
+        return 0;
+
+    /* pairs with the sleepers increment in mpmc_queue_pop_wait() */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&q->sleepers, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&q->lock);
+        pthread_cond_signal(&q->cond);
+        pthread_mutex_unlock(&q->lock);
+    }
+    return 1;
+}
+
+/* Pops an item, sleeping while the queue is empty. NULL once closed and empty */
+static inline void *
+mpmc_queue_pop_wait(struct mpmc_queue *q)
+{
+    void *data;
+
+    for (;;) {
+        data = mpmc_queue_try_pop(q);
+        if (data)
+            return data;
+
+        pthread_mutex_lock(&q->lock);
+        __atomic_add_fetch(&q->sleepers, 1, __ATOMIC_SEQ_CST);
+        if (mpmc_queue_is_empty(q)) {
+            if (q->closed) {
+                __atomic_sub_fetch(&q->sleepers, 1, __ATOMIC_SEQ_CST);
+                pthread_mutex_unlock(&q->lock);
+                return NULL;
+            }
+            pthread_cond_wait(&q->cond, &q->lock);
+        }
+        __atomic_sub_fetch(&q->sleepers, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&q->lock);
+    }
+}
+
+/* No more pushes; wakes up every consumer so that they drain and return */
+static inline void
+mpmc_queue_close(struct mpmc_queue *q)
+{
+    pthread_mutex_lock(&q->lock);
+    q->closed = 1;
+    pthread_cond_broadcast(&q->cond);
+    pthread_mutex_unlock(&q->lock);
+}
+
+#endif /* MPMC_QUEUE_H */
@@ -0,0 +1,523 @@
+/*
+ * Copyright (c) 2015 Intel Corporation. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+ * IN NO EVENT SHALL PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR
+ * ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "quality_metrics.h"
+
+#ifndef VA_FOURCC_I420
+#define VA_FOURCC_I420          VA_FOURCC('I','4','2','0')
+#endif
+
+/* Frames that may be waiting for the worker before submit blocks */
+#define QM_MAX_PENDING          4
+
+#define QM_MAX_PSNR             100.0
+
+struct quality_job {
+    unsigned long long frame_num;
+    unsigned char *src[3];
+    unsigned char *rec[3];
+};
+
+struct quality_metrics {
+    unsigned int width[3];
+    unsigned int height[3];
+    FILE *csv_fp;
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t job_ready;           /* queue not empty, or quit */
+    pthread_cond_t job_done;            /* a job went back to the free list */
+    int quit;
+
+    struct quality_job jobs[QM_MAX_PENDING];
+    /* jobs[queue[(head + i) % QM_MAX_PENDING]], i < queued, wait for the worker */
+    unsigned int queue[QM_MAX_PENDING];
+    unsigned int head, queued;
+    /* the remaining ones, free_jobs[0..num_free) are available */
+    unsigned int free_jobs[QM_MAX_PENDING];
+    unsigned int num_free;
+
+    /* worker thread only */
+    int (*ssim_sums)[4];
+    uint64_t total_sse[3];
+    double total_psnr[3];
+    double total_ssim[3];
+    unsigned int frames;
+};
+
+/* Sum of squared differences over a plane */
+static uint64_t
+plane_sse(const unsigned char *a, unsigned int a_pitch,
+          const unsigned char *b, unsigned int b_pitch,
+          unsigned int width, unsigned int height)
+{
+    uint64_t sse = 0;
+    unsigned int x, y;
+
+    for (y = 0; y < height; y++, a += a_pitch, b += b_pitch) {
+        uint32_t row_sse = 0;
+
+        x = 0;
+#ifdef __SSE2__
+        {
+            const __m128i zero = _mm_setzero_si128();
+            __m128i acc = zero;
+            uint32_t lanes[4];
+
+            /* At most 2 * 255^2 per 32-bit lane and per 16 pixels, no
+               overflow for any row narrower than 64K pixels */
+            for (; x + 16 <= width; x += 16) {
+                __m128i va = _mm_loadu_si128((const __m128i *)(a + x));
+                __m128i vb = _mm_loadu_si128((const __m128i *)(b + x));
+                __m128i d_lo = _mm_sub_epi16(_mm_unpacklo_epi8(va, zero),
+                                             _mm_unpacklo_epi8(vb, zero));
+                __m128i d_hi = _mm_sub_epi16(_mm_unpackhi_epi8(va, zero),
+                                             _mm_unpackhi_epi8(vb, zero));
+
+                acc = _mm_add_epi32(acc, _mm_madd_epi16(d_lo, d_lo));
+                acc = _mm_add_epi32(acc, _mm_madd_epi16(d_hi, d_hi));
+            }
+            _mm_storeu_si128((__m128i *)lanes, acc);
+            row_sse = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+        }
+#endif
+        for (; x < width; x++) {
+            int d = a[x] - b[x];
+            row_sse += d * d;
+        }
+        sse += row_sse;
+    }
+    return sse;
+}
+
+/*
+ * SSIM over 8x8 windows overlapping by 4 pixels, built from the sums of
+ * 4x4 blocks: s1 = sum(a), s2 = sum(b), ss = sum(a^2 + b^2), s12 = sum(a*b)
+ */
+static void
+ssim_4x4_core(const unsigned char *a, unsigned int a_pitch,
+              const unsigned char *b, unsigned int b_pitch, int sums[4])
+{
+    int s1 = 0, s2 = 0, ss = 0, s12 = 0;
+    int x, y;
+
+    for (y = 0; y < 4; y++, a += a_pitch, b += b_pitch) {
+        for (x = 0; x < 4; x++) {
+            s1 += a[x];
+            s2 += b[x];
+            ss += a[x] * a[x] + b[x] * b[x];
+            s12 += a[x] * b[x];
+        }
+    }
+    sums[0] = s1;
+    sums[1] = s2;
+    sums[2] = ss;
+    sums[3] = s12;
+}
+
+/* Two horizontally adjacent 4x4 blocks */
+static void
+ssim_4x4x2_core(const unsigned char *a, unsigned int a_pitch,
+                const unsigned char *b, unsigned int b_pitch, int sums[2][4])
+{
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i ones = _mm_set1_epi16(1);
+    __m128i s1 = zero, s2 = zero, ss = zero, s12 = zero;
+    int32_t v[4][4];
+    int y;
+
+    for (y = 0; y < 4; y++, a += a_pitch, b += b_pitch) {
+        __m128i va = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)a), zero);
+        __m128i vb = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)b), zero);
+
+        s1 = _mm_add_epi16(s1, va);
+        s2 = _mm_add_epi16(s2, vb);
+        ss = _mm_add_epi32(ss, _mm_add_epi32(_mm_madd_epi16(va, va),
+                                             _mm_madd_epi16(vb, vb)));
+        s12 = _mm_add_epi32(s12, _mm_madd_epi16(va, vb));
+    }
+
+    /* 32-bit lanes 0-1 belong to the left block, 2-3 to the right one */
+    _mm_storeu_si128((__m128i *)v[0], _mm_madd_epi16(s1, ones));
+    _mm_storeu_si128((__m128i *)v[1], _mm_madd_epi16(s2, ones));
+    _mm_storeu_si128((__m128i *)v[2], ss);
+    _mm_storeu_si128((__m128i *)v[3], s12);
+    for (y = 0; y < 4; y++) {
+        sums[0][y] = v[y][0] + v[y][1];
+        sums[1][y] = v[y][2] + v[y][3];
+    }
+#else
+    ssim_4x4_core(a, a_pitch, b, b_pitch, sums[0]);
+    ssim_4x4_core(a + 4, a_pitch, b + 4, b_pitch, sums[1]);
+#endif
+}
+
+static float
+ssim_end1(int s1, int s2, int ss, int s12)
+{
+    static const int ssim_c1 = (int)(.01 * .01 * 255 * 255 * 64 + .5);
+    static const int ssim_c2 = (int)(.03 * .03 * 255 * 255 * 64 * 63 + .5);
+    int vars = ss * 64 - s1 * s1 - s2 * s2;
+    int covar = s12 * 64 - s1 * s2;
+
+    return (float)(2 * s1 * s2 + ssim_c1) * (float)(2 * covar + ssim_c2) /
+        ((float)(s1 * s1 + s2 * s2 + ssim_c1) * (float)(vars + ssim_c2));
+}
+
+static double
+plane_ssim(const unsigned char *a, unsigned int a_pitch,
+           const unsigned char *b, unsigned int b_pitch,
+           unsigned int width, unsigned int height, int (*sums)[4])
+{
+    unsigned int w = width / 4, h = height / 4;
+    int (*sum0)[4] = sums, (*sum1)[4] = sums + w, (*tmp)[4];
+    unsigned int x, y, z = 0;
+    double ssim = 0.0;
+
+    if (w < 2 || h < 2)
+        return 1.0;
+
+    for (y = 1; y < h; y++) {
+        /* sum0 holds the 4x4 block row y, sum1 the row above */
+        for (; z <= y; z++) {
+            const unsigned char *pa = a + 4 * z * a_pitch;
+            const unsigned char *pb = b + 4 * z * b_pitch;
+
+            tmp = sum0;
+            sum0 = sum1;
+            sum1 = tmp;
+            for (x = 0; x + 2 <= w; x += 2)
+                ssim_4x4x2_core(pa + 4 * x, a_pitch, pb + 4 * x, b_pitch, &sum0[x]);
+            if (x < w)
+                ssim_4x4_core(pa + 4 * x, a_pitch, pb + 4 * x, b_pitch, sum0[x]);
+        }
+        for (x = 0; x < w - 1; x++)
+            ssim += ssim_end1(sum0[x][0] + sum0[x + 1][0] + sum1[x][0] + sum1[x + 1][0],
+                              sum0[x][1] + sum0[x + 1][1] + sum1[x][1] + sum1[x + 1][1],
+                              sum0[x][2] + sum0[x + 1][2] + sum1[x][2] + sum1[x + 1][2],
+                              sum0[x][3] + sum0[x + 1][3] + sum1[x][3] + sum1[x + 1][3]);
+    }
+    return ssim / ((w - 1) * (h - 1));
+}
+
+static double
+sse_to_psnr(uint64_t sse, uint64_t samples)
+{
+    if (sse == 0)
+        return QM_MAX_PSNR;
+    return 10.0 * log10(255.0 * 255.0 * samples / sse);
+}
+
+static void
+process_job(struct quality_metrics *qm, struct quality_job *job)
+{
+    double psnr[3], ssim[3];
+    uint64_t sse;
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        sse = plane_sse(job->src[i], qm->width[i], job->rec[i], qm->width[i],
+                        qm->width[i], qm->height[i]);
+        psnr[i] = sse_to_psnr(sse, (uint64_t)qm->width[i] * qm->height[i]);
+        ssim[i] = plane_ssim(job->src[i], qm->width[i], job->rec[i], qm->width[i],
+                             qm->width[i], qm->height[i], qm->ssim_sums);
+
+        qm->total_sse[i] += sse;
+        qm->total_psnr[i] += psnr[i];
+        qm->total_ssim[i] += ssim[i];
+    }
+    qm->frames++;
+
+    if (qm->csv_fp)
+        fprintf(qm->csv_fp, "%llu,%.4f,%.4f,%.4f,%.6f,%.6f,%.6f\n", job->frame_num,
+                psnr[0], psnr[1], psnr[2], ssim[0], ssim[1], ssim[2]);
+}
+
+static void *
+quality_metrics_thread(void *data)
+{
+    struct quality_metrics *qm = data;
+    unsigned int index;
+
+    pthread_mutex_lock(&qm->lock);
+    while (1) {
+        while (qm->queued == 0 && !qm->quit)
+            pthread_cond_wait(&qm->job_ready, &qm->lock);
+        if (qm->queued == 0)
+            break;
+
+        index = qm->queue[qm->head];
+        qm->head = (qm->head + 1) % QM_MAX_PENDING;
+        qm->queued--;
+        pthread_mutex_unlock(&qm->lock);
+
+        process_job(qm, &qm->jobs[index]);
+
+        pthread_mutex_lock(&qm->lock);
+        qm->free_jobs[qm->num_free++] = index;
+        pthread_cond_signal(&qm->job_done);
+    }
+    pthread_mutex_unlock(&qm->lock);
+
+    return NULL;
+}
+
+struct quality_metrics *
+quality_metrics_create(unsigned int width, unsigned int height, const char *csv_fn)
+{
+    struct quality_metrics *qm;
+    size_t frame_size;
+    int i, j;
+
+    qm = calloc(1, sizeof(*qm));
+    if (qm == NULL)
+        return NULL;
+
+    qm->width[0] = width;
+    qm->height[0] = height;
+    qm->width[1] = qm->width[2] = (width + 1) / 2;
+    qm->height[1] = qm->height[2] = (height + 1) / 2;
+    frame_size = (size_t)qm->width[0] * qm->height[0] +
+        2 * (size_t)qm->width[1] * qm->height[1];
+
+    for (i = 0; i < QM_MAX_PENDING; i++) {
+        unsigned char *src = malloc(frame_size);
+        unsigned char *rec = malloc(frame_size);
+
+        if (src == NULL || rec == NULL) {
+            free(src);
+            free(rec);
+            goto error;
+        }
+        for (j = 0; j < 3; j++) {
+            qm->jobs[i].src[j] = src;
+            qm->jobs[i].rec[j] = rec;
+            src += qm->width[j] * qm->height[j];
+            rec += qm->width[j] * qm->height[j];
+        }
+        qm->free_jobs[qm->num_free++] = i;
+    }
+
+    /* two rows of 4x4 block sums */
+    qm->ssim_sums = malloc(2 * (width / 4 + 1) * sizeof(*qm->ssim_sums));
+    if (qm->ssim_sums == NULL)
+        goto error;
+
+    if (csv_fn) {
+        qm->csv_fp = fopen(csv_fn, "w");
+        if (qm->csv_fp == NULL) {
+            printf("Open quality CSV file %s failed\n", csv_fn);
+            goto error;
+        }
+        fprintf(qm->csv_fp, "frame,psnr_y,psnr_u,psnr_v,ssim_y,ssim_u,ssim_v\n");
+    }
+
+    pthread_mutex_init(&qm->lock, NULL);
+    pthread_cond_init(&qm->job_ready, NULL);
+    pthread_cond_init(&qm->job_done, NULL);
+    if (pthread_create(&qm->thread, NULL, quality_metrics_thread, qm) != 0) {
+        pthread_cond_destroy(&qm->job_done);
+        pthread_cond_destroy(&qm->job_ready);
+        pthread_mutex_destroy(&qm->lock);
+        goto error;
+    }
+    return qm;
+
+error:
+    if (qm->csv_fp)
+        fclose(qm->csv_fp);
+    free(qm->ssim_sums);
+    for (i = 0; i < QM_MAX_PENDING; i++) {
+        free(qm->jobs[i].src[0]);
+        free(qm->jobs[i].rec[0]);
+    }
+    free(qm);
+    return NULL;
+}
+
+/* Copies one plane, picking every step-th byte of the source */
+static void
+copy_plane(unsigned char *dst, const unsigned char *src, unsigned int pitch,
+           unsigned int step, unsigned int width, unsigned int height)
+{
+    unsigned int x, y;
+
+    for (y = 0; y < height; y++, dst += width, src += pitch) {
+        if (step == 1)
+            memcpy(dst, src, width);
+        else {
+            for (x = 0; x < width; x++)
+                dst[x] = src[x * step];
+        }
+    }
+}
+
+static int
+copy_frame(struct quality_metrics *qm, unsigned char *dst[3],
+           const struct quality_frame *frame)
+{
+    copy_plane(dst[0], frame->planes[0], frame->pitches[0], 1,
+               qm->width[0], qm->height[0]);
+
+    switch (frame->fourcc) {
+    case VA_FOURCC_NV12:
+        copy_plane(dst[1], frame->planes[1], frame->pitches[1], 2,
+                   qm->width[1], qm->height[1]);
+        copy_plane(dst[2], frame->planes[1] + 1, frame->pitches[1], 2,
+                   qm->width[2], qm->height[2]);
+        break;
+    case VA_FOURCC_IYUV:
+    case VA_FOURCC_I420:
+    case VA_FOURCC_YV12:
+        copy_plane(dst[1], frame->planes[1], frame->pitches[1], 1,
+                   qm->width[1], qm->height[1]);
+        copy_plane(dst[2], frame->planes[2], frame->pitches[2], 1,
+                   qm->width[2], qm->height[2]);
+        break;
+    default:
+        return -1;
+    }
+    return 0;
+}
+
+int
+quality_metrics_submit(struct quality_metrics *qm, unsigned long long frame_num,
+                       const struct quality_frame *src, const struct quality_frame *rec)
+{
+    struct quality_job *job;
+    unsigned int index;
+    int ret;
+
+    pthread_mutex_lock(&qm->lock);
+    while (qm->num_free == 0)
+        pthread_cond_wait(&qm->job_done, &qm->lock);
+    index = qm->free_jobs[--qm->num_free];
+    pthread_mutex_unlock(&qm->lock);
+
+    job = &qm->jobs[index];
+    job->frame_num = frame_num;
+    ret = copy_frame(qm, job->src, src);
+    if (ret == 0)
+        ret = copy_frame(qm, job->rec, rec);
+
+    pthread_mutex_lock(&qm->lock);
+    if (ret == 0) {
+        qm->queue[(qm->head + qm->queued) % QM_MAX_PENDING] = index;
+        qm->queued++;
+        pthread_cond_signal(&qm->job_ready);
+    } else
+        qm->free_jobs[qm->num_free++] = index;
+    pthread_mutex_unlock(&qm->lock);
+
+    return ret;
+}
+
+int
+quality_frame_from_image(struct quality_frame *frame, const VAImage *image, void *data)
+{
+    unsigned char *base = data;
+
+    frame->fourcc = image->format.fourcc;
+    frame->planes[0] = base + image->offsets[0];
+    frame->pitches[0] = image->pitches[0];
+
+    switch (image->format.fourcc) {
+    case VA_FOURCC_NV12:
+        frame->planes[1] = base + image->offsets[1];
+        frame->pitches[1] = image->pitches[1];
+        frame->planes[2] = NULL;
+        frame->pitches[2] = 0;
+        break;
+    case VA_FOURCC_IYUV:
+    case VA_FOURCC_I420:
+        frame->planes[1] = base + image->offsets[1];
+        frame->pitches[1] = image->pitches[1];
+        frame->planes[2] = base + image->offsets[2];
+        frame->pitches[2] = image->pitches[2];
+        break;
+    case VA_FOURCC_YV12:
+        frame->planes[1] = base + image->offsets[2];
+        frame->pitches[1] = image->pitches[2];
+        frame->planes[2] = base + image->offsets[1];
+        frame->pitches[2] = image->pitches[1];
+        break;
+    default:
+        return -1;
+    }
+    return 0;
+}
+
+void
+quality_metrics_destroy(struct quality_metrics *qm, struct quality_summary *summary)
+{
+    uint64_t samples = 0, sse = 0;
+    int i;
+
+    if (qm == NULL)
+        return;
+
+    pthread_mutex_lock(&qm->lock);
+    qm->quit = 1;
+    pthread_cond_signal(&qm->job_ready);
+    pthread_mutex_unlock(&qm->lock);
+    pthread_join(qm->thread, NULL);
+
+    if (summary) {
+        memset(summary, 0, sizeof(*summary));
+        summary->frames = qm->frames;
+        for (i = 0; i < 3 && qm->frames; i++) {
+            uint64_t plane_samples = (uint64_t)qm->width[i] * qm->height[i] * qm->frames;
+
+            summary->psnr[i] = qm->total_psnr[i] / qm->frames;
+            summary->global_psnr[i] = sse_to_psnr(qm->total_sse[i], plane_samples);
+            summary->ssim[i] = qm->total_ssim[i] / qm->frames;
+            samples += plane_samples;
+            sse += qm->total_sse[i];
+        }
+        if (qm->frames)
+            summary->psnr_yuv = sse_to_psnr(sse, samples);
+    }
+
+    if (qm->csv_fp)
+        fclose(qm->csv_fp);
+    pthread_cond_destroy(&qm->job_done);
+    pthread_cond_destroy(&qm->job_ready);
+    pthread_mutex_destroy(&qm->lock);
+    free(qm->ssim_sums);
+    for (i = 0; i < QM_MAX_PENDING; i++) {
+        free(qm->jobs[i].src[0]);
+        free(qm->jobs[i].rec[0]);
+    }
+    free(qm);
+}
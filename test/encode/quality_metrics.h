@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2015 Intel Corporation. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+ * IN NO EVENT SHALL PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR
+ * ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Per-frame, per-plane PSNR and SSIM of reconstructed vs. source frames,
+ * computed on a worker thread so that the encoder does not wait for it.
+ *
+ * Frames are handed over straight from mapped VA images: quality_metrics_submit()
+ * copies (and deinterleaves NV12 chroma) into a pooled frame, then returns.
+ */
+
+#ifndef QUALITY_METRICS_H
+#define QUALITY_METRICS_H
+
+#include <va/va.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct quality_metrics;
+
+/** \brief Layout of one 4:2:0 frame, as found in a mapped VAImage */
+struct quality_frame {
+    unsigned int fourcc;                /* VA_FOURCC_NV12, VA_FOURCC_IYUV/I420 or VA_FOURCC_YV12 */
+    const unsigned char *planes[3];     /* Y, U, V (V unused for NV12) */
+    unsigned int pitches[3];
+};
+
+/** \brief Sequence-level results */
+struct quality_summary {
+    unsigned int frames;
+    double psnr[3];                     /* mean of per-frame Y/U/V PSNR */
+    double global_psnr[3];              /* from the sum of squared errors */
+    double psnr_yuv;                    /* global PSNR over all samples */
+    double ssim[3];                     /* mean of per-frame Y/U/V SSIM */
+};
+
+/**
+ * Starts the worker thread. If csv_fn is not NULL, one row per frame is
+ * written to it, in submission order. Returns NULL on failure.
+ */
+struct quality_metrics *
+quality_metrics_create(unsigned int width, unsigned int height, const char *csv_fn);
+
+/** Queues one frame; blocks only when the worker is too far behind */
+int
+quality_metrics_submit(struct quality_metrics *qm, unsigned long long frame_num,
+                       const struct quality_frame *src, const struct quality_frame *rec);
+
+/** Fills a quality_frame from a mapped VAImage */
+int
+quality_frame_from_image(struct quality_frame *frame, const VAImage *image, void *data);
+
+/** Waits for pending frames, stops the worker and releases everything */
+void
+quality_metrics_destroy(struct quality_metrics *qm, struct quality_summary *summary);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* QUALITY_METRICS_H */
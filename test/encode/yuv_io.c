@@ -0,0 +1,281 @@
+/*
+ * Copyright (c) 2015 Intel Corporation. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+ * IN NO EVENT SHALL PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR
+ * ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "yuv_io.h"
+
+/* Frames made resident ahead of the one being read */
+#define YUV_SOURCE_PREFETCH     2
+
+struct yuv_source {
+    unsigned char *data;
+    size_t size;
+    size_t frame_size;
+    unsigned long long frames;
+    size_t page_mask;
+};
+
+struct yuv_write_job {
+    unsigned int index;
+    unsigned long long frame_num;
+};
+
+struct yuv_writer {
+    int fd;
+    size_t frame_size;
+    unsigned int num_buffers;
+    unsigned char **buffers;
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t job_ready;           /* queue not empty, or quit */
+    pthread_cond_t job_done;            /* a buffer went back to the free list */
+    int quit;
+
+    struct yuv_write_job *queue;
+    unsigned int head, queued;
+    unsigned int *free_buffers;
+    unsigned int num_free;
+
+    int errors;
+};
+
+struct yuv_source *
+yuv_source_open(int fd, size_t frame_size)
+{
+    struct yuv_source *source;
+    struct stat st;
+
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < frame_size)
+        return NULL;
+
+    source = calloc(1, sizeof(*source));
+    if (source == NULL)
+        return NULL;
+
+    source->frame_size = frame_size;
+    source->frames = st.st_size / frame_size;
+    source->size = source->frames * frame_size;
+    source->page_mask = sysconf(_SC_PAGESIZE) - 1;
+
+    source->data = mmap(0, source->size, PROT_READ, MAP_SHARED, fd, 0);
+    if (source->data == MAP_FAILED) {
+        printf("Failed to mmap YUV file (%s)\n", strerror(errno));
+        free(source);
+        return NULL;
+    }
+    madvise(source->data, source->size, MADV_SEQUENTIAL);
+
+    return source;
+}
+
+unsigned long long
+yuv_source_frames(struct yuv_source *source)
+{
+    return source->frames;
+}
+
+const unsigned char *
+yuv_source_frame(struct yuv_source *source, unsigned long long n)
+{
+    unsigned long long next = (n + 1) % source->frames;
+    size_t start, end;
+
+    n %= source->frames;
+
+    /* the source wraps around when encoding more frames than it has */
+    start = next * source->frame_size;
+    end = start + YUV_SOURCE_PREFETCH * source->frame_size;
+    if (end > source->size)
+        end = source->size;
+    start &= ~source->page_mask;
+    madvise(source->data + start, end - start, MADV_WILLNEED);
+
+    return source->data + n * source->frame_size;
+}
+
+void
+yuv_source_close(struct yuv_source *source)
+{
+    if (source == NULL)
+        return;
+
+    munmap(source->data, source->size);
+    free(source);
+}
+
+static void *
+yuv_writer_thread(void *data)
+{
+    struct yuv_writer *writer = data;
+    struct yuv_write_job job;
+
+    pthread_mutex_lock(&writer->lock);
+    while (1) {
+        while (writer->queued == 0 && !writer->quit)
+            pthread_cond_wait(&writer->job_ready, &writer->lock);
+        if (writer->queued == 0)
+            break;
+
+        job = writer->queue[writer->head];
+        writer->head = (writer->head + 1) % writer->num_buffers;
+        writer->queued--;
+        pthread_mutex_unlock(&writer->lock);
+
+        if (pwrite(writer->fd, writer->buffers[job.index], writer->frame_size,
+                   (off_t)job.frame_num * writer->frame_size) != (ssize_t)writer->frame_size)
+            writer->errors++;
+
+        pthread_mutex_lock(&writer->lock);
+        writer->free_buffers[writer->num_free++] = job.index;
+        pthread_cond_signal(&writer->job_done);
+    }
+    pthread_mutex_unlock(&writer->lock);
+
+    return NULL;
+}
+
+static void
+yuv_writer_free(struct yuv_writer *writer)
+{
+    unsigned int i;
+
+    if (writer->buffers) {
+        for (i = 0; i < writer->num_buffers; i++)
+            free(writer->buffers[i]);
+    }
+    free(writer->buffers);
+    free(writer->queue);
+    free(writer->free_buffers);
+    free(writer);
+}
+
+struct yuv_writer *
+yuv_writer_create(int fd, size_t frame_size, unsigned int num_buffers)
+{
+    struct yuv_writer *writer;
+    unsigned int i;
+
+    writer = calloc(1, sizeof(*writer));
+    if (writer == NULL)
+        return NULL;
+
+    writer->fd = fd;
+    writer->frame_size = frame_size;
+    writer->num_buffers = num_buffers;
+    writer->buffers = calloc(num_buffers, sizeof(*writer->buffers));
+    writer->queue = calloc(num_buffers, sizeof(*writer->queue));
+    writer->free_buffers = calloc(num_buffers, sizeof(*writer->free_buffers));
+    if (!writer->buffers || !writer->queue || !writer->free_buffers)
+        goto error;
+
+    for (i = 0; i < num_buffers; i++) {
+        writer->buffers[i] = malloc(frame_size);
+        if (writer->buffers[i] == NULL)
+            goto error;
+        writer->free_buffers[writer->num_free++] = i;
+    }
+
+    pthread_mutex_init(&writer->lock, NULL);
+    pthread_cond_init(&writer->job_ready, NULL);
+    pthread_cond_init(&writer->job_done, NULL);
+    if (pthread_create(&writer->thread, NULL, yuv_writer_thread, writer) != 0) {
+        pthread_cond_destroy(&writer->job_done);
+        pthread_cond_destroy(&writer->job_ready);
+        pthread_mutex_destroy(&writer->lock);
+        goto error;
+    }
+    return writer;
+
+error:
+    yuv_writer_free(writer);
+    return NULL;
+}
+
+unsigned char *
+yuv_writer_get_buffer(struct yuv_writer *writer)
+{
+    unsigned int index;
+
+    pthread_mutex_lock(&writer->lock);
+    while (writer->num_free == 0)
+        pthread_cond_wait(&writer->job_done, &writer->lock);
+    index = writer->free_buffers[--writer->num_free];
+    pthread_mutex_unlock(&writer->lock);
+
+    return writer->buffers[index];
+}
+
+void
+yuv_writer_queue(struct yuv_writer *writer, unsigned char *buffer, unsigned long long n)
+{
+    struct yuv_write_job *job;
+    unsigned int index;
+
+    for (index = 0; index < writer->num_buffers; index++) {
+        if (writer->buffers[index] == buffer)
+            break;
+    }
+    if (index == writer->num_buffers)
+        return;
+
+    pthread_mutex_lock(&writer->lock);
+    job = &writer->queue[(writer->head + writer->queued) % writer->num_buffers];
+    job->index = index;
+    job->frame_num = n;
+    writer->queued++;
+    pthread_cond_signal(&writer->job_ready);
+    pthread_mutex_unlock(&writer->lock);
+}
+
+int
+yuv_writer_destroy(struct yuv_writer *writer)
+{
+    int errors;
+
+    if (writer == NULL)
+        return 0;
+
+    pthread_mutex_lock(&writer->lock);
+    writer->quit = 1;
+    pthread_cond_signal(&writer->job_ready);
+    pthread_mutex_unlock(&writer->lock);
+    pthread_join(writer->thread, NULL);
+
+    errors = writer->errors;
+    pthread_cond_destroy(&writer->job_done);
+    pthread_cond_destroy(&writer->job_ready);
+    pthread_mutex_destroy(&writer->lock);
+    yuv_writer_free(writer);
+
+    return errors;
+}
@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2015 Intel Corporation. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+ * IN NO EVENT SHALL PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR
+ * ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Streaming raw YUV I/O for the encode tools:
+ * - yuv_source maps the whole source file once and prefetches the frames
+ *   ahead of the one being read;
+ * - yuv_writer hands frames to a writer thread through a ring of
+ *   preallocated buffers, so that saving never waits for the disk.
+ */
+
+#ifndef YUV_IO_H
+#define YUV_IO_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct yuv_source;
+struct yuv_writer;
+
+/** Maps the file behind fd, frame_size bytes per frame. Returns NULL on failure */
+struct yuv_source *
+yuv_source_open(int fd, size_t frame_size);
+
+/** Number of complete frames in the source */
+unsigned long long
+yuv_source_frames(struct yuv_source *source);
+
+/** Returns frame n (modulo the frame count) and prefetches the next ones */
+const unsigned char *
+yuv_source_frame(struct yuv_source *source, unsigned long long n);
+
+void
+yuv_source_close(struct yuv_source *source);
+
+/** Starts a writer thread for fd, with num_buffers frames of frame_size bytes */
+struct yuv_writer *
+yuv_writer_create(int fd, size_t frame_size, unsigned int num_buffers);
+
+/** Returns a free frame buffer; blocks while all of them are queued */
+unsigned char *
+yuv_writer_get_buffer(struct yuv_writer *writer);
+
+/** Queues a buffer from yuv_writer_get_buffer() to be written as frame n */
+void
+yuv_writer_queue(struct yuv_writer *writer, unsigned char *buffer, unsigned long long n);
+
+/** Writes pending frames, stops the thread. Returns the number of failed writes */
+int
+yuv_writer_destroy(struct yuv_writer *writer);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* YUV_IO_H */
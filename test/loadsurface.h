@@ -22,21 +22,167 @@
  * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 #include "loadsurface_yuv.h"
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
-static int scale_2dimage(unsigned char *src_img, int src_imgw, int src_imgh,
-                         unsigned char *dst_img, int dst_imgw, int dst_imgh)
+/*
+ * The test picture, yuvga_pic, is 640x480 I420. It is scaled to the
+ * surface size by nearest neighbour, through a table of the picture column
+ * of each surface column. Width and height are even, as for any 4:2:0 or
+ * 4:2:2 surface.
+ */
+#define PIC_WIDTH       640
+#define PIC_HEIGHT      480
+
+/* Rows the picture is blended over, instead of the surface content */
+struct yuvgen_pattern {
+    const unsigned char *y[2];  /* checkerboard, by (row / box_width) & 1 */
+    int box_width;
+    const unsigned char *uv;    /* neutral chroma */
+};
+
+/* dst[i] = a[i] * (100 - alpha) / 100 + b[i] * alpha / 100, dst may be a */
+static void blend_row(unsigned char *dst, const unsigned char *a,
+                      const unsigned char *b, int n, int alpha)
+{
+    int i = 0;
+
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i wa = _mm_set1_epi16(100 - alpha);
+    const __m128i wb = _mm_set1_epi16(alpha);
+    /* x / 100 == (x * 5243) >> 19 for x up to 255 * 100 */
+    const __m128i div100 = _mm_set1_epi16(5243);
+
+#define BLEND_DIV100(x, w) \
+    _mm_srli_epi16(_mm_mulhi_epu16(_mm_mullo_epi16(x, w), div100), 3)
+
+    for (; i + 16 <= n; i += 16) {
+        __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+        __m128i lo = _mm_add_epi16(BLEND_DIV100(_mm_unpacklo_epi8(va, zero), wa),
+                                   BLEND_DIV100(_mm_unpacklo_epi8(vb, zero), wb));
+        __m128i hi = _mm_add_epi16(BLEND_DIV100(_mm_unpackhi_epi8(va, zero), wa),
+                                   BLEND_DIV100(_mm_unpackhi_epi8(vb, zero), wb));
+
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(lo, hi));
+    }
+#undef BLEND_DIV100
+#endif
+    for (; i < n; i++)
+        dst[i] = a[i] * (100 - alpha) / 100 + b[i] * alpha / 100;
+}
+
+/*
+ * Blend the test picture into the surface a row at a time. Without
+ * pattern the surface content is blended in place; with it, the surface
+ * is only written, which is much cheaper for mapped surfaces. NV12 chroma
+ * is the interleaved plane at U_start and YUY2 is the packed plane at
+ * Y_start. Other fourccs only have their Y plane blended.
+ */
+static void blend_pic_rows(int width, int height,
+                           unsigned char *Y_start, int Y_pitch,
+                           unsigned char *U_start, int U_pitch,
+                           unsigned char *V_start, int V_pitch,
+                           unsigned int fourcc, int alpha,
+                           const struct yuvgen_pattern *pattern)
 {
-    int row=0, col=0;
+    const unsigned char *pic_y = yuvga_pic;
+    const unsigned char *pic_u = pic_y + PIC_WIDTH * PIC_HEIGHT;
+    const unsigned char *pic_v = pic_u + PIC_WIDTH * PIC_HEIGHT / 4;
+    int chroma_width = width / 2, chroma_height = height / 2;
+    int scaled = width != PIC_WIDTH || height != PIC_HEIGHT;
+    int *y_cols, *uv_cols;
+    unsigned char *buf;
+    int row, col;
 
-    for (row=0; row<dst_imgh; row++) {
-        for (col=0; col<dst_imgw; col++) {
-            *(dst_img + row * dst_imgw + col) = *(src_img + (row * src_imgh/dst_imgh) * src_imgw + col * src_imgw/dst_imgw);
+    y_cols = (int *)malloc((width + chroma_width) * sizeof(int));
+    buf = (unsigned char *)malloc(width * 2);
+    if (!y_cols || !buf) {
+        free(y_cols);
+        free(buf);
+        return;
+    }
+    uv_cols = y_cols + width;
+    for (col = 0; col < width; col++)
+        y_cols[col] = col * PIC_WIDTH / width;
+    for (col = 0; col < chroma_width; col++)
+        uv_cols[col] = col * (PIC_WIDTH / 2) / chroma_width;
+
+    for (row = 0; row < height; row++) {
+        unsigned char *dst = Y_start + row * Y_pitch;
+        const unsigned char *base = pattern ? pattern->y[(row / pattern->box_width) & 1] : dst;
+        const unsigned char *src_y = pic_y + row * PIC_HEIGHT / height * PIC_WIDTH;
+        const unsigned char *pic = src_y;
+
+        if (fourcc == VA_FOURCC_YUY2) {
+            int uv_row = row / 2 * (PIC_HEIGHT / 2) / chroma_height * (PIC_WIDTH / 2);
+            const unsigned char *src_u = pic_u + uv_row;
+            const unsigned char *src_v = pic_v + uv_row;
+
+            for (col = 0; col < chroma_width; col++) {
+                buf[4 * col + 0] = src_y[y_cols[2 * col]];
+                buf[4 * col + 1] = src_u[uv_cols[col]];
+                buf[4 * col + 2] = src_y[y_cols[2 * col + 1]];
+                buf[4 * col + 3] = src_v[uv_cols[col]];
+            }
+            blend_row(dst, base, buf, width * 2, alpha);
+            continue;
         }
+        if (scaled) {
+            for (col = 0; col < width; col++)
+                buf[col] = src_y[y_cols[col]];
+            pic = buf;
+        }
+        blend_row(dst, base, pic, width, alpha);
     }
 
-    return 0;
+    if (fourcc != VA_FOURCC_NV12 && fourcc != VA_FOURCC_YV12)
+        goto out;
+
+    for (row = 0; row < chroma_height; row++) {
+        int uv_row = row * (PIC_HEIGHT / 2) / chroma_height * (PIC_WIDTH / 2);
+        const unsigned char *src_u = pic_u + uv_row;
+        const unsigned char *src_v = pic_v + uv_row;
+        unsigned char *dst_u = U_start + row * U_pitch;
+        unsigned char *dst_v = V_start + row * V_pitch;
+
+        if (fourcc == VA_FOURCC_NV12) {
+            for (col = 0; col < chroma_width; col++) {
+                buf[2 * col + 0] = src_u[uv_cols[col]];
+                buf[2 * col + 1] = src_v[uv_cols[col]];
+            }
+            blend_row(dst_u, pattern ? pattern->uv : dst_u, buf, width, alpha);
+            continue;
+        }
+        if (scaled) {
+            for (col = 0; col < chroma_width; col++) {
+                buf[col] = src_u[uv_cols[col]];
+                buf[chroma_width + col] = src_v[uv_cols[col]];
+            }
+            src_u = buf;
+            src_v = buf + chroma_width;
+        }
+        blend_row(dst_u, pattern ? pattern->uv : dst_u, src_u, chroma_width, alpha);
+        blend_row(dst_v, pattern ? pattern->uv : dst_v, src_v, chroma_width, alpha);
+    }
+
+out:
+    free(y_cols);
+    free(buf);
 }
 
+/* Blend factor in percent: fixed_alpha, or with 0 the next one of a cycle */
+static int pic_blend_alpha(int fixed_alpha)
+{
+    static const int alpha_values[] = {100,90,80,70,60,50,40,30,20,30,40,50,60,70,80,90};
+    static int alpha_idx = 0;
+
+    if (fixed_alpha)
+        return fixed_alpha;
+    return alpha_values[alpha_idx++ % 16];
+}
 
 static int YUV_blend_with_pic(int width, int height,
                               unsigned char *Y_start, int Y_pitch,
@@ -44,102 +190,11 @@ static int YUV_blend_with_pic(int width, int height,
                               unsigned char *V_start, int V_pitch,
                               unsigned int fourcc, int fixed_alpha)
 {
-    /* PIC YUV format */
-    unsigned char *pic_y_old = yuvga_pic;
-    unsigned char *pic_u_old = pic_y_old + 640*480;
-    unsigned char *pic_v_old = pic_u_old + 640*480/4;
-    unsigned char *pic_y, *pic_u, *pic_v;
-
-    int alpha_values[] = {100,90,80,70,60,50,40,30,20,30,40,50,60,70,80,90};
-    
-    static int alpha_idx = 0;
-    int alpha;
-    int allocated = 0;
-    
-    int row, col;
-
-    if (fixed_alpha == 0) {
-        alpha = alpha_values[alpha_idx % 16 ];
-        alpha_idx ++;
-    } else
-        alpha = fixed_alpha;
-
-    //alpha = 0;
-    
-    pic_y = pic_y_old;
-    pic_u = pic_u_old;
-    pic_v = pic_v_old;
-    
-    if (width != 640 || height != 480) { /* need to scale the pic */
-        pic_y = (unsigned char *)malloc(width * height);
-        pic_u = (unsigned char *)malloc(width * height/4);
-        pic_v = (unsigned char *)malloc(width * height/4);
-
-        allocated = 1;
-        
-        scale_2dimage(pic_y_old, 640, 480,
-                      pic_y, width, height);
-        scale_2dimage(pic_u_old, 320, 240,
-                      pic_u, width/2, height/2);
-        scale_2dimage(pic_v_old, 320, 240,
-                      pic_v, width/2, height/2);
-    }
-
-    /* begin blend */
-
-    /* Y plane */
-    int Y_pixel_stride = 1;
-    if (fourcc == VA_FOURCC_YUY2) 
-        Y_pixel_stride = 2;
-         
-    for (row=0; row<height; row++) {
-        unsigned char *p = Y_start + row * Y_pitch;
-        unsigned char *q = pic_y + row * width;
-        for (col=0; col<width; col++, q++) {
-            *p  = *p * (100 - alpha) / 100 + *q * alpha/100;
-            p += Y_pixel_stride;
-        }
-    }
-
-    /* U/V plane */
-    int U_pixel_stride = 0, V_pixel_stride = 0;
-    int v_factor_to_nv12 = 1;
-    switch (fourcc) {
-    case VA_FOURCC_YV12:
-        U_pixel_stride = V_pixel_stride = 1;
-        break;
-    case VA_FOURCC_NV12:
-        U_pixel_stride = V_pixel_stride = 2;
-        break;
-    case VA_FOURCC_YUY2:
-        U_pixel_stride = V_pixel_stride = 4;
-        v_factor_to_nv12 = 2;
-        break;
-    default:
-        break;
-    }
-    for (row=0; row<height/2*v_factor_to_nv12; row++) {
-        unsigned char *pU = U_start + row * U_pitch;
-        unsigned char *pV = V_start + row * V_pitch;
-        unsigned char *qU = pic_u + row/v_factor_to_nv12 * width/2;
-        unsigned char *qV = pic_v + row/v_factor_to_nv12 * width/2;
-            
-        for (col=0; col<width/2; col++, qU++, qV++) {
-            *pU  = *pU * (100 - alpha) / 100 + *qU * alpha/100;
-            *pV  = *pV * (100 - alpha) / 100 + *qV * alpha/100;
-
-            pU += U_pixel_stride;
-            pV += V_pixel_stride;
-        }
-    }
-        
-    
-    if (allocated) {
-        free(pic_y);
-        free(pic_u);
-        free(pic_v);
-    }
-    
+    blend_pic_rows(width, height,
+                   Y_start, Y_pitch,
+                   U_start, U_pitch,
+                   V_start, V_pitch,
+                   fourcc, pic_blend_alpha(fixed_alpha), NULL);
     return 0;
 }
 
@@ -152,13 +207,61 @@ static int yuvgen_planar(int width, int height,
 {
     int row, alpha;
     unsigned char uv_value = 0x80;
+    unsigned char *rows;
+    int jj, ypos;
 
-    /* copy Y plane */
+    /* the two rows of the checkerboard, then a row of neutral chroma */
     int y_factor = 1;
     if (fourcc == VA_FOURCC_YUY2) y_factor = 2;
+    int row_size = width * y_factor;
+
+    rows = (unsigned char *)malloc(row_size * 2 + width);
+    if (!rows)
+        return -1;
+    for (ypos = 0; ypos < 2; ypos++) {
+        unsigned char *Y_row = rows + ypos * row_size;
+
+        for (jj=0; jj<width; jj++) {
+            if ((((row_shift + jj) / box_width) & 0x1) == ypos)
+                Y_row[jj*y_factor] = 0xeb;
+            else 
+                Y_row[jj*y_factor] = 0x10;
+
+            if (fourcc == VA_FOURCC_YUY2) {
+                Y_row[jj*y_factor+1] = uv_value; // it is for UV
+            }
+        }
+    }
+    memset(rows + row_size * 2, uv_value, width);
+
+    /* frames are written once, pattern and picture together */
+    if (field == VA_FRAME_PICTURE &&
+        (fourcc == VA_FOURCC_NV12 || fourcc == VA_FOURCC_YV12 || fourcc == VA_FOURCC_YUY2)) {
+        struct yuvgen_pattern pattern;
+
+        pattern.y[0] = rows;
+        pattern.y[1] = rows + row_size;
+        pattern.box_width = box_width;
+        pattern.uv = rows + row_size * 2;
+
+        /* blending nothing in leaves the pattern */
+        if (getenv("AUTO_NOUV"))
+            alpha = 0;
+        else
+            alpha = pic_blend_alpha(getenv("AUTO_ALPHA") ? 0 : 70);
+
+        blend_pic_rows(width, height,
+                       Y_start, Y_pitch,
+                       U_start, U_pitch,
+                       V_start, V_pitch,
+                       fourcc, alpha, &pattern);
+        free(rows);
+        return 0;
+    }
+
+    /* copy Y plane */
     for (row=0;row<height;row++) {
         unsigned char *Y_row = Y_start + row * Y_pitch;
-        int jj, xpos, ypos;
 
         ypos = (row / box_width) & 0x1;
 
@@ -169,18 +272,9 @@ static int yuvgen_planar(int width, int height,
             continue;
         }
         
-        for (jj=0; jj<width; jj++) {
-            xpos = ((row_shift + jj) / box_width) & 0x1;
-            if (xpos == ypos)
-                Y_row[jj*y_factor] = 0xeb;
-            else 
-                Y_row[jj*y_factor] = 0x10;
-
-            if (fourcc == VA_FOURCC_YUY2) {
-                Y_row[jj*y_factor+1] = uv_value; // it is for UV
-            }
-        }
+        memcpy(Y_row, rows + ypos * row_size, row_size);
     }
+    free(rows);
   
     /* copy UV data */
     for( row =0; row < height/2; row++) {
@@ -0,0 +1,503 @@
+/*
+ * Copyright (c) 2015 Intel Corporation. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+ * IN NO EVENT SHALL PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR
+ * ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Checks the test pattern generator of loadsurface.h against the per-pixel
+ * one it replaced, byte for byte, and with --bench times both on whole
+ * frames, without any VA call. Exits with 1 on the first mismatch.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <getopt.h>
+#include <time.h>
+#include <va/va.h>
+
+#define CHECK_VASTATUS(va_status,func)                                  \
+    if (va_status != VA_STATUS_SUCCESS) {                               \
+        fprintf(stderr,"%s:%s (%d) failed,exit\n", __func__, func, __LINE__); \
+        exit(1);                                                        \
+    }
+
+#include "loadsurface.h"
+
+/* The former generator, kept as the reference */
+static int legacy_scale_2dimage(unsigned char *src_img, int src_imgw, int src_imgh,
+                                unsigned char *dst_img, int dst_imgw, int dst_imgh)
+{
+    int row=0, col=0;
+
+    for (row=0; row<dst_imgh; row++) {
+        for (col=0; col<dst_imgw; col++) {
+            *(dst_img + row * dst_imgw + col) = *(src_img + (row * src_imgh/dst_imgh) * src_imgw + col * src_imgw/dst_imgw);
+        }
+    }
+
+    return 0;
+}
+
+
+static int legacy_YUV_blend_with_pic(int width, int height,
+                                     unsigned char *Y_start, int Y_pitch,
+                                     unsigned char *U_start, int U_pitch,
+                                     unsigned char *V_start, int V_pitch,
+                                     unsigned int fourcc, int fixed_alpha)
+{
+    /* PIC YUV format */
+    unsigned char *pic_y_old = yuvga_pic;
+    unsigned char *pic_u_old = pic_y_old + 640*480;
+    unsigned char *pic_v_old = pic_u_old + 640*480/4;
+    unsigned char *pic_y, *pic_u, *pic_v;
+
+    int alpha_values[] = {100,90,80,70,60,50,40,30,20,30,40,50,60,70,80,90};
+    
+    static int alpha_idx = 0;
+    int alpha;
+    int allocated = 0;
+    
+    int row, col;
+
+    if (fixed_alpha == 0) {
+        alpha = alpha_values[alpha_idx % 16 ];
+        alpha_idx ++;
+    } else
+        alpha = fixed_alpha;
+
+    //alpha = 0;
+    
+    pic_y = pic_y_old;
+    pic_u = pic_u_old;
+    pic_v = pic_v_old;
+    
+    if (width != 640 || height != 480) { /* need to scale the pic */
+        pic_y = (unsigned char *)malloc(width * height);
+        pic_u = (unsigned char *)malloc(width * height/4);
+        pic_v = (unsigned char *)malloc(width * height/4);
+
+        allocated = 1;
+        
+        legacy_scale_2dimage(pic_y_old, 640, 480,
+                             pic_y, width, height);
+        legacy_scale_2dimage(pic_u_old, 320, 240,
+                             pic_u, width/2, height/2);
+        legacy_scale_2dimage(pic_v_old, 320, 240,
+                             pic_v, width/2, height/2);
+    }
+
+    /* begin blend */
+
+    /* Y plane */
+    int Y_pixel_stride = 1;
+    if (fourcc == VA_FOURCC_YUY2) 
+        Y_pixel_stride = 2;
+         
+    for (row=0; row<height; row++) {
+        unsigned char *p = Y_start + row * Y_pitch;
+        unsigned char *q = pic_y + row * width;
+        for (col=0; col<width; col++, q++) {
+            *p  = *p * (100 - alpha) / 100 + *q * alpha/100;
+            p += Y_pixel_stride;
+        }
+    }
+
+    /* U/V plane */
+    int U_pixel_stride = 0, V_pixel_stride = 0;
+    int v_factor_to_nv12 = 1;
+    switch (fourcc) {
+    case VA_FOURCC_YV12:
+        U_pixel_stride = V_pixel_stride = 1;
+        break;
+    case VA_FOURCC_NV12:
+        U_pixel_stride = V_pixel_stride = 2;
+        break;
+    case VA_FOURCC_YUY2:
+        U_pixel_stride = V_pixel_stride = 4;
+        v_factor_to_nv12 = 2;
+        break;
+    default:
+        break;
+    }
+    for (row=0; row<height/2*v_factor_to_nv12; row++) {
+        unsigned char *pU = U_start + row * U_pitch;
+        unsigned char *pV = V_start + row * V_pitch;
+        unsigned char *qU = pic_u + row/v_factor_to_nv12 * width/2;
+        unsigned char *qV = pic_v + row/v_factor_to_nv12 * width/2;
+            
+        for (col=0; col<width/2; col++, qU++, qV++) {
+            *pU  = *pU * (100 - alpha) / 100 + *qU * alpha/100;
+            *pV  = *pV * (100 - alpha) / 100 + *qV * alpha/100;
+
+            pU += U_pixel_stride;
+            pV += V_pixel_stride;
+        }
+    }
+        
+    
+    if (allocated) {
+        free(pic_y);
+        free(pic_u);
+        free(pic_v);
+    }
+    
+    return 0;
+}
+
+static int legacy_yuvgen_planar(int width, int height,
+                                unsigned char *Y_start, int Y_pitch,
+                                unsigned char *U_start, int U_pitch,
+                                unsigned char *V_start, int V_pitch,
+                                unsigned int fourcc, int box_width, int row_shift,
+                                int field)
+{
+    int row, alpha;
+    unsigned char uv_value = 0x80;
+
+    /* copy Y plane */
+    int y_factor = 1;
+    if (fourcc == VA_FOURCC_YUY2) y_factor = 2;
+    for (row=0;row<height;row++) {
+        unsigned char *Y_row = Y_start + row * Y_pitch;
+        int jj, xpos, ypos;
+
+        ypos = (row / box_width) & 0x1;
+
+        /* fill garbage data into the other field */
+        if (((field == VA_TOP_FIELD) && (row &1))
+            || ((field == VA_BOTTOM_FIELD) && ((row &1)==0))) { 
+            memset(Y_row, 0xff, width);
+            continue;
+        }
+        
+        for (jj=0; jj<width; jj++) {
+            xpos = ((row_shift + jj) / box_width) & 0x1;
+            if (xpos == ypos)
+                Y_row[jj*y_factor] = 0xeb;
+            else 
+                Y_row[jj*y_factor] = 0x10;
+
+            if (fourcc == VA_FOURCC_YUY2) {
+                Y_row[jj*y_factor+1] = uv_value; // it is for UV
+            }
+        }
+    }
+  
+    /* copy UV data */
+    for( row =0; row < height/2; row++) {
+
+        /* fill garbage data into the other field */
+        if (((field == VA_TOP_FIELD) && (row &1))
+            || ((field == VA_BOTTOM_FIELD) && ((row &1)==0))) {
+            uv_value = 0xff;
+        }
+
+        unsigned char *U_row = U_start + row * U_pitch;
+        unsigned char *V_row = V_start + row * V_pitch;
+        switch (fourcc) {
+        case VA_FOURCC_NV12:
+            memset(U_row, uv_value, width);
+            break;
+        case VA_FOURCC_YV12:
+            memset (U_row,uv_value,width/2);
+            memset (V_row,uv_value,width/2);
+            break;
+        case VA_FOURCC_YUY2:
+            // see above. it is set with Y update.
+            break;
+        default:
+            printf("unsupported fourcc in loadsurface.h\n");
+            assert(0);
+        }
+    }
+
+    if (getenv("AUTO_NOUV"))
+        return 0;
+
+    if (getenv("AUTO_ALPHA"))
+        alpha = 0;
+    else
+        alpha = 70;
+    
+    legacy_YUV_blend_with_pic(width,height,
+                              Y_start, Y_pitch,
+                              U_start, U_pitch,
+                              V_start, V_pitch,
+                              fourcc, alpha);
+    
+    return 0;
+}
+
+/* A frame in system memory, laid out the way upload_surface() maps one */
+struct frame {
+    unsigned char *buf;
+    unsigned char *Y_start, *U_start, *V_start;
+    int Y_pitch, U_pitch, V_pitch;
+};
+
+/* Rows are padded, to catch writes past the end of a row */
+#define FRAME_PADDING   48
+
+static int
+frame_alloc(struct frame *f, int width, int height, unsigned int fourcc)
+{
+    int pitch = width * 2 + FRAME_PADDING;
+
+    f->buf = malloc(pitch * height * 2);
+    if (!f->buf)
+        return 0;
+
+    f->Y_start = f->buf;
+    f->Y_pitch = f->U_pitch = f->V_pitch = pitch;
+    switch (fourcc) {
+    case VA_FOURCC_NV12:
+        f->U_start = f->buf + pitch * height;
+        f->V_start = f->U_start + 1;
+        break;
+    case VA_FOURCC_YV12:
+        f->V_start = f->buf + pitch * height;
+        f->U_start = f->V_start + pitch * height / 2;
+        break;
+    case VA_FOURCC_YUY2:
+        f->U_start = f->buf + 1;
+        f->V_start = f->buf + 3;
+        break;
+    }
+    return pitch * height * 2;
+}
+
+static unsigned int rand_state = 1;
+
+static void
+fill_random(unsigned char *buf, int size)
+{
+    int i;
+
+    for (i = 0; i < size; i++) {
+        /* xorshift32, reproducible across libcs */
+        rand_state ^= rand_state << 13;
+        rand_state ^= rand_state >> 17;
+        rand_state ^= rand_state << 5;
+        buf[i] = rand_state;
+    }
+}
+
+static const char *
+fourcc_name(unsigned int fourcc)
+{
+    switch (fourcc) {
+    case VA_FOURCC_NV12: return "NV12";
+    case VA_FOURCC_YV12: return "YV12";
+    case VA_FOURCC_YUY2: return "YUY2";
+    }
+    return "?";
+}
+
+/*
+ * Every fourcc, size and field, over surfaces full of garbage, so that the
+ * bytes either generator leaves alone are compared too. The environment
+ * switches are applied to both, and each case is generated several times
+ * so that the AUTO_ALPHA cycle moves on.
+ */
+static int
+check_frames(void)
+{
+    static const unsigned int fourccs[] = {
+        VA_FOURCC_NV12, VA_FOURCC_YV12, VA_FOURCC_YUY2,
+    };
+    static const int sizes[][2] = {
+        { 640, 480 }, { 352, 288 }, { 176, 144 }, { 1920, 1080 }, { 720, 576 }, { 64, 32 },
+    };
+    static const int fields[] = {
+        VA_FRAME_PICTURE, VA_TOP_FIELD, VA_BOTTOM_FIELD,
+    };
+    static const char *envs[] = { NULL, "AUTO_ALPHA", "AUTO_NOUV" };
+    unsigned int f, s, fi, e;
+    int i;
+
+    for (e = 0; e < sizeof(envs) / sizeof(envs[0]); e++) {
+        if (envs[e])
+            setenv(envs[e], "1", 1);
+        for (f = 0; f < sizeof(fourccs) / sizeof(fourccs[0]); f++) {
+            for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+                int width = sizes[s][0], height = sizes[s][1];
+                struct frame ref, out;
+                int size;
+
+                size = frame_alloc(&ref, width, height, fourccs[f]);
+                if (!size || !frame_alloc(&out, width, height, fourccs[f])) {
+                    printf("out of memory\n");
+                    return 0;
+                }
+                for (fi = 0; fi < sizeof(fields) / sizeof(fields[0]); fi++) {
+                    for (i = 0; i < 5; i++) {
+                        int box_width = 8 << (i % 3), row_shift = i * 7;
+
+                        fill_random(ref.buf, size);
+                        memcpy(out.buf, ref.buf, size);
+                        legacy_yuvgen_planar(width, height,
+                                             ref.Y_start, ref.Y_pitch,
+                                             ref.U_start, ref.U_pitch,
+                                             ref.V_start, ref.V_pitch,
+                                             fourccs[f], box_width, row_shift, fields[fi]);
+                        yuvgen_planar(width, height,
+                                      out.Y_start, out.Y_pitch,
+                                      out.U_start, out.U_pitch,
+                                      out.V_start, out.V_pitch,
+                                      fourccs[f], box_width, row_shift, fields[fi]);
+                        if (memcmp(ref.buf, out.buf, size)) {
+                            printf("%s %dx%d, field %d, box %d, shift %d%s%s: frames differ\n",
+                                   fourcc_name(fourccs[f]), width, height, fields[fi],
+                                   box_width, row_shift, envs[e] ? ", " : "",
+                                   envs[e] ? envs[e] : "");
+                            free(ref.buf);
+                            free(out.buf);
+                            return 0;
+                        }
+                    }
+                }
+                free(ref.buf);
+                free(out.buf);
+            }
+        }
+        if (envs[e])
+            unsetenv(envs[e]);
+    }
+    return 1;
+}
+
+static double
+get_time(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Frames as putsurface generates them, one per present */
+static void
+benchmark(int iterations)
+{
+    static const unsigned int fourccs[] = {
+        VA_FOURCC_NV12, VA_FOURCC_YV12, VA_FOURCC_YUY2,
+    };
+    static const int sizes[][2] = {
+        { 640, 480 }, { 1920, 1080 },
+    };
+    unsigned int f, s;
+    int i;
+
+    printf("frames generated per second, %d frames each\n", iterations);
+    for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        for (f = 0; f < sizeof(fourccs) / sizeof(fourccs[0]); f++) {
+            int width = sizes[s][0], height = sizes[s][1];
+            double start, legacy_time, time;
+            struct frame fr;
+
+            if (!frame_alloc(&fr, width, height, fourccs[f]))
+                return;
+
+            start = get_time();
+            for (i = 0; i < iterations; i++)
+                legacy_yuvgen_planar(width, height,
+                                     fr.Y_start, fr.Y_pitch,
+                                     fr.U_start, fr.U_pitch,
+                                     fr.V_start, fr.V_pitch,
+                                     fourccs[f], 32, i, VA_FRAME_PICTURE);
+            legacy_time = get_time() - start;
+
+            start = get_time();
+            for (i = 0; i < iterations; i++)
+                yuvgen_planar(width, height,
+                              fr.Y_start, fr.Y_pitch,
+                              fr.U_start, fr.U_pitch,
+                              fr.V_start, fr.V_pitch,
+                              fourccs[f], 32, i, VA_FRAME_PICTURE);
+            time = get_time() - start;
+
+            printf("  %s %4dx%-4d: former %7.1f, loadsurface.h %7.1f (%.2fx)\n",
+                   fourcc_name(fourccs[f]), width, height,
+                   iterations / legacy_time, iterations / time, legacy_time / time);
+            free(fr.buf);
+        }
+    }
+}
+
+static void
+print_help(const char *name)
+{
+    printf("%s [--bench] [-n frames]\n", name);
+    printf("  --bench: time the generators once they compare equal\n");
+    printf("  -n: frames generated per generator and format in the benchmark, default 200\n");
+}
+
+int
+main(int argc, char **argv)
+{
+    struct option long_opts[] = {
+        {"help", no_argument, NULL, 0 },
+        {"bench", no_argument, NULL, 1 },
+        {NULL, no_argument, NULL, 0 }};
+    int iterations = 200, bench = 0;
+    int c, long_index;
+
+    while ((c = getopt_long_only(argc, argv, "n:?", long_opts, &long_index)) != EOF) {
+        switch (c) {
+        case 'n':
+            iterations = atoi(optarg);
+            break;
+        case 1:
+            bench = 1;
+            break;
+        default:
+            print_help(argv[0]);
+            return c == 0 ? 0 : 1;
+        }
+    }
+    if (iterations <= 0) {
+        print_help(argv[0]);
+        return 1;
+    }
+
+    /* only the generators are used here, the VA helpers go along */
+    (void)upload_surface;
+    (void)upload_surface_yuv;
+    (void)download_surface_yuv;
+
+    /* both generators blend the picture by these, start from the default */
+    unsetenv("AUTO_ALPHA");
+    unsetenv("AUTO_NOUV");
+
+    if (!check_frames()) {
+        printf("test pattern check FAILED\n");
+        return 1;
+    }
+    printf("test pattern check passed\n");
+
+    if (bench)
+        benchmark(iterations);
+
+    return 0;
+}
@@ -34,17 +34,10 @@ using namespace android;
 
 static  int android_display=0;
 
-static sp<SurfaceComposerClient> client0 = NULL;
-static sp<SurfaceControl> surface_ctrl0 = NULL;
-static sp<ANativeWindow> anw0 = NULL;
-
-static sp<SurfaceComposerClient> client1 = NULL;
-static sp<SurfaceControl> surface_ctrl1 = NULL;
-static sp<ANativeWindow> anw1 = NULL;
-
 static void *open_display(void);
 static void close_display(void *win_display);
-static int create_window(void *win_display, int x, int y, int width, int height);
+static void *create_window(void *win_display, int index, int x, int y, int width, int height);
+static void destroy_window(void *win_display, void *drawable);
 static int check_window_event(void *x11_display, void *win, int *width, int *height, int *quit);
 
 #define CAST_DRAWABLE(a)  static_cast<ANativeWindow *>((void *)(*(unsigned int *)a))
@@ -60,60 +53,41 @@ static void close_display(void *win_display)
     return;
 }
 
-static int create_window(void *win_display, int x, int y, int width, int height)
+static sp<SurfaceComposerClient> client[MAX_THREADS];
+static sp<SurfaceControl> surface_ctrl[MAX_THREADS];
+static sp<ANativeWindow> anw[MAX_THREADS];
+
+static void *create_window(void *win_display, int index, int x, int y, int width, int height)
 {
-    client0 = new SurfaceComposerClient();
+    printf("Create window%d for thread%d\n", index, index);
+    client[index] = new SurfaceComposerClient();
     
-    surface_ctrl0 = client1->createSurface(
+    surface_ctrl[index] = client[index]->createSurface(
         String8("Test Surface"),
         width, height,
         PIXEL_FORMAT_RGB_888, 0);
 
     SurfaceComposerClient::openGlobalTransaction();
-    surface_ctrl0->setLayer(0x7FFFFFFF);
-    surface_ctrl0->show();
+    surface_ctrl[index]->setLayer(0x7FFFFFFF);
+    surface_ctrl[index]->show();
     SurfaceComposerClient::closeGlobalTransaction();
     
     SurfaceComposerClient::openGlobalTransaction();
-    surface_ctrl0->setPosition(x, y);
+    surface_ctrl[index]->setPosition(x, y);
     SurfaceComposerClient::closeGlobalTransaction();
     
     SurfaceComposerClient::openGlobalTransaction();
-    surface_ctrl0->setSize(width, height);
+    surface_ctrl[index]->setSize(width, height);
     SurfaceComposerClient::closeGlobalTransaction();
     
-    anw0 = surface_ctrl0->getSurface();
-
-    drawable_thread0 = static_cast<void*>(&anw0);
-    if (multi_thread == 0)
-        return 0;
-
-    printf("Create window1 for thread1\n");
-    client1 = new SurfaceComposerClient();
-    
-    surface_ctrl1 = client1->createSurface(
-        String8("Test Surface"),
-        width, height,
-        PIXEL_FORMAT_RGB_888, 0);
+    anw[index] = surface_ctrl[index]->getSurface();
 
-    SurfaceComposerClient::openGlobalTransaction();
-    surface_ctrl1->setLayer(0x7FFFFFFF);
-    surface_ctrl1->show();
-    SurfaceComposerClient::closeGlobalTransaction();
-    
-    SurfaceComposerClient::openGlobalTransaction();
-    surface_ctrl1->setPosition(x*2, y*2);
-    SurfaceComposerClient::closeGlobalTransaction();
-    
-    SurfaceComposerClient::openGlobalTransaction();
-    surface_ctrl1->setSize(width, height);
-    SurfaceComposerClient::closeGlobalTransaction();
-    
-    anw1 = surface_ctrl1->getSurface();
+    return static_cast<void *>(&anw[index]);
+}
 
-    drawable_thread1 = static_cast<void *>(&anw1);
-    
-    return 0;
+static void destroy_window(void *win_display, void *drawable)
+{
+    return;
 }
 
 int check_window_event(void *win_display, void *drawble, int *width, int *height, int *quit)
@@ -29,6 +29,8 @@
 #include <getopt.h>
 
 #include <sys/time.h>
+#include <time.h>
+#include <errno.h>
 
 #include <unistd.h>
 
@@ -56,7 +58,12 @@ if (va_status != VA_STATUS_SUCCESS) {                                   \
 }
 #include "../loadsurface.h"
 
-#define SURFACE_NUM 16
+#define SURFACE_NUM 16     /* surfaces per thread */
+#define MAX_THREADS 16
+
+/* present latency histogram, the last bucket counts anything slower */
+#define LATENCY_BUCKET_US   10
+#define LATENCY_BUCKETS     10000
 
 static  void *win_display;
 static  VADisplay va_dpy;
@@ -65,10 +72,10 @@ static  int va_num_image_formats = -1;
 static  VAConfigID vpp_config_id = VA_INVALID_ID;
 static  VASurfaceAttrib *va_surface_attribs;
 static  int va_num_surface_attribs = -1;
-static  VASurfaceID surface_id[SURFACE_NUM];
-static  pthread_mutex_t surface_mutex[SURFACE_NUM];
+static  VASurfaceID *surface_id;
+static  int surface_num;
 
-static  void *drawable_thread0, *drawable_thread1;
+static  void *drawables[MAX_THREADS];
 static  int surface_width = 352, surface_height = 288;
 static  int win_x = 0, win_y = 0;
 static  int win_width = 352, win_height = 288;
@@ -80,7 +87,7 @@ static  int test_clip = 0;
 static  int display_field = VA_FRAME_PICTURE;
 static  pthread_mutex_t gmutex;
 static  int box_width = 32;
-static  int multi_thread = 0;
+static  int num_threads = 1;
 static  int verbose = 0;
 static  int test_color_conversion = 0;
 static  int csc_src_fourcc = 0, csc_dst_fourcc = 0;
@@ -88,6 +95,20 @@ static  VAImage csc_dst_fourcc_image;
 static  VASurfaceID csc_render_surface;
 
 
+typedef struct {
+    pthread_t thread;
+    int index;
+    void *drawable;
+    VASurfaceID *surfaces;              /* this thread's ring of SURFACE_NUM */
+    unsigned int frame_num;
+    unsigned int late_frames;           /* deadlines missed by a whole period */
+    unsigned long long elapsed_us;
+    unsigned int latency_max_us;
+    unsigned int latency_hist[LATENCY_BUCKETS];
+} putsurface_thread_data;
+
+static  putsurface_thread_data *thread_data;
+
 typedef struct {
     char* fmt_str;
     unsigned int fourcc;
@@ -282,7 +303,7 @@ int csc_preparation ()
     va_status = vaCreateSurfaces(
         va_dpy,
         VA_RT_FORMAT_YUV420, surface_width, surface_height,
-        &surface_id[0], SURFACE_NUM,
+        &surface_id[0], surface_num,
         surface_attribs, 1
     );
     CHECK_VASTATUS(va_status,"vaCreateSurfaces");
@@ -312,42 +333,6 @@ cleanup:
     return test_color_conversion;
 }
 
-static VASurfaceID get_next_free_surface(int *index)
-{
-    VASurfaceStatus surface_status;
-    int i;
-
-    assert(index);
-
-    if (multi_thread == 0) {
-        i = *index;
-        i++;
-        if (i == SURFACE_NUM)
-            i = 0;
-        *index = i;
-
-        return surface_id[i];
-    }
-    
-    for (i=0; i<SURFACE_NUM; i++) {
-        surface_status = (VASurfaceStatus)0;
-        vaQuerySurfaceStatus(va_dpy, surface_id[i], &surface_status);
-        if (surface_status == VASurfaceReady)
-        {
-            if (0 == pthread_mutex_trylock(&surface_mutex[i]))
-            {
-                *index = i;
-                break;
-            }
-        }
-    }
-
-    if (i==SURFACE_NUM)
-        return VA_INVALID_SURFACE;
-    else
-        return surface_id[i];
-}
-
 static int upload_source_YUV_once_for_all()
 {
     VAImage surface_image;
@@ -357,7 +342,7 @@ static int upload_source_YUV_once_for_all()
     int row_shift_loc=0;
     int i;
     
-    for (i=0; i<SURFACE_NUM; i++) {
+    for (i=0; i<surface_num; i++) {
         printf("\rLoading data into surface %d.....", i);
         upload_surface(va_dpy, surface_id[i], box_width_loc, row_shift_loc, 0);
         
@@ -372,12 +357,71 @@ static int upload_source_YUV_once_for_all()
 /*
  * Helper function for profiling purposes
  */
-static unsigned long get_tick_count(void)
+static unsigned long long get_time_us(void)
 {
-    struct timeval tv;
-    if (gettimeofday(&tv, NULL))
-        return 0;
-    return tv.tv_usec/1000+tv.tv_sec*1000;
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/* Sleep until the absolute deadline, then move it one period on */
+static void wait_deadline(putsurface_thread_data *td, unsigned long long *deadline_us,
+                          unsigned long long period_us)
+{
+    struct timespec ts;
+    unsigned long long now = get_time_us();
+
+    if (now >= *deadline_us + period_us) {
+        /* too late to catch up, start again from now */
+        td->late_frames++;
+        *deadline_us = now;
+    }
+    ts.tv_sec = *deadline_us / 1000000;
+    ts.tv_nsec = (*deadline_us % 1000000) * 1000;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+    *deadline_us += period_us;
+}
+
+static void record_latency(putsurface_thread_data *td, unsigned long long latency_us)
+{
+    unsigned long long bucket = latency_us / LATENCY_BUCKET_US;
+
+    if (bucket >= LATENCY_BUCKETS)
+        bucket = LATENCY_BUCKETS - 1;
+    td->latency_hist[bucket]++;
+    if (latency_us > td->latency_max_us)
+        td->latency_max_us = latency_us;
+}
+
+/* Upper bound of the bucket holding the given fraction of the samples, in ms */
+static double latency_percentile(putsurface_thread_data *td, double fraction)
+{
+    unsigned long long target = (unsigned long long)(td->frame_num * fraction);
+    unsigned long long count = 0;
+    unsigned int i;
+
+    for (i = 0; i < LATENCY_BUCKETS - 1; i++) {
+        count += td->latency_hist[i];
+        if (count > target)
+            break;
+    }
+    if (i == LATENCY_BUCKETS - 1 || (i + 1) * LATENCY_BUCKET_US > td->latency_max_us)
+        return td->latency_max_us / 1000.0;
+    return (i + 1) * LATENCY_BUCKET_US / 1000.0;
+}
+
+static void print_thread_report(putsurface_thread_data *td)
+{
+    printf("thread %d: %u frames, %.2f FPS, %u late, present latency ms: "
+           "p50 %.2f p90 %.2f p99 %.2f p99.9 %.2f max %.2f\n",
+           td->index, td->frame_num,
+           td->elapsed_us ? td->frame_num * 1000000.0 / td->elapsed_us : 0.0,
+           td->late_frames,
+           latency_percentile(td, 0.5), latency_percentile(td, 0.9),
+           latency_percentile(td, 0.99), latency_percentile(td, 0.999),
+           td->latency_max_us / 1000.0);
 }
 
 static void update_clipbox(VARectangle *cliprects, int width, int height)
@@ -401,42 +445,64 @@ static void update_clipbox(VARectangle *cliprects, int width, int height)
            cliprects[1].x, cliprects[1].y, cliprects[1].width, cliprects[1].height);
 }
 
+/*
+ * Each thread presents its own ring of surfaces into its own drawable, so
+ * the only lock left is gmutex, serializing the window system connection.
+ * The present latency of a frame runs from the time it was due, its
+ * deadline or the start of the iteration when not paced, to the return
+ * of vaPutSurface().
+ */
 static void* putsurface_thread(void *data)
 {
+    putsurface_thread_data *td = data;
     int width=win_width, height=win_height;
-    void *drawable = data;
+    void *drawable = td->drawable;
     int quit = 0;
     VAStatus vaStatus;
     int row_shift = 0;
     int index = 0;
-    unsigned int frame_num=0, start_time, putsurface_time;
+    unsigned long long start_time, putsurface_time, first_time, due_time;
+    unsigned long long deadline = 0, period = 0;
     VARectangle cliprects[2]; /* client supplied clip list */
     int continue_display = 0;
-    
-    if (drawable == drawable_thread0)
-        printf("Enter into thread0\n\n");
-    if (drawable == drawable_thread1)
-        printf("Enter into thread1\n\n");
-    
+
+    printf("Enter into thread%d\n\n", td->index);
+
+    if (frame_rate != 0) {
+        period = 1000000 / frame_rate;
+        deadline = get_time_us();
+    }
+
     putsurface_time = 0;
+    first_time = get_time_us();
     while (!quit) {
-        VASurfaceID surface_id = VA_INVALID_SURFACE;
-        
-        while (surface_id == VA_INVALID_SURFACE)
-            surface_id = get_next_free_surface(&index);
+        VASurfaceID surface_id = td->surfaces[index];
 
-        if (verbose) printf("Thread: %p Display surface 0x%x,\n", drawable, surface_id);
+        if (++index == SURFACE_NUM)
+            index = 0;
 
-        if (multi_thread)
+        /*
+         * the surface was shown SURFACE_NUM frames ago by this thread only;
+         * generate the frame before it is due, not as part of presenting it
+         */
+        if (num_threads > 1)
             upload_surface(va_dpy, surface_id, box_width, row_shift, display_field);
 
+        if (frame_rate != 0) {
+            due_time = deadline;
+            wait_deadline(td, &deadline, period);
+        } else
+            due_time = get_time_us();
+
+        if (verbose) printf("Thread: %p Display surface 0x%x,\n", drawable, surface_id);
+
         if (check_event)
             pthread_mutex_lock(&gmutex);
         
-        start_time = get_tick_count();
+        start_time = get_time_us();
 	if ((continue_display == 0) && getenv("FRAME_STOP")) {
             char c;
-            printf("Press any key to display frame %d...(c/C to continue)\n", frame_num);
+            printf("Press any key to display frame %d...(c/C to continue)\n", td->frame_num);
             c = getchar();
             if (c == 'c' || c == 'C')
                 continue_display = 1;
@@ -477,15 +543,14 @@ static void* putsurface_thread(void *data)
             CHECK_VASTATUS(vaStatus,"vaPutSurface");
         }
     
-        putsurface_time += (get_tick_count() - start_time);
+        putsurface_time += (get_time_us() - start_time);
+        record_latency(td, get_time_us() - due_time);
         
         if (check_event)
             pthread_mutex_unlock(&gmutex);
         
-        pthread_mutex_unlock(&surface_mutex[index]); /* locked in get_next_free_surface */
-        
-        if ((frame_num % 0xff) == 0) {
-            fprintf(stderr, "%.2f FPS             \r", 256000.0 / (float)putsurface_time);
+        if ((td->frame_num % 0xff) == 0) {
+            fprintf(stderr, "%.2f FPS             \r", 256000000.0 / (float)putsurface_time);
             putsurface_time = 0;
             update_clipbox(cliprects, width, height);
         }
@@ -493,21 +558,16 @@ static void* putsurface_thread(void *data)
         if (check_event)
             check_window_event(win_display, drawable, &width, &height, &quit);
 
-        if (multi_thread) { /* reload surface content */
+        if (num_threads > 1) { /* reload surface content */
             row_shift++;
             if (row_shift==(2*box_width)) row_shift= 0;
         }
         
-        if (frame_rate != 0) /* rough framerate control */
-            usleep(1000/frame_rate*1000);
-
-        frame_num++;
-        if (frame_num >= frame_num_total)
+        td->frame_num++;
+        if (td->frame_num >= frame_num_total)
             quit = 1;
     }
-    
-    if (drawable == drawable_thread1)    
-        pthread_exit(NULL);
+    td->elapsed_us = get_time_us() - first_time;
     
     return 0;
 }
@@ -515,7 +575,6 @@ int main(int argc,char **argv)
 {
     int major_ver, minor_ver;
     VAStatus va_status;
-    pthread_t thread1;
     int ret;
     char c;
     int i;
@@ -525,10 +584,11 @@ int main(int argc,char **argv)
                  {
                    {"fmt1",  required_argument,       NULL, '1'},
                    {"fmt2",  required_argument,       NULL, '2'},
+                   {"threads", required_argument,     NULL, 'T'},
                    {0, 0, 0, 0}
                  };
 
-    while ((c =getopt_long(argc,argv,"w:h:g:r:d:f:tcep?n:1:2:v", long_options, NULL)) != EOF) {
+    while ((c =getopt_long(argc,argv,"w:h:g:r:d:f:tT:cep?n:1:2:v", long_options, NULL)) != EOF) {
         switch (c) {
             case '?':
                 printf("putsurface <options>\n");
@@ -536,13 +596,15 @@ int main(int argc,char **argv)
                 printf("           -w/-h resolution of surface\n");
                 printf("           -r <framerate>\n");
                 printf("           -d the dimension of black/write square box, default is 32\n");
-                printf("           -t multi-threads\n");
+                printf("           -t multi-threads, same to -T 2\n");
+                printf("           -T <num> threads, each with its own window\n");
                 printf("           -c test clipbox\n");
                 printf("           -f <1/2> top field, or bottom field\n");
                 printf("           -1 source format (fourcc) for color conversion test\n");
                 printf("           -2 dest   format (fourcc) for color conversion test\n");
                 printf("           --fmt1 same to -1\n");
                 printf("           --fmt2 same to -2\n");
+                printf("           --threads same to -T\n");
                 printf("           -v verbose output\n");
                 exit(0);
                 break;
@@ -571,9 +633,17 @@ int main(int argc,char **argv)
                 box_width = atoi(optarg);
                 break;
             case 't':
-                multi_thread = 1;
+                num_threads = 2;
                 printf("Two threads to do vaPutSurface\n");
                 break;
+            case 'T':
+                num_threads = atoi(optarg);
+                if (num_threads < 1 || num_threads > MAX_THREADS) {
+                    printf("invalid thread number %s, must be 1 to %d\n", optarg, MAX_THREADS);
+                    exit(1);
+                }
+                printf("%d threads to do vaPutSurface\n", num_threads);
+                break;
             case 'e':
                 check_event = 0;
                 break;
@@ -627,12 +697,28 @@ int main(int argc,char **argv)
         fprintf(stderr, "Can't open the connection of display!\n");
         exit(-1);
     }
-    create_window(win_display, win_x, win_y, win_width, win_height);
+    for (i = 0; i < num_threads; i++) {
+        /* side by side, the first one at the given location */
+        drawables[i] = create_window(win_display, i, win_x + i * win_width, win_y,
+                                     win_width, win_height);
+        if (drawables[i] == NULL) {
+            fprintf(stderr, "Can't create window %d!\n", i);
+            exit(-1);
+        }
+    }
 
     va_dpy = vaGetDisplay(win_display);
     va_status = vaInitialize(va_dpy, &major_ver, &minor_ver);
     CHECK_VASTATUS(va_status, "vaInitialize");
 
+    surface_num = SURFACE_NUM * num_threads;
+    surface_id = calloc(surface_num, sizeof(*surface_id));
+    thread_data = calloc(num_threads, sizeof(*thread_data));
+    if (!surface_id || !thread_data) {
+        fprintf(stderr, "Out of memory\n");
+        exit(-1);
+    }
+
     if (test_color_conversion) {
         ret = csc_preparation();
     }
@@ -640,28 +726,37 @@ int main(int argc,char **argv)
         va_status = vaCreateSurfaces(
             va_dpy,
             VA_RT_FORMAT_YUV420, surface_width, surface_height,
-            &surface_id[0], SURFACE_NUM,
+            &surface_id[0], surface_num,
             NULL, 0
         );
 	}
     CHECK_VASTATUS(va_status, "vaCreateSurfaces");
-    if (multi_thread == 0) /* upload the content for all surfaces */
+    if (num_threads == 1) /* upload the content for all surfaces */
         upload_source_YUV_once_for_all();
     
     if (check_event)
         pthread_mutex_init(&gmutex, NULL);
-   
-    for(i = 0; i< SURFACE_NUM; i++)
-        pthread_mutex_init(&surface_mutex[i], NULL);
-    
-    if (multi_thread == 1) 
-        ret = pthread_create(&thread1, NULL, putsurface_thread, (void*)drawable_thread1);
 
-    putsurface_thread((void *)drawable_thread0);
+    for (i = 0; i < num_threads; i++) {
+        thread_data[i].index = i;
+        thread_data[i].drawable = drawables[i];
+        thread_data[i].surfaces = &surface_id[i * SURFACE_NUM];
+    }
+    for (i = 1; i < num_threads; i++) {
+        ret = pthread_create(&thread_data[i].thread, NULL, putsurface_thread, &thread_data[i]);
+        if (ret) {
+            fprintf(stderr, "Can't create thread %d!\n", i);
+            exit(-1);
+        }
+    }
+
+    putsurface_thread(&thread_data[0]);
 
-    if (multi_thread == 1) 
-        pthread_join(thread1, (void **)&ret);
-    printf("thread1 is free\n");
+    for (i = 1; i < num_threads; i++)
+        pthread_join(thread_data[i].thread, NULL);
+    printf("\n");
+    for (i = 0; i < num_threads; i++)
+        print_thread_report(&thread_data[i]);
 
     if (test_color_conversion) {
         // destroy temp surface/image
@@ -677,9 +772,14 @@ int main(int argc,char **argv)
         vpp_config_id = VA_INVALID_ID;
     }
 
-    vaDestroySurfaces(va_dpy,&surface_id[0],SURFACE_NUM);    
+    vaDestroySurfaces(va_dpy,&surface_id[0],surface_num);
+    for (i = 0; i < num_threads; i++)
+        destroy_window(win_display, drawables[i]);
     vaTerminate(va_dpy);
 
+    free(surface_id);
+    free(thread_data);
+
     free(va_image_formats);
     free(va_surface_attribs);
     close_display(win_display);
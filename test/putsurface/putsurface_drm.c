@@ -0,0 +1,219 @@
+/*
+ * Copyright (c) 2012 Intel Corporation. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+ * IN NO EVENT SHALL PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR
+ * ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Headless putsurface: there is no window system, a drawable is an image
+ * each presented surface is copied into, once the surface is ready.
+ */
+
+#include <stddef.h>
+#include <fcntl.h>
+#ifdef IN_LIBVA
+# include "va/drm/va_drm.h"
+#else
+# include <va/va_drm.h>
+#endif
+
+static void *open_display(void);
+static void close_display(void *win_display);
+static void *create_window(void *win_display, int index,
+             int x, int y, int width, int height);
+static void destroy_window(void *win_display, void *drawable);
+static int check_window_event(void *win_display, void *drawable,
+                  int *width, int *height, int *quit);
+
+struct display;
+struct drawable;
+
+static VAStatus
+va_put_surface(
+    VADisplay           dpy,
+    struct drawable    *drm_drawable,
+    VASurfaceID         va_surface,
+    const VARectangle  *src_rect
+);
+
+/* Glue code for the current PutSurface test design */
+#define CAST_DRAWABLE(a)  (struct drawable *)(a)
+
+struct display {
+    int                 drm_fd;
+};
+
+static inline VADisplay
+vaGetDisplay(VANativeDisplay native_dpy)
+{
+    struct display * const d = native_dpy;
+
+    return vaGetDisplayDRM(d->drm_fd);
+}
+
+static VAStatus
+vaPutSurface(
+    VADisplay           dpy,
+    VASurfaceID         surface,
+    struct drawable    *drm_drawable,
+    short               src_x,
+    short               src_y,
+    unsigned short      src_w,
+    unsigned short      src_h,
+    short               dst_x,
+    short               dst_y,
+    unsigned short      dst_w,
+    unsigned short      dst_h,
+    const VARectangle  *cliprects,
+    unsigned int        num_cliprects,
+    unsigned int        flags
+)
+{
+    VARectangle src_rect;
+
+    src_rect.x      = src_x;
+    src_rect.y      = src_y;
+    src_rect.width  = src_w;
+    src_rect.height = src_h;
+    return va_put_surface(dpy, drm_drawable, surface, &src_rect);
+}
+
+#include "putsurface_common.c"
+
+struct drawable {
+    VAImage             image;
+    unsigned int        image_tried     : 1;
+};
+
+/* The image formats are looked up once, by whichever thread comes first */
+static pthread_mutex_t image_format_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static VAStatus
+va_put_surface(
+    VADisplay           dpy,
+    struct drawable    *drm_drawable,
+    VASurfaceID         va_surface,
+    const VARectangle  *src_rect
+)
+{
+    const VAImageFormat *image_format;
+    VAStatus va_status;
+
+    if (!drm_drawable)
+        return VA_STATUS_ERROR_INVALID_SURFACE;
+
+    va_status = vaSyncSurface(dpy, va_surface);
+    if (va_status != VA_STATUS_SUCCESS)
+        return va_status;
+
+    /* Without NV12 images, presenting is waiting for the surface only */
+    if (!drm_drawable->image_tried) {
+        drm_drawable->image_tried = 1;
+        pthread_mutex_lock(&image_format_mutex);
+        image_format = lookup_image_format(VA_FOURCC_NV12);
+        pthread_mutex_unlock(&image_format_mutex);
+        if (image_format &&
+            vaCreateImage(dpy, (VAImageFormat *)image_format,
+                          src_rect->width, src_rect->height,
+                          &drm_drawable->image) != VA_STATUS_SUCCESS)
+            drm_drawable->image.image_id = VA_INVALID_ID;
+    }
+    if (drm_drawable->image.image_id == VA_INVALID_ID)
+        return VA_STATUS_SUCCESS;
+
+    return vaGetImage(dpy, va_surface, src_rect->x, src_rect->y,
+                      src_rect->width, src_rect->height,
+                      drm_drawable->image.image_id);
+}
+
+static void *
+open_display(void)
+{
+    static const char *drm_device_paths[] = {
+        "/dev/dri/renderD128",
+        "/dev/dri/card0",
+        NULL
+    };
+    struct display *d;
+    int i;
+
+    d = calloc(1, sizeof *d);
+    if (!d)
+        return NULL;
+
+    for (i = 0; drm_device_paths[i]; i++) {
+        d->drm_fd = open(drm_device_paths[i], O_RDWR);
+        if (d->drm_fd >= 0)
+            break;
+    }
+    if (d->drm_fd < 0) {
+        free(d);
+        return NULL;
+    }
+
+    /* No window events, nor a connection shared by the threads to lock */
+    check_event = 0;
+    return d;
+}
+
+static void
+close_display(void *win_display)
+{
+    struct display * const d = win_display;
+
+    close(d->drm_fd);
+    free(d);
+}
+
+static void *
+create_window(void *win_display, int index, int x, int y, int width, int height)
+{
+    struct drawable *drawable;
+
+    drawable = calloc(1, sizeof(*drawable));
+    if (!drawable)
+        return NULL;
+    drawable->image.image_id = VA_INVALID_ID;
+    return drawable;
+}
+
+/* Called before vaTerminate(), the image belongs to the VA display */
+static void
+destroy_window(void *win_display, void *drawable)
+{
+    struct drawable * const drm_drawable = drawable;
+
+    if (drm_drawable->image.image_id != VA_INVALID_ID)
+        vaDestroyImage(va_dpy, drm_drawable->image.image_id);
+    free(drm_drawable);
+}
+
+static int
+check_window_event(
+    void *win_display,
+    void *drawable,
+    int  *width,
+    int  *height,
+    int  *quit
+)
+{
+    return 0;
+}
@@ -34,8 +34,9 @@
 
 static void *open_display(void);
 static void close_display(void *win_display);
-static int create_window(void *win_display,
+static void *create_window(void *win_display, int index,
              int x, int y, int width, int height);
+static void destroy_window(void *win_display, void *drawable);
 static int check_window_event(void *win_display, void *drawable,
                   int *width, int *height, int *quit);
 
@@ -156,7 +157,8 @@ va_put_surface(
             wl_display_dispatch(wl_drawable->display);
     }
 
-    va_status = vaGetSurfaceBufferWl(va_dpy, va_surface, VA_FRAME_PICTURE, &buffer);
+    va_status = vaGetSurfaceBufferWl(va_dpy, va_surface,
+        VA_FRAME_PICTURE | VA_WAYLAND_BUFFER_CACHED, &buffer);
     if (va_status != VA_STATUS_SUCCESS)
         return va_status;
 
@@ -240,43 +242,35 @@ close_display(void *win_display)
     free(d);
 }
 
-static int
-create_window(void *win_display, int x, int y, int width, int height)
+static void *
+create_window(void *win_display, int index, int x, int y, int width, int height)
 {
     struct wl_display * const display = win_display;
     struct display * const d = wl_display_get_user_data(display);
-    struct wl_surface *surface1, *surface2;
+    struct wl_surface *surface;
     struct wl_shell_surface *shell_surface;
-    struct wl_shell_surface *shell_surface_2;
-    struct drawable *drawable1, *drawable2;
+    struct drawable *drawable;
 
-    surface1 = wl_compositor_create_surface(d->compositor);
-    shell_surface = wl_shell_get_shell_surface(d->shell, surface1);
+    surface = wl_compositor_create_surface(d->compositor);
+    shell_surface = wl_shell_get_shell_surface(d->shell, surface);
     wl_shell_surface_set_toplevel(shell_surface);
 
-    drawable1 = malloc(sizeof(*drawable1));
-    drawable1->display          = display;
-    drawable1->surface          = surface1;
-    drawable1->redraw_pending   = 0;
-
-    /* global out */
-    drawable_thread0 = drawable1;
-
-    if (multi_thread == 0)
-        return 0;
-
-    surface2 = wl_compositor_create_surface(d->compositor);
-    shell_surface_2 = wl_shell_get_shell_surface(d->shell, surface2);
-    wl_shell_surface_set_toplevel(shell_surface_2);
+    drawable = malloc(sizeof(*drawable));
+    if (!drawable)
+        return NULL;
+    drawable->display           = display;
+    drawable->surface           = surface;
+    drawable->redraw_pending    = 0;
+    return drawable;
+}
 
-    drawable2 = malloc(sizeof(*drawable2));
-    drawable2->display          = display;
-    drawable1->surface          = surface2;
-    drawable2->redraw_pending   = 0;
+static void
+destroy_window(void *win_display, void *drawable)
+{
+    struct drawable * const wl_drawable = drawable;
 
-    /* global out */
-    drawable_thread1 = drawable2;
-    return 0;
+    wl_surface_destroy(wl_drawable->surface);
+    free(wl_drawable);
 }
 
 static int
@@ -26,13 +26,12 @@
 #include <X11/Xutil.h>
 #include <va/va_x11.h>
 
-static  Window window_thread0, window_thread1;
-static  GC context_thread0, context_thread1;
 static  pthread_mutex_t gmutex;
 
 static void *open_display(void);
 static void close_display(void *win_display);
-static int create_window(void *win_display, int x, int y, int width, int height);
+static void *create_window(void *win_display, int index, int x, int y, int width, int height);
+static void destroy_window(void *win_display, void *drawable);
 static int check_window_event(void *x11_display, void *drawable, int *width, int *height, int *quit);
 
 #define CAST_DRAWABLE(a)  (Drawable)(a)
@@ -68,68 +67,46 @@ static Pixmap create_pixmap(void *win_display, int width, int height)
     return pixmap;
 }
 
-static int create_window(void *win_display, int x, int y, int width, int height)
+static void *create_window(void *win_display, int index, int x, int y, int width, int height)
 {
     Display *x11_display = (Display *)win_display;
     int screen = DefaultScreen(x11_display);
     Window root, win;
+    char title[32];
 
     root = RootWindow(x11_display, screen);
 
-    printf("Create window0 for thread0\n");
-    drawable_thread0 = (void *)XCreateSimpleWindow(x11_display, root, x, y, width, height,
-                                           0, 0, WhitePixel(x11_display, 0));
-
-    win = (Window)drawable_thread0;
-    if (drawable_thread0) {
-        XSizeHints sizehints;
-        sizehints.width  = width;
-        sizehints.height = height;
-        sizehints.flags = USSize;
-        XSetNormalHints(x11_display, win, &sizehints);
-        XSetStandardProperties(x11_display, win, "Thread 0", "Thread 0",
-                               None, (char **)NULL, 0, &sizehints);
-
-        XMapWindow(x11_display, win);
-    }
-    context_thread0 = XCreateGC(x11_display, win, 0, 0);
+    printf("Create window%d for thread%d\n", index, index);
+    win = XCreateSimpleWindow(x11_display, root, x, y, width, height,
+                              0, 0, WhitePixel(x11_display, 0));
+    if (!win)
+        return NULL;
+
+    XSizeHints sizehints;
+    sizehints.width  = width;
+    sizehints.height = height;
+    sizehints.flags = USSize;
+    XSetNormalHints(x11_display, win, &sizehints);
+    sprintf(title, "Thread %d", index);
+    XSetStandardProperties(x11_display, win, title, title,
+                           None, (char **)NULL, 0, &sizehints);
+
+    XMapWindow(x11_display, win);
     XSelectInput(x11_display, win, KeyPressMask | StructureNotifyMask);
     XSync(x11_display, False);
 
-    if (put_pixmap) {
-        window_thread0 = (Window)drawable_thread0;
-        drawable_thread0 = (void *)create_pixmap(x11_display, width, height);
-    }
-    
-    if (multi_thread == 0)
-        return 0;
+    if (put_pixmap)
+        return (void *)create_pixmap(x11_display, width, height);
 
-    printf("Create window1 for thread1\n");
-    
-    drawable_thread1 = (void *)XCreateSimpleWindow(x11_display, root, width, 0, width, height,
-                                            0, 0, WhitePixel(x11_display, 0));
-    win = (Window)drawable_thread1;
-    if (drawable_thread1) {
-        XSizeHints sizehints;
-        sizehints.width  = width;
-        sizehints.height = height;
-        sizehints.flags = USSize;
-        XSetNormalHints(x11_display, win, &sizehints);
-        XSetStandardProperties(x11_display, win, "Thread 1", "Thread 1",
-                               None, (char **)NULL, 0, &sizehints);
-
-        XMapWindow(x11_display, win);
-    }
-    if (put_pixmap) {
-        window_thread1 = (Window)drawable_thread1;
-        drawable_thread1 = (void *)create_pixmap(x11_display, width, height);
-    }
+    return (void *)win;
+}
 
-    context_thread1 = XCreateGC(x11_display, win, 0, 0);
-    XSelectInput(x11_display, win, KeyPressMask | StructureNotifyMask);
-    XSync(x11_display, False);
-    
-    return 0;
+static void destroy_window(void *win_display, void *drawable)
+{
+    if (put_pixmap)
+        XFreePixmap((Display *)win_display, (Pixmap)drawable);
+    else
+        XDestroyWindow((Display *)win_display, (Window)drawable);
 }
 
 static int check_window_event(void *win_display, void *drawable, int *width, int *height, int *quit)
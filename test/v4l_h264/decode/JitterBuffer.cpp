@@ -0,0 +1,238 @@
+/*
+ * Copyright (c) 2012 Intel Corporation. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <time.h>
+
+#include "JitterBuffer.h"
+
+// delay added per unit of interarrival jitter
+#define JITTER_DELAY_FACTOR 3
+// weight of the latest transit in the smallest one, to follow clock drift
+#define TRANSIT_DRIFT_SHIFT 10
+// decay of the largest recent transit spread, per frame
+#define SPREAD_DECAY_SHIFT  8
+
+
+long long monotonic_us()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+
+JitterBuffer::JitterBuffer(unsigned int depth) :
+    depth(depth ? depth : 1),
+    head(0),
+    count(0),
+    queued(0),
+    peak(0),
+    waits(0),
+    closed(false)
+{
+    frames = (JitterFrame *)calloc(this->depth, sizeof(*frames));
+    pthread_mutex_init(&mutex, NULL);
+    pthread_cond_init(&cond, NULL);
+}
+
+
+JitterBuffer::~JitterBuffer()
+{
+    free(frames);
+    pthread_cond_destroy(&cond);
+    pthread_mutex_destroy(&mutex);
+}
+
+
+JitterFrame *JitterBuffer::getFree()
+{
+    JitterFrame *frame;
+
+    pthread_mutex_lock(&mutex);
+    if (count == depth && !closed) {
+        waits++;
+    }
+    while (count == depth && !closed) {
+        pthread_cond_wait(&cond, &mutex);
+    }
+    if (closed) {
+        pthread_mutex_unlock(&mutex);
+        return NULL;
+    }
+    frame = &frames[(head + count) % depth];
+    pthread_mutex_unlock(&mutex);
+
+    return frame;
+}
+
+
+void JitterBuffer::push()
+{
+    pthread_mutex_lock(&mutex);
+    count++;
+    queued++;
+    if (queued > peak) {
+        peak = queued;
+    }
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&mutex);
+}
+
+
+void JitterBuffer::close()
+{
+    pthread_mutex_lock(&mutex);
+    closed = true;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&mutex);
+}
+
+
+JitterFrame *JitterBuffer::pop()
+{
+    JitterFrame *frame = NULL;
+
+    pthread_mutex_lock(&mutex);
+    while (queued == 0 && !closed) {
+        pthread_cond_wait(&cond, &mutex);
+    }
+    if (queued) {
+        frame = &frames[head];
+        queued--;
+    }
+    pthread_mutex_unlock(&mutex);
+
+    return frame;
+}
+
+
+void JitterBuffer::release()
+{
+    pthread_mutex_lock(&mutex);
+    head = (head + 1) % depth;
+    count--;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&mutex);
+}
+
+
+unsigned int JitterBuffer::level()
+{
+    unsigned int val;
+
+    pthread_mutex_lock(&mutex);
+    val = queued;
+    pthread_mutex_unlock(&mutex);
+    return val;
+}
+
+
+unsigned int JitterBuffer::maxLevel()
+{
+    unsigned int val;
+
+    pthread_mutex_lock(&mutex);
+    val = peak;
+    pthread_mutex_unlock(&mutex);
+    return val;
+}
+
+
+unsigned int JitterBuffer::fullWaits()
+{
+    unsigned int val;
+
+    pthread_mutex_lock(&mutex);
+    val = waits;
+    pthread_mutex_unlock(&mutex);
+    return val;
+}
+
+
+PlayoutClock::PlayoutClock(unsigned int maxDelayUs) :
+    maxDelay(maxDelayUs),
+    started(false),
+    lastTimestamp(0),
+    timestampUs(0),
+    lastTransit(0),
+    minTransit(0),
+    maxSpread(0),
+    jitter(0),
+    period(1000000.0 / 30),
+    delay(0)
+{
+}
+
+
+long long PlayoutClock::schedule(unsigned int timestamp, long long readyUs)
+{
+    long long transit;
+
+    if (started) {
+        // signed difference, so the 32 bit timestamps may wrap
+        long long step = (long long)(int)(timestamp - lastTimestamp) * 1000000 / TIMESTAMP_CLOCK;
+
+        timestampUs += step;
+        if (step > 0) {
+            period += (step - period) / 16;
+        }
+    }
+    lastTimestamp = timestamp;
+
+    transit = readyUs - timestampUs;
+    if (!started) {
+        lastTransit = minTransit = transit;
+        started = true;
+    }
+
+    // RFC 3550, 6.4.1
+    long long d = transit - lastTransit;
+    jitter += ((d < 0 ? -d : d) - jitter) / 16;
+    lastTransit = transit;
+
+    if (transit < minTransit) {
+        minTransit = transit;
+    } else {
+        minTransit += (transit - minTransit) >> TRANSIT_DRIFT_SHIFT;
+    }
+
+    // a late burst raises the delay at once, which then comes down slowly
+    if (transit - minTransit > maxSpread) {
+        maxSpread = transit - minTransit;
+    } else {
+        maxSpread -= maxSpread >> SPREAD_DECAY_SHIFT;
+    }
+
+    delay = (unsigned int)(JITTER_DELAY_FACTOR * jitter);
+    if (delay < maxSpread) {
+        delay = maxSpread;
+    }
+    if (delay > maxDelay) {
+        delay = maxDelay;
+    }
+
+    return timestampUs + minTransit + delay;
+}
@@ -0,0 +1,164 @@
+/*
+ * Copyright (c) 2012 Intel Corporation. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+* Frame queue between the TCP receive thread and the decode thread, and
+* the playout clock of the display thread
+*/
+
+#ifndef __JITTER_BUFFER_H__
+#define __JITTER_BUFFER_H__
+
+#include <pthread.h>
+
+/* Timestamps on the wire are 32 bit, 90 kHz */
+#define TIMESTAMP_CLOCK     90000
+
+struct JitterFrame {
+    unsigned int frameCount;
+    unsigned int sliceType;
+    unsigned int timestamp;
+    unsigned int size;
+    const unsigned char *data;  // in the receive ring, held until released
+};
+
+
+class JitterBuffer
+{
+public:
+    /**
+    * Construct a buffer of depth frames
+    **/
+    JitterBuffer(unsigned int depth);
+
+    ~JitterBuffer();
+
+    /* Receive side */
+    /**
+    * Get the next free frame. Blocks while all frames are queued.
+    * return value:
+    *   the frame to fill, NULL once the buffer is closed
+    **/
+    JitterFrame *getFree();
+
+    /**
+    * Queue the frame returned by getFree()
+    **/
+    void push();
+
+    /**
+    * No more frames, pop() returns NULL once the queued ones are taken
+    **/
+    void close();
+
+    /* Decode side */
+    /**
+    * Take the oldest queued frame. Blocks while the buffer is empty.
+    * return value:
+    *   the frame, valid until release(); NULL once closed and empty
+    **/
+    JitterFrame *pop();
+
+    /**
+    * Give back the frame returned by pop()
+    **/
+    void release();
+
+    /* Counters, for any thread */
+    unsigned int level();       // frames queued now
+    unsigned int maxLevel();    // most frames queued at once
+    unsigned int fullWaits();   // getFree() calls that had to wait
+
+private:
+    // don't allow value semantics on this object
+    JitterBuffer(const JitterBuffer &jb);
+    void operator=(const JitterBuffer &jb);
+
+    JitterFrame *frames;
+    unsigned int depth;
+    unsigned int head;      // next frame to pop
+    unsigned int count;     // frames queued, or taken and not released
+    unsigned int queued;    // frames queued
+    unsigned int peak;
+    unsigned int waits;
+    bool closed;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+};
+
+
+/*
+* Maps stream timestamps to local display times.
+*
+* The transit time of a frame is its local ready time minus its timestamp,
+* both in microseconds; the sender and receiver clocks only need to run at
+* the same rate. The smallest transit seen is the fastest path through the
+* network and the decoder. Frames are shown at their timestamp plus that
+* transit plus a delay, capped at the latency bound, that covers both the
+* interarrival jitter (RFC 3550 style estimate) and the largest recent
+* transit above the smallest one, which decays over a few seconds. The
+* smallest transit creeps up towards the recent ones, to follow clock drift
+* and route changes.
+*/
+class PlayoutClock
+{
+public:
+    /**
+    * parameters:
+    * - maxDelayUs: bound on the delay added for jitter
+    **/
+    PlayoutClock(unsigned int maxDelayUs);
+
+    /**
+    * Schedule the next frame, in stream order.
+    * parameters:
+    * - timestamp: stream timestamp, 90 kHz
+    * - readyUs:   local time the frame was ready for display, CLOCK_MONOTONIC
+    * return value:
+    *   local time to display the frame at, CLOCK_MONOTONIC microseconds
+    **/
+    long long schedule(unsigned int timestamp, long long readyUs);
+
+    unsigned int jitterUs() { return (unsigned int)jitter; }
+    unsigned int delayUs() { return delay; }
+    unsigned int framePeriodUs() { return (unsigned int)period; }
+
+private:
+    unsigned int maxDelay;
+    bool started;
+    unsigned int lastTimestamp;
+    long long timestampUs;  // unwrapped
+    long long lastTransit;
+    long long minTransit;
+    long long maxSpread;
+    double jitter;
+    double period;
+    unsigned int delay;
+};
+
+/* CLOCK_MONOTONIC in microseconds */
+long long monotonic_us();
+
+#endif // __JITTER_BUFFER_H__
@@ -36,6 +36,9 @@
 #include <netdb.h>  // for hostent, gethostbyname()
 #include <fcntl.h>  // for fcntl()
 #include <errno.h>
+#include <sys/epoll.h>  // for epoll_create1(), epoll_wait()
+#include <sys/mman.h>   // for mmap(), shm_open()
+#include <sys/syscall.h>    // for SYS_memfd_create
 
 #include <cstring>  // for memset
 
@@ -43,11 +46,50 @@
 
 using std::string;
 
+// holds a few seconds of 1080p slices; a multiple of the page size
+#define RING_SIZE   (16 << 20)
+
+#define FRAME_HEADER_SIZE   16
+
+
+/*
+ * An anonymous file to map the receive ring from: memfd_create() where the
+ * kernel has it, else a POSIX shared memory object unlinked right away.
+ */
+static int createRingFile()
+{
+    int fd = -1;
+
+#ifdef SYS_memfd_create
+    fd = syscall(SYS_memfd_create, "tcp-ring", 0);
+    if (fd >= 0 || errno != ENOSYS) {
+        return fd;
+    }
+#endif
+
+    char name[64];
+    snprintf(name, sizeof(name), "/tcp-ring-%d-%p", (int)getpid(), (void *)&fd);
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd >= 0) {
+        shm_unlink(name);
+    }
+    return fd;
+}
+
 
 TCPSocketServer::TCPSocketServer(unsigned short localPort) throw(std::runtime_error) :
 sockDesc(-1),
-    connSockDesc(-1)
+    connSockDesc(-1),
+    epollDesc(-1),
+    ring(NULL),
+    ringSize(0),
+    ringHead(0),
+    ringRead(0),
+    ringTail(0)
 {
+    pthread_mutex_init(&ringMutex, NULL);
+    pthread_cond_init(&ringCond, NULL);
+
     // create new socket
     if ((sockDesc = socket(PF_INET, SOCK_STREAM, 0)) < 0) {
         throw std::runtime_error("Socket creation failed (socket())");
@@ -78,6 +120,14 @@ TCPSocketServer::~TCPSocketServer()
     if (connSockDesc > 0) {
         ::close(connSockDesc);
     }
+    if (epollDesc >= 0) {
+        ::close(epollDesc);
+    }
+    if (ring) {
+        munmap(ring, 2 * ringSize);
+    }
+    pthread_cond_destroy(&ringCond);
+    pthread_mutex_destroy(&ringMutex);
 
     ::close(sockDesc);
 }
@@ -97,6 +147,55 @@ void TCPSocketServer::accept(string &remoteAddr, unsigned short &remotePort) thr
 
     remoteAddr = inet_ntoa(connSockAddr.sin_addr);
     remotePort = ntohs(connSockAddr.sin_port);
+
+    initRing();
+}
+
+
+/* Set up the receive ring and the epoll set for the connected socket */
+void TCPSocketServer::initRing() throw (std::runtime_error)
+{
+    if (ring == NULL) {
+        ringSize = RING_SIZE;
+
+        int fd = createRingFile();
+        if (fd < 0) {
+            throw std::runtime_error("Receive ring creation failed (memfd_create(), shm_open())");
+        }
+        if (ftruncate(fd, ringSize) < 0) {
+            ::close(fd);
+            throw std::runtime_error("Receive ring creation failed (ftruncate())");
+        }
+
+        // reserve both halves, then map the same pages in each
+        void *base = mmap(NULL, 2 * ringSize, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (base == MAP_FAILED ||
+            mmap(base, ringSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+            mmap((unsigned char *)base + ringSize, ringSize, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+            ::close(fd);
+            throw std::runtime_error("Receive ring mapping failed (mmap())");
+        }
+        ::close(fd);
+        ring = (unsigned char *)base;
+    }
+    ringHead = ringRead = ringTail = 0;
+
+    if (epollDesc >= 0) {
+        ::close(epollDesc);
+    }
+    if ((epollDesc = epoll_create1(0)) < 0) {
+        throw std::runtime_error("Poll set creation failed (epoll_create1())");
+    }
+
+    struct epoll_event ev;
+    ::memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = connSockDesc;
+    if (fcntl(connSockDesc, F_SETFL, fcntl(connSockDesc, F_GETFL) | O_NONBLOCK) < 0 ||
+        epoll_ctl(epollDesc, EPOLL_CTL_ADD, connSockDesc, &ev) < 0) {
+        throw std::runtime_error("Socket initialization failed (epoll_ctl())");
+    }
 }
 
 
@@ -154,32 +253,118 @@ ssize_t TCPSocketServer::send(const string &message) throw (std::runtime_error)
 }
 
 
-int TCPSocketServer::recv_data(unsigned char *data, int size)
+/*
+ * Free bytes in the ring. With wait set, blocks while frames held by
+ * another thread fill it.
+ */
+size_t TCPSocketServer::ringSpace(bool wait)
 {
-    int total = 0;
-    try {
-        int pos = 0;
-        int recvMsgSize;
-        for (;;) {
-            // try to receive a message
-            recvMsgSize = recv(&data[pos], size);
-            if ((recvMsgSize < 0) && (errno == EWOULDBLOCK)) {
-                // no data received on non-blocking socket
-                usleep(100);
-            } else {
-                total += recvMsgSize;
-                if (recvMsgSize != size) {
-                    pos += recvMsgSize;
-                    size -= recvMsgSize;
-                } else {
-                    break;
+    size_t space;
+
+    pthread_mutex_lock(&ringMutex);
+    while (wait && ringTail - ringHead == ringSize) {
+        pthread_cond_wait(&ringCond, &ringMutex);
+    }
+    space = ringSize - (ringTail - ringHead);
+    pthread_mutex_unlock(&ringMutex);
+    return space;
+}
+
+
+/* Give back size bytes at ringHead, in the order they were received */
+void TCPSocketServer::releaseRing(size_t size)
+{
+    pthread_mutex_lock(&ringMutex);
+    ringHead += size;
+    pthread_cond_broadcast(&ringCond);
+    pthread_mutex_unlock(&ringMutex);
+}
+
+
+/*
+ * Read whatever the socket has into the free part of the ring, waiting in
+ * epoll if there is nothing yet, or for release_frame() if the ring is
+ * full. Returns 1 if data was added, 0 if a signal interrupted the wait
+ * and -1 once the connection is closed.
+ */
+int TCPSocketServer::fillRing()
+{
+    struct epoll_event ev;
+    int added = 0;
+    size_t space;
+
+    if (connSockDesc <= 0) {
+        return -1;
+    }
+
+    while ((space = ringSpace(!added)) > 0) {
+        ssize_t rval = ::read(connSockDesc, ring + ringTail % ringSize, space);
+
+        if (rval > 0) {
+            ringTail += rval;
+            added = 1;
+            continue;
+        }
+        if (rval < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rval < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (added) {
+                break;
+            }
+            if (epoll_wait(epollDesc, &ev, 1, -1) < 0) {
+                if (errno == EINTR) {
+                    return 0;
                 }
+                break;
             }
+            continue;
         }
+
+        // EOF (connection closed by remote host) or error
+        if (added) {
+            break;
+        }
+        ::close(connSockDesc);
+        connSockDesc = -1;
+        ::memset(&connSockAddr, 0, sizeof(connSockAddr));
+        return -1;
     }
-    catch (const std::exception& e) {
-        printf("%s\n", e.what());
-        exit(1);
+
+    return 1;
+}
+
+
+/* Wait until size bytes past ringRead are in the ring */
+bool TCPSocketServer::waitRing(size_t size)
+{
+    while (ringTail - ringRead < size) {
+        if (fillRing() <= 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+int TCPSocketServer::recv_data(unsigned char *data, int size)
+{
+    int total = 0;
+
+    while (total < size) {
+        size_t chunk = size - total;
+
+        if (chunk > ringSize) {
+            chunk = ringSize;
+        }
+        if (!waitRing(chunk)) {
+            printf("Error reading from socket (connection closed)\n");
+            exit(1);
+        }
+        ::memcpy(data + total, ring + ringRead % ringSize, chunk);
+        ringRead += chunk;
+        releaseRing(chunk);
+        total += chunk;
     }
     return total;
 }
@@ -190,3 +375,38 @@ unsigned int TCPSocketServer::recv_uint32()
     recv_data((unsigned char*)&buffer, 4);
     return buffer;
 }
+
+
+const unsigned char *TCPSocketServer::recv_frame(unsigned int &frameCount, unsigned int &sliceType,
+                                                 unsigned int &timestamp, unsigned int &size)
+    throw (std::runtime_error)
+{
+    unsigned int header[FRAME_HEADER_SIZE / 4];
+    const unsigned char *data;
+
+    if (!waitRing(FRAME_HEADER_SIZE)) {
+        return NULL;
+    }
+    ::memcpy(header, ring + ringRead % ringSize, FRAME_HEADER_SIZE);
+    if (header[2] > ringSize - FRAME_HEADER_SIZE) {
+        throw std::runtime_error("Frame larger than the receive ring");
+    }
+    if (!waitRing(FRAME_HEADER_SIZE + header[2])) {
+        return NULL;
+    }
+
+    frameCount = header[0];
+    sliceType = header[1];
+    size = header[2];
+    timestamp = header[3];
+
+    data = ring + ringRead % ringSize + FRAME_HEADER_SIZE;
+    ringRead += FRAME_HEADER_SIZE + size;
+    return data;
+}
+
+
+void TCPSocketServer::release_frame(unsigned int size)
+{
+    releaseRing(FRAME_HEADER_SIZE + size);
+}
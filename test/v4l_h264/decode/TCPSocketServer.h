@@ -31,6 +31,8 @@
 
 #include <stdexcept>
 
+#include <pthread.h>
+
 #include <netinet/in.h> // for IPPROTO_TCP, sockadd_in
 
 #ifndef SERVER_ADDR
@@ -109,9 +111,41 @@ public:
     ssize_t send(const std::string &message) throw (std::runtime_error);
 
 
+    /* Buffered receive */
+    /**
+    * Receive exactly size bytes.
+    * The data goes through the receive ring, the call waits in epoll until
+    * enough of it has arrived. Not to be called while frames are held.
+    **/
     int recv_data(unsigned char *data, int size);
     unsigned int recv_uint32();
 
+    /**
+    * Receive the next frame: frame count, slice type, size and timestamp
+    * as 32 bit words, then size bytes of slice data.
+    * parameters:
+    * - frameCount: (OUT) frame count from the header
+    * - sliceType:  (OUT) slice type from the header
+    * - timestamp:  (OUT) capture time, 90 kHz
+    * - size:       (OUT) size of the slice data
+    * return value:
+    *   the slice data, in place in the receive ring and held there until
+    *   release_frame(); NULL if the peer closed the connection or a signal
+    *   interrupted the wait
+    * Once the held frames fill the ring, the call waits for a release.
+    **/
+    const unsigned char *recv_frame(unsigned int &frameCount, unsigned int &sliceType,
+                                    unsigned int &timestamp, unsigned int &size)
+        throw (std::runtime_error);
+
+    /**
+    * Give the oldest held frame back to the ring. Frames are released in
+    * the order recv_frame() returned them, from any thread.
+    * parameters:
+    * - size: size of its slice data
+    **/
+    void release_frame(unsigned int size);
+
 
 private:
     // don't allow value semantics on this object
@@ -123,6 +157,28 @@ private:
 
     int connSockDesc;   // connected socket descriptor
     sockaddr_in connSockAddr;
+
+    /*
+    * Receive ring, mapped twice back to back so that any ringSize bytes
+    * starting in the first mapping are contiguous. The counters only grow
+    * and are taken modulo ringSize: frames handed out and not released yet
+    * are at [ringHead, ringRead), data not parsed yet at [ringRead, ringTail).
+    * ringHead is under ringMutex, the others belong to the receiving thread.
+    */
+    int epollDesc;
+    unsigned char *ring;
+    size_t ringSize;
+    size_t ringHead;
+    size_t ringRead;
+    size_t ringTail;
+    pthread_mutex_t ringMutex;
+    pthread_cond_t ringCond;    // signaled when ringHead moves
+
+    void initRing() throw (std::runtime_error);
+    size_t ringSpace(bool wait);
+    void releaseRing(size_t size);
+    int fillRing();
+    bool waitRing(size_t size);
 };
 
 #endif // __TCP_SOCKET_H__
@@ -29,14 +29,17 @@
 #include <csignal>
 #include <cstring>
 #include <cstdarg>
+#include <cerrno>
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
 #include <cassert>
 #include <va/va_x11.h>
 #include <iostream>
 #include <cstdlib>
+#include <pthread.h>
 
 #include "TCPSocketServer.h"
+#include "JitterBuffer.h"
 using std::string;
 
 #define MYPROF  VAProfileH264High
@@ -44,7 +47,8 @@ using std::string;
 int   g_Debug = 0;
 int   ip_port = 8888;
 TCPSocketServer *sock_ptr = NULL;
-#define SURFACE_NUM 7
+#define SURFACE_MAX 16
+#define SLICE_DATA_SIZE 4177920 // 1080p size
 static  Display *win_display;
 static  VADisplay va_dpy;
 Window  win;
@@ -54,11 +58,38 @@ bool g_LiveView = true;
 int pwm;
 int phm;
 VAContextID context_id;
-VASurfaceID surface_id[SURFACE_NUM];
+VASurfaceID surface_id[SURFACE_MAX];
+int surface_num;
 int win_width = 0, win_height = 0;
 int surface_width = 0, surface_height = 0;
 static int time_to_quit = 0;
 
+/* frames received and not decoded yet */
+static JitterBuffer *jitter_buffer;
+static int jitter_depth = 8;
+/* surfaces decoded ahead of the display */
+static int decode_ahead = 4;
+static int max_latency_ms = 100;
+
+/*
+* Decoded surfaces waiting for display, in decoding order. A surface is
+* free for decoding once it is neither queued, displayed nor the reference.
+*/
+struct DisplayEntry {
+    int sid;
+    unsigned int frame_count;
+    unsigned int timestamp;
+    long long ready_us;     // decoded, CLOCK_MONOTONIC
+};
+static pthread_mutex_t surface_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t surface_cond = PTHREAD_COND_INITIALIZER;
+static int surface_refs[SURFACE_MAX];
+static DisplayEntry display_queue[SURFACE_MAX];
+static int display_head, display_count, display_peak;
+static bool decode_done;
+
+static unsigned int frames_decoded, frames_shown, frames_late, frames_skipped;
+
 static void SignalHandler(int a_Signal)
 {
     time_to_quit = 1;
@@ -386,6 +417,249 @@ void DumpVASliceParameterBufferH264(VASliceParameterBufferH264 *p)
 #endif
 
 
+static VABufferID pic_param_buf_id[SURFACE_MAX];
+static VABufferID mat_param_buf_id[SURFACE_MAX];
+static VABufferID sp_param_buf_id[SURFACE_MAX];
+static VABufferID d_param_buf_id[SURFACE_MAX];
+
+/* Wait for a surface nobody uses */
+static int get_free_surface()
+{
+    int sid;
+
+    pthread_mutex_lock(&surface_mutex);
+    for (;;) {
+        for (sid = 0; sid < surface_num; sid++) {
+            if (surface_refs[sid] == 0) {
+                break;
+            }
+        }
+        if (sid < surface_num) {
+            break;
+        }
+        pthread_cond_wait(&surface_cond, &surface_mutex);
+    }
+    pthread_mutex_unlock(&surface_mutex);
+    return sid;
+}
+
+/* Jitter buffer -> decode -> display queue */
+static void *decode_thread(void *arg)
+{
+    int t2first = 1;
+    int FieldOrderCnt = 0;
+    unsigned char frid = 0;
+    int sid;
+    int ref_sid = -1;
+    unsigned int slice_type, frame_count, timestamp, data_size;
+    char *dh264 = NULL;
+    VAStatus              va_status;
+    VAIQMatrixBufferH264     *mh264 = NULL;
+    VAPictureParameterBufferH264 *ph264 = NULL;
+    VASliceParameterBufferH264   *sh264 = NULL;
+    VABufferID            bufids[10];
+    VAPictureH264         my_VAPictureH264;
+    VAPictureH264         my_old_VAPictureH264;
+    JitterFrame           *frame;
+
+    while ((frame = jitter_buffer->pop()) != NULL) {
+    frame_count = frame->frameCount;
+    slice_type = frame->sliceType;
+    timestamp = frame->timestamp;
+    data_size = frame->size;
+    if (g_Debug) {
+      printf("T=%d S=%8d [%8d]\n", slice_type, data_size, frame_count);
+    }
+    sid = get_free_surface();
+    va_status = vaBeginPicture(va_dpy, context_id, surface_id[sid]);
+    CHECK_VASTATUS(va_status, "vaBeginPicture");
+    my_VAPictureH264.picture_id = surface_id[sid];
+    my_VAPictureH264.frame_idx = frid;
+    my_VAPictureH264.flags = 0;
+    my_VAPictureH264.BottomFieldOrderCnt = FieldOrderCnt;
+    my_VAPictureH264.TopFieldOrderCnt = FieldOrderCnt;
+    if (pic_param_buf_id[sid] == VA_INVALID_ID) {
+        va_status = vaCreateBuffer(va_dpy, context_id, VAPictureParameterBufferType, sizeof(VAPictureParameterBufferH264), 1, NULL, &pic_param_buf_id[sid]);
+    }
+    CHECK_VASTATUS(va_status, "vaCreateBuffer");
+    CHECK_SURF(surface_id[sid]);
+    va_status = vaMapBuffer(va_dpy,pic_param_buf_id[sid],(void **)&ph264);
+    CHECK_VASTATUS(va_status, "vaMapBuffer");
+    SetVAPictureParameterBufferH264(ph264);
+    memcpy(&ph264->CurrPic, &my_VAPictureH264, sizeof(VAPictureH264));
+    if (slice_type == 2) {
+    } else {
+        memcpy(&ph264->ReferenceFrames[0], &my_old_VAPictureH264, sizeof(VAPictureH264));
+        ph264->ReferenceFrames[0].flags = 0;
+    }
+    ph264->frame_num = frid;
+
+#ifdef XT_DEBUG
+    DumpVAPictureParameterBufferH264(ph264);
+#endif
+    va_status = vaUnmapBuffer(va_dpy,pic_param_buf_id[sid]);
+    CHECK_VASTATUS(va_status, "vaUnmapBuffer");
+
+    if (mat_param_buf_id[sid] == VA_INVALID_ID) {
+        va_status = vaCreateBuffer(va_dpy, context_id, VAIQMatrixBufferType, sizeof(VAIQMatrixBufferH264), 1, NULL, &mat_param_buf_id[sid]);
+        CHECK_VASTATUS(va_status, "vaCreateBuffer");
+    }
+    CHECK_SURF(surface_id[sid]);
+    va_status = vaMapBuffer(va_dpy, mat_param_buf_id[sid], (void **)&mh264);
+    CHECK_VASTATUS(va_status, "vaMapBuffer");
+    memcpy(mh264, m_MatrixBufferH264, 224);
+    va_status = vaUnmapBuffer(va_dpy, mat_param_buf_id[sid]);
+    CHECK_VASTATUS(va_status, "vaUnmapBuffer");
+    bufids[0] = pic_param_buf_id[sid];
+    bufids[1] = mat_param_buf_id[sid];
+    CHECK_SURF(surface_id[sid]);
+    va_status = vaRenderPicture(va_dpy, context_id, bufids, 2);
+    CHECK_VASTATUS(va_status, "vaRenderPicture");
+    if (sp_param_buf_id[sid] == VA_INVALID_ID) {
+        va_status = vaCreateBuffer(va_dpy, context_id, VASliceParameterBufferType, sizeof(VASliceParameterBufferH264), 1, NULL, &sp_param_buf_id[sid]);
+        CHECK_VASTATUS(va_status, "vaCreateBuffer");
+    }
+    CHECK_SURF(surface_id[sid]);
+    va_status = vaMapBuffer(va_dpy, sp_param_buf_id[sid], (void **)&sh264);
+    CHECK_VASTATUS(va_status, "vaMapBuffer");
+    if (slice_type == 2) {
+        SetVASliceParameterBufferH264_T2(sh264, t2first);
+        t2first = 0;
+    } else {
+        SetVASliceParameterBufferH264(sh264);
+        memcpy(&sh264->RefPicList0[0], &my_old_VAPictureH264, sizeof(VAPictureH264));
+        sh264->RefPicList0[0].flags = 0;
+    }
+    sh264->slice_data_bit_offset = 0;
+    sh264->slice_data_size = data_size;
+#ifdef XT_DEBUG
+    DumpVASliceParameterBufferH264(sh264);
+#endif
+    va_status = vaUnmapBuffer(va_dpy, sp_param_buf_id[sid]);
+    CHECK_VASTATUS(va_status, "vaUnmapBuffer");
+    CHECK_SURF(surface_id[sid]);
+    if (d_param_buf_id[sid] == VA_INVALID_ID) {
+        va_status = vaCreateBuffer(va_dpy, context_id, VASliceDataBufferType, SLICE_DATA_SIZE, 1, NULL, &d_param_buf_id[sid]);
+        CHECK_VASTATUS(va_status, "vaCreateBuffer");
+    }
+    va_status = vaMapBuffer(va_dpy, d_param_buf_id[sid], (void **)&dh264);
+    CHECK_VASTATUS(va_status, "vaMapBuffer");
+    /* the only copy of the slice, out of the receive ring */
+    memcpy(dh264, frame->data, data_size);
+    sock_ptr->release_frame(data_size);
+    jitter_buffer->release();
+    CHECK_SURF(surface_id[sid]);
+    va_status = vaUnmapBuffer(va_dpy, d_param_buf_id[sid]);
+    CHECK_VASTATUS(va_status, "vaUnmapBuffer");
+    bufids[0] = sp_param_buf_id[sid];
+    bufids[1] = d_param_buf_id[sid];
+    CHECK_SURF(surface_id[sid]);
+    va_status = vaRenderPicture(va_dpy, context_id, bufids, 2);
+    CHECK_VASTATUS(va_status, "vaRenderPicture");
+    va_status = vaEndPicture(va_dpy, context_id);
+    CHECK_VASTATUS(va_status, "vaEndPicture");
+    /* the ready time drives the playout clock, so wait for it here */
+    va_status = vaSyncSurface(va_dpy, surface_id[sid]);
+    CHECK_VASTATUS(va_status, "vaSyncSurface");
+
+    pthread_mutex_lock(&surface_mutex);
+    DisplayEntry *entry = &display_queue[(display_head + display_count) % SURFACE_MAX];
+    entry->sid = sid;
+    entry->frame_count = frame_count;
+    entry->timestamp = timestamp;
+    entry->ready_us = monotonic_us();
+    if (++display_count > display_peak) {
+        display_peak = display_count;
+    }
+    surface_refs[sid] += 2;     // queued, and the next reference
+    if (ref_sid >= 0) {
+        surface_refs[ref_sid]--;
+    }
+    pthread_cond_broadcast(&surface_cond);
+    pthread_mutex_unlock(&surface_mutex);
+    ref_sid = sid;
+
+    frid++;
+    if (frid>15) frid = 0;
+    FieldOrderCnt+=2;
+    memcpy(&my_old_VAPictureH264, &my_VAPictureH264, sizeof(VAPictureH264));
+    frames_decoded++;
+    }
+
+    pthread_mutex_lock(&surface_mutex);
+    if (ref_sid >= 0) {
+        surface_refs[ref_sid]--;
+    }
+    decode_done = true;
+    pthread_cond_broadcast(&surface_cond);
+    pthread_mutex_unlock(&surface_mutex);
+    return NULL;
+}
+
+/* Display queue -> window, paced by the playout clock */
+static void *display_thread(void *arg)
+{
+    PlayoutClock clock(max_latency_ms * 1000);
+    long long next_report = monotonic_us() + 1000000;
+    VAStatus va_status;
+
+    for (;;) {
+    DisplayEntry entry;
+    int waiting, peak;
+
+    pthread_mutex_lock(&surface_mutex);
+    while (display_count == 0 && !decode_done) {
+        pthread_cond_wait(&surface_cond, &surface_mutex);
+    }
+    if (display_count == 0) {
+        pthread_mutex_unlock(&surface_mutex);
+        break;
+    }
+    entry = display_queue[display_head];
+    display_head = (display_head + 1) % SURFACE_MAX;
+    waiting = --display_count;
+    peak = display_peak;
+    pthread_mutex_unlock(&surface_mutex);
+
+    long long due = clock.schedule(entry.timestamp, entry.ready_us);
+    long long late = monotonic_us() - due;
+    if (late > clock.framePeriodUs() / 2 && waiting) {
+        /* catch up: a newer frame is already decoded */
+        frames_skipped++;
+    } else {
+        if (late > clock.framePeriodUs() / 2) {
+            frames_late++;
+        } else if (late < 0) {
+            struct timespec ts;
+            ts.tv_sec = due / 1000000;
+            ts.tv_nsec = (due % 1000000) * 1000;
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+                ;
+        }
+        if (g_LiveView) {
+            va_status = vaPutSurface(va_dpy, surface_id[entry.sid], win, 0, 0, surface_width, surface_height, 0, 0, win_width, win_height, NULL, 0, VA_FRAME_PICTURE);
+            CHECK_VASTATUS(va_status, "vaPutSurface");
+        }
+        frames_shown++;
+    }
+
+    pthread_mutex_lock(&surface_mutex);
+    surface_refs[entry.sid]--;
+    pthread_cond_broadcast(&surface_cond);
+    pthread_mutex_unlock(&surface_mutex);
+
+    if (g_Debug && monotonic_us() >= next_report) {
+        printf("jitter buffer %u (max %u), display queue %d (max %d), jitter %u us, delay %u us, "
+               "%u late, %u skipped\n",
+               jitter_buffer->level(), jitter_buffer->maxLevel(), waiting, peak,
+               clock.jitterUs(), clock.delayUs(), frames_late, frames_skipped);
+        next_report += 1000000;
+    }
+    }
+    return NULL;
+}
+
+
 static void usage (FILE * fp, int argc, char ** argv)
 {
     fprintf (fp,
@@ -400,11 +674,14 @@ static void usage (FILE * fp, int argc, char ** argv)
         "-w, --width=WIDTH      Window width [same as Surface]\n"
         "-h, --height=HEIGHT    Window height [same as Surface]\n"
         "-d, --debug=LEVEL      Debug level [%d]\n"
+        "-j, --jitter=FRAMES    Frames buffered between receive and decode [%d]\n"
+        "-a, --ahead=FRAMES     Frames decoded ahead of the display (1-%d) [%d]\n"
+        "-L, --latency=MS       Bound on the delay added for network jitter [%d]\n"
         "\n",
-        argv[0], ip_port, g_Debug);
+        argv[0], ip_port, g_Debug, jitter_depth, SURFACE_MAX - 3, decode_ahead, max_latency_ms);
 }
 
-static const char short_options [] = "?p:lx:y:w:h:d:";
+static const char short_options [] = "?p:lx:y:w:h:d:j:a:L:";
 
 static const struct option
     long_options [] = {
@@ -416,42 +693,32 @@ static const struct option
         { "width",          required_argument,  NULL, 'w' },
         { "height",         required_argument,  NULL, 'h' },
         { "debug",          required_argument,  NULL, 'd' },
+        { "jitter",         required_argument,  NULL, 'j' },
+        { "ahead",          required_argument,  NULL, 'a' },
+        { "latency",        required_argument,  NULL, 'L' },
         { 0, 0, 0, 0 }
 };
 
 
 int main(int argc,char **argv)
 {
-    int t2first = 1;
-    int real_frame = 0;
-    int slice_type = 2;
-    int FieldOrderCnt = 0;
+    unsigned int slice_type = 2;
     int major_ver, minor_ver;
     int i;
-    unsigned char frid = 0;
-    int z;
-    int sid = 0;
-    int newsid = 0;
     unsigned int data_size = 0;
     unsigned int frame_count = 0;
+    unsigned int timestamp = 0;
+    const unsigned char *slice_data;
+    JitterFrame *frame;
+    pthread_t decode_tid, display_tid;
+    sigset_t sigint, oldmask;
     std::string remoteAddr;
     unsigned short remotePort;
-    char *dh264 = NULL;
     int num_entrypoints,vld_entrypoint;
     VAStatus              va_status;
-    VAIQMatrixBufferH264     *mh264 = NULL;
-    VAPictureParameterBufferH264 *ph264 = NULL;
-    VASliceParameterBufferH264   *sh264 = NULL;
-    VABufferID            bufids[10];
     VAEntrypoint          entrypoints[5];
     VAConfigAttrib        attrib;
     VAConfigID            config_id;
-    VABufferID            pic_param_buf_id[SURFACE_NUM];
-    VABufferID            mat_param_buf_id[SURFACE_NUM];
-    VABufferID            sp_param_buf_id[SURFACE_NUM];
-    VABufferID            d_param_buf_id[SURFACE_NUM];
-    VAPictureH264         my_VAPictureH264;
-    VAPictureH264         my_old_VAPictureH264;
 
 
     for (;;) {
@@ -493,6 +760,22 @@ int main(int argc,char **argv)
     case 'd':
         g_Debug = atoi(optarg);
         break;
+    case 'j':
+        jitter_depth = atoi(optarg);
+        if (jitter_depth < 1) {
+            jitter_depth = 1;
+        }
+        break;
+    case 'a':
+        decode_ahead = atoi(optarg);
+        if (decode_ahead < 1 || decode_ahead > SURFACE_MAX - 3) {
+            usage (stderr, argc, argv);
+            exit (EXIT_FAILURE);
+        }
+        break;
+    case 'L':
+        max_latency_ms = atoi(optarg);
+        break;
     default:
         usage (stderr, argc, argv);
         exit (EXIT_FAILURE);
@@ -516,6 +799,8 @@ int main(int argc,char **argv)
     pwm = sock_ptr->recv_uint32();
     phm = sock_ptr->recv_uint32();
 
+    /* decode and display run in their own threads */
+    XInitThreads();
     win_display = (Display *)XOpenDisplay(":0.0");
     if (win_display == NULL) {
     fprintf(stderr, "Can't open the connection of display!\n");
@@ -559,24 +844,40 @@ int main(int argc,char **argv)
     CHECK_VASTATUS(va_status, "vaGetConfigAttributes");
     va_status = vaCreateConfig(va_dpy, MYPROF, VAEntrypointVLD, &attrib, 1,&config_id);
     CHECK_VASTATUS(va_status, "vaCreateConfig");
-    va_status = vaCreateSurfaces(va_dpy,surface_width,surface_height,VA_RT_FORMAT_YUV420, SURFACE_NUM, &surface_id[0]);
+    surface_num = decode_ahead + 3; // + reference, decoding and displayed
+    va_status = vaCreateSurfaces(va_dpy,surface_width,surface_height,VA_RT_FORMAT_YUV420, surface_num, &surface_id[0]);
     CHECK_VASTATUS(va_status, "vaCreateSurfaces");
-    va_status = vaCreateContext(va_dpy, config_id, surface_width,surface_height, 0/*VA_PROGRESSIVE*/,  &surface_id[0], SURFACE_NUM, &context_id);
+    va_status = vaCreateContext(va_dpy, config_id, surface_width,surface_height, 0/*VA_PROGRESSIVE*/,  &surface_id[0], surface_num, &context_id);
     CHECK_VASTATUS(va_status, "vaCreateContext");
-    for(i=0; i<SURFACE_NUM; i++) {
+    for(i=0; i<surface_num; i++) {
     pic_param_buf_id[i] = VA_INVALID_ID;
     mat_param_buf_id[i] = VA_INVALID_ID;
     sp_param_buf_id[i] = VA_INVALID_ID;
     d_param_buf_id[i] = VA_INVALID_ID;
     }
-    va_status = vaBeginPicture(va_dpy, context_id, surface_id[sid]);
-    CHECK_VASTATUS(va_status, "vaBeginPicture");
+
+    /* only this thread takes SIGINT, it interrupts the receive wait */
+    jitter_buffer = new JitterBuffer(jitter_depth);
+    sigemptyset(&sigint);
+    sigaddset(&sigint, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &sigint, &oldmask);
+    pthread_create(&decode_tid, NULL, decode_thread, NULL);
+    pthread_create(&display_tid, NULL, display_thread, NULL);
+    pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
+
     if (g_Debug) {
       printf("--- Loop start here....\n");
     }
     while(!time_to_quit) {
-    frame_count = sock_ptr->recv_uint32();
-    slice_type = sock_ptr->recv_uint32();
+    slice_data = sock_ptr->recv_frame(frame_count, slice_type, timestamp, data_size);
+    if (slice_data == NULL) {
+        /* connection closed, or interrupted */
+        break;
+    }
+    if (data_size > SLICE_DATA_SIZE) {
+        printf("Slice too large: %d\n", data_size);
+        exit(-1);
+    }
     switch(slice_type) {
     case 0:
     case 2:
@@ -586,116 +887,29 @@ int main(int argc,char **argv)
         exit(-1);
         break;
     }
-    data_size = sock_ptr->recv_uint32();
-    if (g_Debug) {
-      printf("T=%d S=%8d [%8d]\n", slice_type, data_size, frame_count);
-    }
-    my_VAPictureH264.picture_id = surface_id[sid];
-    my_VAPictureH264.frame_idx = frid;
-    my_VAPictureH264.flags = 0;
-    my_VAPictureH264.BottomFieldOrderCnt = FieldOrderCnt;
-    my_VAPictureH264.TopFieldOrderCnt = FieldOrderCnt;
-    if (pic_param_buf_id[sid] == VA_INVALID_ID) {
-        va_status = vaCreateBuffer(va_dpy, context_id, VAPictureParameterBufferType, sizeof(VAPictureParameterBufferH264), 1, NULL, &pic_param_buf_id[sid]);
-    }
-    CHECK_VASTATUS(va_status, "vaCreateBuffer");
-    CHECK_SURF(surface_id[sid]);
-    va_status = vaMapBuffer(va_dpy,pic_param_buf_id[sid],(void **)&ph264);
-    CHECK_VASTATUS(va_status, "vaMapBuffer");
-    SetVAPictureParameterBufferH264(ph264);
-    memcpy(&ph264->CurrPic, &my_VAPictureH264, sizeof(VAPictureH264));
-    if (slice_type == 2) {
-    } else {
-        memcpy(&ph264->ReferenceFrames[0], &my_old_VAPictureH264, sizeof(VAPictureH264));
-        ph264->ReferenceFrames[0].flags = 0;
-    }
-    ph264->frame_num = frid;
-
-#ifdef XT_DEBUG
-    DumpVAPictureParameterBufferH264(ph264);
-#endif
-    va_status = vaUnmapBuffer(va_dpy,pic_param_buf_id[sid]);
-    CHECK_VASTATUS(va_status, "vaUnmapBuffer");
-
-    if (mat_param_buf_id[sid] == VA_INVALID_ID) {
-        va_status = vaCreateBuffer(va_dpy, context_id, VAIQMatrixBufferType, sizeof(VAIQMatrixBufferH264), 1, NULL, &mat_param_buf_id[sid]);
-        CHECK_VASTATUS(va_status, "vaCreateBuffer");
-    }
-    CHECK_SURF(surface_id[sid]);
-    va_status = vaMapBuffer(va_dpy, mat_param_buf_id[sid], (void **)&mh264);
-    CHECK_VASTATUS(va_status, "vaMapBuffer");
-    memcpy(mh264, m_MatrixBufferH264, 224);
-    va_status = vaUnmapBuffer(va_dpy, mat_param_buf_id[sid]);
-    CHECK_VASTATUS(va_status, "vaUnmapBuffer");
-    bufids[0] = pic_param_buf_id[sid];
-    bufids[1] = mat_param_buf_id[sid];
-    CHECK_SURF(surface_id[sid]);
-    va_status = vaRenderPicture(va_dpy, context_id, bufids, 2);
-    CHECK_VASTATUS(va_status, "vaRenderPicture");
-    if (sp_param_buf_id[sid] == VA_INVALID_ID) {
-        va_status = vaCreateBuffer(va_dpy, context_id, VASliceParameterBufferType, sizeof(VASliceParameterBufferH264), 1, NULL, &sp_param_buf_id[sid]);
-        CHECK_VASTATUS(va_status, "vaCreateBuffer");
-    }
-    CHECK_SURF(surface_id[sid]);
-    va_status = vaMapBuffer(va_dpy, sp_param_buf_id[sid], (void **)&sh264);
-    CHECK_VASTATUS(va_status, "vaMapBuffer");
-    if (slice_type == 2) {
-        SetVASliceParameterBufferH264_T2(sh264, t2first);
-        t2first = 0;
-    } else {
-        SetVASliceParameterBufferH264(sh264);
-        memcpy(&sh264->RefPicList0[0], &my_old_VAPictureH264, sizeof(VAPictureH264));
-        sh264->RefPicList0[0].flags = 0;
-    }
-    sh264->slice_data_bit_offset = 0;
-    sh264->slice_data_size = data_size;
-#ifdef XT_DEBUG
-    DumpVASliceParameterBufferH264(sh264);
-#endif
-    va_status = vaUnmapBuffer(va_dpy, sp_param_buf_id[sid]);
-    CHECK_VASTATUS(va_status, "vaUnmapBuffer");
-    CHECK_SURF(surface_id[sid]);
-    if (d_param_buf_id[sid] == VA_INVALID_ID) {
-        va_status = vaCreateBuffer(va_dpy, context_id, VASliceDataBufferType, 4177920, 1, NULL, &d_param_buf_id[sid]); // 1080p size
-        CHECK_VASTATUS(va_status, "vaCreateBuffer");
-    }
-    va_status = vaMapBuffer(va_dpy, d_param_buf_id[sid], (void **)&dh264);
-    CHECK_VASTATUS(va_status, "vaMapBuffer");
-    sock_ptr->recv_data((unsigned char*)dh264, data_size);
-    CHECK_SURF(surface_id[sid]);
-    va_status = vaUnmapBuffer(va_dpy, d_param_buf_id[sid]);
-    CHECK_VASTATUS(va_status, "vaUnmapBuffer");
-    bufids[0] = sp_param_buf_id[sid];
-    bufids[1] = d_param_buf_id[sid];
-    CHECK_SURF(surface_id[sid]);
-    va_status = vaRenderPicture(va_dpy, context_id, bufids, 2);
-    CHECK_VASTATUS(va_status, "vaRenderPicture");
-    va_status = vaEndPicture(va_dpy, context_id);
-    CHECK_VASTATUS(va_status, "vaEndPicture");
-    newsid = sid+1;
-    if (newsid==SURFACE_NUM) {
-        newsid = 0;
-    }
-    va_status = vaBeginPicture(va_dpy, context_id, surface_id[newsid]);
-    CHECK_VASTATUS(va_status, "vaBeginPicture");
-    va_status = vaSyncSurface(va_dpy, surface_id[sid]);
-    CHECK_VASTATUS(va_status, "vaSyncSurface");
-    CHECK_SURF(surface_id[sid]);
-    if (g_LiveView) {
-        va_status = vaPutSurface(va_dpy, surface_id[sid], win, 0, 0, surface_width, surface_height, 0, 0, win_width, win_height, NULL, 0, VA_FRAME_PICTURE);
-        CHECK_VASTATUS(va_status, "vaPutSurface");
+    frame = jitter_buffer->getFree();
+    if (frame == NULL) {
+        break;
     }
-    sid = newsid;
-    frid++;
-    if (frid>15) frid = 0;
-    FieldOrderCnt+=2;
-    memcpy(&my_old_VAPictureH264, &my_VAPictureH264, sizeof(VAPictureH264));
-    real_frame ++;
+    frame->frameCount = frame_count;
+    frame->sliceType = slice_type;
+    frame->timestamp = timestamp;
+    frame->size = data_size;
+    frame->data = slice_data;
+    jitter_buffer->push();
     }
+    jitter_buffer->close();
+    pthread_join(decode_tid, NULL);
+    pthread_join(display_tid, NULL);
     if (g_Debug) {
       printf("Final !\n");
     }
-    vaDestroySurfaces(va_dpy,&surface_id[0],SURFACE_NUM);
+    printf("%u frames decoded, %u shown (%u late), %u skipped; "
+           "jitter buffer max %u/%d (full %u times), display queue max %d\n",
+           frames_decoded, frames_shown, frames_late, frames_skipped,
+           jitter_buffer->maxLevel(), jitter_depth, jitter_buffer->fullWaits(), display_peak);
+    delete jitter_buffer;
+    vaDestroySurfaces(va_dpy,&surface_id[0],surface_num);
     vaTerminate(va_dpy);
     XCloseDisplay(win_display);
     delete sock_ptr;
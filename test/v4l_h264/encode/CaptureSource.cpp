@@ -0,0 +1,286 @@
+/*
+ * Copyright (c) 2012 Intel Corporation. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+* File and test pattern capture sources
+*/
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cassert>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <va/va.h>
+
+#include "CaptureSource.h"
+
+#define CHECK_VASTATUS(va_status,func)                  \
+    if (va_status != VA_STATUS_SUCCESS) {                   \
+    fprintf(stderr,"%s:%s (%d) failed,exit\n", __func__, func, __LINE__); \
+    exit(1);                                \
+    }
+
+#include "../../loadsurface.h"
+
+// the checkerboard moves this many pixels per frame, over two squares
+#define PATTERN_BOX_WIDTH   32
+#define PATTERN_STEP        4
+#define PATTERN_FRAMES      (2 * PATTERN_BOX_WIDTH / PATTERN_STEP)
+
+
+/* Frame pacing shared by the sources that have no clock of their own */
+class FramePacer
+{
+public:
+    FramePacer(unsigned int fpsNum, unsigned int fpsDen) :
+        periodNs(fpsNum ? 1000000000LL * (fpsDen ? fpsDen : 1) / fpsNum : 0),
+        nextNs(0)
+    {
+    }
+
+    /* Sleep until the next frame is due; returns false if interrupted */
+    bool wait()
+    {
+        struct timespec ts;
+
+        if (periodNs == 0) {
+            return true;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        long long nowNs = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+        if (nextNs == 0 || nowNs - nextNs > periodNs) {
+            // first frame, or too far behind to catch up
+            nextNs = nowNs;
+        }
+        ts.tv_sec = nextNs / 1000000000LL;
+        ts.tv_nsec = nextNs % 1000000000LL;
+        if (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0) {
+            return false;
+        }
+        nextNs += periodNs;
+        return true;
+    }
+
+    void settings(char *buf, size_t size, unsigned int width, unsigned int height,
+                  unsigned int fpsNum, unsigned int fpsDen, const char *what)
+    {
+        if (periodNs) {
+            snprintf(buf, size, "%ux%u@%u/%u %s", width, height, fpsDen ? fpsDen : 1, fpsNum, what);
+        } else {
+            snprintf(buf, size, "%ux%u %s", width, height, what);
+        }
+    }
+
+private:
+    long long periodNs;
+    long long nextNs;
+};
+
+
+class FileCapture : public CaptureSource
+{
+public:
+    FileCapture(const char *fileName, unsigned int width, unsigned int height,
+                unsigned int fpsNum, unsigned int fpsDen) :
+        fileName(fileName),
+        frameSize((size_t)width * height * 2),
+        map(NULL),
+        mapSize(0),
+        frames(0),
+        next(0),
+        pacer(fpsNum, fpsDen)
+    {
+        pacer.settings(settingsBuf, sizeof(settingsBuf), width, height, fpsNum, fpsDen, "file");
+    }
+
+    ~FileCapture()
+    {
+        stop();
+    }
+
+    bool start()
+    {
+        struct stat st;
+        int fd = open(fileName, O_RDONLY);
+
+        if (fd < 0 || fstat(fd, &st) < 0) {
+            fprintf(stderr, "Cannot open '%s': %d, %s\n", fileName, errno, strerror(errno));
+            if (fd >= 0) {
+                close(fd);
+            }
+            return false;
+        }
+        frames = st.st_size / frameSize;
+        if (frames == 0) {
+            fprintf(stderr, "'%s' is smaller than one %zu byte YUYV frame\n", fileName, frameSize);
+            close(fd);
+            return false;
+        }
+        mapSize = frames * frameSize;
+        map = (unsigned char *)mmap(NULL, mapSize, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED) {
+            fprintf(stderr, "Cannot map '%s': %d, %s\n", fileName, errno, strerror(errno));
+            map = NULL;
+            return false;
+        }
+        madvise(map, mapSize, MADV_SEQUENTIAL);
+        next = 0;
+        return true;
+    }
+
+    const unsigned char *nextFrame()
+    {
+        const unsigned char *frame;
+
+        if (!pacer.wait()) {
+            return NULL;
+        }
+        frame = map + next * frameSize;
+        if (++next == frames) {
+            next = 0;
+        }
+        return frame;
+    }
+
+    void stop()
+    {
+        if (map) {
+            munmap(map, mapSize);
+            map = NULL;
+        }
+    }
+
+    const char *settings()
+    {
+        return settingsBuf;
+    }
+
+private:
+    const char *fileName;
+    size_t frameSize;
+    unsigned char *map;
+    size_t mapSize;
+    size_t frames;
+    size_t next;
+    FramePacer pacer;
+    char settingsBuf[64];
+};
+
+
+class PatternCapture : public CaptureSource
+{
+public:
+    PatternCapture(unsigned int width, unsigned int height,
+                   unsigned int fpsNum, unsigned int fpsDen) :
+        width(width),
+        height(height),
+        frameSize((size_t)width * height * 2),
+        buffer(NULL),
+        next(0),
+        pacer(fpsNum, fpsDen)
+    {
+        pacer.settings(settingsBuf, sizeof(settingsBuf), width, height, fpsNum, fpsDen, "pattern");
+    }
+
+    ~PatternCapture()
+    {
+        stop();
+    }
+
+    /* The pattern repeats, so the whole cycle is drawn once here */
+    bool start()
+    {
+        buffer = (unsigned char *)malloc(frameSize * PATTERN_FRAMES);
+        if (buffer == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            return false;
+        }
+        for (int i = 0; i < PATTERN_FRAMES; i++) {
+            unsigned char *yuyv = buffer + i * frameSize;
+
+            // YUY2: U and V are every 4th byte, from offsets 1 and 3
+            yuvgen_planar(width, height,
+                          yuyv, width * 2,
+                          yuyv + 1, width * 2,
+                          yuyv + 3, width * 2,
+                          VA_FOURCC_YUY2, PATTERN_BOX_WIDTH, i * PATTERN_STEP,
+                          VA_FRAME_PICTURE);
+        }
+        next = 0;
+        return true;
+    }
+
+    const unsigned char *nextFrame()
+    {
+        const unsigned char *frame;
+
+        if (!pacer.wait()) {
+            return NULL;
+        }
+        frame = buffer + next * frameSize;
+        if (++next == PATTERN_FRAMES) {
+            next = 0;
+        }
+        return frame;
+    }
+
+    void stop()
+    {
+        free(buffer);
+        buffer = NULL;
+    }
+
+    const char *settings()
+    {
+        return settingsBuf;
+    }
+
+private:
+    unsigned int width;
+    unsigned int height;
+    size_t frameSize;
+    unsigned char *buffer;
+    int next;
+    FramePacer pacer;
+    char settingsBuf[64];
+};
+
+
+CaptureSource *create_file_capture(const char *fileName, unsigned int width, unsigned int height,
+                                   unsigned int fpsNum, unsigned int fpsDen)
+{
+    return new FileCapture(fileName, width, height, fpsNum, fpsDen);
+}
+
+CaptureSource *create_pattern_capture(unsigned int width, unsigned int height,
+                                      unsigned int fpsNum, unsigned int fpsDen)
+{
+    return new PatternCapture(width, height, fpsNum, fpsDen);
+}
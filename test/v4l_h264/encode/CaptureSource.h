@@ -0,0 +1,85 @@
+/*
+ * Copyright (c) 2012 Intel Corporation. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+* Frame sources for the encoder: a V4L2 device, a raw YUYV file or a
+* generated test pattern. Frames are YUYV, width * height * 2 bytes.
+*/
+
+#ifndef __CAPTURE_SOURCE_H__
+#define __CAPTURE_SOURCE_H__
+
+class CaptureSource
+{
+public:
+    virtual ~CaptureSource() {}
+
+    /**
+    * Open the source and start capturing.
+    * return value:
+    *   false on failure, the reason is printed
+    **/
+    virtual bool start() = 0;
+
+    /**
+    * Wait for the next frame.
+    * return value:
+    *   the frame, valid until the next call or stop(); NULL at the end of
+    *   the source or when a signal interrupted the wait
+    **/
+    virtual const unsigned char *nextFrame() = 0;
+
+    /**
+    * Stop capturing and release everything start() acquired
+    **/
+    virtual void stop() = 0;
+
+    /**
+    * Short description, such as "640x480@1/30", for the window title
+    **/
+    virtual const char *settings() = 0;
+};
+
+/**
+* Source reading a raw YUYV file through mmap(), from the start again at
+* its end.
+* parameters:
+* - fileName:   YUYV frames, back to back
+* - width, height: frame size
+* - fpsNum, fpsDen: frames per second, 0: as fast as possible
+**/
+CaptureSource *create_file_capture(const char *fileName, unsigned int width, unsigned int height,
+                                   unsigned int fpsNum, unsigned int fpsDen);
+
+/**
+* Source generating a checkerboard moving one step per frame, blended with
+* the test picture of loadsurface.h.
+* parameters:
+* - width, height: frame size
+* - fpsNum, fpsDen: frames per second, 0: as fast as possible
+**/
+CaptureSource *create_pattern_capture(unsigned int width, unsigned int height,
+                                      unsigned int fpsNum, unsigned int fpsDen);
+
+#endif // __CAPTURE_SOURCE_H__
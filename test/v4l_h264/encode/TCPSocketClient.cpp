@@ -36,11 +36,25 @@
 #include <netdb.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <poll.h>
+#include <linux/errqueue.h>
 #include <cstring>
 using std::string;
 
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY     60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY    0x4000000
+#endif
+
+// below this, pinning the pages costs more than copying them
+#define ZEROCOPY_MIN_SIZE   (64 * 1024)
+
 TCPSocketClient::TCPSocketClient(const std::string &remoteAddr, const unsigned short &remotePort) throw(std::runtime_error) :
-sockDesc(-1)
+sockDesc(-1),
+    zeroCopy(false),
+    zeroCopySends(0)
 {
     ::memset(&sockAddr, 0, sizeof(sockAddr));
     sockAddr.sin_family = AF_INET;
@@ -57,6 +71,9 @@ sockDesc(-1)
     if (connect(sockDesc, (struct sockaddr *) &sockAddr, sizeof(sockAddr)) < 0) {
         throw std::runtime_error("Error connecting to remote host (connect())");
     }
+
+    int one = 1;
+    zeroCopy = setsockopt(sockDesc, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0;
 }
 
 /* Destructor */
@@ -121,3 +138,130 @@ ssize_t TCPSocketClient::send(unsigned int val) throw (std::runtime_error)
     return send(&val, 4);
 }
 
+
+/*
+ * sendmsg() until everything is written, msg->msg_iov is updated. calls
+ * counts the successful sendmsg() calls. Returns the bytes written, less
+ * than size on error.
+ */
+ssize_t TCPSocketClient::sendAll(struct msghdr *msg, size_t size, int flags, unsigned int &calls)
+{
+    size_t total = 0;
+
+    while (total < size) {
+        ssize_t rval = ::sendmsg(sockDesc, msg, flags | MSG_NOSIGNAL);
+
+        if (rval < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        calls++;
+        total += rval;
+
+        // skip what was written
+        while (rval > 0 && msg->msg_iovlen) {
+            if ((size_t)rval < msg->msg_iov->iov_len) {
+                msg->msg_iov->iov_base = (char *)msg->msg_iov->iov_base + rval;
+                msg->msg_iov->iov_len -= rval;
+                break;
+            }
+            rval -= msg->msg_iov->iov_len;
+            msg->msg_iov++;
+            msg->msg_iovlen--;
+        }
+    }
+    return total;
+}
+
+
+/* Wait until the kernel has released the pages of MSG_ZEROCOPY send id */
+void TCPSocketClient::waitZeroCopy(unsigned int id) throw (std::runtime_error)
+{
+    for (;;) {
+        char control[128];
+        struct msghdr msg;
+        struct pollfd pfd;
+
+        ::memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (::recvmsg(sockDesc, &msg, MSG_ERRQUEUE) < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                throw std::runtime_error("Error reading the socket error queue (recvmsg())");
+            }
+            // completions are reported as POLLERR
+            pfd.fd = sockDesc;
+            pfd.events = 0;
+            ::poll(&pfd, 1, -1);
+            continue;
+        }
+
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            struct sock_extended_err *serr = (struct sock_extended_err *)CMSG_DATA(cm);
+
+            if (serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                continue;
+            }
+            // the kernel copied after all (loopback, no scatter-gather): stop pinning
+            if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                zeroCopy = false;
+            }
+            // [ee_info, ee_data] is the range of completed sends
+            if ((int)(id - serr->ee_data) <= 0) {
+                return;
+            }
+        }
+    }
+}
+
+
+ssize_t TCPSocketClient::send_frame(unsigned int frameCount, unsigned int sliceType, unsigned int timestamp,
+                                    const void *data, unsigned int size) throw (std::runtime_error)
+{
+    unsigned int header[4] = { frameCount, sliceType, size, timestamp };
+    struct iovec iov[2];
+    struct msghdr msg;
+    ssize_t rval;
+
+    if (sockDesc <= 0) {
+        throw std::runtime_error("socket is not connected (send_frame())");
+    }
+
+    iov[0].iov_base = header;
+    iov[0].iov_len = sizeof(header);
+    iov[1].iov_base = (void *)data;
+    iov[1].iov_len = size;
+    ::memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+
+    if (zeroCopy && size >= ZEROCOPY_MIN_SIZE) {
+        // every MSG_ZEROCOPY sendmsg() gets the next completion id, from 0
+        unsigned int calls = 0;
+
+        rval = sendAll(&msg, sizeof(header) + size, MSG_ZEROCOPY, calls);
+        zeroCopySends += calls;
+        if (calls) {
+            waitZeroCopy(zeroCopySends - 1);
+        }
+        if (rval == (ssize_t)(sizeof(header) + size)) {
+            return rval;
+        }
+        if (calls) {
+            throw std::runtime_error("Error writing to socket (sendmsg())");
+        }
+        // pages that cannot be pinned, or out of option memory: copy
+        zeroCopy = errno == ENOBUFS;
+    }
+
+    unsigned int calls = 0;
+    rval = sendAll(&msg, sizeof(header) + size, 0, calls);
+    if (rval < (ssize_t)(sizeof(header) + size)) {
+        sockDesc = -1;
+        ::memset(&sockAddr, 0, sizeof(sockAddr));
+        throw std::runtime_error("Error writing to socket (sendmsg())");
+    }
+    return rval;
+}
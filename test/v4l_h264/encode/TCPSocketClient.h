@@ -90,6 +90,23 @@ public:
 
     ssize_t send(unsigned int val) throw (std::runtime_error);
 
+    /**
+    * Send a frame: frame count, slice type, size and timestamp as 32 bit
+    * words, then the slice data, in one sendmsg(). Large slices are sent with
+    * MSG_ZEROCOPY when the kernel supports it; the call still returns only
+    * once the kernel is done with data, so the caller may reuse it.
+    * parameters:
+    * - frameCount: frame count
+    * - sliceType:  slice type
+    * - timestamp:  capture time, 90 kHz
+    * - data:       slice data
+    * - size:       size of the slice data
+    * return value:
+    *   number of bytes written, header included
+    **/
+    ssize_t send_frame(unsigned int frameCount, unsigned int sliceType, unsigned int timestamp,
+                       const void *data, unsigned int size) throw (std::runtime_error);
+
 private:
     // don't allow value semantics on this object
     TCPSocketClient(const TCPSocketClient &sock);
@@ -97,6 +114,12 @@ private:
 
     int sockDesc;       // socket descriptor
     sockaddr_in sockAddr; // structure keeping IP and port of peer
+
+    bool zeroCopy;          // SO_ZEROCOPY is set and the kernel does not copy anyway
+    unsigned int zeroCopySends; // MSG_ZEROCOPY sends so far, their completion ids
+
+    ssize_t sendAll(struct msghdr *msg, size_t size, int flags, unsigned int &calls);
+    void waitZeroCopy(unsigned int id) throw (std::runtime_error);
 };
 
 #endif // __TCP_SOCKET_H__
@@ -38,6 +38,8 @@
 
 #include <iostream>
 #include <cstdlib>
+#include <ctime>
+#include "startcode.h"
 
 #include "TCPSocketClient.h"
 
@@ -223,12 +225,7 @@ static void release_encode_resource()
 
 static int get_coded_bitsteam_length(unsigned char *buffer, int buffer_length)
 {
-    int i;
-    for (i = buffer_length - 1; i >= 0; i--) {
-        if (buffer[i])
-            break;
-    }
-    return i + 1;
+    return startcode_trim_zeros(buffer, buffer_length);
 }
 
 
@@ -256,10 +253,11 @@ int encoder_init(int width, int height)
     codedbuf_size = picture_width * picture_height * 1.5;
     create_encode_pipe();
     alloc_encode_resource();
-    sock_ptr->send(picture_width);
-    sock_ptr->send(picture_height);
-    sock_ptr->send(picture_width_in_mbs-1);
-    sock_ptr->send(picture_height_in_mbs-1);
+    unsigned int stream_header[4] = {
+        (unsigned int)picture_width, (unsigned int)picture_height,
+        (unsigned int)picture_width_in_mbs - 1, (unsigned int)picture_height_in_mbs - 1
+    };
+    sock_ptr->send(stream_header, sizeof(stream_header));
     if (g_LiveView) {
         win2 = XCreateSimpleWindow(x11_display, RootWindow(x11_display, 0), 0, 0, win2_width, win2_height, 0, 0, WhitePixel(x11_display, 0));
         XMapWindow(x11_display, win2);
@@ -449,7 +447,15 @@ static void prepare_input(unsigned char *buffer, int intra_slice, unsigned int f
     surface_ids[SID_REFERENCE_PICTURE] = tempID;
 }
 
-static void send_slice_data(unsigned int frcount, int slice_type)
+/* CLOCK_MONOTONIC at 90 kHz, wrapping at 32 bits */
+static unsigned int capture_timestamp()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned int)(ts.tv_sec * 90000ULL + ts.tv_nsec / (1000000000 / 90000));
+}
+
+static void send_slice_data(unsigned int frcount, int slice_type, unsigned int timestamp)
 {
     VACodedBufferSegment *coded_buffer_segment;
     unsigned char *coded_mem;
@@ -466,20 +472,23 @@ static void send_slice_data(unsigned int frcount, int slice_type)
     va_status = vaMapBuffer(va_dpy, coded_buf, (void **)(&coded_buffer_segment));
     CHECK_VASTATUS(va_status,"vaMapBuffer");
     coded_mem = (unsigned char*)coded_buffer_segment->buf;
-    sock_ptr->send(frcount);
-    sock_ptr->send(slice_type);
 
     if (is_cabac) {
         if (!coded_buffer_segment->next) {
-            slice_data_length = get_coded_bitsteam_length(coded_mem, codedbuf_size);
+            /* the driver reports the size, only trust it within the buffer */
+            slice_data_length = coded_buffer_segment->size;
+            if (slice_data_length > codedbuf_size)
+                slice_data_length = codedbuf_size;
+            slice_data_length = get_coded_bitsteam_length(coded_mem, slice_data_length);
         } else {
             /* Fixme me - to do: loop to each block and calculate the real data_lenght */
             assert(0);
         }
         if (g_Debug) {
             printf("T=%d BS=%8d SZ=%8d C=%d\n", slice_type, codedbuf_size, slice_data_length, frcount);
-        }sock_ptr->send(slice_data_length);
-        sock_ptr->send((unsigned char*)coded_mem,  slice_data_length);
+        }
+        /* returns once the socket is done with coded_mem */
+        sock_ptr->send_frame(frcount, slice_type, timestamp, coded_mem, slice_data_length);
     } else {
         /* FIXME */
         assert(0);
@@ -491,6 +500,7 @@ static void send_slice_data(unsigned int frcount, int slice_type)
 int encode_frame(unsigned char *inbuf)
 {
     static unsigned int framecount = 0;
+    unsigned int timestamp = capture_timestamp();
     int is_intra = (framecount % 30 == 0);
     if (g_Force_P_Only) {
         is_intra = 1;
@@ -501,7 +511,7 @@ int encode_frame(unsigned char *inbuf)
     prepare_input(inbuf, is_intra, framecount);
     va_status = vaEndPicture(va_dpy,context_id);
     CHECK_VASTATUS(va_status,"vaRenderPicture");
-    send_slice_data(framecount, is_intra ? SLICE_TYPE_I : SLICE_TYPE_P);
+    send_slice_data(framecount, is_intra ? SLICE_TYPE_I : SLICE_TYPE_P, timestamp);
     framecount++;
     return 1;
 }
@@ -49,6 +49,7 @@
 using std::string;
 
 #include "TCPSocketClient.h"
+#include "CaptureSource.h"
 
 
 extern bool g_Force_P_Only;
@@ -119,19 +120,33 @@ static int xioctl (int fd, int request, void * arg)
 }
 
 
+/* The buffer handed out by read_frame(), given back to the driver on the next call */
+static struct v4l2_buffer held_buf;
+static bool buf_held = false;
+
 static void
-    process_image (const void * p, ssize_t size)
+    requeue_frame (void)
+{
+    if (!buf_held)
+        return;
+    if (-1 == xioctl (fd, VIDIOC_QBUF, &held_buf))
+        errno_exit ("VIDIOC_QBUF");
+    buf_held = false;
+}
+
+static bool
+    check_image (ssize_t size)
 {
     const size_t src_frame_size = (width*height) + height*(width >> 1) + height*(width >> 1);
     if (size != src_frame_size){
         std::cerr << "wrong buffer size: " << size << "; expect: " << src_frame_size << '\n';
-        return;
+        return false;
     }
-    if (!encode_frame((unsigned char *)p))
-        time_to_quit = 1;
+    return true;
 }
 
-static int
+/* Returns the frame, or NULL to wait for another one */
+static const unsigned char *
     read_frame (void)
 {
     struct v4l2_buffer buf;
@@ -141,7 +156,7 @@ static int
         if (-1 == read (fd, buffers[0].start, buffers[0].length)) {
             switch (errno) {
             case EAGAIN:
-                return 0;
+                return NULL;
             case EIO:
                 /* Could ignore EIO, see spec. */
                 /* fall through */
@@ -149,8 +164,9 @@ static int
                 errno_exit ("read");
             }
         }
-        process_image (buffers[0].start, buffers[0].length);
-        break;
+        if (!check_image (buffers[0].length))
+            return NULL;
+        return (const unsigned char *) buffers[0].start;
 
     case IO_METHOD_MMAP:
         CLEAR (buf);
@@ -161,7 +177,7 @@ static int
         if (-1 == xioctl (fd, VIDIOC_DQBUF, &buf)) {
             switch (errno) {
             case EAGAIN:
-                return 0;
+                return NULL;
 
             case EIO:
                 /* Could ignore EIO, see spec. */
@@ -173,12 +189,13 @@ static int
 
         assert (buf.index < n_buffers);
 
-        process_image (buffers[buf.index].start, buf.length);
-
-        if (-1 == xioctl (fd, VIDIOC_QBUF, &buf))
-            errno_exit ("VIDIOC_QBUF");
-
-        break;
+        held_buf = buf;
+        buf_held = true;
+        if (!check_image (buf.length)) {
+            requeue_frame ();
+            return NULL;
+        }
+        return (const unsigned char *) buffers[buf.index].start;
 
     case IO_METHOD_USERPTR:
         CLEAR (buf);
@@ -189,7 +206,7 @@ static int
         if (-1 == xioctl (fd, VIDIOC_DQBUF, &buf)) {
             switch (errno) {
             case EAGAIN:
-                return 0;
+                return NULL;
 
             case EIO:
                 /* Could ignore EIO, see spec. */
@@ -204,52 +221,58 @@ static int
                 break;
 
         assert (i < n_buffers);
-        process_image ((void *) buf.m.userptr, buf.length);
-        if (-1 == xioctl (fd, VIDIOC_QBUF, &buf))
-            errno_exit ("VIDIOC_QBUF");
-
-        break;
+        held_buf = buf;
+        buf_held = true;
+        if (!check_image (buf.length)) {
+            requeue_frame ();
+            return NULL;
+        }
+        return (const unsigned char *) buf.m.userptr;
     }
 
-    return 1;
+    return NULL;
 }
 
-static void
-    mainloop (void)
+/* Returns the next frame, or NULL once SIGINT was caught */
+static const unsigned char *
+    wait_frame (void)
 {
+    const unsigned char *frame;
+
+    requeue_frame ();
     while (!time_to_quit) {
-        for (;;) {
-            fd_set fds;
-            struct timeval tv;
-            int r;
+        fd_set fds;
+        struct timeval tv;
+        int r;
 
-            FD_ZERO (&fds);
-            FD_SET (fd, &fds);
+        FD_ZERO (&fds);
+        FD_SET (fd, &fds);
 
-            /* Timeout. */
-            tv.tv_sec = 5;
-            tv.tv_usec = 0;
+        /* Timeout. */
+        tv.tv_sec = 5;
+        tv.tv_usec = 0;
 
-            r = select (fd + 1, &fds, NULL, NULL, &tv);
+        r = select (fd + 1, &fds, NULL, NULL, &tv);
 
-            if (-1 == r) {
-                if (EINTR == errno)
-                    continue;
+        if (-1 == r) {
+            if (EINTR == errno)
+                continue;
 
-                errno_exit ("select");
-            }
+            errno_exit ("select");
+        }
 
-            if (0 == r) {
-                std::cerr << "select timeout\n";
-                exit (EXIT_FAILURE);
-            }
+        if (0 == r) {
+            std::cerr << "select timeout\n";
+            exit (EXIT_FAILURE);
+        }
 
-            if (read_frame ())
-                break;
+        frame = read_frame ();
+        if (frame)
+            return frame;
 
-            /* EAGAIN - continue select loop. */
-        }
+        /* EAGAIN - continue select loop. */
     }
+    return NULL;
 }
 
 static void
@@ -269,6 +292,8 @@ static void
         if (-1 == xioctl (fd, VIDIOC_STREAMOFF, &type))
             errno_exit ("VIDIOC_STREAMOFF");
 
+        /* STREAMOFF dequeues every buffer */
+        buf_held = false;
         break;
     }
 }
@@ -669,6 +694,37 @@ static void open_device (void)
     }
 }
 
+/* The device, behind the interface of the other sources */
+class V4L2Capture : public CaptureSource
+{
+public:
+    bool start()
+    {
+        open_device ();
+        pixelformat = V4L2_PIX_FMT_YUYV;
+        init_device ();
+        start_capturing ();
+        return true;
+    }
+
+    const unsigned char *nextFrame()
+    {
+        return wait_frame ();
+    }
+
+    void stop()
+    {
+        stop_capturing ();
+        uninit_device ();
+        close_device ();
+    }
+
+    const char *settings()
+    {
+        return device_settings;
+    }
+};
+
 static void usage (std::ostream &o, int argc, char ** argv)
 {
     o << "Usage: " << argv[0] << " [options]\n"
@@ -676,6 +732,8 @@ static void usage (std::ostream &o, int argc, char ** argv)
         "Options:\n"
         "-?, --help             Print this message\n"
         "-d, --device=NAME      Video device name ["<< dev_name<< "]\n"
+        "-s, --source=SOURCE    v4l2, pattern or a YUYV file name [v4l2]\n"
+        "-c, --count=FRAMES     Stop after FRAMES frames [no limit]\n"
         "-i, --ip=IP            Target ip [localhost]\n"
         "-p, --port=PORT        Target port [" << ip_port << "]\n"
         "-m, --mmap             Use memory mapped buffers\n"
@@ -710,11 +768,13 @@ void InitSock()
 }
 
 
-static const char short_options [] = "d:i:p:?mruNPlf:w:h:x:y:n:W:H:D:";
+static const char short_options [] = "d:s:c:i:p:?mruNPlf:w:h:x:y:n:W:H:D:";
 
 static const struct option
     long_options [] = {
         { "device",        required_argument, NULL, 'd' },
+        { "source",        required_argument, NULL, 's' },
+        { "count",         required_argument, NULL, 'c' },
         { "ip",            required_argument, NULL, 'i' },
         { "port",          required_argument, NULL, 'p' },
         { "help",          no_argument,       NULL, '?' },
@@ -739,6 +799,12 @@ static const struct option
 int
     main (int argc, char ** argv)
 {
+    const char *source_name = "v4l2";
+    int frame_count = 0;
+    CaptureSource *source;
+    const unsigned char *frame;
+    int frames = 0;
+
     width = 640;
     height = 480;
     dev_name = (char*)"/dev/video0";
@@ -761,6 +827,12 @@ int
         case 'd':
             dev_name = optarg;
             break;
+        case 's':
+            source_name = optarg;
+            break;
+        case 'c':
+            frame_count = atoi(optarg);
+            break;
         case 'i':
             ip_name = optarg;
             break;
@@ -830,22 +902,36 @@ int
         printf("signal() failed\n");
         time_to_quit = 1;
     }
+    /* Synthetic sources are paced with -f/-n themselves, the device by its driver */
+    if (!strcmp(source_name, "v4l2"))
+        source = new V4L2Capture();
+    else if (!strcmp(source_name, "pattern"))
+        source = create_pattern_capture(width, height, g_FrameRate, g_Numerator);
+    else
+        source = create_file_capture(source_name, width, height, g_FrameRate, g_Numerator);
+
     InitSock();
-    open_device();
-    pixelformat = V4L2_PIX_FMT_YUYV;
-    init_device ();
+    if (!source->start()) {
+        delete source;
+        delete sock_ptr;
+        return 1;
+    }
+    device_settings = (char*)source->settings();
     printf("negotiated frame resolution: %dx%d\n", width, height);
 
     if (!encoder_init(width, height)) {
-        start_capturing ();
-        mainloop ();
-        stop_capturing ();
+        while (!time_to_quit && (frame = source->nextFrame())) {
+            if (!encode_frame((unsigned char *)frame))
+                break;
+            if (++frames == frame_count)
+                break;
+        }
         encoder_close();
     } else {
         printf("Error: encoder init !\n");
     }
-    uninit_device ();
-    close_device ();
+    source->stop();
+    delete source;
     delete sock_ptr;
     return 0;
 }
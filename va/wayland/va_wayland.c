@@ -26,6 +26,7 @@
 
 #include "sysdeps.h"
 #include <stdarg.h>
+#include <pthread.h>
 #include "va_wayland.h"
 #include "va_wayland_drm.h"
 #include "va_wayland_emgd.h"
@@ -33,6 +34,28 @@
 #include "va_backend.h"
 #include "va_backend_wayland.h"
 
+/* Cached wl_buffer wrapping a VA surface */
+typedef struct va_wayland_buffer {
+    struct va_wayland_buffer   *next;
+    struct va_wayland_vtable   *vtable;
+    struct wl_buffer           *buffer;
+    VASurfaceID                 surface;
+    unsigned int                flags;
+    unsigned int                is_busy         : 1;
+} VAWaylandBuffer;
+
+/* VA/Wayland implementation hooks, as allocated by libVA */
+typedef struct va_wayland_vtable {
+    struct VADriverVTableWayland base;      /* must be first */
+    pthread_mutex_t             buffers_lock;
+    VAWaylandBuffer            *buffers;
+    VAStatus                  (*vaDestroySurfaces)(
+        VADriverContextP        ctx,
+        VASurfaceID            *surface_list,
+        int                     num_surfaces
+    );
+} VADriverVTableWaylandPriv, *VADriverVTableWaylandPrivP;
+
 static inline VADriverContextP
 get_driver_context(VADisplay dpy)
 {
@@ -41,6 +64,12 @@ get_driver_context(VADisplay dpy)
     return ((VADisplayContextP)dpy)->pDriverContext;
 }
 
+static inline VADriverVTableWaylandPrivP
+get_vtable_priv(VADriverContextP ctx)
+{
+    return (VADriverVTableWaylandPrivP)ctx->vtable_wayland;
+}
+
 void
 va_wayland_error(const char *format, ...)
 {
@@ -53,6 +82,143 @@ va_wayland_error(const char *format, ...)
     va_end(args);
 }
 
+/* -------------------------------------------------------------------------- */
+/* --- Buffer cache                                                       --- */
+/* -------------------------------------------------------------------------- */
+
+static void
+buffer_handle_release(void *data, struct wl_buffer *wl_buffer)
+{
+    VAWaylandBuffer * const buffer = data;
+    VADriverVTableWaylandPrivP const vtable = buffer->vtable;
+
+    pthread_mutex_lock(&vtable->buffers_lock);
+    buffer->is_busy = 0;
+    pthread_mutex_unlock(&vtable->buffers_lock);
+}
+
+static const struct wl_buffer_listener buffer_listener = {
+    buffer_handle_release
+};
+
+/* Destroys all cached wl_buffers wrapping the supplied VA surface */
+static void
+va_wayland_buffer_cache_invalidate(
+    VADriverVTableWaylandPrivP  vtable,
+    VASurfaceID                 surface
+)
+{
+    VAWaylandBuffer **buffer_ptr, *buffer;
+
+    buffer_ptr = &vtable->buffers;
+    while ((buffer = *buffer_ptr) != NULL) {
+        if (buffer->surface != surface) {
+            buffer_ptr = &buffer->next;
+            continue;
+        }
+        *buffer_ptr = buffer->next;
+        wl_buffer_destroy(buffer->buffer);
+        free(buffer);
+    }
+}
+
+static void
+va_wayland_buffer_cache_destroy(VADriverVTableWaylandPrivP vtable)
+{
+    VAWaylandBuffer *buffer;
+
+    while ((buffer = vtable->buffers) != NULL) {
+        vtable->buffers = buffer->next;
+        wl_buffer_destroy(buffer->buffer);
+        free(buffer);
+    }
+    pthread_mutex_destroy(&vtable->buffers_lock);
+}
+
+/* Hook into vaDestroySurfaces() so that stale wl_buffers are dropped */
+static VAStatus
+va_wayland_DestroySurfaces(
+    VADriverContextP    ctx,
+    VASurfaceID        *surface_list,
+    int                 num_surfaces
+)
+{
+    VADriverVTableWaylandPrivP const vtable = get_vtable_priv(ctx);
+    int i;
+
+    pthread_mutex_lock(&vtable->buffers_lock);
+    for (i = 0; i < num_surfaces; i++)
+        va_wayland_buffer_cache_invalidate(vtable, surface_list[i]);
+    pthread_mutex_unlock(&vtable->buffers_lock);
+
+    return vtable->vaDestroySurfaces(ctx, surface_list, num_surfaces);
+}
+
+static VAStatus
+va_wayland_buffer_cache_lookup(
+    VADriverContextP    ctx,
+    VASurfaceID         surface,
+    unsigned int        flags,
+    struct wl_buffer  **out_buffer
+)
+{
+    VADriverVTableWaylandPrivP const vtable = get_vtable_priv(ctx);
+    VAWaylandBuffer *buffer;
+    struct wl_buffer *wl_buffer;
+    VAStatus va_status = VA_STATUS_SUCCESS;
+
+    pthread_mutex_lock(&vtable->buffers_lock);
+    if (ctx->vtable->vaDestroySurfaces != va_wayland_DestroySurfaces) {
+        vtable->vaDestroySurfaces = ctx->vtable->vaDestroySurfaces;
+        ctx->vtable->vaDestroySurfaces = va_wayland_DestroySurfaces;
+    }
+
+    /* Reuse a wl_buffer that the compositor has released already */
+    for (buffer = vtable->buffers; buffer != NULL; buffer = buffer->next) {
+        if (buffer->surface == surface && buffer->flags == flags &&
+            !buffer->is_busy)
+            break;
+    }
+
+    if (!buffer) {
+        va_status = vtable->base.vaGetSurfaceBufferWl(ctx, surface, flags,
+                                                      &wl_buffer);
+        if (va_status != VA_STATUS_SUCCESS)
+            goto end;
+
+        buffer = calloc(1, sizeof(*buffer));
+        if (!buffer) {
+            wl_buffer_destroy(wl_buffer);
+            va_status = VA_STATUS_ERROR_ALLOCATION_FAILED;
+            goto end;
+        }
+        buffer->vtable  = vtable;
+        buffer->buffer  = wl_buffer;
+        buffer->surface = surface;
+        buffer->flags   = flags;
+
+        /*
+         * Without the release event the entry would stay busy forever:
+         * if the driver has a listener on the wl_buffer already, hand it
+         * out uncached, as without VA_WAYLAND_BUFFER_CACHED.
+         */
+        if (wl_buffer_add_listener(wl_buffer, &buffer_listener, buffer) != 0) {
+            free(buffer);
+            *out_buffer = wl_buffer;
+            goto end;
+        }
+
+        buffer->next    = vtable->buffers;
+        vtable->buffers = buffer;
+    }
+    buffer->is_busy = 1;
+    *out_buffer = buffer->buffer;
+
+end:
+    pthread_mutex_unlock(&vtable->buffers_lock);
+    return va_status;
+}
+
 static int
 va_DisplayContextIsValid(VADisplayContextP pDisplayContext)
 {
@@ -77,6 +243,8 @@ va_DisplayContextDestroy(VADisplayContextP pDisplayContext)
 
     pDriverContext = pDisplayContext->pDriverContext;
     if (pDriverContext) {
+        if (pDriverContext->vtable_wayland)
+            va_wayland_buffer_cache_destroy(get_vtable_priv(pDriverContext));
         free(pDriverContext->vtable_wayland);
         pDriverContext->vtable_wayland = NULL;
         free(pDriverContext);
@@ -117,7 +285,7 @@ vaGetDisplayWl(struct wl_display *display)
 {
     VADisplayContextP pDisplayContext = NULL;
     VADriverContextP pDriverContext;
-    struct VADriverVTableWayland *vtable;
+    VADriverVTableWaylandPrivP vtable;
     unsigned int i;
 
     pDisplayContext = calloc(1, sizeof(*pDisplayContext));
@@ -140,9 +308,10 @@ vaGetDisplayWl(struct wl_display *display)
     vtable = calloc(1, sizeof(*vtable));
     if (!vtable)
         goto error;
-    pDriverContext->vtable_wayland      = vtable;
+    pthread_mutex_init(&vtable->buffers_lock, NULL);
+    pDriverContext->vtable_wayland      = &vtable->base;
 
-    vtable->version                     = VA_WAYLAND_API_VERSION;
+    vtable->base.version                = VA_WAYLAND_API_VERSION;
 
     for (i = 0; g_backends[i].create != NULL; i++) {
         if (g_backends[i].create(pDisplayContext))
@@ -171,6 +340,9 @@ vaGetSurfaceBufferWl(
         return VA_STATUS_ERROR_INVALID_DISPLAY;
     if (!ctx->vtable_wayland || !ctx->vtable_wayland->vaGetSurfaceBufferWl)
         return VA_STATUS_ERROR_UNIMPLEMENTED;
+    if (flags & VA_WAYLAND_BUFFER_CACHED)
+        return va_wayland_buffer_cache_lookup(ctx, surface,
+            flags & ~VA_WAYLAND_BUFFER_CACHED, out_buffer);
     return ctx->vtable_wayland->vaGetSurfaceBufferWl(ctx, surface, flags,
                                                      out_buffer);
 }
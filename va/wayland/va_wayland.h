@@ -53,6 +53,25 @@ extern "C" {
  * - Attach wl_buffer to wl_surface ;
  */
 
+/**
+ * \brief Requests a wl_buffer from the VA display buffer cache.
+ *
+ * When this flag is passed to vaGetSurfaceBufferWl(), libVA keeps
+ * the resulting wl_buffer around and returns it again on subsequent
+ * calls with the same VA surface and flags, as soon as the compositor
+ * released it. A new wl_buffer is only created if all the cached ones
+ * are still in use by the compositor.
+ *
+ * The returned wl_buffer is owned by the VA display. The caller must
+ * neither destroy it, nor install a wl_buffer listener on it. It is
+ * destroyed when the VA surface is destroyed, or on vaTerminate().
+ *
+ * If the driver listens to its wl_buffers itself, their release cannot
+ * be tracked and the flag has no effect: a new, uncached wl_buffer is
+ * returned on every call, as without it.
+ */
+#define VA_WAYLAND_BUFFER_CACHED        0x00010000
+
 /**
  * \brief Returns a VA display wrapping the specified Wayland display.
  *
@@ -79,7 +98,9 @@ vaGetDisplayWl(struct wl_display *display);
  * to expose a de-interlaced buffer. If the VA driver does not support
  * any of the supplied flags, then #VA_STATUS_ERROR_FLAG_NOT_SUPPORTED
  * is returned. The following flags are allowed: \c VA_FRAME_PICTURE,
- * \c VA_TOP_FIELD, \c VA_BOTTOM_FIELD.
+ * \c VA_TOP_FIELD, \c VA_BOTTOM_FIELD. Additionally, the
+ * \ref VA_WAYLAND_BUFFER_CACHED flag can be combined with them so that
+ * wl_buffers are reused from one frame to another.
  *
  * @param[in]   dpy         the VA display
  * @param[in]   surface     the VA surface
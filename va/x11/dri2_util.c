@@ -56,9 +56,32 @@ struct dri2_drawable
     int has_backbuffer;
     int back_index;
     int front_index;
+    int has_buffers;
+    unsigned int invalidate_stamp;
 };
 
 static int gsDRI2SwapAvailable;
+static int gsDRI2InvalidateAvailable;
+
+/*
+ * InvalidateBuffers event counters, indexed by drawable hash. The X
+ * server sends this event when the buffers of a drawable changed, i.e.
+ * on resize or after a swap, so that DRI2GetBuffers is only needed then.
+ */
+static volatile unsigned int gsDRI2InvalidateStamps[DRAWABLE_HASH_SZ];
+
+static void
+dri2InvalidateBuffers(Display *dpy, XID drawable)
+{
+    int i;
+
+    if (drawable == None) {
+        for (i = 0; i < DRAWABLE_HASH_SZ; i++)
+            gsDRI2InvalidateStamps[i]++;
+        return;
+    }
+    gsDRI2InvalidateStamps[drawable % DRAWABLE_HASH_SZ]++;
+}
 
 static struct dri_drawable * 
 dri2CreateDrawable(VADriverContextP ctx, XID x_drawable)
@@ -119,6 +142,17 @@ dri2GetRenderingBuffer(VADriverContextP ctx, struct dri_drawable *dri_drawable)
     int count;
     unsigned int attachments[5];
     VA_DRI2Buffer *buffers;
+    int index = dri_drawable->x_drawable % DRAWABLE_HASH_SZ;
+
+    /* Reuse the buffers until the X server invalidates them */
+    if (gsDRI2InvalidateAvailable &&
+        VA_DRI2SetInvalidateBuffersProc(ctx->native_dpy, dri2InvalidateBuffers) &&
+        dri2_drawable->has_buffers &&
+        dri2_drawable->invalidate_stamp == gsDRI2InvalidateStamps[index])
+        goto end;
+
+    dri2_drawable->has_buffers = 0;
+    dri2_drawable->invalidate_stamp = gsDRI2InvalidateStamps[index];
     
     i = 0;
     if (dri_drawable->is_window)
@@ -153,8 +187,10 @@ dri2GetRenderingBuffer(VADriverContextP ctx, struct dri_drawable *dri_drawable)
     
     dri_drawable->width = dri2_drawable->width;
     dri_drawable->height = dri2_drawable->height;
+    dri2_drawable->has_buffers = 1;
     Xfree(buffers);
 
+end:
     if (dri2_drawable->has_backbuffer)
         return &dri2_drawable->buffers[dri2_drawable->back_index];
 
@@ -172,28 +208,27 @@ dri2Close(VADriverContextP ctx)
 	close(dri_state->base.fd);
 }
 
-Bool 
-isDRI2Connected(VADriverContextP ctx, char **driver_name)
+static Bool
+dri2QueryVersion(VADriverContextP ctx, int *minor)
 {
-    struct dri_state *dri_state = (struct dri_state *)ctx->drm_state;
-    int major, minor;
+    int major;
     int error_base;
     int event_base;
-    char *device_name = NULL;
-    drm_magic_t magic;        
-    *driver_name = NULL;
-    dri_state->base.fd = -1;
-    dri_state->base.auth_type = VA_NONE;
+
     if (!VA_DRI2QueryExtension(ctx->native_dpy, &event_base, &error_base))
-        goto err_out;
+        return False;
 
-    if (!VA_DRI2QueryVersion(ctx->native_dpy, &major, &minor))
-        goto err_out;
+    if (!VA_DRI2QueryVersion(ctx->native_dpy, &major, minor))
+        return False;
 
+    return True;
+}
 
-    if (!VA_DRI2Connect(ctx->native_dpy, RootWindow(ctx->native_dpy, ctx->x11_screen),
-                     driver_name, &device_name))
-        goto err_out;
+static Bool
+dri2OpenDevice(VADriverContextP ctx, const char *device_name, int minor)
+{
+    struct dri_state *dri_state = (struct dri_state *)ctx->drm_state;
+    drm_magic_t magic;
 
     dri_state->base.fd = open(device_name, O_RDWR);
 
@@ -214,25 +249,78 @@ isDRI2Connected(VADriverContextP ctx, char **driver_name)
     dri_state->getRenderingBuffer = dri2GetRenderingBuffer;
     dri_state->close = dri2Close;
     gsDRI2SwapAvailable = (minor >= 2);
+    gsDRI2InvalidateAvailable = (minor >= 3);
+
+    return True;
+
+err_out:
+    if (dri_state->base.fd >= 0)
+        close(dri_state->base.fd);
+
+    dri_state->base.fd = -1;
+
+    return False;
+}
+
+Bool 
+isDRI2ConnectedEx(VADriverContextP ctx, char **driver_name, char **device_name)
+{
+    struct dri_state *dri_state = (struct dri_state *)ctx->drm_state;
+    int minor;
+    char *dri2_device_name = NULL;
+
+    *driver_name = NULL;
+    if (device_name)
+        *device_name = NULL;
+    dri_state->base.fd = -1;
+    dri_state->base.auth_type = VA_NONE;
+
+    if (!dri2QueryVersion(ctx, &minor))
+        goto err_out;
+
+    if (!VA_DRI2Connect(ctx->native_dpy, RootWindow(ctx->native_dpy, ctx->x11_screen),
+                     driver_name, &dri2_device_name))
+        goto err_out;
+
+    if (!dri2OpenDevice(ctx, dri2_device_name, minor))
+        goto err_out;
 
     if (device_name)
-        Xfree(device_name);
+        *device_name = dri2_device_name;
+    else
+        Xfree(dri2_device_name);
 
     return True;
 
 err_out:
-    if (device_name)
-        Xfree(device_name);
+    if (dri2_device_name)
+        Xfree(dri2_device_name);
 
     if (*driver_name)
         Xfree(*driver_name);
 
-    if (dri_state->base.fd >= 0)
-        close(dri_state->base.fd);
-
     *driver_name = NULL;
-    dri_state->base.fd = -1;
     
     return False;
 }
 
+Bool 
+isDRI2Connected(VADriverContextP ctx, char **driver_name)
+{
+    return isDRI2ConnectedEx(ctx, driver_name, NULL);
+}
+
+Bool
+isDRI2ConnectedToDevice(VADriverContextP ctx, const char *device_name)
+{
+    struct dri_state *dri_state = (struct dri_state *)ctx->drm_state;
+    int minor;
+
+    dri_state->base.fd = -1;
+    dri_state->base.auth_type = VA_NONE;
+
+    if (!dri2QueryVersion(ctx, &minor))
+        return False;
+
+    return dri2OpenDevice(ctx, device_name, minor);
+}
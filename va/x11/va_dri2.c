@@ -55,10 +55,18 @@ VA_DRI2GetBuffers_internal(XExtDisplayInfo *info,
                            int count,
                            int *outCount);
 
+static int
+VA_DRI2CloseDisplay(Display *dpy, XExtCodes *codes);
+
+/* Per-display private data, stored in XExtDisplayInfo.data */
+typedef struct {
+    Bool (*wire_to_event)(Display *, XEvent *, xEvent *); /* chained hook */
+    VA_DRI2InvalidateBuffersProc invalidate_buffers;
+} VA_DRI2DisplayPrivate;
+
 static char va_dri2ExtensionName[] = DRI2_NAME;
 static XExtensionInfo _va_dri2_info_data;
 static XExtensionInfo *va_dri2Info = &_va_dri2_info_data;
-static XEXT_GENERATE_CLOSE_DISPLAY (VA_DRI2CloseDisplay, va_dri2Info)
 static /* const */ XExtensionHooks va_dri2ExtensionHooks = {
     NULL,				/* create_gc */
     NULL,				/* copy_gc */
@@ -78,6 +86,46 @@ static XEXT_GENERATE_FIND_DISPLAY (DRI2FindDisplay, va_dri2Info,
 				   &va_dri2ExtensionHooks, 
 				   0, NULL)
 
+static int
+VA_DRI2CloseDisplay(Display *dpy, XExtCodes *codes)
+{
+    XExtDisplayInfo *info = XextFindDisplay(va_dri2Info, dpy);
+
+    if (info && info->data) {
+        Xfree(info->data);
+        info->data = NULL;
+    }
+    return XextRemoveDisplay(va_dri2Info, dpy);
+}
+
+/*
+ * DRI2 InvalidateBuffers events are received by every DRI2 client on
+ * the X display, e.g. Mesa too. So, the previous handler is chained.
+ * This is called with the display lock held.
+ */
+static Bool
+VA_DRI2WireToEvent(Display *dpy, XEvent *event, xEvent *wire)
+{
+    XExtDisplayInfo *info = DRI2FindDisplay(dpy);
+    VA_DRI2DisplayPrivate *priv;
+    const xDRI2InvalidateBuffers *invalidate;
+
+    if (!XextHasExtension(info) || !info->data)
+        return False;
+    priv = (VA_DRI2DisplayPrivate *)info->data;
+
+    if ((wire->u.u.type & 0x7f) ==
+        info->codes->first_event + DRI2_InvalidateBuffers) {
+        invalidate = (const xDRI2InvalidateBuffers *)wire;
+        if (priv->invalidate_buffers)
+            priv->invalidate_buffers(dpy, invalidate->drawable);
+    }
+
+    if (priv->wire_to_event)
+        return priv->wire_to_event(dpy, event, wire);
+    return False;
+}
+
 static CARD32 _va_resource_x_error_drawable = 0;
 static Bool   _va_resource_x_error_matched = False;
 
@@ -422,3 +470,44 @@ void VA_DRI2SwapBuffers(Display *dpy, XID drawable, CARD64 target_msc,
     UnlockDisplay(dpy);
     SyncHandle();
 }
+
+/*
+ * Installs the DRI2 InvalidateBuffers event hook, unless it is still in
+ * place. Another DRI2 client, e.g. Mesa, may have replaced it since. In
+ * that case, events could have been lost and proc is called with None
+ * so that all buffers are considered invalid.
+ */
+Bool VA_DRI2SetInvalidateBuffersProc(Display *dpy,
+                                     VA_DRI2InvalidateBuffersProc proc)
+{
+    XExtDisplayInfo *info = DRI2FindDisplay(dpy);
+    VA_DRI2DisplayPrivate *priv;
+    Bool installed = False;
+    int event_number;
+
+    XextCheckExtension (dpy, info, va_dri2ExtensionName, False);
+
+    event_number = info->codes->first_event + DRI2_InvalidateBuffers;
+
+    LockDisplay(dpy);
+    priv = (VA_DRI2DisplayPrivate *)info->data;
+    if (!priv) {
+        priv = Xcalloc(1, sizeof(*priv));
+        if (!priv) {
+            UnlockDisplay(dpy);
+            return False;
+        }
+        info->data = (XPointer)priv;
+    }
+    if (dpy->event_vec[event_number] != VA_DRI2WireToEvent) {
+        priv->wire_to_event = dpy->event_vec[event_number];
+        dpy->event_vec[event_number] = VA_DRI2WireToEvent;
+        installed = True;
+    }
+    priv->invalidate_buffers = proc;
+    UnlockDisplay(dpy);
+
+    if (installed)
+        proc(dpy, None);
+    return True;
+}
@@ -46,6 +46,8 @@ typedef struct {
     unsigned int flags;
 } VA_DRI2Buffer;
 
+typedef void (*VA_DRI2InvalidateBuffersProc)(Display *dpy, XID drawable);
+
 extern Bool
 VA_DRI2QueryExtension(Display *display, int *eventBase, int *errorBase);
 extern Bool
@@ -70,4 +72,6 @@ VA_DRI2CopyRegion(Display *dpy, XID drawable, XserverRegion region,
 extern void
 VA_DRI2SwapBuffers(Display *dpy, XID drawable, CARD64 target_msc, CARD64 divisor,
                    CARD64 remainder, CARD64 *count);
+extern Bool
+VA_DRI2SetInvalidateBuffersProc(Display *dpy, VA_DRI2InvalidateBuffersProc proc);
 #endif
@@ -55,6 +55,10 @@
 #define X_DRI2WaitSBC			11
 #define X_DRI2SwapInterval		12
 
+/* Events */
+#define DRI2_BufferSwapComplete		0
+#define DRI2_InvalidateBuffers		1
+
 typedef struct {
     CARD32  attachment B32;
     CARD32  name B32;
@@ -224,4 +228,18 @@ typedef struct {
 } xDRI2SwapBuffersReply;
 #define sz_xDRI2SwapBuffersReply 32
 
+typedef struct {
+    CARD8   type;
+    CARD8   pad;
+    CARD16  sequenceNumber B16;
+    CARD32  drawable B32;
+    CARD32  pad1 B32;
+    CARD32  pad2 B32;
+    CARD32  pad3 B32;
+    CARD32  pad4 B32;
+    CARD32  pad5 B32;
+    CARD32  pad6 B32;
+} xDRI2InvalidateBuffers;
+#define sz_xDRI2InvalidateBuffers 32
+
 #endif
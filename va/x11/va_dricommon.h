@@ -85,6 +85,8 @@ struct dri_state
 };
 
 Bool isDRI2Connected(VADriverContextP ctx, char **driver_name);
+Bool isDRI2ConnectedEx(VADriverContextP ctx, char **driver_name, char **device_name);
+Bool isDRI2ConnectedToDevice(VADriverContextP ctx, const char *device_name);
 void free_drawable(VADriverContextP ctx, struct dri_drawable* dri_drawable);
 void free_drawable_hashtable(VADriverContextP ctx);
 struct dri_drawable *dri_get_drawable(VADriverContextP ctx, XID drawable);
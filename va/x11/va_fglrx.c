@@ -245,3 +245,12 @@ end:
         dlclose(libadl_handle);
     return success;
 }
+
+/* Cheap check that the X server still runs fglrx, without loading ADL */
+Bool VA_FGLRXQueryExtension( Display *dpy )
+{
+    int major_opcode, first_event, first_error;
+
+    return XQueryExtension(dpy, "ATIFGLEXTENSION",
+                           &major_opcode, &first_event, &first_error);
+}
@@ -32,4 +32,7 @@ Bool VA_FGLRXGetClientDriverName( Display *dpy, int screen,
     int *ddxDriverMajorVersion, int *ddxDriverMinorVersion,
     int *ddxDriverPatchVersion, char **clientDriverName );
 
+DLL_HIDDEN
+Bool VA_FGLRXQueryExtension( Display *dpy );
+
 #endif /* VA_FGLRX_H */
@@ -42,6 +42,57 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <pthread.h>
+
+/* Method that was used to resolve the driver name of an X display */
+enum {
+    VA_X11_DRIVER_DRI2 = 1,
+    VA_X11_DRIVER_NVCTRL,
+    VA_X11_DRIVER_FGLRX
+};
+
+/*
+ * Driver name cache, indexed by X display string and screen. This
+ * avoids probing for DRI2, NV-CONTROL and then FGLRX again, with all
+ * the X round trips involved, each time the same X display is opened.
+ * It lives as long as any X11 VADisplay does.
+ */
+struct driver_name_cache {
+    struct driver_name_cache *next;
+    char *display_name;
+    int screen;
+    int method;
+    char *driver_name;
+    char *device_name;          /* DRM device, for VA_X11_DRIVER_DRI2 */
+};
+
+/* Most recently used first, kept until the library is unloaded */
+#define DRIVER_NAME_CACHE_MAX   16
+
+static struct driver_name_cache *g_driver_name_cache;
+static pthread_mutex_t g_driver_name_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void va_DriverNameCacheEntryFree (
+    struct driver_name_cache *entry
+)
+{
+    free(entry->display_name);
+    free(entry->driver_name);
+    free(entry->device_name);
+    free(entry);
+}
+
+static void __attribute__((destructor)) va_DriverNameCacheFree (void)
+{
+    struct driver_name_cache *entry;
+
+    pthread_mutex_lock(&g_driver_name_cache_lock);
+    while ((entry = g_driver_name_cache) != NULL) {
+        g_driver_name_cache = entry->next;
+        va_DriverNameCacheEntryFree(entry);
+    }
+    pthread_mutex_unlock(&g_driver_name_cache_lock);
+}
 
 static int va_DisplayContextIsValid (
     VADisplayContextP pDisplayContext
@@ -73,19 +124,6 @@ static void va_DisplayContextDestroy (
 }
 
 
-static VAStatus va_DRI2GetDriverName (
-    VADisplayContextP pDisplayContext,
-    char **driver_name
-)
-{
-    VADriverContextP ctx = pDisplayContext->pDriverContext;
-
-    if (!isDRI2Connected(ctx, driver_name))
-        return VA_STATUS_ERROR_UNKNOWN;
-
-    return VA_STATUS_SUCCESS;
-}
-
 static VAStatus va_NVCTRL_GetDriverName (
     VADisplayContextP pDisplayContext,
     char **driver_name
@@ -127,23 +165,185 @@ static VAStatus va_FGLRX_GetDriverName (
     return VA_STATUS_SUCCESS;
 }
 
+/* Looks up the cache, returns a copy of the matching entry */
+static int va_DriverNameCacheLookup (
+    VADriverContextP ctx,
+    char **driver_name,
+    char **device_name
+)
+{
+    const char *display_name = DisplayString((Display *)ctx->native_dpy);
+    struct driver_name_cache *entry, **entry_ptr;
+    int method = 0;
+
+    *driver_name = NULL;
+    *device_name = NULL;
+
+    pthread_mutex_lock(&g_driver_name_cache_lock);
+    for (entry_ptr = &g_driver_name_cache; (entry = *entry_ptr) != NULL; entry_ptr = &entry->next) {
+        if (entry->screen == ctx->x11_screen &&
+            strcmp(entry->display_name, display_name) == 0)
+            break;
+    }
+    if (entry) {
+        /* move to the front */
+        *entry_ptr = entry->next;
+        entry->next = g_driver_name_cache;
+        g_driver_name_cache = entry;
+
+        *driver_name = strdup(entry->driver_name);
+        if (entry->device_name)
+            *device_name = strdup(entry->device_name);
+        if (*driver_name && (*device_name || !entry->device_name))
+            method = entry->method;
+    }
+    pthread_mutex_unlock(&g_driver_name_cache_lock);
+
+    if (!method) {
+        free(*driver_name);
+        *driver_name = NULL;
+        free(*device_name);
+        *device_name = NULL;
+    }
+    return method;
+}
+
+static void va_DriverNameCacheUpdate (
+    VADriverContextP ctx,
+    int method,
+    const char *driver_name,
+    const char *device_name
+)
+{
+    const char *display_name = DisplayString((Display *)ctx->native_dpy);
+    struct driver_name_cache *entry, **entry_ptr;
+    int count;
+
+    pthread_mutex_lock(&g_driver_name_cache_lock);
+
+    /* Drop any stale entry, e.g. if the X server was restarted */
+    entry_ptr = &g_driver_name_cache;
+    while ((entry = *entry_ptr) != NULL) {
+        if (entry->screen == ctx->x11_screen &&
+            strcmp(entry->display_name, display_name) == 0) {
+            *entry_ptr = entry->next;
+            va_DriverNameCacheEntryFree(entry);
+            break;
+        }
+        entry_ptr = &entry->next;
+    }
+
+    entry = calloc(1, sizeof(*entry));
+    if (!entry)
+        goto end;
+
+    entry->display_name = strdup(display_name);
+    entry->screen       = ctx->x11_screen;
+    entry->method       = method;
+    entry->driver_name  = strdup(driver_name);
+    if (device_name)
+        entry->device_name = strdup(device_name);
+
+    if (!entry->display_name || !entry->driver_name ||
+        (device_name && !entry->device_name)) {
+        va_DriverNameCacheEntryFree(entry);
+        goto end;
+    }
+
+    entry->next = g_driver_name_cache;
+    g_driver_name_cache = entry;
+
+    /* Drop the least recently used entry past the limit */
+    for (count = 1; entry->next != NULL; count++) {
+        if (count == DRIVER_NAME_CACHE_MAX) {
+            va_DriverNameCacheEntryFree(entry->next);
+            entry->next = NULL;
+            break;
+        }
+        entry = entry->next;
+    }
+
+end:
+    pthread_mutex_unlock(&g_driver_name_cache_lock);
+}
+
+/* Resolves the driver name from a previous lookup on the same X display */
+static VAStatus va_DisplayContextGetCachedDriverName (
+    VADisplayContextP pDisplayContext,
+    char **driver_name
+)
+{
+    VADriverContextP ctx = pDisplayContext->pDriverContext;
+    char *cached_driver_name, *device_name;
+    VAStatus vaStatus = VA_STATUS_ERROR_UNKNOWN;
+    Bool direct_capable;
+
+    /*
+     * The X server may have been restarted with another driver since the
+     * entry was made: check the extension is still there, which is much
+     * cheaper than the lookup it stands for.
+     */
+    switch (va_DriverNameCacheLookup(ctx, &cached_driver_name, &device_name)) {
+    case VA_X11_DRIVER_DRI2:
+        /* Skip DRI2Connect, but the DRM device still needs authentication */
+        if (isDRI2ConnectedToDevice(ctx, device_name))
+            vaStatus = VA_STATUS_SUCCESS;
+        break;
+    case VA_X11_DRIVER_NVCTRL:
+        if (VA_NVCTRLQueryDirectRenderingCapable(ctx->native_dpy, ctx->x11_screen,
+                                                 &direct_capable) && direct_capable)
+            vaStatus = VA_STATUS_SUCCESS;
+        break;
+    case VA_X11_DRIVER_FGLRX:
+        if (VA_FGLRXQueryExtension(ctx->native_dpy))
+            vaStatus = VA_STATUS_SUCCESS;
+        break;
+    }
+
+    if (vaStatus == VA_STATUS_SUCCESS) {
+        *driver_name = cached_driver_name;
+        cached_driver_name = NULL;
+    }
+    free(cached_driver_name);
+    free(device_name);
+    return vaStatus;
+}
+
 static VAStatus va_DisplayContextGetDriverName (
     VADisplayContextP pDisplayContext,
     char **driver_name
 )
 {
+    VADriverContextP ctx = pDisplayContext->pDriverContext;
+    char *device_name = NULL;
+    int method;
     VAStatus vaStatus;
 
     if (driver_name)
 	*driver_name = NULL;
     else
         return VA_STATUS_ERROR_UNKNOWN;
+
+    vaStatus = va_DisplayContextGetCachedDriverName(pDisplayContext, driver_name);
+    if (vaStatus == VA_STATUS_SUCCESS)
+        return vaStatus;
     
-    vaStatus = va_DRI2GetDriverName(pDisplayContext, driver_name);
-    if (vaStatus != VA_STATUS_SUCCESS)
+    method = VA_X11_DRIVER_DRI2;
+    vaStatus = isDRI2ConnectedEx(ctx, driver_name, &device_name) ?
+        VA_STATUS_SUCCESS : VA_STATUS_ERROR_UNKNOWN;
+    if (vaStatus != VA_STATUS_SUCCESS) {
+        method = VA_X11_DRIVER_NVCTRL;
         vaStatus = va_NVCTRL_GetDriverName(pDisplayContext, driver_name);
-    if (vaStatus != VA_STATUS_SUCCESS)
+    }
+    if (vaStatus != VA_STATUS_SUCCESS) {
+        method = VA_X11_DRIVER_FGLRX;
         vaStatus = va_FGLRX_GetDriverName(pDisplayContext, driver_name);
+    }
+
+    if (vaStatus == VA_STATUS_SUCCESS && *driver_name)
+        va_DriverNameCacheUpdate(ctx, method, *driver_name, device_name);
+    if (device_name)
+        XFree(device_name);
     return vaStatus;
 }
 